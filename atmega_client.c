@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ipc_frame.h"
+#include "progress_bar.h"
+
+/* ジョブのパラメータを追加する */
+static int add_param(char *payload, size_t size, const char *key, const char *value) {
+	size_t len = strlen(payload);
+	if (len + strlen(key) + strlen(value) + 3 > size) return 0;
+	sprintf(payload + len, "%s %s\n", key, value);
+	return 1;
+}
+
+/* サーバから見えるように、入力ファイルのパスを絶対パスにする */
+static int absolute_path(char *out, size_t size, const char *path) {
+#ifdef _WIN32
+	return _fullpath(out, path, size) != NULL;
+#else
+	char *resolved = realpath(path, NULL);
+	int ok = 0;
+	if (resolved == NULL) return 0;
+	if (strlen(resolved) < size) {
+		strcpy(out, resolved);
+		ok = 1;
+	}
+	free(resolved);
+	return ok;
+#endif
+}
+
+static void show_usage(const char *name) {
+	fprintf(stderr, "Usage: %s [--socket <path>] <job> [options...]\n", name);
+	fputs("jobs:\n", stderr);
+	fputs("program [options...] : write hex file\n", stderr);
+	fputs("verify [options...] : compare the target with hex file\n", stderr);
+	fputs("dump start_addr read_size out_file : read program memory\n", stderr);
+	fputs("options for program/verify:\n", stderr);
+	fputs("--input-file <file> / -i <file> : set hex file\n", stderr);
+	fputs("--page-size <size> / -p <size> : set page size (default: 64)\n", stderr);
+	fputs("--lock-bits <byte> / -l <byte> : write Lock bits\n", stderr);
+	fputs("--fuse-low-byte <byte> / -fl <byte> : write Fuse Low Byte\n", stderr);
+	fputs("--fuse-high-byte <byte> / -fh <byte> : write Fuse High Byte\n", stderr);
+	fputs("--extended-fuse-byte <byte> / -ef <byte> : write Extended Fuse Byte\n", stderr);
+	fputs("--no-chip-erase : don't do chip erase before writing\n", stderr);
+	fputs("--validation / -v : do validation after writing\n", stderr);
+	fputs("--fixed-wait : wait 10ms for writing/erasing\n", stderr);
+}
+
+int main(int argc, char *argv[]) {
+	static char payload[IPC_FRAME_MAX_PAYLOAD + 1];
+	static const char *options[][3] = {
+		/* 長いオプション, 短いオプション, パラメータ名 */
+		{"--page-size", "-p", "page-size"},
+		{"--lock-bits", "-l", "lock-bits"},
+		{"--fuse-low-byte", "-fl", "fuse-low-byte"},
+		{"--fuse-high-byte", "-fh", "fuse-high-byte"},
+		{"--extended-fuse-byte", "-ef", "extended-fuse-byte"}
+	};
+	const char *name = argc > 0 ? argv[0] : "atmega_client";
+	const char *socket_path = "atmega_server.sock";
+	const char *out_file = NULL;
+	FILE *out_fp = NULL;
+	ipc_socket_t s;
+	progress_t progress;
+	int progress_started = 0;
+	int job_type;
+	int result = 1;
+	int i, j;
+	int type;
+	unsigned long size;
+	/* コマンドライン引数を読み込む */
+	i = 1;
+	if (i + 1 < argc && (strcmp(argv[i], "--socket") == 0 || strcmp(argv[i], "-s") == 0)) {
+		socket_path = argv[i + 1];
+		i += 2;
+	}
+	if (i >= argc) {
+		show_usage(name);
+		return 1;
+	}
+	payload[0] = '\0';
+	if (strcmp(argv[i], "dump") == 0) {
+		job_type = IPC_FRAME_DUMP;
+		if (i + 4 != argc) {
+			show_usage(name);
+			return 1;
+		}
+		add_param(payload, sizeof(payload), "start", argv[i + 1]);
+		add_param(payload, sizeof(payload), "size", argv[i + 2]);
+		out_file = argv[i + 3];
+	} else if (strcmp(argv[i], "program") == 0 || strcmp(argv[i], "verify") == 0) {
+		job_type = strcmp(argv[i], "program") == 0 ? IPC_FRAME_PROGRAM : IPC_FRAME_VERIFY;
+		for (i++; i < argc; i++) {
+			int matched = 0;
+			if (strcmp(argv[i], "--input-file") == 0 || strcmp(argv[i], "-i") == 0) {
+				char path[1024];
+				if (i + 1 >= argc || !absolute_path(path, sizeof(path), argv[++i])) {
+					fprintf(stderr, "invalid argument for --input-file\n");
+					return 1;
+				}
+				add_param(payload, sizeof(payload), "input", path);
+				continue;
+			} else if (strcmp(argv[i], "--no-chip-erase") == 0) {
+				add_param(payload, sizeof(payload), "chip-erase", "0");
+				continue;
+			} else if (strcmp(argv[i], "--validation") == 0 || strcmp(argv[i], "-v") == 0) {
+				add_param(payload, sizeof(payload), "validation", "1");
+				continue;
+			} else if (strcmp(argv[i], "--fixed-wait") == 0) {
+				add_param(payload, sizeof(payload), "fixed-wait", "1");
+				continue;
+			}
+			for (j = 0; j < (int)(sizeof(options) / sizeof(options[0])); j++) {
+				if (strcmp(argv[i], options[j][0]) == 0 || strcmp(argv[i], options[j][1]) == 0) {
+					if (i + 1 >= argc) {
+						fprintf(stderr, "missing argument for %s\n", options[j][0]);
+						return 1;
+					}
+					add_param(payload, sizeof(payload), options[j][2], argv[++i]);
+					matched = 1;
+					break;
+				}
+			}
+			if (!matched) {
+				fprintf(stderr, "unrecognized command line option: %s\n", argv[i]);
+				show_usage(name);
+				return 1;
+			}
+		}
+	} else {
+		show_usage(name);
+		return 1;
+	}
+
+	/* ジョブを送信する */
+	if (!ipc_init()) {
+		fputs("ipc_init error\n", stderr);
+		return 1;
+	}
+	if ((s = ipc_connect(socket_path)) == IPC_INVALID_SOCKET) {
+		fprintf(stderr, "failed to connect to \"%s\"\n", socket_path);
+		return 1;
+	}
+	if (out_file != NULL && (out_fp = fopen(out_file, "wb")) == NULL) {
+		fputs("fopen error\n", stderr);
+		ipc_close(s);
+		return 1;
+	}
+	if (!ipc_send_frame(s, job_type, payload, strlen(payload))) {
+		fputs("failed to send the job\n", stderr);
+	} else {
+		/* 結果を受信する */
+		while (ipc_recv_frame(s, &type, payload, IPC_FRAME_MAX_PAYLOAD, &size)) {
+			if (type == IPC_FRAME_PROGRESS) {
+				int done, total;
+				if (sscanf(payload, "%d %d", &done, &total) != 2 || total <= 0) continue;
+				if (!progress_started) {
+					init_progress(&progress, total);
+					progress_started = 1;
+				}
+				update_progress(&progress, done);
+				if (done >= total) {
+					fputc('\n', stderr);
+					progress_started = 0;
+				}
+			} else if (type == IPC_FRAME_MESSAGE) {
+				if (progress_started) {
+					fputc('\n', stderr);
+					progress_started = 0;
+				}
+				printf("%s\n", payload);
+			} else if (type == IPC_FRAME_DATA) {
+				if (out_fp != NULL) fwrite(payload, 1, size, out_fp);
+			} else if (type == IPC_FRAME_RESULT) {
+				char *message = strchr(payload, ' ');
+				if (progress_started) fputc('\n', stderr);
+				if (sscanf(payload, "%d", &result) != 1) result = 1;
+				if (result != 0) fprintf(stderr, "job failed: %s\n", message != NULL ? message + 1 : "");
+				break;
+			}
+		}
+	}
+	if (out_fp != NULL) fclose(out_fp);
+	ipc_close(s);
+	return result;
+}
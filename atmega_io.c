@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 
 #if defined(USE_NANOSLEEP)
@@ -13,6 +14,30 @@
 
 #include "atmega_io.h"
 
+/*
+ * コンパイル時にバックエンドを結び付ける場合は、ATMEGAIO_STATIC_SOURCEにバックエンドのソースファイルを、
+ * ATMEGAIO_STATIC_IO_8BITSにそのファイル内の1オクテットを送受信する関数を指定する。
+ * (例: -DATMEGAIO_STATIC_SOURCE='"atmega_sim.c"' -DATMEGAIO_STATIC_IO_8BITS=sim_io_8bits)
+ * コマンドの送受信はio_8bitsやcommandを通さずにその関数を直接呼ぶので、
+ * 最適化を有効にすればバックエンドの処理まで含めてインライン展開される。
+ * commandを使わずに1オクテットずつ送るので、シミュレータやGPIOのような
+ * 手元で速く動くバックエンド向けである。
+ * バックエンドはこのファイルと一緒にコンパイルされるので、別にリンクしてはいけない。
+ * このビルドは指定したバックエンドが作ったatmegaio_tにしか使えない。
+ * 指定しない場合(既定)は、atmegaio_tの関数ポインタを通して呼ぶ。
+ */
+#ifdef ATMEGAIO_STATIC_SOURCE
+/* バックエンド内のstatic関数の名前がこのファイルの関数と重ならないようにする */
+#define sleep_ms backend_sleep_ms
+#include ATMEGAIO_STATIC_SOURCE
+#undef sleep_ms
+#define IO_8BITS(func, out) ATMEGAIO_STATIC_IO_8BITS((func)->hardware_data, (out))
+#define HAS_COMMAND(func) 0
+#else
+#define IO_8BITS(func, out) ((func)->io_8bits)((func)->hardware_data, (out))
+#define HAS_COMMAND(func) ((func)->command != NULL)
+#endif
+
 /**
  * 指定した時間以上待つ
  * @param ms 待つ時間(ミリ秒)
@@ -38,19 +63,136 @@ static void sleep_ms(int ms) {
 #endif
 }
 
+/* キャッシュするプログラムデータとEEPROMの範囲(コマンドで指定できるアドレス全体) */
+#define CACHE_PROGRAM_WORDS 0x10000
+#define CACHE_EEPROM_BYTES 0x400
+/* キャッシュする各種情報の数(Lock bits、Fuse bits、Fuse High bits、Extended Fuse bits、Calibration Byte) */
+#define CACHE_INFORMATION_NUM 5
+
+struct atmegaio_cache {
+	unsigned short program[CACHE_PROGRAM_WORDS];
+	unsigned char program_valid[CACHE_PROGRAM_WORDS];
+	unsigned char eeprom[CACHE_EEPROM_BYTES];
+	unsigned char eeprom_valid[CACHE_EEPROM_BYTES];
+	int information[CACHE_INFORMATION_NUM];
+	int information_valid[CACHE_INFORMATION_NUM];
+	int signature[3];
+	int signature_valid;
+	atmegaio_cache_stats_t stats;
+};
+
+/* キャッシュの内容を全て無効にする */
+static void cache_invalidate_all(struct atmegaio_cache *cache) {
+	if (cache == NULL) return;
+	memset(cache->program_valid, 0, sizeof(cache->program_valid));
+	memset(cache->eeprom_valid, 0, sizeof(cache->eeprom_valid));
+	memset(cache->information_valid, 0, sizeof(cache->information_valid));
+	cache->signature_valid = 0;
+}
+
+int enable_cache(atmegaio_t *func) {
+	if (func == NULL) return ATMEGAIO_INVALID_PARAMETER;
+	if (func->cache != NULL) return ATMEGAIO_SUCCESS;
+	func->cache = calloc(1, sizeof(struct atmegaio_cache));
+	if (func->cache == NULL) return ATMEGAIO_CONTROLLER_ERROR;
+	return ATMEGAIO_SUCCESS;
+}
+
+int get_cache_stats(const atmegaio_t *func, atmegaio_cache_stats_t *stats) {
+	if (func == NULL || func->cache == NULL || stats == NULL) return ATMEGAIO_INVALID_PARAMETER;
+	*stats = func->cache->stats;
+	return ATMEGAIO_SUCCESS;
+}
+
 int disconnect(atmegaio_t *func) {
 	if (func == NULL) return ATMEGAIO_INVALID_PARAMETER;
 	if (!(func->disconnect)(func->hardware_data)) return ATMEGAIO_CONTROLLER_ERROR;
+	free(func->cache);
 	free(func);
 	return ATMEGAIO_SUCCESS;
 }
 
 int reset(const atmegaio_t *func) {
 	if (func == NULL) return ATMEGAIO_INVALID_PARAMETER;
+	/* ターゲットが交換されたかもしれない */
+	cache_invalidate_all(func->cache);
 	if (!(func->reset)(func->hardware_data)) return ATMEGAIO_CONTROLLER_ERROR;
 	return ATMEGAIO_SUCCESS;
 }
 
+int release_target(const atmegaio_t *func) {
+	if (func == NULL) return ATMEGAIO_INVALID_PARAMETER;
+	/* 動いている間にプログラムがEEPROMを書き換えるかもしれない */
+	cache_invalidate_all(func->cache);
+	/* resetで代用すると、ターゲットはリセットされたままになる */
+	if (func->release == NULL) return ATMEGAIO_NOT_SUPPORTED;
+	if (!(func->release)(func->hardware_data)) return ATMEGAIO_CONTROLLER_ERROR;
+	return ATMEGAIO_SUCCESS;
+}
+
+/* 通信の失敗を検出したときに、再同期してから再試行する回数 */
+#define RETRY_MAX 3
+
+/**
+ * 4オクテットのコマンドを送信する。
+ * ターゲットは2オクテット目と3オクテット目で直前に受信したオクテットを送り返すので、
+ * check_echoが真ならそれを確認して同期のずれを検出する。
+ * 1オクテットずつ送る場合は、コマンドが実行される4オクテット目を送る前に確認し、
+ * ずれていたら4オクテット目を送らずに中断する。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param out_seq 送信するコマンド
+ * @param in_seq 受信したデータを格納する配列
+ * @param check_echo 真ならエコーを確認する
+ * @return エラーコード
+ */
+static int transfer_command(const atmegaio_t *func, const int out_seq[4], int in_seq[4],
+int check_echo) {
+	int i;
+	if (HAS_COMMAND(func)) {
+		/* 書き込み器がコマンドをまとめて送れる場合はそれを使う */
+		if (!(func->command)(func->hardware_data, out_seq, in_seq)) return ATMEGAIO_CONTROLLER_ERROR;
+		i = 4;
+	} else {
+		for (i = 0; i < 4; i++) {
+			if (check_echo && i == 3) break;
+			in_seq[i] = IO_8BITS(func, out_seq[i]);
+			if (in_seq[i] < 0) return ATMEGAIO_CONTROLLER_ERROR;
+		}
+	}
+	if (check_echo &&
+	(in_seq[1] != (out_seq[0] & 0xff) || in_seq[2] != (out_seq[1] & 0xff))) {
+		return ATMEGAIO_ECHO_ERROR;
+	}
+	if (i == 3) {
+		in_seq[3] = IO_8BITS(func, out_seq[3]);
+		if (in_seq[3] < 0) return ATMEGAIO_CONTROLLER_ERROR;
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+/* エコーを確認しながら4オクテットのコマンドを送信する */
+static int send_command(const atmegaio_t *func, const int out_seq[4], int in_seq[4]) {
+	return transfer_command(func, out_seq, in_seq, 1);
+}
+
+/**
+ * 失敗した操作を再試行するかを判定し、再試行する場合はリセットで同期を取り直す。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param ret 操作のエラーコード
+ * @param retry_count 再試行した回数を格納する変数へのポインタ
+ * @return 再試行するなら真
+ */
+static int need_retry(const atmegaio_t *func, int ret, int *retry_count) {
+	if (ret != ATMEGAIO_CONTROLLER_ERROR && ret != ATMEGAIO_ECHO_ERROR &&
+	ret != ATMEGAIO_PROGRAMMING_ENABLE_ERROR) {
+		return 0;
+	}
+	if (*retry_count >= RETRY_MAX) return 0;
+	(*retry_count)++;
+	(func->reset)(func->hardware_data);
+	return 1;
+}
+
 /**
  * Programming Enableを送信する
  * @param func 利用する関数が格納された構造体へのポインタ
@@ -59,12 +201,10 @@ int reset(const atmegaio_t *func) {
 static int send_programming_enable(const atmegaio_t *func) {
 	static const int out_seq[4] = {0xAC, 0x53, 0x00, 0x00};
 	int in_seq[4];
-	int i;
+	int ret;
 	if (func == NULL) return ATMEGAIO_INVALID_PARAMETER;
-	for (i = 0; i < 4; i++) {
-		in_seq[i] = (func->io_8bits)(func->hardware_data, out_seq[i]);
-		if (in_seq[i] < 0) return ATMEGAIO_CONTROLLER_ERROR;
-	}
+	ret = transfer_command(func, out_seq, in_seq, 0);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
 	return in_seq[2] == 0x53 ? ATMEGAIO_SUCCESS : ATMEGAIO_PROGRAMMING_ENABLE_ERROR;
 }
 
@@ -78,46 +218,45 @@ static int send_programming_enable(const atmegaio_t *func) {
 static int wait_operation(const atmegaio_t *func, int fixed_wait) {
 	static const int out_seq[4] = {0xF0, 0x00, 0x00, 0x00};
 	int in_seq[4];
-	int i;
 	int ret;
 	if (func == NULL) return ATMEGAIO_INVALID_PARAMETER;
 	if (fixed_wait) {
-		sleep_ms(10);
+		if (func->wait_ms != NULL) {
+			(func->wait_ms)(func->hardware_data, 10);
+		} else {
+			sleep_ms(10);
+		}
 	} else {
 		do {
 			/* 念のためin syncかを確認する */
 			ret = send_programming_enable(func);
 			if (ret != ATMEGAIO_SUCCESS) return ret;
 			/* ポーリングを行う */
-			for (i = 0; i < 4; i++) {
-				in_seq[i] = (func->io_8bits)(func->hardware_data, out_seq[i]);
-				if (in_seq[i] < 0) return ATMEGAIO_CONTROLLER_ERROR;
-			}
+			ret = send_command(func, out_seq, in_seq);
+			if (ret != ATMEGAIO_SUCCESS) return ret;
 		} while ((in_seq[3] & 1) != 0);
 	}
 	return ATMEGAIO_SUCCESS;
 }
 
-int read_signature_byte(const atmegaio_t *func, int *out) {
+static int read_signature_byte_once(const atmegaio_t *func, int *out) {
 	int out_seq[4] = {0x30, 0x00, 0x00, 0x00};
-	int i, j;
+	int in_seq[4];
+	int i;
 	int spe_ret;
 	if (func == NULL || out == NULL) return ATMEGAIO_INVALID_PARAMETER;
 	spe_ret = send_programming_enable(func);
 	if (spe_ret != ATMEGAIO_SUCCESS) return spe_ret;
 	for (i = 0; i < 3; i++) {
-		int ret = 0;
-		for (j = 0; j < 4; j++) {
-			ret = (func->io_8bits)(func->hardware_data, out_seq[j]);
-			if (ret < 0) return ATMEGAIO_CONTROLLER_ERROR;
-		}
+		int ret = send_command(func, out_seq, in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
 		out_seq[2]++;
-		out[i] = ret;
+		out[i] = in_seq[3];
 	}
 	return ATMEGAIO_SUCCESS;
 }
 
-int read_information(const atmegaio_t *func, int *lock_bits, int *fuse_bits,
+static int read_information_once(const atmegaio_t *func, int *lock_bits, int *fuse_bits,
 int *fuse_high_bits, int *extended_fuse_bits, int *calibration_byte) {
 	static const int out_seq[5][4] = {
 		{0x58, 0x00, 0x00, 0x00},
@@ -130,28 +269,29 @@ int *fuse_high_bits, int *extended_fuse_bits, int *calibration_byte) {
 		lock_bits, fuse_bits, fuse_high_bits,
 		extended_fuse_bits, calibration_byte
 	};
-	int i, j;
+	int in_seq[4];
+	int i;
 	int spe_ret;
 	if (func == NULL) return ATMEGAIO_INVALID_PARAMETER;
 	spe_ret = send_programming_enable(func);
 	if (spe_ret != ATMEGAIO_SUCCESS) return spe_ret;
 	for (i = 0; i < 5; i++) {
-		int ret = 0;
+		int ret;
 		if (ptr[i] == NULL) continue;
-		for (j = 0; j < 4; j++) {
-			ret = (func->io_8bits)(func->hardware_data, out_seq[i][j]);
-			if (ret < 0) return ATMEGAIO_CONTROLLER_ERROR;
-		}
-		*ptr[i] = ret;
+		ret = send_command(func, out_seq[i], in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		*ptr[i] = in_seq[3];
 	}
 	return ATMEGAIO_SUCCESS;
 }
 
-int read_program(const atmegaio_t *func, unsigned int *data_out,
+static int read_program_once(const atmegaio_t *func, unsigned int *data_out,
 unsigned int start_addr, unsigned int data_size) {
 	int out_seq[4];
+	int in_low[4], in_high[4];
 	int spe_ret;
-	unsigned int i, j;
+	int ret;
+	unsigned int i;
 	if (func == NULL || data_out == NULL ||
 	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0xffff) != 0) {
 		/* オーバーフローまたはアドレスがオーバーランする */
@@ -159,34 +299,37 @@ unsigned int start_addr, unsigned int data_size) {
 	}
 	spe_ret = send_programming_enable(func);
 	if (spe_ret != ATMEGAIO_SUCCESS) return spe_ret;
+	if (func->read_program != NULL) {
+		if (!(func->read_program)(func->hardware_data, data_out, start_addr, data_size)) {
+			return ATMEGAIO_CONTROLLER_ERROR;
+		}
+		return ATMEGAIO_SUCCESS;
+	}
 	out_seq[3] = 0x00;
 	for (i = 0; i < data_size; i++) {
-		int ret1, ret2;
 		/* Low byteを読み込む */
 		out_seq[0] = 0x20;
 		out_seq[1] = ((start_addr + i) >> 8) & 0xff;
 		out_seq[2] = (start_addr + i) & 0xff;
-		for (j = 0; j < 4; j++) {
-			ret1 = (func->io_8bits)(func->hardware_data, out_seq[j]);
-			if (ret1 < 0) return ATMEGAIO_CONTROLLER_ERROR;
-		}
+		ret = send_command(func, out_seq, in_low);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
 		/* High byteを読み込む */
 		out_seq[0] = 0x28;
-		for (j = 0; j < 4; j++) {
-			ret2 = (func->io_8bits)(func->hardware_data, out_seq[j]);
-			if (ret2 < 0) return ATMEGAIO_CONTROLLER_ERROR;
-		}
+		ret = send_command(func, out_seq, in_high);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
 		/* 合体して格納する */
-		data_out[i] = (unsigned int)ret1 | ((unsigned int)ret2 << 8);
+		data_out[i] = (unsigned int)in_low[3] | ((unsigned int)in_high[3] << 8);
 	}
 	return ATMEGAIO_SUCCESS;
 }
 
-int read_eeprom(const atmegaio_t *func, int *data_out,
+static int read_eeprom_once(const atmegaio_t *func, int *data_out,
 unsigned int start_addr, unsigned int data_size) {
 	int out_seq[4] = {0xA0, 0x00, 0x00, 0x00};
+	int in_seq[4];
 	int spe_ret;
-	unsigned int i, j;
+	int ret;
+	unsigned int i;
 	if (func == NULL || data_out == NULL ||
 	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0x03ff) != 0) {
 		/* オーバーフローまたはアドレスがオーバーランする */
@@ -194,33 +337,39 @@ unsigned int start_addr, unsigned int data_size) {
 	}
 	spe_ret = send_programming_enable(func);
 	if (spe_ret != ATMEGAIO_SUCCESS) return spe_ret;
+	if (func->read_eeprom != NULL) {
+		if (!(func->read_eeprom)(func->hardware_data, data_out, start_addr, data_size)) {
+			return ATMEGAIO_CONTROLLER_ERROR;
+		}
+		return ATMEGAIO_SUCCESS;
+	}
 	for (i = 0; i < data_size; i++) {
-		int ret;
 		out_seq[1] = ((start_addr + i) >> 8) & 0x03;
 		out_seq[2] = (start_addr + i) & 0xff;
-		for (j = 0; j < 4; j++) {
-			ret = (func->io_8bits)(func->hardware_data, out_seq[j]);
-			if (ret < 0) return ATMEGAIO_CONTROLLER_ERROR;
-		}
-		data_out[i] = ret;
+		ret = send_command(func, out_seq, in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		data_out[i] = in_seq[3];
 	}
 	return ATMEGAIO_SUCCESS;
 }
 
-int chip_erase(const atmegaio_t *func, int fixed_wait) {
+static int chip_erase_once(const atmegaio_t *func, int fixed_wait) {
 	static const int out_seq[4] = {0xAC, 0x80, 0x00, 0x00};
+	int in_seq[4];
 	int spe_ret;
-	int i;
+	int ret;
 	spe_ret = send_programming_enable(func);
 	if (spe_ret != ATMEGAIO_SUCCESS) return spe_ret;
-	for (i = 0; i < 4; i++) {
-		int ret = (func->io_8bits)(func->hardware_data, out_seq[i]);
-		if (ret < 0) return ATMEGAIO_CONTROLLER_ERROR;
+	if (func->chip_erase != NULL) {
+		if (!(func->chip_erase)(func->hardware_data, fixed_wait)) return ATMEGAIO_CONTROLLER_ERROR;
+		return ATMEGAIO_SUCCESS;
 	}
+	ret = send_command(func, out_seq, in_seq);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
 	return wait_operation(func, fixed_wait);
 }
 
-int write_information(const atmegaio_t *func, int fixed_wait, int lock_bits,
+static int write_information_once(const atmegaio_t *func, int fixed_wait, int lock_bits,
 int fuse_bits, int fuse_high_bits, int extended_fuse_bits) {
 	int out_seq[4][4] = {
 		{0xAC, 0xA0, 0x00, fuse_bits},
@@ -228,18 +377,17 @@ int fuse_bits, int fuse_high_bits, int extended_fuse_bits) {
 		{0xAC, 0xA4, 0x00, extended_fuse_bits},
 		{0xAC, 0xE0, 0x00, lock_bits}
 	};
+	int in_seq[4];
 	int spe_ret;
-	int i, j;
+	int i;
 	int ret;
 	spe_ret = send_programming_enable(func);
 	if (spe_ret != ATMEGAIO_SUCCESS) return spe_ret;
 	for (i = 0; i < 4; i++) {
 		if (out_seq[i][3] < 0) continue;
 		/* 書き込みを行う */
-		for (j = 0; j < 4; j++) {
-			ret = (func->io_8bits)(func->hardware_data, out_seq[i][j]);
-			if (ret < 0) return ATMEGAIO_CONTROLLER_ERROR;
-		}
+		ret = send_command(func, out_seq[i], in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
 		/* 完了を待つ */
 		ret = wait_operation(func, fixed_wait);
 		if (ret != ATMEGAIO_SUCCESS) return ret;
@@ -247,11 +395,12 @@ int fuse_bits, int fuse_high_bits, int extended_fuse_bits) {
 	return ATMEGAIO_SUCCESS;
 }
 
-int write_program(const atmegaio_t *func, int fixed_wait, const unsigned int *data,
+static int write_program_once(const atmegaio_t *func, int fixed_wait, const unsigned int *data,
 unsigned int start_addr, unsigned int data_size, unsigned int page_size) {
 	int out_seq[4];
+	int in_seq[4];
 	int spe_ret;
-	unsigned int i, j;
+	unsigned int i;
 	int ret;
 	if (func == NULL || data == NULL ||
 	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0xffff) != 0 ||
@@ -261,33 +410,34 @@ unsigned int start_addr, unsigned int data_size, unsigned int page_size) {
 	}
 	spe_ret = send_programming_enable(func);
 	if (spe_ret != ATMEGAIO_SUCCESS) return spe_ret;
+	if (func->write_program != NULL) {
+		if (!(func->write_program)(func->hardware_data, fixed_wait, data,
+		start_addr, data_size, page_size)) {
+			return ATMEGAIO_CONTROLLER_ERROR;
+		}
+		return ATMEGAIO_SUCCESS;
+	}
 	for (i = 0; i < data_size; i++) {
 		/* Low byteをloadする */
 		out_seq[0] = 0x40;
 		out_seq[1] = 0;
 		out_seq[2] = (start_addr + i) & 0xff;
 		out_seq[3] = data[i] & 0xff;
-		for (j = 0; j < 4; j++) {
-			ret = (func->io_8bits)(func->hardware_data, out_seq[j]);
-			if (ret < 0) return ATMEGAIO_CONTROLLER_ERROR;
-		}
+		ret = send_command(func, out_seq, in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
 		/* High byteをloadする */
 		out_seq[0] = 0x48;
 		out_seq[3] = (data[i] >> 8) & 0xff;
-		for (j = 0; j < 4; j++) {
-			ret = (func->io_8bits)(func->hardware_data, out_seq[j]);
-			if (ret < 0) return ATMEGAIO_CONTROLLER_ERROR;
-		}
+		ret = send_command(func, out_seq, in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
 		/* データの終わりまたはページの区切り */
 		if ((i + 1) % page_size == 0 || (i + 1) >= data_size) {
 			/* PageをWriteする */
 			out_seq[0] = 0x4C;
 			out_seq[1] = ((start_addr + i) >> 8) & 0xff;
 			out_seq[3] = 0x00;
-			for (j = 0; j < 4; j++) {
-				ret = (func->io_8bits)(func->hardware_data, out_seq[j]);
-				if (ret < 0) return ATMEGAIO_CONTROLLER_ERROR;
-			}
+			ret = send_command(func, out_seq, in_seq);
+			if (ret != ATMEGAIO_SUCCESS) return ret;
 			/* 完了を待つ */
 			ret = wait_operation(func, fixed_wait);
 			if (ret != ATMEGAIO_SUCCESS) return ret;
@@ -296,29 +446,34 @@ unsigned int start_addr, unsigned int data_size, unsigned int page_size) {
 	return ATMEGAIO_SUCCESS;
 }
 
-int write_eeprom(const atmegaio_t *func, int fixed_wait, const int *data,
+static int write_eeprom_once(const atmegaio_t *func, int fixed_wait, const int *data,
 unsigned int start_addr, unsigned int data_size) {
 	int out_seq[4];
+	int in_seq[4];
 	int spe_ret;
-	spe_ret = send_programming_enable(func);
-	if (spe_ret != ATMEGAIO_SUCCESS) return spe_ret;
-	unsigned int i, j;
+	unsigned int i;
 	int ret;
 	if (func == NULL || data == NULL ||
 	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0x03ff) != 0) {
 		/* オーバーフローまたはアドレスがオーバーランする */
 		return ATMEGAIO_INVALID_PARAMETER;
 	}
+	spe_ret = send_programming_enable(func);
+	if (spe_ret != ATMEGAIO_SUCCESS) return spe_ret;
+	if (func->write_eeprom != NULL) {
+		if (!(func->write_eeprom)(func->hardware_data, fixed_wait, data, start_addr, data_size)) {
+			return ATMEGAIO_CONTROLLER_ERROR;
+		}
+		return ATMEGAIO_SUCCESS;
+	}
 	for (i = 0; i < data_size; i++) {
 		/* loadする */
 		out_seq[0] = 0xC1;
 		out_seq[1] = 0;
 		out_seq[2] = (start_addr + i) & 0x03;
 		out_seq[3] = data[i] & 0xff;
-		for (j = 0; j < 4; j++) {
-			ret = (func->io_8bits)(func->hardware_data, out_seq[j]);
-			if (ret < 0) return ATMEGAIO_CONTROLLER_ERROR;
-		}
+		ret = send_command(func, out_seq, in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
 		/* データの終わりまたはページの区切り */
 		if ((i + 1) % 4 == 0 || (i + 1) >= data_size) {
 			/* PageをWriteする */
@@ -326,10 +481,8 @@ unsigned int start_addr, unsigned int data_size) {
 			out_seq[1] = ((start_addr + i) >> 8) & 0x03;
 			out_seq[2] = (start_addr + i) & 0xFC;
 			out_seq[3] = 0x00;
-			for (j = 0; j < 4; j++) {
-				ret = (func->io_8bits)(func->hardware_data, out_seq[j]);
-				if (ret < 0) return ATMEGAIO_CONTROLLER_ERROR;
-			}
+			ret = send_command(func, out_seq, in_seq);
+			if (ret != ATMEGAIO_SUCCESS) return ret;
 			/* 完了を待つ */
 			ret = wait_operation(func, fixed_wait);
 			if (ret != ATMEGAIO_SUCCESS) return ret;
@@ -337,3 +490,719 @@ unsigned int start_addr, unsigned int data_size) {
 	}
 	return ATMEGAIO_SUCCESS;
 }
+
+/*
+ * 以下の関数は、通信の失敗やエコーの不一致を検出すると、
+ * リセットで同期を取り直してRETRY_MAX回まで再試行する。
+ * 書き込みはページ単位で再試行する。
+ */
+
+int read_signature_byte(const atmegaio_t *func, int *out) {
+	struct atmegaio_cache *cache = func != NULL ? func->cache : NULL;
+	int retry_count = 0;
+	int ret;
+	if (cache != NULL && out != NULL && cache->signature_valid) {
+		memcpy(out, cache->signature, sizeof(cache->signature));
+		cache->stats.hits += 3;
+		return ATMEGAIO_SUCCESS;
+	}
+	do {
+		ret = read_signature_byte_once(func, out);
+	} while (need_retry(func, ret, &retry_count));
+	if (ret == ATMEGAIO_SUCCESS && cache != NULL) {
+		memcpy(cache->signature, out, sizeof(cache->signature));
+		cache->signature_valid = 1;
+		cache->stats.misses += 3;
+	}
+	return ret;
+}
+
+int read_information(const atmegaio_t *func, int *lock_bits, int *fuse_bits,
+int *fuse_high_bits, int *extended_fuse_bits, int *calibration_byte) {
+	struct atmegaio_cache *cache = func != NULL ? func->cache : NULL;
+	int *ptr[CACHE_INFORMATION_NUM] = {
+		lock_bits, fuse_bits, fuse_high_bits,
+		extended_fuse_bits, calibration_byte
+	};
+	/* ターゲットから読み込む情報 */
+	int *request[CACHE_INFORMATION_NUM];
+	int value[CACHE_INFORMATION_NUM];
+	int request_num = 0;
+	int retry_count = 0;
+	int ret;
+	int i;
+	for (i = 0; i < CACHE_INFORMATION_NUM; i++) {
+		request[i] = ptr[i];
+		if (cache == NULL || ptr[i] == NULL) continue;
+		if (cache->information_valid[i]) {
+			*ptr[i] = cache->information[i];
+			cache->stats.hits++;
+			request[i] = NULL;
+		} else {
+			request[i] = &value[i];
+			request_num++;
+		}
+	}
+	if (cache != NULL && request_num == 0) return ATMEGAIO_SUCCESS;
+	do {
+		ret = read_information_once(func, request[0], request[1],
+			request[2], request[3], request[4]);
+	} while (need_retry(func, ret, &retry_count));
+	if (ret == ATMEGAIO_SUCCESS && cache != NULL) {
+		for (i = 0; i < CACHE_INFORMATION_NUM; i++) {
+			if (request[i] == NULL) continue;
+			*ptr[i] = value[i];
+			cache->information[i] = value[i];
+			cache->information_valid[i] = 1;
+			cache->stats.misses++;
+		}
+	}
+	return ret;
+}
+
+/* キャッシュを使わずにプログラムデータを読み込む */
+static int read_program_uncached(const atmegaio_t *func, unsigned int *data_out,
+unsigned int start_addr, unsigned int data_size) {
+	int retry_count = 0;
+	int ret;
+	do {
+		ret = read_program_once(func, data_out, start_addr, data_size);
+	} while (need_retry(func, ret, &retry_count));
+	return ret;
+}
+
+int read_program(const atmegaio_t *func, unsigned int *data_out,
+unsigned int start_addr, unsigned int data_size) {
+	struct atmegaio_cache *cache;
+	unsigned int i, j, run;
+	int ret;
+	if (func == NULL || data_out == NULL ||
+	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0xffff) != 0) {
+		return ATMEGAIO_INVALID_PARAMETER;
+	}
+	cache = func->cache;
+	if (cache == NULL) return read_program_uncached(func, data_out, start_addr, data_size);
+	for (i = 0; i < data_size; i += run) {
+		unsigned int addr = start_addr + i;
+		int valid = cache->program_valid[addr];
+		/* キャッシュにあるかないかが同じ範囲をまとめて処理する */
+		for (run = 1; i + run < data_size && cache->program_valid[addr + run] == valid; run++);
+		if (valid) {
+			for (j = 0; j < run; j++) data_out[i + j] = cache->program[addr + j];
+			cache->stats.hits += run;
+		} else {
+			ret = read_program_uncached(func, data_out + i, addr, run);
+			if (ret != ATMEGAIO_SUCCESS) return ret;
+			for (j = 0; j < run; j++) {
+				cache->program[addr + j] = (unsigned short)data_out[i + j];
+				cache->program_valid[addr + j] = 1;
+			}
+			cache->stats.misses += run;
+		}
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+/* キャッシュを使わずにEEPROMのデータを読み込む */
+static int read_eeprom_uncached(const atmegaio_t *func, int *data_out,
+unsigned int start_addr, unsigned int data_size) {
+	int retry_count = 0;
+	int ret;
+	do {
+		ret = read_eeprom_once(func, data_out, start_addr, data_size);
+	} while (need_retry(func, ret, &retry_count));
+	return ret;
+}
+
+int read_eeprom(const atmegaio_t *func, int *data_out,
+unsigned int start_addr, unsigned int data_size) {
+	struct atmegaio_cache *cache;
+	unsigned int i, j, run;
+	int ret;
+	if (func == NULL || data_out == NULL ||
+	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0x03ff) != 0) {
+		return ATMEGAIO_INVALID_PARAMETER;
+	}
+	cache = func->cache;
+	if (cache == NULL) return read_eeprom_uncached(func, data_out, start_addr, data_size);
+	for (i = 0; i < data_size; i += run) {
+		unsigned int addr = start_addr + i;
+		int valid = cache->eeprom_valid[addr];
+		for (run = 1; i + run < data_size && cache->eeprom_valid[addr + run] == valid; run++);
+		if (valid) {
+			for (j = 0; j < run; j++) data_out[i + j] = cache->eeprom[addr + j];
+			cache->stats.hits += run;
+		} else {
+			ret = read_eeprom_uncached(func, data_out + i, addr, run);
+			if (ret != ATMEGAIO_SUCCESS) return ret;
+			for (j = 0; j < run; j++) {
+				cache->eeprom[addr + j] = (unsigned char)data_out[i + j];
+				cache->eeprom_valid[addr + j] = 1;
+			}
+			cache->stats.misses += run;
+		}
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+int chip_erase(const atmegaio_t *func, int fixed_wait) {
+	int retry_count = 0;
+	int ret;
+	if (func != NULL && func->cache != NULL) {
+		/* EEPROMはEESAVEの設定によって消えるかもしれない。Lock bitsも戻る。 */
+		memset(func->cache->program_valid, 0, sizeof(func->cache->program_valid));
+		memset(func->cache->eeprom_valid, 0, sizeof(func->cache->eeprom_valid));
+		func->cache->information_valid[0] = 0;
+	}
+	do {
+		ret = chip_erase_once(func, fixed_wait);
+	} while (need_retry(func, ret, &retry_count));
+	return ret;
+}
+
+int write_information(const atmegaio_t *func, int fixed_wait, int lock_bits,
+int fuse_bits, int fuse_high_bits, int extended_fuse_bits) {
+	int retry_count = 0;
+	int ret;
+	if (func != NULL && func->cache != NULL) {
+		if (lock_bits >= 0) func->cache->information_valid[0] = 0;
+		if (fuse_bits >= 0) func->cache->information_valid[1] = 0;
+		if (fuse_high_bits >= 0) func->cache->information_valid[2] = 0;
+		if (extended_fuse_bits >= 0) func->cache->information_valid[3] = 0;
+	}
+	do {
+		ret = write_information_once(func, fixed_wait, lock_bits,
+			fuse_bits, fuse_high_bits, extended_fuse_bits);
+	} while (need_retry(func, ret, &retry_count));
+	return ret;
+}
+
+int write_program(const atmegaio_t *func, int fixed_wait, const unsigned int *data,
+unsigned int start_addr, unsigned int data_size, unsigned int page_size) {
+	unsigned int done = 0;
+	int ret;
+	if (func == NULL || data == NULL ||
+	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0xffff) != 0 ||
+	page_size == 0 || start_addr % page_size != 0) {
+		return ATMEGAIO_INVALID_PARAMETER;
+	}
+	if (func->cache != NULL) {
+		/* 書き込むページ全体を外す */
+		unsigned int end = start_addr + (data_size + page_size - 1) / page_size * page_size;
+		unsigned int addr;
+		for (addr = start_addr; addr < end && addr < CACHE_PROGRAM_WORDS; addr++) {
+			func->cache->program_valid[addr] = 0;
+		}
+	}
+	do {
+		/* 1ページずつ書き込み、失敗したらそのページを書き込み直す */
+		unsigned int size = data_size - done < page_size ? data_size - done : page_size;
+		int retry_count = 0;
+		do {
+			ret = write_program_once(func, fixed_wait, data + done, start_addr + done, size, page_size);
+		} while (need_retry(func, ret, &retry_count));
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		done += size;
+	} while (done < data_size);
+	return ATMEGAIO_SUCCESS;
+}
+
+int write_eeprom(const atmegaio_t *func, int fixed_wait, const int *data,
+unsigned int start_addr, unsigned int data_size) {
+	unsigned int done = 0;
+	int ret;
+	if (func == NULL || data == NULL ||
+	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0x03ff) != 0) {
+		return ATMEGAIO_INVALID_PARAMETER;
+	}
+	if (func->cache != NULL) {
+		memset(func->cache->eeprom_valid + start_addr, 0, data_size);
+	}
+	do {
+		/* EEPROMのページ(4オクテット)の境界で区切って書き込む */
+		unsigned int size = 4 - (start_addr + done) % 4;
+		int retry_count = 0;
+		if (size > data_size - done) size = data_size - done;
+		do {
+			ret = write_eeprom_once(func, fixed_wait, data + done, start_addr + done, size);
+		} while (need_retry(func, ret, &retry_count));
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		done += size;
+	} while (done < data_size);
+	return ATMEGAIO_SUCCESS;
+}
+
+int set_sck_frequency(const atmegaio_t *func, unsigned long frequency, unsigned long *actual) {
+	unsigned long result = 0;
+	if (func == NULL || frequency == 0) return ATMEGAIO_INVALID_PARAMETER;
+	if (func->set_sck_frequency != NULL) {
+		result = (func->set_sck_frequency)(func->hardware_data, frequency);
+		if (result == 0) return ATMEGAIO_CONTROLLER_ERROR;
+	}
+	if (actual != NULL) *actual = result;
+	return ATMEGAIO_SUCCESS;
+}
+
+/* SCKの周波数の調整で、1つの周波数を確認する回数 */
+#define SCK_CHECK_REPEAT 4
+
+/**
+ * 現在のSCKの周波数でターゲットと安定して通信できるかを確認する。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @return 安定していればATMEGAIO_SUCCESS、
+ *         不安定ならATMEGAIO_PROGRAMMING_ENABLE_ERRORまたはATMEGAIO_ECHO_ERROR、
+ *         書き込み器の失敗ならATMEGAIO_CONTROLLER_ERROR
+ */
+static int check_sck_stable(const atmegaio_t *func) {
+	int first[3], signature[3];
+	int ret;
+	int i, j;
+	/* ターゲットは変わらないので、キャッシュを外さないように直接リセットする */
+	if (!(func->reset)(func->hardware_data)) return ATMEGAIO_CONTROLLER_ERROR;
+	for (i = 0; i < SCK_CHECK_REPEAT; i++) {
+		/* Programming Enableのエコーはread_signature_byteの中で確認される */
+		ret = read_signature_byte_once(func, i == 0 ? first : signature);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		if (i == 0) {
+			/* 全ビットが同じ値になるのは通信できていない場合 */
+			if ((first[0] == 0x00 && first[1] == 0x00 && first[2] == 0x00) ||
+			(first[0] == 0xff && first[1] == 0xff && first[2] == 0xff)) {
+				return ATMEGAIO_PROGRAMMING_ENABLE_ERROR;
+			}
+		} else {
+			for (j = 0; j < 3; j++) {
+				if (signature[j] != first[j]) return ATMEGAIO_PROGRAMMING_ENABLE_ERROR;
+			}
+		}
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+int calibrate_sck(const atmegaio_t *func, unsigned long *frequency) {
+	unsigned long request = ATMEGAIO_SCK_MAX_FREQUENCY;
+	unsigned long last = 0;
+	int ret;
+	if (func == NULL) return ATMEGAIO_INVALID_PARAMETER;
+	if (func->set_sck_frequency == NULL) {
+		/* 周波数を変えられないので、そのまま使う */
+		if (frequency != NULL) *frequency = 0;
+		return check_sck_stable(func);
+	}
+	while (request > 0) {
+		unsigned long actual = (func->set_sck_frequency)(func->hardware_data, request);
+		if (actual == 0) return ATMEGAIO_CONTROLLER_ERROR;
+		if (actual == last) {
+			/* 書き込み器の下限に達した */
+			break;
+		}
+		last = actual;
+		ret = check_sck_stable(func);
+		if (ret == ATMEGAIO_SUCCESS) {
+			if (frequency != NULL) *frequency = actual;
+			return ATMEGAIO_SUCCESS;
+		}
+		if (ret != ATMEGAIO_PROGRAMMING_ENABLE_ERROR && ret != ATMEGAIO_ECHO_ERROR) return ret;
+		/* 設定された周波数の半分から試す */
+		request = actual / 2;
+	}
+	return ATMEGAIO_PROGRAMMING_ENABLE_ERROR;
+}
+
+/* 複数ターゲット用のPoll RDY/~BSYの最大実行回数 */
+#define MULTI_POLL_MAX 100
+
+/**
+ * 有効なターゲットの数を数える。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param status 各ターゲットの状態
+ * @return 有効なターゲットの数
+ */
+static int multi_count_active(const atmegaio_multi_t *func, const int *status) {
+	int i;
+	int count = 0;
+	for (i = 0; i < func->target_num; i++) {
+		if (status[i] == ATMEGAIO_SUCCESS) count++;
+	}
+	return count;
+}
+
+/**
+ * 全ターゲットに4オクテットのコマンドを送信する。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param out_seq 送信するコマンド
+ * @param in_seq 各ターゲットから受信したデータを格納する配列
+ * @return エラーコード
+ */
+static int multi_send_command(const atmegaio_multi_t *func, const int out_seq[4],
+int in_seq[][4]) {
+	int in[ATMEGAIO_MAX_TARGETS];
+	int i, j;
+	for (j = 0; j < 4; j++) {
+		if (!(func->io_8bits)(func->hardware_data, out_seq[j], in)) {
+			return ATMEGAIO_CONTROLLER_ERROR;
+		}
+		for (i = 0; i < func->target_num; i++) in_seq[i][j] = in[i];
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+/**
+ * 全ターゲットにProgramming Enableを送信し、接続に失敗したターゲットを外す。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param status 各ターゲットの状態
+ * @return エラーコード
+ */
+static int multi_send_programming_enable(const atmegaio_multi_t *func, int *status) {
+	static const int out_seq[4] = {0xAC, 0x53, 0x00, 0x00};
+	int in_seq[ATMEGAIO_MAX_TARGETS][4];
+	int i;
+	int ret;
+	if (func == NULL || status == NULL ||
+	func->target_num <= 0 || ATMEGAIO_MAX_TARGETS < func->target_num) {
+		return ATMEGAIO_INVALID_PARAMETER;
+	}
+	ret = multi_send_command(func, out_seq, in_seq);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
+	for (i = 0; i < func->target_num; i++) {
+		if (status[i] == ATMEGAIO_SUCCESS && in_seq[i][2] != 0x53) {
+			status[i] = ATMEGAIO_PROGRAMMING_ENABLE_ERROR;
+		}
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+/**
+ * 全ターゲットでPoll RDY/~BSYを実行する。
+ * 有効な全ターゲットから0が返ってくるまで処理を続ける。
+ * 規定回数以内に完了しなかったターゲットは外す。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param fixed_wait 真の場合、Poll RDY/~BSYを実行するのではなく、10ms待つ
+ * @param status 各ターゲットの状態
+ * @return エラーコード
+ */
+static int multi_wait_operation(const atmegaio_multi_t *func, int fixed_wait, int *status) {
+	static const int out_seq[4] = {0xF0, 0x00, 0x00, 0x00};
+	int in_seq[ATMEGAIO_MAX_TARGETS][4];
+	int i;
+	int ret;
+	int count;
+	int busy;
+	if (fixed_wait) {
+		sleep_ms(10);
+		return ATMEGAIO_SUCCESS;
+	}
+	for (count = 0; ; count++) {
+		/* 念のためin syncかを確認する */
+		ret = multi_send_programming_enable(func, status);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		/* ポーリングを行う */
+		ret = multi_send_command(func, out_seq, in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		busy = 0;
+		for (i = 0; i < func->target_num; i++) {
+			if (status[i] == ATMEGAIO_SUCCESS && (in_seq[i][3] & 1) != 0) {
+				if (count + 1 >= MULTI_POLL_MAX) {
+					status[i] = ATMEGAIO_BUSY_TIMEOUT;
+				} else {
+					busy = 1;
+				}
+			}
+		}
+		if (!busy) break;
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+int multi_disconnect(atmegaio_multi_t *func) {
+	if (func == NULL) return ATMEGAIO_INVALID_PARAMETER;
+	if (!(func->disconnect)(func->hardware_data)) return ATMEGAIO_CONTROLLER_ERROR;
+	free(func);
+	return ATMEGAIO_SUCCESS;
+}
+
+int multi_reset(const atmegaio_multi_t *func) {
+	if (func == NULL) return ATMEGAIO_INVALID_PARAMETER;
+	if (!(func->reset)(func->hardware_data)) return ATMEGAIO_CONTROLLER_ERROR;
+	return ATMEGAIO_SUCCESS;
+}
+
+int multi_read_signature_byte(const atmegaio_multi_t *func, int (*out)[3], int *status) {
+	int out_seq[4] = {0x30, 0x00, 0x00, 0x00};
+	int in_seq[ATMEGAIO_MAX_TARGETS][4];
+	int i, j;
+	int ret;
+	if (out == NULL) return ATMEGAIO_INVALID_PARAMETER;
+	ret = multi_send_programming_enable(func, status);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
+	for (i = 0; i < 3; i++) {
+		if (multi_count_active(func, status) == 0) break;
+		ret = multi_send_command(func, out_seq, in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		for (j = 0; j < func->target_num; j++) {
+			if (status[j] == ATMEGAIO_SUCCESS) out[j][i] = in_seq[j][3];
+		}
+		out_seq[2]++;
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+int multi_check_signature_byte(const atmegaio_multi_t *func, const int expected[3], int (*out)[3], int *status) {
+	int i, j;
+	int ret;
+	if (expected == NULL) return ATMEGAIO_INVALID_PARAMETER;
+	ret = multi_read_signature_byte(func, out, status);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
+	for (i = 0; i < func->target_num; i++) {
+		if (status[i] != ATMEGAIO_SUCCESS) continue;
+		for (j = 0; j < 3; j++) {
+			if (out[i][j] != expected[j]) status[i] = ATMEGAIO_MISMATCH;
+		}
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+int multi_read_program(const atmegaio_multi_t *func, unsigned int *const *data_out,
+unsigned int start_addr, unsigned int data_size, int *status) {
+	int out_seq[4];
+	int in_low[ATMEGAIO_MAX_TARGETS][4], in_high[ATMEGAIO_MAX_TARGETS][4];
+	unsigned int i;
+	int j;
+	int ret;
+	if (data_out == NULL ||
+	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0xffff) != 0) {
+		/* オーバーフローまたはアドレスがオーバーランする */
+		return ATMEGAIO_INVALID_PARAMETER;
+	}
+	ret = multi_send_programming_enable(func, status);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
+	out_seq[3] = 0x00;
+	for (i = 0; i < data_size; i++) {
+		if (multi_count_active(func, status) == 0) break;
+		/* Low byteを読み込む */
+		out_seq[0] = 0x20;
+		out_seq[1] = ((start_addr + i) >> 8) & 0xff;
+		out_seq[2] = (start_addr + i) & 0xff;
+		ret = multi_send_command(func, out_seq, in_low);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		/* High byteを読み込む */
+		out_seq[0] = 0x28;
+		ret = multi_send_command(func, out_seq, in_high);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		/* 合体して格納する */
+		for (j = 0; j < func->target_num; j++) {
+			if (status[j] != ATMEGAIO_SUCCESS) continue;
+			data_out[j][i] = (unsigned int)in_low[j][3] | ((unsigned int)in_high[j][3] << 8);
+		}
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+int multi_chip_erase(const atmegaio_multi_t *func, int fixed_wait, int *status) {
+	static const int out_seq[4] = {0xAC, 0x80, 0x00, 0x00};
+	int in_seq[ATMEGAIO_MAX_TARGETS][4];
+	int ret;
+	ret = multi_send_programming_enable(func, status);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
+	if (multi_count_active(func, status) == 0) return ATMEGAIO_SUCCESS;
+	ret = multi_send_command(func, out_seq, in_seq);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
+	return multi_wait_operation(func, fixed_wait, status);
+}
+
+int multi_write_information(const atmegaio_multi_t *func, int fixed_wait, int lock_bits,
+int fuse_bits, int fuse_high_bits, int extended_fuse_bits, int *status) {
+	int out_seq[4][4] = {
+		{0xAC, 0xA0, 0x00, fuse_bits},
+		{0xAC, 0xA8, 0x00, fuse_high_bits},
+		{0xAC, 0xA4, 0x00, extended_fuse_bits},
+		{0xAC, 0xE0, 0x00, lock_bits}
+	};
+	int in_seq[ATMEGAIO_MAX_TARGETS][4];
+	int i;
+	int ret;
+	ret = multi_send_programming_enable(func, status);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
+	for (i = 0; i < 4; i++) {
+		if (out_seq[i][3] < 0) continue;
+		if (multi_count_active(func, status) == 0) break;
+		/* 書き込みを行う */
+		ret = multi_send_command(func, out_seq[i], in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		/* 完了を待つ */
+		ret = multi_wait_operation(func, fixed_wait, status);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+int multi_write_program(const atmegaio_multi_t *func, int fixed_wait, const unsigned int *data,
+unsigned int start_addr, unsigned int data_size, unsigned int page_size, int *status) {
+	int out_seq[4];
+	int in_seq[ATMEGAIO_MAX_TARGETS][4];
+	unsigned int i;
+	int ret;
+	if (data == NULL ||
+	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0xffff) != 0 ||
+	page_size == 0 || start_addr % page_size != 0) {
+		/* オーバーフローまたはアドレスがオーバーランするまたはアラインメント違反 */
+		return ATMEGAIO_INVALID_PARAMETER;
+	}
+	ret = multi_send_programming_enable(func, status);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
+	for (i = 0; i < data_size; i++) {
+		if (multi_count_active(func, status) == 0) break;
+		/* Low byteをloadする */
+		out_seq[0] = 0x40;
+		out_seq[1] = 0;
+		out_seq[2] = (start_addr + i) & 0xff;
+		out_seq[3] = data[i] & 0xff;
+		ret = multi_send_command(func, out_seq, in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		/* High byteをloadする */
+		out_seq[0] = 0x48;
+		out_seq[3] = (data[i] >> 8) & 0xff;
+		ret = multi_send_command(func, out_seq, in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		/* データの終わりまたはページの区切り */
+		if ((i + 1) % page_size == 0 || (i + 1) >= data_size) {
+			/* PageをWriteする */
+			out_seq[0] = 0x4C;
+			out_seq[1] = ((start_addr + i) >> 8) & 0xff;
+			out_seq[3] = 0x00;
+			ret = multi_send_command(func, out_seq, in_seq);
+			if (ret != ATMEGAIO_SUCCESS) return ret;
+			/* 完了を待つ */
+			ret = multi_wait_operation(func, fixed_wait, status);
+			if (ret != ATMEGAIO_SUCCESS) return ret;
+		}
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+int multi_verify_program(const atmegaio_multi_t *func, const unsigned int *data,
+unsigned int start_addr, unsigned int data_size, int *status) {
+	int out_seq[4];
+	int in_low[ATMEGAIO_MAX_TARGETS][4], in_high[ATMEGAIO_MAX_TARGETS][4];
+	unsigned int i;
+	int j;
+	int ret;
+	if (data == NULL ||
+	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0xffff) != 0) {
+		/* オーバーフローまたはアドレスがオーバーランする */
+		return ATMEGAIO_INVALID_PARAMETER;
+	}
+	ret = multi_send_programming_enable(func, status);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
+	out_seq[3] = 0x00;
+	for (i = 0; i < data_size; i++) {
+		if (multi_count_active(func, status) == 0) break;
+		out_seq[0] = 0x20;
+		out_seq[1] = ((start_addr + i) >> 8) & 0xff;
+		out_seq[2] = (start_addr + i) & 0xff;
+		ret = multi_send_command(func, out_seq, in_low);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		out_seq[0] = 0x28;
+		ret = multi_send_command(func, out_seq, in_high);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		for (j = 0; j < func->target_num; j++) {
+			if (status[j] != ATMEGAIO_SUCCESS) continue;
+			if (((unsigned int)in_low[j][3] | ((unsigned int)in_high[j][3] << 8)) != (data[i] & 0xffff)) {
+				status[j] = ATMEGAIO_MISMATCH;
+			}
+		}
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+int multi_read_eeprom(const atmegaio_multi_t *func, int *const *data_out,
+unsigned int start_addr, unsigned int data_size, int *status) {
+	int out_seq[4] = {0xA0, 0x00, 0x00, 0x00};
+	int in_seq[ATMEGAIO_MAX_TARGETS][4];
+	unsigned int i;
+	int j;
+	int ret;
+	if (data_out == NULL ||
+	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0x03ff) != 0) {
+		/* オーバーフローまたはアドレスがオーバーランする */
+		return ATMEGAIO_INVALID_PARAMETER;
+	}
+	ret = multi_send_programming_enable(func, status);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
+	for (i = 0; i < data_size; i++) {
+		if (multi_count_active(func, status) == 0) break;
+		out_seq[1] = ((start_addr + i) >> 8) & 0x03;
+		out_seq[2] = (start_addr + i) & 0xff;
+		ret = multi_send_command(func, out_seq, in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		for (j = 0; j < func->target_num; j++) {
+			if (status[j] == ATMEGAIO_SUCCESS) data_out[j][i] = in_seq[j][3];
+		}
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+int multi_write_eeprom(const atmegaio_multi_t *func, int fixed_wait, const int *data,
+unsigned int start_addr, unsigned int data_size, int *status) {
+	int out_seq[4];
+	int in_seq[ATMEGAIO_MAX_TARGETS][4];
+	unsigned int i;
+	int ret;
+	if (data == NULL ||
+	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0x03ff) != 0) {
+		/* オーバーフローまたはアドレスがオーバーランする */
+		return ATMEGAIO_INVALID_PARAMETER;
+	}
+	ret = multi_send_programming_enable(func, status);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
+	for (i = 0; i < data_size; i++) {
+		if (multi_count_active(func, status) == 0) break;
+		/* loadする */
+		out_seq[0] = 0xC1;
+		out_seq[1] = 0;
+		out_seq[2] = (start_addr + i) & 0x03;
+		out_seq[3] = data[i] & 0xff;
+		ret = multi_send_command(func, out_seq, in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		/* データの終わりまたはページ(4オクテット)の区切り */
+		if ((start_addr + i + 1) % 4 == 0 || (i + 1) >= data_size) {
+			/* PageをWriteする */
+			out_seq[0] = 0xC2;
+			out_seq[1] = ((start_addr + i) >> 8) & 0x03;
+			out_seq[2] = (start_addr + i) & 0xFC;
+			out_seq[3] = 0x00;
+			ret = multi_send_command(func, out_seq, in_seq);
+			if (ret != ATMEGAIO_SUCCESS) return ret;
+			/* 完了を待つ */
+			ret = multi_wait_operation(func, fixed_wait, status);
+			if (ret != ATMEGAIO_SUCCESS) return ret;
+		}
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+int multi_verify_eeprom(const atmegaio_multi_t *func, const int *data,
+unsigned int start_addr, unsigned int data_size, int *status) {
+	int out_seq[4] = {0xA0, 0x00, 0x00, 0x00};
+	int in_seq[ATMEGAIO_MAX_TARGETS][4];
+	unsigned int i;
+	int j;
+	int ret;
+	if (data == NULL ||
+	UINT_MAX - data_size < start_addr || ((start_addr + data_size) & ~0x03ff) != 0) {
+		/* オーバーフローまたはアドレスがオーバーランする */
+		return ATMEGAIO_INVALID_PARAMETER;
+	}
+	ret = multi_send_programming_enable(func, status);
+	if (ret != ATMEGAIO_SUCCESS) return ret;
+	for (i = 0; i < data_size; i++) {
+		if (multi_count_active(func, status) == 0) break;
+		out_seq[1] = ((start_addr + i) >> 8) & 0x03;
+		out_seq[2] = (start_addr + i) & 0xff;
+		ret = multi_send_command(func, out_seq, in_seq);
+		if (ret != ATMEGAIO_SUCCESS) return ret;
+		for (j = 0; j < func->target_num; j++) {
+			if (status[j] == ATMEGAIO_SUCCESS && in_seq[j][3] != (data[i] & 0xff)) status[j] = ATMEGAIO_MISMATCH;
+		}
+	}
+	return ATMEGAIO_SUCCESS;
+}
@@ -1,6 +1,9 @@
 #ifndef ATMEGA_IO_H_GUARD_7FCA6973_B2F4_479A_9F39_2DFE7DE31870
 #define ATMEGA_IO_H_GUARD_7FCA6973_B2F4_479A_9F39_2DFE7DE31870
 
+/* ターゲットのメモリの読み込みキャッシュ(内容はライブラリ内部で定義する) */
+struct atmegaio_cache;
+
 /* ATmegaの読み書きに必要な操作を行う関数の情報を持つ構造体 */
 typedef struct {
 	/* 各ハードウェア操作プログラム定義のデータ */
@@ -17,8 +20,71 @@ typedef struct {
 	 * 成功と判定したら読み込んだ値(0以上255以下)、失敗を検出したら-1を返す。
 	 */
 	int (*io_8bits)(void *hardware_data, int out);
+
+	/* 以下は省略可能な関数で、使わない場合はNULLにしておく。
+	 * 設定されている場合、対応する操作はio_8bitsを使わずにこれらの関数で行う。
+	 * いずれも成功と判定したら真、失敗を検出したら偽を返す。
+	 */
+	/* 4オクテットのコマンドをまとめて送受信する関数 */
+	int (*command)(void *hardware_data, const int *out, int *in);
+	/* プログラムデータを読み込む関数 */
+	int (*read_program)(void *hardware_data, unsigned int *data_out,
+		unsigned int start_addr, unsigned int data_size);
+	/* プログラムデータを書き込む関数(start_addrはpage_sizeの倍数) */
+	int (*write_program)(void *hardware_data, int fixed_wait, const unsigned int *data,
+		unsigned int start_addr, unsigned int data_size, unsigned int page_size);
+	/* EEPROMのデータを読み込む関数 */
+	int (*read_eeprom)(void *hardware_data, int *data_out,
+		unsigned int start_addr, unsigned int data_size);
+	/* EEPROMのデータを書き込む関数 */
+	int (*write_eeprom)(void *hardware_data, int fixed_wait, const int *data,
+		unsigned int start_addr, unsigned int data_size);
+	/* Chip Eraseを行う関数 */
+	int (*chip_erase)(void *hardware_data, int fixed_wait);
+	/* SCKの周波数を、frequency(Hz)以下で書き込み器が扱える最も近い値に設定する関数。
+	 * frequencyが書き込み器の上限を超える場合は上限に設定する。
+	 * 設定した周波数を返し、失敗を検出したら0を返す。
+	 */
+	unsigned long (*set_sck_frequency)(void *hardware_data, unsigned long frequency);
+	/* 書き込みや消去の完了をms(ミリ秒)待つ関数。
+	 * 設定されている場合、Poll RDY/~BSYを使わない固定の待ち時間はこの関数で待つ。
+	 */
+	void (*wait_ms)(void *hardware_data, int ms);
+	/* プログラミングモードを抜けて、ターゲットのプログラムを動かす関数 */
+	int (*release)(void *hardware_data);
+
+	/* ライブラリが使う読み込みキャッシュ。enable_cacheで作成し、disconnectで解放する。
+	 * ハードウェア操作プログラムはNULLにしておく。
+	 */
+	struct atmegaio_cache *cache;
 } atmegaio_t;
 
+/* 同時に操作できるターゲットの最大数 */
+#define ATMEGAIO_MAX_TARGETS 16
+
+/* 複数のATmegaを同時に読み書きするための関数の情報を持つ構造体
+ * SCK、MOSI、RESETは全ターゲットで共有し、MISOのみターゲットごとに用意する。
+ */
+typedef struct {
+	/* 各ハードウェア操作プログラム定義のデータ */
+	void *hardware_data;
+	/* ターゲットの数(1以上ATMEGAIO_MAX_TARGETS以下) */
+	int target_num;
+	/* 切断する関数
+	 * 成功と判定したら真、失敗を検出したら偽を返す。
+	 */
+	int (*disconnect)(void *hardware_data);
+	/* 全ターゲットをリセットする関数
+	 * 成功と判定したら真、失敗を検出したら偽を返す。
+	 */
+	int (*reset)(void *hardware_data);
+	/* 全ターゲットに同じ1オクテットを送信し、各ターゲットから1オクテットずつ受信する関数
+	 * 受信した値(0以上255以下)はinにターゲットの順に格納する。
+	 * 成功と判定したら真、失敗を検出したら偽を返す。
+	 */
+	int (*io_8bits)(void *hardware_data, int out, int *in);
+} atmegaio_multi_t;
+
 /* エラーコード */
 enum {
 	/* 成功と判定された */
@@ -28,7 +94,15 @@ enum {
 	/* ATmega操作関数が失敗を返した */
 	ATMEGAIO_CONTROLLER_ERROR,
 	/* Programming Enableで接続失敗を検出した */
-	ATMEGAIO_PROGRAMMING_ENABLE_ERROR
+	ATMEGAIO_PROGRAMMING_ENABLE_ERROR,
+	/* Poll RDY/~BSYが規定回数以内に完了しなかった */
+	ATMEGAIO_BUSY_TIMEOUT,
+	/* コマンドのエコーが一致せず、同期のずれを検出した */
+	ATMEGAIO_ECHO_ERROR,
+	/* 書き込み器がその操作に対応していない */
+	ATMEGAIO_NOT_SUPPORTED,
+	/* 読み込んだ値が期待した値と一致しなかった(複数ターゲットの照合で使う) */
+	ATMEGAIO_MISMATCH
 };
 
 /**
@@ -45,6 +119,20 @@ int disconnect(atmegaio_t *func);
  */
 int reset(const atmegaio_t *func);
 
+/**
+ * プログラミングモードを抜けて、ターゲットのプログラムを動かす。
+ * 次に操作する前にはresetを呼ばなければならない。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @return エラーコード(書き込み器がreleaseを持っていなければATMEGAIO_NOT_SUPPORTED)
+ */
+int release_target(const atmegaio_t *func);
+
+/*
+ * 以下のターゲットを操作する関数は、各コマンドのエコーを確認する。
+ * 通信の失敗や同期のずれを検出した場合はリセットで同期を取り直し、数回まで再試行する。
+ * 書き込みはページ単位で再試行するので、途中まで書き込んだページも正しく書き直される。
+ */
+
 /**
  * Signature Byteを読み込む。
  * outはあらかじめ3要素以上確保しておかないといけない。
@@ -140,4 +228,210 @@ int write_program(const atmegaio_t *func, int fixed_wait, const unsigned int *da
 int write_eeprom(const atmegaio_t *func, int fixed_wait, const int *data,
 	unsigned int start_addr, unsigned int data_size);
 
+/* 読み込みキャッシュの統計 */
+typedef struct {
+	/* キャッシュから返した値の数(プログラムはワード、EEPROMはオクテット、各種情報は1個ずつ数える) */
+	unsigned long hits;
+	/* ターゲットから読み込んだ値の数 */
+	unsigned long misses;
+} atmegaio_cache_stats_t;
+
+/*
+ * 読み込みキャッシュを有効にすると、Signature Byte、各種情報、プログラムデータ、EEPROMの
+ * 読み込み結果を覚えておき、同じ値を再度読み込むときは通信せずに返す。
+ * 書き込み後に読み込んで照合した値はそのままキャッシュに入るので、後の照合は通信なしで済む。
+ * 書き込んだ範囲(プログラムデータはページ単位)、Chip Eraseで消える範囲、
+ * resetを呼んだ場合は全体をキャッシュから外す。
+ * 通信の失敗から再同期するための内部のリセットでは外さない。
+ */
+
+/**
+ * 読み込みキャッシュを有効にする。既に有効なら何もしない。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @return エラーコード(メモリ不足の場合はATMEGAIO_CONTROLLER_ERROR)
+ */
+int enable_cache(atmegaio_t *func);
+
+/**
+ * 読み込みキャッシュの統計を取得する。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param stats 統計を格納する領域へのポインタ
+ * @return エラーコード(キャッシュが無効ならATMEGAIO_INVALID_PARAMETER)
+ */
+int get_cache_stats(const atmegaio_t *func, atmegaio_cache_stats_t *stats);
+
+/* SCKの周波数の調整を始める周波数(Hz) */
+#define ATMEGAIO_SCK_MAX_FREQUENCY 4000000UL
+
+/**
+ * SCKの周波数を設定する。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param frequency 設定する周波数(Hz)。書き込み器が扱える最も近い値に切り捨てられる
+ * @param actual 実際に設定した周波数を格納する変数へのポインタ(不要ならNULL)。
+ *               書き込み器が周波数の設定に対応していない場合は0を格納する
+ * @return エラーコード
+ */
+int set_sck_frequency(const atmegaio_t *func, unsigned long frequency, unsigned long *actual);
+
+/**
+ * SCKの周波数を、ターゲットと安定して通信できる最大の値に調整する。
+ * 書き込み器が扱える最大の周波数から始め、リセットした上でProgramming Enableのエコーと
+ * Signature Byteの読み込みを繰り返し、結果が安定するまで周波数を下げていく。
+ * クロックの設定はリセット時に反映されるので、Fuse bitsでクロックを変更した後に
+ * 再度呼ぶと新しいクロックに合わせた周波数になる。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param frequency 決定した周波数を格納する変数へのポインタ(不要ならNULL)。
+ *                  書き込み器が周波数の設定に対応していない場合は0を格納する
+ * @return エラーコード(どの周波数でも安定しなければATMEGAIO_PROGRAMMING_ENABLE_ERROR)
+ */
+int calibrate_sck(const atmegaio_t *func, unsigned long *frequency);
+
+/*
+ * 以下は複数ターゲット用の関数である。
+ * statusはtarget_num要素の配列で、各ターゲットの状態を表す。
+ * ATMEGAIO_SUCCESSのターゲットのみを操作の対象とし、
+ * 操作に失敗したターゲットにはエラーコードを設定して以降の操作の対象から外す。
+ * 返り値のエラーコードは全ターゲットに共通のエラー(パラメータの不正や通信の失敗)を表し、
+ * 一部のターゲットが失敗しただけの場合はATMEGAIO_SUCCESSを返す。
+ * SCK、MOSI、RESETは共有しているので、外したターゲットにもコマンドは届く。
+ * 外したターゲットが書き換わらないのは、プログラミングモードに入っていない場合だけである。
+ */
+
+/**
+ * 切断を行う。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @return エラーコード
+ */
+int multi_disconnect(atmegaio_multi_t *func);
+
+/**
+ * 全ターゲットのリセット操作を行う。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @return エラーコード
+ */
+int multi_reset(const atmegaio_multi_t *func);
+
+/**
+ * 各ターゲットのSignature Byteを読み込む。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param out 読み込んだSignature Byteをターゲットごとに保存する配列
+ * @param status 各ターゲットの状態
+ * @return エラーコード
+ */
+int multi_read_signature_byte(const atmegaio_multi_t *func, int (*out)[3], int *status);
+
+/**
+ * 各ターゲットのSignature Byteを読み込み、期待した値と違うターゲットを
+ * ATMEGAIO_MISMATCHにして外す。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param expected 期待するSignature Byte
+ * @param out 読み込んだSignature Byteをターゲットごとに保存する配列
+ * @param status 各ターゲットの状態
+ * @return エラーコード
+ */
+int multi_check_signature_byte(const atmegaio_multi_t *func, const int expected[3], int (*out)[3], int *status);
+
+/**
+ * 各ターゲットのプログラムデータを読み込む。
+ * data_outの各要素はあらかじめ十分な領域を確保しておかないといけない。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param data_out 読み込んだプログラムデータを格納する配列のターゲットごとの配列
+ * @param start_addr 読み込みを開始するプログラムデータのアドレス
+ * @param data_size 読み込むプログラムのワード数
+ * @param status 各ターゲットの状態
+ * @return エラーコード
+ */
+int multi_read_program(const atmegaio_multi_t *func, unsigned int *const *data_out,
+	unsigned int start_addr, unsigned int data_size, int *status);
+
+/**
+ * 全ターゲットのChip Eraseを行う。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param fixed_wait 真の場合、Poll RDY/~BSYを実行するのではなく、10ms待つ
+ * @param status 各ターゲットの状態
+ * @return エラーコード
+ */
+int multi_chip_erase(const atmegaio_multi_t *func, int fixed_wait, int *status);
+
+/**
+ * 全ターゲットに各種情報を書き込む。書き込まない情報は-1を入れる。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param fixed_wait 真の場合、Poll RDY/~BSYを実行するのではなく、10ms待つ
+ * @param lock_bits Lock bitsに書き込むデータ
+ * @param fuse_bits Fuse bitsをに書き込むデータ
+ * @param fuse_high_bits Fuse High bitsに書き込むデータ
+ * @param extended_fuse_bits Extended Huse Bitsに書き込むデータ
+ * @param status 各ターゲットの状態
+ * @return エラーコード
+ */
+int multi_write_information(const atmegaio_multi_t *func, int fixed_wait, int lock_bits,
+	int fuse_bits, int fuse_high_bits, int extended_fuse_bits, int *status);
+
+/**
+ * 全ターゲットに同じプログラムデータを書き込む。
+ * start_addrはpage_sizeの倍数でないといけない。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param fixed_wait 真の場合、Poll RDY/~BSYを実行するのではなく、10ms待つ
+ * @param data 書き込むプログラムデータを格納する配列
+ * @param start_addr 書き込みを開始するプログラムデータのアドレス
+ * @param data_size 書き込むプログラムのワード数
+ * @param page_size 書き込みに使用するページサイズ(適切に設定しないと失敗します)
+ * @param status 各ターゲットの状態
+ * @return エラーコード
+ */
+int multi_write_program(const atmegaio_multi_t *func, int fixed_wait, const unsigned int *data,
+	unsigned int start_addr, unsigned int data_size, unsigned int page_size, int *status);
+
+/**
+ * 各ターゲットのプログラムデータを読み込んで比較し、一致しないターゲットを
+ * ATMEGAIO_MISMATCHにして外す。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param data 比較するプログラムデータを格納する配列
+ * @param start_addr 比較を開始するプログラムデータのアドレス
+ * @param data_size 比較するプログラムのワード数
+ * @param status 各ターゲットの状態
+ * @return エラーコード
+ */
+int multi_verify_program(const atmegaio_multi_t *func, const unsigned int *data,
+	unsigned int start_addr, unsigned int data_size, int *status);
+
+/**
+ * 各ターゲットのEEPROMのデータを読み込む。
+ * data_outの各要素はあらかじめ十分な領域を確保しておかないといけない。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param data_out 読み込んだデータを格納する配列のターゲットごとの配列
+ * @param start_addr 読み込みを開始するEEPROMのアドレス
+ * @param data_size 読み込むオクテット数
+ * @param status 各ターゲットの状態
+ * @return エラーコード
+ */
+int multi_read_eeprom(const atmegaio_multi_t *func, int *const *data_out,
+	unsigned int start_addr, unsigned int data_size, int *status);
+
+/**
+ * 全ターゲットのEEPROMに同じデータを書き込む。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param fixed_wait 真の場合、Poll RDY/~BSYを実行するのではなく、10ms待つ
+ * @param data 書き込むデータを格納する配列
+ * @param start_addr 書き込みを開始するEEPROMのアドレス
+ * @param data_size 書き込むオクテット数
+ * @param status 各ターゲットの状態
+ * @return エラーコード
+ */
+int multi_write_eeprom(const atmegaio_multi_t *func, int fixed_wait, const int *data,
+	unsigned int start_addr, unsigned int data_size, int *status);
+
+/**
+ * 各ターゲットのEEPROMのデータを読み込んで比較し、一致しないターゲットを
+ * ATMEGAIO_MISMATCHにして外す。
+ * @param func 利用する関数が格納された構造体へのポインタ
+ * @param data 比較するデータを格納する配列(data[0]がstart_addrのデータ)
+ * @param start_addr 比較を開始するEEPROMのアドレス
+ * @param data_size 比較するオクテット数
+ * @param status 各ターゲットの状態
+ * @return エラーコード
+ */
+int multi_verify_eeprom(const atmegaio_multi_t *func, const int *data,
+	unsigned int start_addr, unsigned int data_size, int *status);
+
 #endif
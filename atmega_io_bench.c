@@ -0,0 +1,101 @@
+/* シミュレートしたATmegaに対してプログラムデータ全体の書き込みと読み込みを繰り返し、
+ * atmega_io.cのコマンド処理の速さを測る。
+ * 既定のビルドと、ATMEGAIO_STATIC_SOURCEでシミュレータに結び付けたビルドを比べるのに使う。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "atmega_io.h"
+#include "atmega_sim.h"
+
+/* 既定の繰り返し回数。1回は数ms程度なので、ばらつきを見られるだけ繰り返す */
+#define DEFAULT_ROUNDS 200
+
+static atmega_sim_t sim;
+static unsigned int data[ATMEGA_SIM_FLASH_WORDS];
+static unsigned int read_back[ATMEGA_SIM_FLASH_WORDS];
+
+static double now_s(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 各回の1オクテットあたりの時間(ns)の平均、標準偏差、最小値を表示する */
+static void report(const char *name, const double *ns_per_byte, int rounds) {
+	double sum = 0, squares = 0, min = ns_per_byte[0];
+	double mean;
+	int i;
+	for (i = 0; i < rounds; i++) {
+		sum += ns_per_byte[i];
+		if (ns_per_byte[i] < min) min = ns_per_byte[i];
+	}
+	mean = sum / rounds;
+	for (i = 0; i < rounds; i++) squares += (ns_per_byte[i] - mean) * (ns_per_byte[i] - mean);
+	printf("%s: %d x %d words, mean %.2f ns/byte, sd %.2f, min %.2f\n", name, rounds, ATMEGA_SIM_FLASH_WORDS,
+		mean, rounds > 1 ? sqrt(squares / (rounds - 1)) : 0.0, min);
+}
+
+int main(int argc, char *argv[]) {
+	atmegaio_t *atmegaio;
+	int rounds = DEFAULT_ROUNDS;
+	double *write_ns, *read_ns;
+	int round;
+	int i;
+	if (argc > 1 && (sscanf(argv[1], "%d", &rounds) != 1 || rounds <= 0)) {
+		fprintf(stderr, "Usage: %s [rounds (default: %d)]\n", argv[0], DEFAULT_ROUNDS);
+		return 1;
+	}
+	write_ns = malloc(sizeof(double) * rounds);
+	read_ns = malloc(sizeof(double) * rounds);
+	if (write_ns == NULL || read_ns == NULL) {
+		fputs("malloc error\n", stderr);
+		return 1;
+	}
+	for (i = 0; i < ATMEGA_SIM_FLASH_WORDS; i++) data[i] = (i * 40503u) & 0xffff;
+	atmega_sim_init(&sim);
+	atmegaio = atmega_sim_open(&sim);
+	if (atmegaio == NULL) {
+		fputs("atmega_sim_open error\n", stderr);
+		return 1;
+	}
+	for (round = 0; round < rounds; round++) {
+		double start;
+		unsigned long count;
+		if (reset(atmegaio) != ATMEGAIO_SUCCESS || chip_erase(atmegaio, 0) != ATMEGAIO_SUCCESS) {
+			fputs("reset or chip_erase error\n", stderr);
+			return 1;
+		}
+		count = sim.byte_count;
+		start = now_s();
+		if (write_program(atmegaio, 0, data, 0, ATMEGA_SIM_FLASH_WORDS, ATMEGA_SIM_PAGE_WORDS) != ATMEGAIO_SUCCESS) {
+			fputs("write_program error\n", stderr);
+			return 1;
+		}
+		write_ns[round] = (now_s() - start) * 1e9 / (sim.byte_count - count);
+		count = sim.byte_count;
+		start = now_s();
+		if (read_program(atmegaio, read_back, 0, ATMEGA_SIM_FLASH_WORDS) != ATMEGAIO_SUCCESS) {
+			fputs("read_program error\n", stderr);
+			return 1;
+		}
+		read_ns[round] = (now_s() - start) * 1e9 / (sim.byte_count - count);
+		if (memcmp(data, read_back, sizeof(data)) != 0) {
+			fputs("read back mismatch\n", stderr);
+			return 1;
+		}
+	}
+	disconnect(atmegaio);
+#ifdef ATMEGAIO_STATIC_SOURCE
+	printf("backend: %s (bound at compile time)\n", ATMEGAIO_STATIC_SOURCE);
+#else
+	puts("backend: atmegaio_t (runtime dispatch)");
+#endif
+	report("write", write_ns, rounds);
+	report("read ", read_ns, rounds);
+	free(write_ns);
+	free(read_ns);
+	return 0;
+}
@@ -0,0 +1,454 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "atmega_io.h"
+#include "programmer.h"
+#include "load_hex.h"
+#include "ipc_frame.h"
+
+#define DATA_BUFFER_SIZE 0x10000
+#define DATA_WORDS (DATA_BUFFER_SIZE / 2)
+/* キャッシュしておく解析済みイメージの数 */
+#define IMAGE_CACHE_NUM 4
+/* 読み出しジョブで1フレームに入れるワード数 */
+#define DUMP_CHUNK_WORDS 64
+
+/* 解析済みのイメージ */
+typedef struct {
+	char path[1024];
+	time_t mtime;
+	long size;
+	/* 更新日時は秒単位なので、同じ秒に同じサイズで書き換えられても分かるように内容も比べる */
+	unsigned long hash;
+	unsigned long last_used;
+	unsigned int *words;
+} image_cache_t;
+
+/* ジョブのパラメータ */
+typedef struct {
+	char input_file[1024];
+	int page_size;
+	int do_chip_erase;
+	int do_validation;
+	int fixed_wait;
+	int lock_bits, fuse_bits, fuse_high_bits, extended_fuse_bits;
+	unsigned int start_addr, read_size;
+} job_t;
+
+/* サーバの状態 */
+typedef struct {
+	const char *programmer;
+	atmegaio_t *atmegaio;
+	image_cache_t cache[IMAGE_CACHE_NUM];
+	unsigned long use_counter;
+} server_t;
+
+/* メッセージフレームを送信する */
+static void send_message(ipc_socket_t s, const char *format, ...) {
+	char buffer[1024];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	ipc_send_frame(s, IPC_FRAME_MESSAGE, buffer, strlen(buffer));
+}
+
+/* 進捗フレームを送信する */
+static void send_progress(ipc_socket_t s, int done, int total) {
+	char buffer[64];
+	sprintf(buffer, "%d %d", done, total);
+	ipc_send_frame(s, IPC_FRAME_PROGRESS, buffer, strlen(buffer));
+}
+
+/* 結果フレームを送信する */
+static int send_result(ipc_socket_t s, int code, const char *message) {
+	char buffer[1024];
+	snprintf(buffer, sizeof(buffer), "%d %s", code, message);
+	return ipc_send_frame(s, IPC_FRAME_RESULT, buffer, strlen(buffer));
+}
+
+/* ジョブのパラメータを解析する。成功したら真、失敗したら偽を返す。 */
+static int parse_job(job_t *job, char *payload) {
+	char *line;
+	job->input_file[0] = '\0';
+	job->page_size = 64;
+	job->do_chip_erase = 1;
+	job->do_validation = 0;
+	job->fixed_wait = 0;
+	job->lock_bits = job->fuse_bits = job->fuse_high_bits = job->extended_fuse_bits = -1;
+	job->start_addr = job->read_size = 0;
+	for (line = strtok(payload, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+		char *value = strchr(line, ' ');
+		if (value == NULL) return 0;
+		*(value++) = '\0';
+		if (strcmp(line, "input") == 0) {
+			if (strlen(value) >= sizeof(job->input_file)) return 0;
+			strcpy(job->input_file, value);
+		} else if (strcmp(line, "page-size") == 0) {
+			if (sscanf(value, "%d", &job->page_size) != 1 || job->page_size <= 0) return 0;
+		} else if (strcmp(line, "chip-erase") == 0) {
+			if (sscanf(value, "%d", &job->do_chip_erase) != 1) return 0;
+		} else if (strcmp(line, "validation") == 0) {
+			if (sscanf(value, "%d", &job->do_validation) != 1) return 0;
+		} else if (strcmp(line, "fixed-wait") == 0) {
+			if (sscanf(value, "%d", &job->fixed_wait) != 1) return 0;
+		} else if (strcmp(line, "lock-bits") == 0) {
+			if (sscanf(value, "%x", &job->lock_bits) != 1) return 0;
+		} else if (strcmp(line, "fuse-low-byte") == 0) {
+			if (sscanf(value, "%x", &job->fuse_bits) != 1) return 0;
+		} else if (strcmp(line, "fuse-high-byte") == 0) {
+			if (sscanf(value, "%x", &job->fuse_high_bits) != 1) return 0;
+		} else if (strcmp(line, "extended-fuse-byte") == 0) {
+			if (sscanf(value, "%x", &job->extended_fuse_bits) != 1) return 0;
+		} else if (strcmp(line, "start") == 0) {
+			if (sscanf(value, "%u", &job->start_addr) != 1) return 0;
+		} else if (strcmp(line, "size") == 0) {
+			if (sscanf(value, "%u", &job->read_size) != 1) return 0;
+		} else {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* ファイルの内容のハッシュ値(FNV-1a)を計算する。読み込めたら真を返す。 */
+static int hash_file(const char *path, unsigned long *hash) {
+	unsigned char buffer[4096];
+	size_t size, i;
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) return 0;
+	*hash = 2166136261UL;
+	while ((size = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+		for (i = 0; i < size; i++) *hash = ((*hash ^ buffer[i]) * 16777619UL) & 0xffffffffUL;
+	}
+	size = ferror(fp);
+	fclose(fp);
+	return size == 0;
+}
+
+/**
+ * 解析済みのイメージを取得する。
+ * ファイルの更新日時、サイズ、内容のハッシュ値が一致するキャッシュがあればそれを使い、
+ * 無ければ読み込んで最も長く使われていないキャッシュと置き換える。
+ * @return イメージのワード配列、失敗したらNULL
+ */
+static const unsigned int *get_image(server_t *server, ipc_socket_t s, const char *path) {
+	static char data[DATA_BUFFER_SIZE];
+	struct stat st;
+	image_cache_t *entry = NULL;
+	unsigned long hash;
+	FILE *fp;
+	int i;
+	int ret;
+	if (strlen(path) >= sizeof(entry->path)) {
+		send_message(s, "file path too long (%u characters at most)", (unsigned int)sizeof(entry->path) - 1);
+		return NULL;
+	}
+	if (stat(path, &st) != 0) {
+		send_message(s, "file \"%s\" stat error", path);
+		return NULL;
+	}
+	if (!hash_file(path, &hash)) {
+		send_message(s, "file \"%s\" read error", path);
+		return NULL;
+	}
+	for (i = 0; i < IMAGE_CACHE_NUM; i++) {
+		image_cache_t *c = &server->cache[i];
+		if (c->words != NULL && strcmp(c->path, path) == 0 &&
+		c->mtime == st.st_mtime && c->size == (long)st.st_size && c->hash == hash) {
+			c->last_used = ++server->use_counter;
+			return c->words;
+		}
+	}
+	/* 置き換えるキャッシュを選ぶ */
+	for (i = 0; i < IMAGE_CACHE_NUM; i++) {
+		image_cache_t *c = &server->cache[i];
+		if (entry == NULL || c->words == NULL ||
+		(entry->words != NULL && c->last_used < entry->last_used)) {
+			entry = c;
+		}
+	}
+	if (entry->words == NULL) {
+		entry->words = malloc(sizeof(unsigned int) * DATA_WORDS);
+		if (entry->words == NULL) {
+			send_message(s, "malloc error");
+			return NULL;
+		}
+	}
+	entry->path[0] = '\0';
+	/* ファイルを読み込む */
+	for (i = 0; i < DATA_BUFFER_SIZE; i++) data[i] = 0xff;
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		send_message(s, "file \"%s\" open error", path);
+		return NULL;
+	}
+	ret = load_hex(data, sizeof(data), fp);
+	fclose(fp);
+	if (ret != LOAD_HEX_SUCCESS) {
+		send_message(s, "error %d on load_hex", ret);
+		return NULL;
+	}
+	if ((ret = chars_to_words(entry->words, data, sizeof(data))) != LOAD_HEX_SUCCESS) {
+		send_message(s, "error %d on chars_to_words", ret);
+		return NULL;
+	}
+	strcpy(entry->path, path);
+	entry->mtime = st.st_mtime;
+	entry->size = (long)st.st_size;
+	entry->hash = hash;
+	entry->last_used = ++server->use_counter;
+	return entry->words;
+}
+
+/* 通信エラーの後は次のジョブで接続し直す */
+static void handle_error(server_t *server, int ret) {
+	if (ret == ATMEGAIO_CONTROLLER_ERROR && server->atmegaio != NULL) {
+		disconnect(server->atmegaio);
+		server->atmegaio = NULL;
+	}
+}
+
+/* ターゲットごとにSCKの周波数を合わせる */
+static void calibrate_target(server_t *server, ipc_socket_t s) {
+	unsigned long frequency;
+	int ret;
+	if ((ret = calibrate_sck(server->atmegaio, &frequency)) != ATMEGAIO_SUCCESS) {
+		send_message(s, "error %d on calibrate_sck", ret);
+	} else if (frequency > 0) {
+		send_message(s, "SCK = %lu Hz", frequency);
+	}
+}
+
+/* 書き込み操作を接続し、ターゲットをリセットする。成功したら真、失敗したら偽を返す。 */
+static int prepare_target(server_t *server, ipc_socket_t s) {
+	int signature[3];
+	int ret;
+	if (server->atmegaio == NULL) {
+		if ((server->atmegaio = programmer_open(server->programmer)) == NULL) {
+			send_message(s, "error on programmer_open");
+			return 0;
+		}
+		/* 失敗してもキャッシュなしで動作する */
+		enable_cache(server->atmegaio);
+	}
+	/* リセットできなければ、その後の較正や読み込みも意味が無い */
+	if ((ret = reset(server->atmegaio)) != ATMEGAIO_SUCCESS) {
+		send_message(s, "error %d on reset", ret);
+		handle_error(server, ret);
+		return 0;
+	}
+	calibrate_target(server, s);
+	if ((ret = read_signature_byte(server->atmegaio, signature)) == ATMEGAIO_SUCCESS) {
+		send_message(s, "signature = %02X %02X %02X", signature[0], signature[1], signature[2]);
+	} else {
+		send_message(s, "read_signature_byte error %d", ret);
+		handle_error(server, ret);
+		return ret != ATMEGAIO_CONTROLLER_ERROR;
+	}
+	return 1;
+}
+
+/* ページに書き込むべきデータがあるかを調べる */
+static int page_used(const unsigned int *words, int page, int page_size) {
+	int i;
+	for (i = 0; i < page_size; i++) {
+		if (words[page + i] != 0xffff) return 1;
+	}
+	return 0;
+}
+
+/* 書き込んだデータを照合する。不一致の数を返し、エラーの場合は-1を返す。 */
+static int verify_image(server_t *server, ipc_socket_t s, const job_t *job,
+const unsigned int *words) {
+	static unsigned int read_words[DATA_WORDS];
+	int pages = 0, checked_pages = 0;
+	int checked = 0, mismatch = 0;
+	int i, j;
+	int ret;
+	for (i = 0; i + job->page_size <= DATA_WORDS; i += job->page_size) {
+		if (page_used(words, i, job->page_size)) pages++;
+	}
+	send_message(s, "validating the data...");
+	for (i = 0; i + job->page_size <= DATA_WORDS; i += job->page_size) {
+		if (!page_used(words, i, job->page_size)) continue;
+		if ((ret = read_program(server->atmegaio, read_words + i, i, job->page_size)) != ATMEGAIO_SUCCESS) {
+			send_message(s, "error %d on read_program", ret);
+			handle_error(server, ret);
+			return -1;
+		}
+		for (j = 0; j < job->page_size; j++) {
+			checked++;
+			if (words[i + j] != read_words[i + j]) mismatch++;
+		}
+		send_progress(s, ++checked_pages, pages);
+	}
+	send_message(s, "program: %d word(s) checked, %d mismatch(es) found.", checked, mismatch);
+	return mismatch;
+}
+
+/* 書き込みジョブを実行する */
+static int job_program(server_t *server, ipc_socket_t s, const job_t *job) {
+	const unsigned int *words;
+	int pages_to_write = 0, written_pages = 0;
+	int i;
+	int ret;
+	if (job->input_file[0] == '\0') return send_result(s, 1, "no input file");
+	if ((words = get_image(server, s, job->input_file)) == NULL) {
+		return send_result(s, 1, "image load failed");
+	}
+	if (!prepare_target(server, s)) return send_result(s, 1, "connection failed");
+	if (job->do_chip_erase) {
+		if ((ret = chip_erase(server->atmegaio, job->fixed_wait)) != ATMEGAIO_SUCCESS) {
+			send_message(s, "error %d on chip_erase", ret);
+			handle_error(server, ret);
+			return send_result(s, 1, "chip_erase failed");
+		}
+	}
+	if ((ret = write_information(server->atmegaio, job->fixed_wait, job->lock_bits,
+	job->fuse_bits, job->fuse_high_bits, job->extended_fuse_bits)) != ATMEGAIO_SUCCESS) {
+		send_message(s, "error %d on write_information", ret);
+		handle_error(server, ret);
+		return send_result(s, 1, "write_information failed");
+	}
+	if (job->fuse_bits >= 0) calibrate_target(server, s);
+	for (i = 0; i + job->page_size <= DATA_WORDS; i += job->page_size) {
+		if (page_used(words, i, job->page_size)) pages_to_write++;
+	}
+	send_message(s, "writing the data...");
+	for (i = 0; i + job->page_size <= DATA_WORDS; i += job->page_size) {
+		if (!page_used(words, i, job->page_size)) continue;
+		if ((ret = write_program(server->atmegaio, job->fixed_wait,
+		words + i, i, job->page_size, job->page_size)) != ATMEGAIO_SUCCESS) {
+			send_message(s, "error %d on write_program", ret);
+			handle_error(server, ret);
+			return send_result(s, 1, "write_program failed");
+		}
+		send_progress(s, ++written_pages, pages_to_write);
+	}
+	if (job->do_validation) {
+		ret = verify_image(server, s, job, words);
+		if (ret < 0) return send_result(s, 1, "validation failed");
+		if (ret > 0) return send_result(s, 2, "mismatch found");
+	}
+	return send_result(s, 0, "done");
+}
+
+/* 照合ジョブを実行する */
+static int job_verify(server_t *server, ipc_socket_t s, const job_t *job) {
+	const unsigned int *words;
+	int ret;
+	if (job->input_file[0] == '\0') return send_result(s, 1, "no input file");
+	if ((words = get_image(server, s, job->input_file)) == NULL) {
+		return send_result(s, 1, "image load failed");
+	}
+	if (!prepare_target(server, s)) return send_result(s, 1, "connection failed");
+	ret = verify_image(server, s, job, words);
+	if (ret < 0) return send_result(s, 1, "validation failed");
+	if (ret > 0) return send_result(s, 2, "mismatch found");
+	return send_result(s, 0, "done");
+}
+
+/* 読み出しジョブを実行する */
+static int job_dump(server_t *server, ipc_socket_t s, const job_t *job) {
+	unsigned int words[DUMP_CHUNK_WORDS];
+	unsigned char bytes[DUMP_CHUNK_WORDS * 2];
+	unsigned int done = 0;
+	unsigned int i;
+	int ret;
+	if (job->read_size > DATA_WORDS * 2 || job->start_addr > DATA_WORDS * 2 - job->read_size) {
+		return send_result(s, 1, "invalid range");
+	}
+	if (!prepare_target(server, s)) return send_result(s, 1, "connection failed");
+	while (done < job->read_size) {
+		unsigned int current = job->read_size - done;
+		if (current > DUMP_CHUNK_WORDS) current = DUMP_CHUNK_WORDS;
+		if ((ret = read_program(server->atmegaio, words, job->start_addr + done, current)) != ATMEGAIO_SUCCESS) {
+			send_message(s, "read_program error %d", ret);
+			handle_error(server, ret);
+			return send_result(s, 1, "read_program failed");
+		}
+		for (i = 0; i < current; i++) {
+			bytes[i * 2] = words[i] & 0xff;
+			bytes[i * 2 + 1] = (words[i] >> 8) & 0xff;
+		}
+		if (!ipc_send_frame(s, IPC_FRAME_DATA, bytes, current * 2)) return 0;
+		done += current;
+		send_progress(s, done, job->read_size);
+	}
+	return send_result(s, 0, "done");
+}
+
+/* 1個の接続からのジョブを処理する */
+static void serve_client(server_t *server, ipc_socket_t s) {
+	static char payload[IPC_FRAME_MAX_PAYLOAD + 1];
+	int type;
+	unsigned long size;
+	while (ipc_recv_frame(s, &type, payload, IPC_FRAME_MAX_PAYLOAD, &size)) {
+		job_t job;
+		int ok;
+		if (!parse_job(&job, payload)) {
+			ok = send_result(s, 1, "invalid job parameter");
+		} else if (type == IPC_FRAME_PROGRAM) {
+			ok = job_program(server, s, &job);
+		} else if (type == IPC_FRAME_VERIFY) {
+			ok = job_verify(server, s, &job);
+		} else if (type == IPC_FRAME_DUMP) {
+			ok = job_dump(server, s, &job);
+		} else {
+			ok = send_result(s, 1, "unknown job type");
+		}
+		if (!ok) break;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	static server_t server;
+	const char *socket_path = "atmega_server.sock";
+	ipc_socket_t listen_socket;
+	int i;
+	/* コマンドライン引数を読み込む */
+	for (i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "--socket") == 0 || strcmp(argv[i], "-s") == 0) && i + 1 < argc) {
+			socket_path = argv[++i];
+		} else if ((strcmp(argv[i], "--programmer") == 0 || strcmp(argv[i], "-P") == 0) && i + 1 < argc) {
+			server.programmer = argv[++i];
+		} else {
+			fprintf(stderr, "Usage: %s [--socket <path> / -s <path>] [--programmer <spec> / -P <spec>]\n\n",
+				argc > 0 ? argv[0] : "atmega_server");
+			programmer_usage(stderr);
+			return 1;
+		}
+	}
+	if (!ipc_init()) {
+		fputs("ipc_init error\n", stderr);
+		return 1;
+	}
+#ifndef _WIN32
+	/* 進捗を送っている間にクライアントが切断しても、SIGPIPEで終了せずにジョブを続ける */
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	if ((listen_socket = ipc_listen(socket_path)) == IPC_INVALID_SOCKET) {
+		fprintf(stderr, "failed to listen on \"%s\"\n", socket_path);
+		return 1;
+	}
+	/* 書き込み操作は最初に開いておき、ジョブ間で使い回す */
+	if ((server.atmegaio = programmer_open(server.programmer)) == NULL) {
+		fputs("error on programmer_open (will retry on each job)\n", stderr);
+	} else {
+		enable_cache(server.atmegaio);
+	}
+	fprintf(stderr, "listening on \"%s\"\n", socket_path);
+	for (;;) {
+		ipc_socket_t s = ipc_accept(listen_socket);
+		if (s == IPC_INVALID_SOCKET) continue;
+		serve_client(&server, s);
+		ipc_close(s);
+	}
+	return 0;
+}
@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include "atmega_sim.h"
+
+/* Fuse bitsからクロックを求める(CKSEL=0010は内蔵8MHz、0011は内蔵128kHz、他は外部16MHzとする) */
+static unsigned long clock_from_fuse(int fuse_bits) {
+	unsigned long clock;
+	switch (fuse_bits & 0x0f) {
+	case 0x02: clock = 8000000UL; break;
+	case 0x03: clock = 128000UL; break;
+	default: clock = 16000000UL; break;
+	}
+	/* CKDIV8がprogrammedなら8分の1 */
+	return (fuse_bits & 0x80) ? clock : clock / 8;
+}
+
+void atmega_sim_init(atmega_sim_t *sim) {
+	int i;
+	if (sim == NULL) return;
+	for (i = 0; i < ATMEGA_SIM_FLASH_WORDS; i++) sim->flash[i] = 0xffff;
+	for (i = 0; i < ATMEGA_SIM_EEPROM_BYTES; i++) sim->eeprom[i] = 0xff;
+	for (i = 0; i < ATMEGA_SIM_PAGE_WORDS; i++) sim->page_buffer[i] = 0xffff;
+	for (i = 0; i < ATMEGA_SIM_EEPROM_PAGE_BYTES; i++) sim->eeprom_page_buffer[i] = 0xff;
+	/* ATmega328P */
+	sim->signature[0] = 0x1E;
+	sim->signature[1] = 0x95;
+	sim->signature[2] = 0x0F;
+	sim->lock_bits = 0xFF;
+	sim->fuse_bits = 0x62;
+	sim->fuse_high_bits = 0xD9;
+	sim->extended_fuse_bits = 0xFF;
+	sim->calibration_byte = 0x9A;
+	sim->reset_pin = 0;
+	sim->sck_pin = 0;
+	sim->mosi_pin = 0;
+	sim->programming_enabled = 0;
+	sim->byte_index = 0;
+	sim->next_out = 0;
+	sim->in_shift = 0;
+	sim->out_shift = 0;
+	sim->bit_count = 0;
+	sim->clock_frequency = clock_from_fuse(sim->fuse_bits);
+	sim->sck_frequency = 0;
+	sim->fault_command = 0;
+	sim->fault_index = 0;
+	sim->byte_count = 0;
+}
+
+/* 4オクテット揃ったコマンドを実行し、4オクテット目で返すデータを返す */
+static int execute_command(atmega_sim_t *sim, int read_only) {
+	const int *c = sim->command;
+	unsigned int word_addr = ((c[1] << 8) | c[2]) & (ATMEGA_SIM_FLASH_WORDS - 1);
+	unsigned int eeprom_addr = ((c[1] << 8) | c[2]) & (ATMEGA_SIM_EEPROM_BYTES - 1);
+	unsigned int page_index = c[2] & (ATMEGA_SIM_PAGE_WORDS - 1);
+	int i;
+	if (c[0] == 0xAC && c[1] == 0x53) {
+		if (!read_only) sim->programming_enabled = 1;
+		return c[2];
+	}
+	if (!sim->programming_enabled) return c[2];
+	switch (c[0]) {
+	case 0x20: /* Read Program Memory, Low byte */
+		return sim->flash[word_addr] & 0xff;
+	case 0x28: /* Read Program Memory, High byte */
+		return (sim->flash[word_addr] >> 8) & 0xff;
+	case 0xA0: /* Read EEPROM Memory */
+		return sim->eeprom[eeprom_addr];
+	case 0x30: /* Read Signature Byte */
+		return (c[2] & 3) < 3 ? sim->signature[c[2] & 3] : 0xff;
+	case 0x38: /* Read Calibration Byte */
+		return sim->calibration_byte;
+	case 0x58: /* Read Lock bits / Fuse High bits */
+		return c[1] == 0x08 ? sim->fuse_high_bits : sim->lock_bits;
+	case 0x50: /* Read Fuse bits / Extended Fuse Bits */
+		return c[1] == 0x08 ? sim->extended_fuse_bits : sim->fuse_bits;
+	case 0xF0: /* Poll RDY/~BSY (書き込みは即座に完了する) */
+		return 0x00;
+	}
+	if (read_only) return c[2];
+	switch (c[0]) {
+	case 0xAC:
+		if (c[1] == 0x80) {
+			/* Chip Erase (EESAVEがprogrammedならEEPROMを残す) */
+			for (i = 0; i < ATMEGA_SIM_FLASH_WORDS; i++) sim->flash[i] = 0xffff;
+			if (sim->fuse_high_bits & 0x08) {
+				for (i = 0; i < ATMEGA_SIM_EEPROM_BYTES; i++) sim->eeprom[i] = 0xff;
+			}
+			sim->lock_bits = 0xff;
+		} else if (c[1] == 0xA0) {
+			sim->fuse_bits = c[3];
+		} else if (c[1] == 0xA8) {
+			sim->fuse_high_bits = c[3];
+		} else if (c[1] == 0xA4) {
+			sim->extended_fuse_bits = c[3];
+		} else if (c[1] == 0xE0) {
+			/* Lock bitsはChip Eraseでしか戻せない */
+			sim->lock_bits &= c[3] | 0xC0;
+		}
+		break;
+	case 0x40: /* Load Program Memory Page, Low byte */
+		sim->page_buffer[page_index] = (sim->page_buffer[page_index] & 0xff00) | c[3];
+		break;
+	case 0x48: /* Load Program Memory Page, High byte */
+		sim->page_buffer[page_index] = (sim->page_buffer[page_index] & 0x00ff) | (c[3] << 8);
+		break;
+	case 0x4C: /* Write Program Memory Page (消去は行わないので、1から0にしか変わらない) */
+		word_addr &= ~(unsigned int)(ATMEGA_SIM_PAGE_WORDS - 1);
+		for (i = 0; i < ATMEGA_SIM_PAGE_WORDS; i++) {
+			sim->flash[word_addr + i] &= sim->page_buffer[i];
+			sim->page_buffer[i] = 0xffff;
+		}
+		break;
+	case 0xC0: /* Write EEPROM Memory */
+		sim->eeprom[eeprom_addr] = c[3];
+		break;
+	case 0xC1: /* Load EEPROM Memory Page */
+		sim->eeprom_page_buffer[c[2] & (ATMEGA_SIM_EEPROM_PAGE_BYTES - 1)] = c[3];
+		break;
+	case 0xC2: /* Write EEPROM Memory Page */
+		eeprom_addr &= ~(unsigned int)(ATMEGA_SIM_EEPROM_PAGE_BYTES - 1);
+		for (i = 0; i < ATMEGA_SIM_EEPROM_PAGE_BYTES; i++) {
+			sim->eeprom[eeprom_addr + i] = sim->eeprom_page_buffer[i];
+			sim->eeprom_page_buffer[i] = 0xff;
+		}
+		break;
+	}
+	return c[2];
+}
+
+/* 受信したオクテットを処理し、次に送信するオクテットを決める */
+static void receive_byte(atmega_sim_t *sim, int in) {
+	sim->byte_count++;
+	if (sim->fault_command != 0 && sim->byte_index > 0 && sim->byte_index == sim->fault_index &&
+	sim->command[0] == sim->fault_command) {
+		in ^= 0x01;
+		sim->fault_command = 0;
+	}
+	sim->command[sim->byte_index++] = in & 0xff;
+	if (sim->byte_index == 3) {
+		/* 4オクテット目では読み出したデータを返す */
+		sim->command[3] = 0;
+		sim->next_out = execute_command(sim, 1);
+	} else if (sim->byte_index == 4) {
+		execute_command(sim, 0);
+		sim->byte_index = 0;
+		sim->next_out = in & 0xff;
+	} else {
+		/* 1つ前に受信したオクテットをそのまま返す */
+		sim->next_out = in & 0xff;
+	}
+}
+
+int atmega_sim_transfer(atmega_sim_t *sim, int in) {
+	int out;
+	if (sim == NULL || sim->reset_pin) return 0xff;
+	out = sim->next_out;
+	if (sim->sck_frequency != 0 && sim->sck_frequency * 4 >= sim->clock_frequency) {
+		/* SCKが速すぎると1ビットずれて受信・送信してしまう */
+		receive_byte(sim, ((in << 1) | 1) & 0xff);
+		return (out >> 1) | 0x80;
+	}
+	receive_byte(sim, in);
+	return out;
+}
+
+void atmega_sim_set_pins(atmega_sim_t *sim, int reset, int sck, int mosi) {
+	if (sim == NULL) return;
+	reset = reset != 0;
+	sck = sck != 0;
+	mosi = mosi != 0;
+	if (reset) {
+		/* リセット中は通信の状態を初期化し、クロックの設定を反映する */
+		sim->clock_frequency = clock_from_fuse(sim->fuse_bits);
+		sim->programming_enabled = 0;
+		sim->byte_index = 0;
+		sim->next_out = 0;
+		sim->in_shift = 0;
+		sim->bit_count = 0;
+		sim->out_shift = 0;
+	} else if (!sim->sck_pin && sck) {
+		/* 立ち上がりでMOSIを読み込む */
+		sim->in_shift = ((sim->in_shift << 1) | mosi) & 0xff;
+		sim->bit_count++;
+	} else if (sim->sck_pin && !sck) {
+		/* 立ち下がりでMISOを更新する */
+		sim->out_shift = (sim->out_shift << 1) & 0xff;
+		if (sim->bit_count >= 8) {
+			receive_byte(sim, sim->in_shift);
+			sim->out_shift = sim->next_out;
+			sim->bit_count = 0;
+		}
+	}
+	if (sim->reset_pin && !reset) sim->out_shift = sim->next_out;
+	sim->reset_pin = reset;
+	sim->sck_pin = sck;
+	sim->mosi_pin = mosi;
+}
+
+int atmega_sim_miso(const atmega_sim_t *sim) {
+	if (sim == NULL || sim->reset_pin) return 1;
+	return (sim->out_shift >> 7) & 1;
+}
+
+static int sim_disconnect(void *hardware_data) {
+	return hardware_data != NULL;
+}
+
+static int sim_reset(void *hardware_data) {
+	atmega_sim_t *sim = (atmega_sim_t*)hardware_data;
+	if (sim == NULL) return 0;
+	atmega_sim_set_pins(sim, 1, 0, 0);
+	atmega_sim_set_pins(sim, 0, 0, 0);
+	return 1;
+}
+
+static int sim_io_8bits(void *hardware_data, int out) {
+	if (hardware_data == NULL) return -1;
+	return atmega_sim_transfer((atmega_sim_t*)hardware_data, out);
+}
+
+/* 一般的な書き込み器の上限として8MHzまで設定できることにする */
+static unsigned long sim_set_sck_frequency(void *hardware_data, unsigned long frequency) {
+	atmega_sim_t *sim = (atmega_sim_t*)hardware_data;
+	if (sim == NULL) return 0;
+	sim->sck_frequency = frequency < 8000000UL ? frequency : 8000000UL;
+	return sim->sck_frequency;
+}
+
+atmegaio_t *atmega_sim_open(atmega_sim_t *sim) {
+	atmegaio_t *atmegaio;
+	if (sim == NULL) return NULL;
+	atmegaio = calloc(1, sizeof(atmegaio_t));
+	if (atmegaio == NULL) return NULL;
+	atmegaio->hardware_data = (void*)sim;
+	atmegaio->disconnect = sim_disconnect;
+	atmegaio->reset = sim_reset;
+	atmegaio->io_8bits = sim_io_8bits;
+	atmegaio->set_sck_frequency = sim_set_sck_frequency;
+	return atmegaio;
+}
+
+/* 複数ターゲット用の通信データ */
+typedef struct {
+	atmega_sim_t *sims;
+	int target_num;
+} sim_multi_t;
+
+static int sim_multi_disconnect(void *hardware_data) {
+	if (hardware_data == NULL) return 0;
+	free(hardware_data);
+	return 1;
+}
+
+static int sim_multi_reset(void *hardware_data) {
+	sim_multi_t *multi = (sim_multi_t*)hardware_data;
+	int i;
+	if (multi == NULL) return 0;
+	for (i = 0; i < multi->target_num; i++) sim_reset(&multi->sims[i]);
+	return 1;
+}
+
+/* 全シミュレータに同じオクテットを送り、それぞれの応答を受け取る */
+static int sim_multi_io_8bits(void *hardware_data, int out, int *in) {
+	sim_multi_t *multi = (sim_multi_t*)hardware_data;
+	int i;
+	if (multi == NULL || in == NULL) return 0;
+	for (i = 0; i < multi->target_num; i++) in[i] = atmega_sim_transfer(&multi->sims[i], out);
+	return 1;
+}
+
+atmegaio_multi_t *atmega_sim_open_multi(atmega_sim_t *sims, int target_num) {
+	atmegaio_multi_t *atmegaio;
+	sim_multi_t *multi;
+	if (sims == NULL || target_num <= 0 || ATMEGAIO_MAX_TARGETS < target_num) return NULL;
+	atmegaio = calloc(1, sizeof(atmegaio_multi_t));
+	if (atmegaio == NULL) return NULL;
+	multi = malloc(sizeof(sim_multi_t));
+	if (multi == NULL) {
+		free(atmegaio);
+		return NULL;
+	}
+	multi->sims = sims;
+	multi->target_num = target_num;
+	atmegaio->hardware_data = (void*)multi;
+	atmegaio->target_num = target_num;
+	atmegaio->disconnect = sim_multi_disconnect;
+	atmegaio->reset = sim_multi_reset;
+	atmegaio->io_8bits = sim_multi_io_8bits;
+	return atmegaio;
+}
@@ -0,0 +1,82 @@
+#ifndef ATMEGA_SIM_H_GUARD_5F2C8A1E_7B3D_4E96_8C04_D1A9E6B3F257
+#define ATMEGA_SIM_H_GUARD_5F2C8A1E_7B3D_4E96_8C04_D1A9E6B3F257
+
+#include "atmega_io.h"
+
+/* シミュレートするATmega328Pの仕様 */
+#define ATMEGA_SIM_FLASH_WORDS 0x4000
+#define ATMEGA_SIM_PAGE_WORDS 64
+#define ATMEGA_SIM_EEPROM_BYTES 0x400
+#define ATMEGA_SIM_EEPROM_PAGE_BYTES 4
+
+/* シリアルプログラミングに応答するATmegaのシミュレータ */
+typedef struct {
+	/* メモリ */
+	unsigned int flash[ATMEGA_SIM_FLASH_WORDS];
+	unsigned char eeprom[ATMEGA_SIM_EEPROM_BYTES];
+	unsigned int page_buffer[ATMEGA_SIM_PAGE_WORDS];
+	unsigned char eeprom_page_buffer[ATMEGA_SIM_EEPROM_PAGE_BYTES];
+	int signature[3];
+	int lock_bits, fuse_bits, fuse_high_bits, extended_fuse_bits, calibration_byte;
+	/* ピンの状態 */
+	int reset_pin, sck_pin, mosi_pin;
+	/* シリアル通信の状態 */
+	int programming_enabled;
+	int command[4];
+	int byte_index;
+	int next_out;
+	int in_shift, out_shift, bit_count;
+	/* クロック(Hz)。Fuse bitsの設定をリセット時に反映する */
+	unsigned long clock_frequency;
+	/* atmega_sim_transferで通信するときのSCKの周波数(Hz)。0なら考慮しない。
+	 * クロックの4分の1以上になると通信に失敗する。
+	 */
+	unsigned long sck_frequency;
+	/* 通信の故障の注入。fault_commandが0以外なら、次にfault_commandで始まるコマンドの
+	 * fault_index番目(1から3)のオクテットを1ビット反転して受信し、fault_commandを0に戻す。
+	 */
+	int fault_command, fault_index;
+	/* 統計 */
+	unsigned long byte_count;
+} atmega_sim_t;
+
+/* シミュレータを工場出荷時の状態で初期化する */
+void atmega_sim_init(atmega_sim_t *sim);
+
+/**
+ * シリアルプログラミングの1オクテットを送受信する。
+ * @param sim シミュレータ
+ * @param in ターゲットが受信する(MOSIの)データ
+ * @return ターゲットが送信する(MISOの)データ
+ */
+int atmega_sim_transfer(atmega_sim_t *sim, int in);
+
+/**
+ * ピンの状態を設定する。SCKの立ち上がりでMOSIを読み込み、立ち下がりでMISOを更新する。
+ * RESETがHIGHの間はリセット状態になる。
+ * @param sim シミュレータ
+ * @param reset RESETピンの状態
+ * @param sck SCKピンの状態
+ * @param mosi MOSIピンの状態
+ */
+void atmega_sim_set_pins(atmega_sim_t *sim, int reset, int sck, int mosi);
+
+/* MISOピンの状態を返す */
+int atmega_sim_miso(const atmega_sim_t *sim);
+
+/**
+ * シミュレータをターゲットとする書き込み操作を初期化する。
+ * simは切断まで有効でなければならない。
+ * 成功と判定したら通信用データのポインタ、失敗を検出したらNULLを返す。
+ */
+atmegaio_t *atmega_sim_open(atmega_sim_t *sim);
+
+/**
+ * SCK、MOSI、RESETを共有し、MISOだけ別にした複数のシミュレータを
+ * ターゲットとする書き込み操作を初期化する。
+ * simsはtarget_num要素の配列で、切断まで有効でなければならない。
+ * 成功と判定したら通信用データのポインタ、失敗を検出したらNULLを返す。
+ */
+atmegaio_multi_t *atmega_sim_open_multi(atmega_sim_t *sims, int target_num);
+
+#endif
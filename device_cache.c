@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <string.h>
+#include "device_cache.h"
+
+/* キャッシュファイルからパスを読み込む */
+static int load_cached_path(const char *cache_file, char *path) {
+	FILE *fp;
+	size_t len;
+	if (cache_file == NULL) return 0;
+	fp = fopen(cache_file, "r");
+	if (fp == NULL) return 0;
+	if (fgets(path, DEVICE_PATH_MAX, fp) == NULL) {
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	/* 改行を消す */
+	len = strlen(path);
+	while (len > 0 && (path[len - 1] == '\n' || path[len - 1] == '\r')) path[--len] = '\0';
+	return len > 0;
+}
+
+/* キャッシュファイルにパスを書き込む */
+static void save_cached_path(const char *cache_file, const char *path) {
+	FILE *fp;
+	if (cache_file == NULL) return;
+	fp = fopen(cache_file, "w");
+	if (fp == NULL) return;
+	fprintf(fp, "%s\n", path);
+	fclose(fp);
+}
+
+int device_open_cached(const device_source_t *source, const char *cache_file, void *device) {
+	char path[DEVICE_PATH_MAX];
+	char cached_path[DEVICE_PATH_MAX];
+	const char *current;
+	int has_cache;
+	int found = 0;
+	if (source == NULL || device == NULL) return 0;
+	/* まずキャッシュされたパスを試す */
+	has_cache = load_cached_path(cache_file, cached_path);
+	if (has_cache && (source->open)(source->context, cached_path, device)) return 1;
+	/* 列挙して探す */
+	if (!(source->begin)(source->context)) return 0;
+	while ((current = (source->next)(source->context)) != NULL) {
+		/* キャッシュされたパスは既に試したので飛ばす */
+		if (has_cache && strcmp(current, cached_path) == 0) continue;
+		if ((source->open)(source->context, current, device)) {
+			if (strlen(current) < sizeof(path)) {
+				strcpy(path, current);
+				found = 1;
+			}
+			break;
+		}
+	}
+	(source->end)(source->context);
+	if (found) save_cached_path(cache_file, path);
+	return found;
+}
+
+#ifdef DEVICE_CACHE_TEST
+/* 偽のデバイス列挙を用いて、キャッシュの有無による起動時間を比較する */
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+typedef struct {
+	int device_num; /* 列挙されるデバイスの数 */
+	int target_index; /* 目的のデバイスの番号 */
+	int open_cost_ms; /* デバイスを開いて確認するのにかかる時間 */
+	int index;
+	int open_count;
+	char path[64];
+} fake_source_t;
+
+static double now_ms(void) {
+#ifdef _WIN32
+	return (double)GetTickCount();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static void wait_ms(int ms) {
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	struct timespec req;
+	req.tv_sec = ms / 1000;
+	req.tv_nsec = (long)(ms % 1000) * 1000000L;
+	nanosleep(&req, NULL);
+#endif
+}
+
+static int fake_begin(void *context) {
+	((fake_source_t*)context)->index = 0;
+	return 1;
+}
+
+static const char *fake_next(void *context) {
+	fake_source_t *fake = (fake_source_t*)context;
+	if (fake->index >= fake->device_num) return NULL;
+	sprintf(fake->path, "\\\\?\\hid#fake_device#%04d", fake->index++);
+	return fake->path;
+}
+
+static void fake_end(void *context) {
+	(void)context;
+}
+
+static int fake_open(void *context, const char *path, void *device) {
+	fake_source_t *fake = (fake_source_t*)context;
+	int index;
+	fake->open_count++;
+	wait_ms(fake->open_cost_ms);
+	if (sscanf(path, "\\\\?\\hid#fake_device#%d", &index) != 1 ||
+	index < 0 || fake->device_num <= index) return 0;
+	if (index != fake->target_index) return 0;
+	*(int*)device = index;
+	return 1;
+}
+
+static int run(fake_source_t *fake, device_source_t *source, const char *cache_file,
+const char *label) {
+	double start;
+	int device = -1;
+	int ok;
+	fake->open_count = 0;
+	start = now_ms();
+	ok = device_open_cached(source, cache_file, &device);
+	printf("%-24s: %s, %3d open(s), %8.1f ms\n", label,
+		ok && device == fake->target_index ? "found" : "NOT FOUND",
+		fake->open_count, now_ms() - start);
+	return ok && device == fake->target_index;
+}
+
+int main(int argc, char *argv[]) {
+	const char *cache_file = "device_cache_test.cache";
+	fake_source_t fake;
+	device_source_t source;
+	int ok = 1;
+	fake.device_num = argc > 1 ? atoi(argv[1]) : 40;
+	fake.open_cost_ms = argc > 2 ? atoi(argv[2]) : 5;
+	fake.target_index = fake.device_num - 1;
+	source.context = &fake;
+	source.begin = fake_begin;
+	source.next = fake_next;
+	source.end = fake_end;
+	source.open = fake_open;
+	printf("%d fake device(s), %d ms per open\n", fake.device_num, fake.open_cost_ms);
+	remove(cache_file);
+	ok &= run(&fake, &source, NULL, "full scan (no cache)");
+	ok &= run(&fake, &source, cache_file, "cold cache");
+	ok &= run(&fake, &source, cache_file, "warm cache");
+	/* 目的のデバイスが別のパスに移った場合は列挙し直す */
+	fake.target_index = 0;
+	ok &= run(&fake, &source, cache_file, "stale cache");
+	ok &= run(&fake, &source, cache_file, "warm cache after rescan");
+	remove(cache_file);
+	return ok ? 0 : 1;
+}
+#endif
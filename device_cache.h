@@ -0,0 +1,37 @@
+#ifndef DEVICE_CACHE_H_GUARD_9B4E2D61_0C7F_4A38_A5D1_6E83F2B7C049
+#define DEVICE_CACHE_H_GUARD_9B4E2D61_0C7F_4A38_A5D1_6E83F2B7C049
+
+/* デバイスのパスの最大長 */
+#define DEVICE_PATH_MAX 1024
+
+/* デバイスを列挙する関数の情報を持つ構造体 */
+typedef struct {
+	/* 各列挙方法定義のデータ */
+	void *context;
+	/* 列挙を開始する関数
+	 * 成功と判定したら真、失敗を検出したら偽を返す。
+	 */
+	int (*begin)(void *context);
+	/* 次のデバイスのパスを返す関数
+	 * デバイスが無くなったらNULLを返す。
+	 */
+	const char *(*next)(void *context);
+	/* 列挙を終了する関数 */
+	void (*end)(void *context);
+	/* パスで指定したデバイスを開き、目的のデバイスかを確認する関数
+	 * 目的のデバイスなら真を返してdeviceに開いたデバイスを格納し、そうでなければ偽を返す。
+	 */
+	int (*open)(void *context, const char *path, void *device);
+} device_source_t;
+
+/**
+ * キャッシュファイルに記録されたパスのデバイスを開く。
+ * 開けなかった場合は列挙して探し、見つかったデバイスのパスをキャッシュファイルに記録する。
+ * @param source 利用する列挙方法
+ * @param cache_file キャッシュファイルのパス(NULLならキャッシュを使わない)
+ * @param device 開いたデバイスを格納する領域へのポインタ(openに渡される)
+ * @return 成功と判定したら真、失敗を検出したら偽
+ */
+int device_open_cached(const device_source_t *source, const char *cache_file, void *device);
+
+#endif
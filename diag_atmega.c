@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "atmega_io.h"
+#include "programmer.h"
+#ifdef __linux__
+#include "usbio_linux.h"
+#else
+#include <windows.h>
+#include "usbio_windows.h"
+#endif
+
+/* 往復時間の既定の測定回数 */
+#define DEFAULT_SAMPLES 1000
+/* 通信速度の測定で送る既定のオクテット数 */
+#define DEFAULT_THROUGHPUT_BYTES 200
+/* ループバック試験で周波数ごとに送る既定のオクテット数 */
+#define DEFAULT_LOOPBACK_BYTES 1000
+/* ループバック試験で下げていくSCKの周波数の下限(Hz) */
+#define LOOPBACK_MIN_FREQUENCY 10000UL
+/* ループバック試験を行う周波数の最大数 */
+#define LOOPBACK_MAX_RATES 32
+/* USB-IO2.0で1オクテットの送受信に使うレポートの数 */
+#define REPORTS_PER_BYTE 17
+/* ヒストグラムの区間の数
+ * 0番は1us未満、k番は2^(k-1)us以上2^k us未満で、最後の区間は上限なし
+ */
+#define HISTOGRAM_BINS 21
+
+/* 往復時間の測定結果 */
+typedef struct {
+	/* 1回の往復の単位("report"または"byte") */
+	const char *unit;
+	int samples;
+	int failures;
+	double min_us, mean_us, p50_us, p90_us, p99_us, max_us;
+	unsigned long histogram[HISTOGRAM_BINS];
+} latency_t;
+
+/* 通信速度の測定結果 */
+typedef struct {
+	/* 1オクテット分のレポートをまとめて送るか(-1なら書き込み器に該当する設定がない) */
+	int batching;
+	int bytes;
+	int failures;
+	double seconds;
+} throughput_t;
+
+/* ループバック試験の結果 */
+typedef struct {
+	/* SCKの周波数(Hz)。書き込み器が周波数の設定に対応していなければ0 */
+	unsigned long sck_frequency;
+	unsigned long bits;
+	unsigned long bit_errors;
+	int failures;
+} loopback_t;
+
+/* 単調増加する時刻をマイクロ秒単位で返す */
+static double now_us(void) {
+#ifdef __linux__
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#else
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (double)count.QuadPart * 1e6 / (double)frequency.QuadPart;
+#endif
+}
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* ヒストグラムの区間の下限(us) */
+static unsigned long bin_from_us(int bin) {
+	return bin == 0 ? 0 : 1UL << (bin - 1);
+}
+
+/* 書き込み器がUSB-IO2.0なら真を返す */
+static int is_usbio(const char *spec) {
+	return spec == NULL || strcmp(spec, "usbio") == 0 || strncmp(spec, "usbio:", 6) == 0;
+}
+
+/**
+ * 往復時間を測定する。
+ * USB-IO2.0ではレポート1個の送受信、それ以外の書き込み器では1オクテットの送受信を1回とする。
+ * @param atmegaio 書き込み器
+ * @param usbio 書き込み器がUSB-IO2.0なら真
+ * @param samples 測定する回数
+ * @param result 結果を格納する構造体へのポインタ
+ * @return メモリを確保できたら真
+ */
+static int measure_latency(const atmegaio_t *atmegaio, int usbio, int samples, latency_t *result) {
+	double *times = malloc(sizeof(double) * (samples > 0 ? samples : 1));
+	double sum = 0;
+	int i;
+	if (times == NULL) return 0;
+	memset(result, 0, sizeof(*result));
+	result->unit = usbio ? "report" : "byte";
+	for (i = 0; i < samples; i++) {
+		double start = now_us();
+		int ok = usbio ? usbio_round_trip(atmegaio->hardware_data) :
+			(atmegaio->io_8bits)(atmegaio->hardware_data, 0) >= 0;
+		double elapsed = now_us() - start;
+		int bin = 0;
+		if (!ok) {
+			result->failures++;
+			continue;
+		}
+		times[result->samples++] = elapsed;
+		sum += elapsed;
+		while (bin < HISTOGRAM_BINS - 1 && elapsed >= (double)bin_from_us(bin + 1)) bin++;
+		result->histogram[bin]++;
+	}
+	if (result->samples > 0) {
+		int n = result->samples;
+		qsort(times, n, sizeof(double), compare_double);
+		result->min_us = times[0];
+		result->max_us = times[n - 1];
+		result->mean_us = sum / n;
+		result->p50_us = times[(n - 1) * 50 / 100];
+		result->p90_us = times[(n - 1) * 90 / 100];
+		result->p99_us = times[(n - 1) * 99 / 100];
+	}
+	free(times);
+	return 1;
+}
+
+/* bytesオクテットを続けて送受信し、かかった時間を測定する */
+static void measure_throughput(const atmegaio_t *atmegaio, int bytes, int batching, throughput_t *result) {
+	double start;
+	int i;
+	result->batching = batching;
+	result->bytes = bytes;
+	result->failures = 0;
+	start = now_us();
+	for (i = 0; i < bytes; i++) {
+		if ((atmegaio->io_8bits)(atmegaio->hardware_data, i & 0xff) < 0) result->failures++;
+	}
+	result->seconds = (now_us() - start) / 1e6;
+}
+
+/* 1になっているビットの数を数える */
+static int count_bits(int value) {
+	int count = 0;
+	for (; value != 0; value >>= 1) count += value & 1;
+	return count;
+}
+
+/* MOSIとMISOを繋いだ状態で疑似乱数を送受信し、送ったビットと受け取ったビットを比較する */
+static void run_loopback(const atmegaio_t *atmegaio, int bytes, loopback_t *result) {
+	/* 16ビットのガロアLFSR(x^16 + x^14 + x^13 + x^11 + 1) */
+	unsigned int lfsr = 0xACE1u;
+	int i, j;
+	result->bits = result->bit_errors = 0;
+	result->failures = 0;
+	for (i = 0; i < bytes; i++) {
+		int out = 0, in;
+		for (j = 0; j < 8; j++) {
+			out = (out << 1) | (lfsr & 1);
+			lfsr = (lfsr >> 1) ^ ((lfsr & 1) ? 0xB400u : 0);
+		}
+		if ((in = (atmegaio->io_8bits)(atmegaio->hardware_data, out)) < 0) {
+			result->failures++;
+			continue;
+		}
+		result->bits += 8;
+		result->bit_errors += count_bits((out ^ in) & 0xff);
+	}
+}
+
+/* JSONの文字列を出力する */
+static void print_json_string(const char *str) {
+	putchar('"');
+	for (; *str != '\0'; str++) {
+		unsigned char c = (unsigned char)*str;
+		if (c == '"' || c == '\\') {
+			printf("\\%c", c);
+		} else if (c < 0x20) {
+			printf("\\u%04x", c);
+		} else {
+			putchar(c);
+		}
+	}
+	putchar('"');
+}
+
+static void print_json(const char *programmer, const latency_t *latency,
+const throughput_t *throughput, int throughput_num, int usbio,
+const loopback_t *loopback, int loopback_num, int loopback_enabled) {
+	int i;
+	printf("{\"time\":%ld,\"programmer\":", (long)time(NULL));
+	print_json_string(programmer != NULL ? programmer : "usbio");
+	printf(",\"latency\":{\"unit\":\"%s\",\"samples\":%d,\"failures\":%d", latency->unit,
+		latency->samples, latency->failures);
+	if (latency->samples > 0) {
+		printf(",\"min_us\":%.1f,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f",
+			latency->min_us, latency->mean_us, latency->p50_us, latency->p90_us, latency->p99_us, latency->max_us);
+	}
+	fputs(",\"histogram\":[", stdout);
+	for (i = 0; i < HISTOGRAM_BINS; i++) {
+		printf("%s{\"from_us\":%lu,", i > 0 ? "," : "", bin_from_us(i));
+		if (i < HISTOGRAM_BINS - 1) {
+			printf("\"to_us\":%lu,", bin_from_us(i + 1));
+		} else {
+			fputs("\"to_us\":null,", stdout);
+		}
+		printf("\"count\":%lu}", latency->histogram[i]);
+	}
+	fputs("]},\"throughput\":[", stdout);
+	for (i = 0; i < throughput_num; i++) {
+		const throughput_t *t = &throughput[i];
+		printf("%s{\"batching\":%s,\"bytes\":%d,\"failures\":%d,\"seconds\":%.6f", i > 0 ? "," : "",
+			t->batching < 0 ? "null" : (t->batching ? "true" : "false"), t->bytes, t->failures, t->seconds);
+		if (t->seconds > 0) {
+			printf(",\"bytes_per_second\":%.1f", t->bytes / t->seconds);
+			if (usbio) printf(",\"reports_per_second\":%.1f", t->bytes * REPORTS_PER_BYTE / t->seconds);
+		}
+		putchar('}');
+	}
+	fputs("],\"loopback\":", stdout);
+	if (!loopback_enabled) {
+		fputs("null", stdout);
+	} else {
+		putchar('[');
+		for (i = 0; i < loopback_num; i++) {
+			const loopback_t *l = &loopback[i];
+			printf("%s{\"sck_frequency\":%lu,\"bits\":%lu,\"bit_errors\":%lu,\"failures\":%d,\"ber\":",
+				i > 0 ? "," : "", l->sck_frequency, l->bits, l->bit_errors, l->failures);
+			if (l->bits > 0) {
+				printf("%.3e}", (double)l->bit_errors / l->bits);
+			} else {
+				fputs("null}", stdout);
+			}
+		}
+		putchar(']');
+	}
+	puts("}");
+}
+
+static void print_text(const char *programmer, const latency_t *latency,
+const throughput_t *throughput, int throughput_num, int usbio,
+const loopback_t *loopback, int loopback_num) {
+	int i;
+	printf("programmer: %s\n", programmer != NULL ? programmer : "usbio");
+	printf("round trip (%s): %d sample(s), %d failure(s)\n", latency->unit, latency->samples, latency->failures);
+	if (latency->samples > 0) {
+		printf("  min %.1f us, mean %.1f us, p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+			latency->min_us, latency->mean_us, latency->p50_us, latency->p90_us, latency->p99_us, latency->max_us);
+		for (i = 0; i < HISTOGRAM_BINS; i++) {
+			if (latency->histogram[i] == 0) continue;
+			if (i < HISTOGRAM_BINS - 1) {
+				printf("  %7lu - %7lu us : %lu\n", bin_from_us(i), bin_from_us(i + 1), latency->histogram[i]);
+			} else {
+				printf("  %7lu us -         : %lu\n", bin_from_us(i), latency->histogram[i]);
+			}
+		}
+	}
+	for (i = 0; i < throughput_num; i++) {
+		const throughput_t *t = &throughput[i];
+		printf("throughput%s: %d byte(s) in %.3f s, %d failure(s)",
+			t->batching < 0 ? "" : (t->batching ? " (batching on)" : " (batching off)"),
+			t->bytes, t->seconds, t->failures);
+		if (t->seconds > 0) {
+			printf(", %.1f byte(s)/s", t->bytes / t->seconds);
+			if (usbio) printf(", %.1f report(s)/s", t->bytes * REPORTS_PER_BYTE / t->seconds);
+		}
+		putchar('\n');
+	}
+	for (i = 0; i < loopback_num; i++) {
+		const loopback_t *l = &loopback[i];
+		if (l->sck_frequency > 0) {
+			printf("loopback at %lu Hz: ", l->sck_frequency);
+		} else {
+			fputs("loopback: ", stdout);
+		}
+		printf("%lu bit(s), %lu error(s), %d failure(s)", l->bits, l->bit_errors, l->failures);
+		if (l->bits > 0) printf(", BER %.3e", (double)l->bit_errors / l->bits);
+		putchar('\n');
+	}
+}
+
+int main(int argc, char *argv[]) {
+	const char *programmer = NULL;
+	int samples = DEFAULT_SAMPLES;
+	int throughput_bytes = DEFAULT_THROUGHPUT_BYTES;
+	int loopback_bytes = DEFAULT_LOOPBACK_BYTES;
+	int loopback_enabled = 0;
+	int json = 0;
+	int command_line_error = 0;
+	int show_help = 0;
+	atmegaio_t *atmegaio;
+	int usbio;
+	latency_t latency;
+	throughput_t throughput[2];
+	int throughput_num = 0;
+	loopback_t loopback[LOOPBACK_MAX_RATES];
+	int loopback_num = 0;
+	int exit_code = 0;
+	int i;
+	int ret;
+	/* コマンドライン引数を読み込む */
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--programmer") == 0 || strcmp(argv[i], "-P") == 0) {
+			if ((++i) < argc) {
+				programmer = argv[i];
+			} else {
+				fprintf(stderr, "missing argument for --programmer\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--samples") == 0) {
+			if ((++i) < argc) {
+				if (sscanf(argv[i], "%d", &samples) != 1 || samples <= 0) {
+					fprintf(stderr, "invalid argument for --samples\n");
+					command_line_error = 1;
+				}
+			} else {
+				fprintf(stderr, "missing argument for --samples\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--bytes") == 0) {
+			if ((++i) < argc) {
+				if (sscanf(argv[i], "%d", &throughput_bytes) != 1 || throughput_bytes <= 0) {
+					fprintf(stderr, "invalid argument for --bytes\n");
+					command_line_error = 1;
+				}
+			} else {
+				fprintf(stderr, "missing argument for --bytes\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--loopback") == 0) {
+			loopback_enabled = 1;
+		} else if (strcmp(argv[i], "--loopback-bytes") == 0) {
+			if ((++i) < argc) {
+				if (sscanf(argv[i], "%d", &loopback_bytes) != 1 || loopback_bytes <= 0) {
+					fprintf(stderr, "invalid argument for --loopback-bytes\n");
+					command_line_error = 1;
+				}
+			} else {
+				fprintf(stderr, "missing argument for --loopback-bytes\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--json") == 0) {
+			json = 1;
+		} else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+			show_help = 1;
+		} else {
+			fprintf(stderr, "unrecognized command line option: %s\n", argv[i]);
+			command_line_error = 1;
+		}
+	}
+	/* 必要ならヘルプを表示する */
+	if (show_help || command_line_error) {
+		fprintf(stderr, "Usage: %s [options...]\n", argc > 0 ? argv[0] : "diag_atmega");
+		fputs("measure the link to the programmer without entering the programming mode\n", stderr);
+		fputs("options:\n", stderr);
+		fputs("--programmer <spec> / -P <spec> : select programmer (default: usbio)\n", stderr);
+		fprintf(stderr, "--samples <n> : number of round trips to time (default: %d)\n", DEFAULT_SAMPLES);
+		fputs("    (one report for USB-IO2.0, one byte for other programmers)\n", stderr);
+		fprintf(stderr, "--bytes <n> : bytes to send for the throughput test (default: %d)\n",
+			DEFAULT_THROUGHPUT_BYTES);
+		fputs("    (USB-IO2.0 on Linux is measured with report batching off and on)\n", stderr);
+		fputs("--loopback : measure the bit error rate at each SCK frequency;\n", stderr);
+		fputs("    connect MOSI to MISO and disconnect the target first\n", stderr);
+		fprintf(stderr, "--loopback-bytes <n> : bytes to send at each SCK frequency (default: %d)\n",
+			DEFAULT_LOOPBACK_BYTES);
+		fputs("--json : print the result as one line of JSON\n", stderr);
+		fputs("--help / -h : show this help\n", stderr);
+		fputs("exit status is 1 if any transfer failed or any loopback bit was wrong\n", stderr);
+		fputc('\n', stderr);
+		programmer_usage(stderr);
+		return command_line_error ? 1 : 0;
+	}
+
+	usbio = is_usbio(programmer);
+	atmegaio = programmer_open(programmer);
+	if (atmegaio == NULL) {
+		fputs("error on programmer_open\n", stderr);
+		return 1;
+	}
+
+	/* 往復時間 */
+	if (!measure_latency(atmegaio, usbio, samples, &latency)) {
+		fputs("out of memory\n", stderr);
+		disconnect(atmegaio);
+		return 1;
+	}
+	if (latency.failures > 0) exit_code = 1;
+
+	/* 通信速度 */
+	if (usbio) {
+#ifdef __linux__
+		usbio_set_pipelined(atmegaio->hardware_data, 0);
+		measure_throughput(atmegaio, throughput_bytes, 0, &throughput[throughput_num++]);
+		usbio_set_pipelined(atmegaio->hardware_data, 1);
+		measure_throughput(atmegaio, throughput_bytes, 1, &throughput[throughput_num++]);
+		usbio_set_pipelined(atmegaio->hardware_data, 0);
+#else
+		measure_throughput(atmegaio, throughput_bytes, 0, &throughput[throughput_num++]);
+#endif
+	} else {
+		measure_throughput(atmegaio, throughput_bytes, -1, &throughput[throughput_num++]);
+	}
+	for (i = 0; i < throughput_num; i++) {
+		if (throughput[i].failures > 0) exit_code = 1;
+	}
+
+	/* ループバック試験(最大の周波数から半分ずつ下げていく) */
+	if (loopback_enabled) {
+		unsigned long frequency;
+		if ((ret = set_sck_frequency(atmegaio, ATMEGAIO_SCK_MAX_FREQUENCY, &frequency)) != ATMEGAIO_SUCCESS) {
+			fprintf(stderr, "error %d on set_sck_frequency\n", ret);
+			exit_code = 1;
+		} else {
+			for (;;) {
+				unsigned long next;
+				loopback[loopback_num].sck_frequency = frequency;
+				run_loopback(atmegaio, loopback_bytes, &loopback[loopback_num]);
+				if (loopback[loopback_num].bit_errors > 0 || loopback[loopback_num].failures > 0) exit_code = 1;
+				loopback_num++;
+				/* 周波数を設定できない書き込み器では1回だけ行う */
+				if (frequency == 0 || frequency / 2 < LOOPBACK_MIN_FREQUENCY || loopback_num >= LOOPBACK_MAX_RATES) break;
+				if (set_sck_frequency(atmegaio, frequency / 2, &next) != ATMEGAIO_SUCCESS || next >= frequency) break;
+				frequency = next;
+			}
+		}
+	}
+
+	if (json) {
+		print_json(programmer, &latency, throughput, throughput_num, usbio, loopback, loopback_num, loopback_enabled);
+	} else {
+		print_text(programmer, &latency, throughput, throughput_num, usbio, loopback, loopback_num);
+	}
+	if ((ret = disconnect(atmegaio)) != ATMEGAIO_SUCCESS) {
+		fprintf(stderr, "disconnect error %d\n", ret);
+	}
+	return exit_code;
+}
@@ -0,0 +1,333 @@
+/* 1台のUSB-IO2.0に複数のATmegaをつなぎ、同じデータを同時に書き込む。
+ * SCK、MOSI、RESETは全ターゲットで共有し、MISOだけターゲットごとに別のポートにつなぐ。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "atmega_io.h"
+#include "load_hex.h"
+#include "progress_bar.h"
+#ifdef __linux__
+#include "usbio_linux.h"
+#else
+#include "usbio_windows.h"
+#endif
+
+/* 読み込むデータのサイズ(オクテット) */
+#define DATA_BUFFER_SIZE 0x10000
+#define EEPROM_BUFFER_SIZE 0x400
+
+/* USB-IO2.0の共有するポート(MOSI, SCK, RESET)と、既定のMISOのポート */
+#define USBIO_SHARED_PORTS 7, 6, 5
+#define DEFAULT_MISO_PORT 8
+
+/* ターゲットの状態を表示用の文字列にする */
+static const char *status_string(int status) {
+	switch (status) {
+	case ATMEGAIO_SUCCESS: return "OK";
+	case ATMEGAIO_PROGRAMMING_ENABLE_ERROR: return "no response to Programming Enable";
+	case ATMEGAIO_BUSY_TIMEOUT: return "RDY/~BSY timeout";
+	case ATMEGAIO_MISMATCH: return "data mismatch";
+	default: return "error";
+	}
+}
+
+/* "8,9,10"のようなポートの並びを読み込み、ポートの数を返す。不正なら0を返す。 */
+static int parse_ports(const char *arg, int *ports) {
+	int num = 0;
+	while (num < ATMEGAIO_MAX_TARGETS) {
+		char *end;
+		long port = strtol(arg, &end, 10);
+		if (end == arg || port < 0) return 0;
+		ports[num++] = (int)port;
+		if (*end == '\0') return num;
+		if (*end != ',') return 0;
+		arg = end + 1;
+	}
+	return 0;
+}
+
+/* HEXファイルを読み込む。成功したら真を返す。 */
+static int load_file(const char *path, char *data, unsigned char *defined, int size) {
+	FILE *fp;
+	int ret;
+	memset(data, 0xff, size);
+	memset(defined, 0, size);
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "file \"%s\" open error\n", path);
+		return 0;
+	}
+	ret = load_hex_merge(data, defined, size, 0, fp, NULL, NULL);
+	fclose(fp);
+	if (ret != LOAD_HEX_SUCCESS) {
+		fprintf(stderr, "error %d on load_hex \"%s\"\n", ret, path);
+		return 0;
+	}
+	return 1;
+}
+
+/* 有効なターゲットの数を数える */
+static int count_active(const int *status, int target_num) {
+	int i, count = 0;
+	for (i = 0; i < target_num; i++) {
+		if (status[i] == ATMEGAIO_SUCCESS) count++;
+	}
+	return count;
+}
+
+int main(int argc, char *argv[]) {
+	static char data[DATA_BUFFER_SIZE];
+	static unsigned char data_defined[DATA_BUFFER_SIZE];
+	static unsigned int data_words[DATA_BUFFER_SIZE / 2];
+	static char eeprom_bytes[EEPROM_BUFFER_SIZE];
+	static unsigned char eeprom_defined[EEPROM_BUFFER_SIZE];
+	int eeprom_image[EEPROM_BUFFER_SIZE];
+	const char *input_file = NULL;
+	const char *eeprom_file = NULL;
+	int miso_ports[ATMEGAIO_MAX_TARGETS] = {DEFAULT_MISO_PORT};
+	int target_num = 1;
+	int page_size = 64;
+	int lock_bits = -1, fuse_bits = -1, fuse_high_bits = -1, extended_fuse_bits = -1;
+	int expected_signature[3] = {-1, -1, -1};
+	int fixed_wait = 0;
+	int command_line_error = 0;
+	int show_help = 0;
+	atmegaio_multi_t *atmegaio;
+	int status[ATMEGAIO_MAX_TARGETS];
+	int signature[ATMEGAIO_MAX_TARGETS][3];
+	progress_t progress;
+	int pages_to_write, written_pages;
+	int exit_code = 0;
+	int i, j, k;
+	int ret;
+	/* コマンドライン引数を読み込む */
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--input-file") == 0 || strcmp(argv[i], "-i") == 0) {
+			if ((++i) < argc) {
+				input_file = argv[i];
+			} else {
+				fprintf(stderr, "missing argument for --input-file\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--eeprom-file") == 0) {
+			if ((++i) < argc) {
+				eeprom_file = argv[i];
+			} else {
+				fprintf(stderr, "missing argument for --eeprom-file\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--miso") == 0) {
+			if ((++i) < argc) {
+				if ((target_num = parse_ports(argv[i], miso_ports)) == 0) {
+					fprintf(stderr, "invalid argument for --miso\n");
+					command_line_error = 1;
+				}
+			} else {
+				fprintf(stderr, "missing argument for --miso\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--signature") == 0) {
+			unsigned int value;
+			if ((++i) < argc) {
+				if (strlen(argv[i]) != 6 || sscanf(argv[i], "%x", &value) != 1) {
+					fprintf(stderr, "invalid argument for --signature\n");
+					command_line_error = 1;
+				} else {
+					for (k = 0; k < 3; k++) expected_signature[k] = (value >> (16 - 8 * k)) & 0xff;
+				}
+			} else {
+				fprintf(stderr, "missing argument for --signature\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--page-size") == 0 || strcmp(argv[i], "-p") == 0) {
+			if ((++i) < argc) {
+				if (sscanf(argv[i], "%d", &page_size) != 1 || page_size <= 0 ||
+				DATA_BUFFER_SIZE / 2 % page_size != 0) {
+					fprintf(stderr, "invalid argument for --page-size\n");
+					command_line_error = 1;
+				}
+			} else {
+				fprintf(stderr, "missing argument for --page-size\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--lock-bits") == 0 || strcmp(argv[i], "-l") == 0 ||
+		strcmp(argv[i], "--fuse-low-byte") == 0 || strcmp(argv[i], "-fl") == 0 ||
+		strcmp(argv[i], "--fuse-high-byte") == 0 || strcmp(argv[i], "-fh") == 0 ||
+		strcmp(argv[i], "--extended-fuse-byte") == 0 || strcmp(argv[i], "-ef") == 0) {
+			const char *option = argv[i];
+			int *target;
+			if (strcmp(option, "--lock-bits") == 0 || strcmp(option, "-l") == 0) {
+				target = &lock_bits;
+			} else if (strcmp(option, "--fuse-low-byte") == 0 || strcmp(option, "-fl") == 0) {
+				target = &fuse_bits;
+			} else if (strcmp(option, "--fuse-high-byte") == 0 || strcmp(option, "-fh") == 0) {
+				target = &fuse_high_bits;
+			} else {
+				target = &extended_fuse_bits;
+			}
+			if ((++i) < argc) {
+				if (sscanf(argv[i], "%x", target) != 1) {
+					fprintf(stderr, "invalid argument for %s\n", option);
+					command_line_error = 1;
+				}
+			} else {
+				fprintf(stderr, "missing argument for %s\n", option);
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--fixed-wait") == 0) {
+			fixed_wait = 1;
+		} else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+			show_help = 1;
+		} else {
+			fprintf(stderr, "unrecognized command line option: %s\n", argv[i]);
+			command_line_error = 1;
+		}
+	}
+	if (!show_help && !command_line_error && input_file == NULL) {
+		fputs("input file not specified\n", stderr);
+		command_line_error = 1;
+	}
+	/* 必要ならヘルプを表示する */
+	if (show_help || command_line_error) {
+		fprintf(stderr, "Usage: %s [options...]\n", argc > 0 ? argv[0] : "gang_atmega");
+		fputs("write the same data to several ATmegas on one USB-IO2.0 at once\n", stderr);
+		fputs("options:\n", stderr);
+		fputs("--input-file <file> / -i <file> : set hex file to write (required)\n", stderr);
+		fputs("--eeprom-file <file> : also write this hex file to EEPROM\n", stderr);
+		fprintf(stderr, "--miso <port,port,...> : USB-IO2.0 port of each target's MISO (default: %d)\n",
+			DEFAULT_MISO_PORT);
+		fputs("    (port 8 is J2-0, 9 is J2-1, ...); MOSI (J1-7), SCK (J1-6) and RESET (J1-5)\n", stderr);
+		fputs("    are shared by all targets\n", stderr);
+		fputs("--signature <hex> : expected Signature Bytes, e.g. 1E950F\n", stderr);
+		fputs("    (default: those of the first target that responds)\n", stderr);
+		fputs("--page-size <size> / -p <size> : set page size (default: 64)\n", stderr);
+		fputs("--lock-bits <byte> / -l <byte> : write Lock bits\n", stderr);
+		fputs("--fuse-low-byte <byte> / -fl <byte> : write Fuse Low Byte\n", stderr);
+		fputs("--fuse-high-byte <byte> / -fh <byte> : write Fuse High Byte\n", stderr);
+		fputs("--extended-fuse-byte <byte> / -ef <byte> : write Extended Fuse Byte\n", stderr);
+		fputs("--fixed-wait : wait 10ms for writing/erasing\n", stderr);
+		fputs("    instead of using Poll RDY/~BSY\n", stderr);
+		fputs("--help / -h : show this help\n", stderr);
+		fputs("a target that doesn't respond is left out and the others are written;\n", stderr);
+		fputs("nothing is written if a target reports other Signature Bytes, because the shared\n", stderr);
+		fputs("lines would erase and write it too\n", stderr);
+		fputs("exit status is 1 unless every target was written and verified\n", stderr);
+		return command_line_error ? 1 : 0;
+	}
+
+	if (!load_file(input_file, data, data_defined, DATA_BUFFER_SIZE)) return 1;
+	chars_to_words(data_words, data, DATA_BUFFER_SIZE);
+	if (eeprom_file != NULL) {
+		if (!load_file(eeprom_file, eeprom_bytes, eeprom_defined, EEPROM_BUFFER_SIZE)) return 1;
+		for (i = 0; i < EEPROM_BUFFER_SIZE; i++) eeprom_image[i] = (unsigned char)eeprom_bytes[i];
+	}
+
+	atmegaio = usbio_init_multi(miso_ports, target_num, USBIO_SHARED_PORTS);
+	if (atmegaio == NULL) {
+		fputs("usbio_init_multi error (USB-IO2.0 not found or ports overlap)\n", stderr);
+		return 1;
+	}
+	for (i = 0; i < target_num; i++) status[i] = ATMEGAIO_SUCCESS;
+	if ((ret = multi_reset(atmegaio)) != ATMEGAIO_SUCCESS) {
+		fprintf(stderr, "error %d on multi_reset\n", ret);
+		multi_disconnect(atmegaio);
+		return 1;
+	}
+	/* Signature Byteを確かめる */
+	if (expected_signature[0] < 0) {
+		if ((ret = multi_read_signature_byte(atmegaio, signature, status)) != ATMEGAIO_SUCCESS) {
+			fprintf(stderr, "error %d on multi_read_signature_byte\n", ret);
+			multi_disconnect(atmegaio);
+			return 1;
+		}
+		for (i = 0; i < target_num && status[i] != ATMEGAIO_SUCCESS; i++);
+		if (i < target_num) memcpy(expected_signature, signature[i], sizeof(expected_signature));
+	}
+	if (count_active(status, target_num) > 0 &&
+	(ret = multi_check_signature_byte(atmegaio, expected_signature, signature, status)) != ATMEGAIO_SUCCESS) {
+		fprintf(stderr, "error %d on multi_check_signature_byte\n", ret);
+		multi_disconnect(atmegaio);
+		return 1;
+	}
+	for (i = 0; i < target_num; i++) {
+		if (status[i] == ATMEGAIO_SUCCESS || status[i] == ATMEGAIO_MISMATCH) {
+			printf("target %d (port %d): signature = %02X %02X %02X%s\n", i + 1, miso_ports[i],
+				signature[i][0], signature[i][1], signature[i][2],
+				status[i] == ATMEGAIO_MISMATCH ? " (different part)" : "");
+		} else {
+			printf("target %d (port %d): %s\n", i + 1, miso_ports[i], status_string(status[i]));
+		}
+	}
+	for (i = 0; i < target_num; i++) {
+		if (status[i] == ATMEGAIO_MISMATCH) {
+			/* 信号線を共有しているので、外しても消去と書き込みは届いてしまう */
+			fputs("a different part is connected; remove it and try again\n", stderr);
+			multi_disconnect(atmegaio);
+			return 1;
+		}
+	}
+	if (count_active(status, target_num) == 0) {
+		fputs("no target responded\n", stderr);
+		multi_disconnect(atmegaio);
+		return 1;
+	}
+
+	/* 消去と各種情報の書き込み */
+	if ((ret = multi_chip_erase(atmegaio, fixed_wait, status)) != ATMEGAIO_SUCCESS ||
+	(ret = multi_write_information(atmegaio, fixed_wait, lock_bits, fuse_bits,
+	fuse_high_bits, extended_fuse_bits, status)) != ATMEGAIO_SUCCESS) {
+		fprintf(stderr, "error %d on erasing or writing Fuse bits\n", ret);
+		exit_code = 1;
+	}
+
+	/* データのあるページを書き込み、照合する */
+	pages_to_write = 0;
+	for (i = 0; i < DATA_BUFFER_SIZE / 2; i += page_size) {
+		for (j = 0; j < page_size * 2 && !data_defined[i * 2 + j]; j++);
+		if (j < page_size * 2) pages_to_write++;
+	}
+	written_pages = 0;
+	if (exit_code == 0) {
+		fputs("writing the data...\n", stderr);
+		init_progress(&progress, pages_to_write);
+	}
+	for (i = 0; i < DATA_BUFFER_SIZE / 2 && exit_code == 0; i += page_size) {
+		for (j = 0; j < page_size * 2 && !data_defined[i * 2 + j]; j++);
+		if (j >= page_size * 2) continue;
+		if (count_active(status, target_num) == 0) break;
+		if ((ret = multi_write_program(atmegaio, fixed_wait, data_words + i, i, page_size, page_size,
+		status)) != ATMEGAIO_SUCCESS ||
+		(ret = multi_verify_program(atmegaio, data_words + i, i, page_size, status)) != ATMEGAIO_SUCCESS) {
+			fprintf(stderr, "\nerror %d on writing the page at word address %04X\n", ret, i);
+			exit_code = 1;
+			break;
+		}
+		update_progress(&progress, ++written_pages);
+	}
+	if (pages_to_write > 0) fputc('\n', stderr);
+
+	/* EEPROMのデータをデータのある範囲ごとに書き込み、照合する */
+	for (i = 0; i < EEPROM_BUFFER_SIZE && eeprom_file != NULL && exit_code == 0; i = j) {
+		if (!eeprom_defined[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i; j < EEPROM_BUFFER_SIZE && eeprom_defined[j]; j++);
+		if ((ret = multi_write_eeprom(atmegaio, fixed_wait, eeprom_image + i, i, j - i, status)) != ATMEGAIO_SUCCESS ||
+		(ret = multi_verify_eeprom(atmegaio, eeprom_image + i, i, j - i, status)) != ATMEGAIO_SUCCESS) {
+			fprintf(stderr, "error %d on writing EEPROM at %03X\n", ret, i);
+			exit_code = 1;
+			break;
+		}
+	}
+
+	/* ターゲットごとの結果 */
+	puts("--- results ---");
+	for (i = 0; i < target_num; i++) {
+		printf("target %d (port %d): %s\n", i + 1, miso_ports[i],
+			exit_code == 0 ? status_string(status[i]) : "not finished");
+		if (status[i] != ATMEGAIO_SUCCESS) exit_code = 1;
+	}
+	multi_disconnect(atmegaio);
+	return exit_code;
+}
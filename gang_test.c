@@ -0,0 +1,98 @@
+/* MISOだけ別にした複数のシミュレータに対して、atmega_io.cの複数ターゲット用の関数を試験する。
+ * 0番と1番は正常、2番はSignature Byteが違う部品、3番はSCKが速すぎて通信できないターゲットにする。
+ * 信号線を共有しているので、外したターゲットにもコマンドは届く。
+ * プログラミングモードに入れなかったターゲットだけは、何も変わらない。
+ */
+#include <stdio.h>
+#include <string.h>
+#include "atmega_io.h"
+#include "atmega_sim.h"
+
+#define TARGETS 4
+#define IMAGE_WORDS 200
+#define PAGE_WORDS ATMEGA_SIM_PAGE_WORDS
+#define EEPROM_BYTES 10
+
+static atmega_sim_t sims[TARGETS];
+
+static int check(int cond, const char *what) {
+	printf("%s: %s\n", cond ? "ok  " : "FAIL", what);
+	return cond;
+}
+
+int main(void) {
+	static const int expected_signature[3] = {0x1E, 0x95, 0x0F};
+	static unsigned int image[IMAGE_WORDS];
+	static unsigned int readback[TARGETS][IMAGE_WORDS];
+	unsigned int *readback_ptr[TARGETS];
+	int eeprom_data[EEPROM_BYTES];
+	int eeprom_readback[TARGETS][EEPROM_BYTES];
+	int *eeprom_ptr[TARGETS];
+	int signature[TARGETS][3];
+	int status[TARGETS] = {ATMEGAIO_SUCCESS, ATMEGAIO_SUCCESS, ATMEGAIO_SUCCESS, ATMEGAIO_SUCCESS};
+	int shifted_status[TARGETS];
+	atmegaio_multi_t *atmegaio;
+	int ok = 1;
+	int i;
+	for (i = 0; i < TARGETS; i++) {
+		atmega_sim_init(&sims[i]);
+		readback_ptr[i] = readback[i];
+		eeprom_ptr[i] = eeprom_readback[i];
+	}
+	/* ATmega328(Pなし) */
+	sims[2].signature[2] = 0x14;
+	sims[3].sck_frequency = 16000000UL;
+	sims[3].flash[0] = 0x1111;
+	sims[3].eeprom[3] = 0x5A;
+	for (i = 0; i < IMAGE_WORDS; i++) image[i] = (i * 0x0301 + 0x1C0E) & 0xffff;
+	for (i = 0; i < EEPROM_BYTES; i++) eeprom_data[i] = (i * 29 + 3) & 0xff;
+	atmegaio = atmega_sim_open_multi(sims, TARGETS);
+	if (!check(atmegaio != NULL, "atmega_sim_open_multi")) return 1;
+
+	ok &= check(multi_reset(atmegaio) == ATMEGAIO_SUCCESS, "reset");
+	ok &= check(multi_check_signature_byte(atmegaio, expected_signature, signature, status) == ATMEGAIO_SUCCESS &&
+		status[0] == ATMEGAIO_SUCCESS && status[1] == ATMEGAIO_SUCCESS &&
+		memcmp(signature[0], expected_signature, sizeof(expected_signature)) == 0 &&
+		memcmp(signature[1], expected_signature, sizeof(expected_signature)) == 0,
+		"signature of the good targets");
+	ok &= check(status[2] == ATMEGAIO_MISMATCH && signature[2][2] == 0x14, "wrong part dropped");
+	ok &= check(status[3] == ATMEGAIO_PROGRAMMING_ENABLE_ERROR, "unreachable target dropped");
+
+	ok &= check(multi_chip_erase(atmegaio, 0, status) == ATMEGAIO_SUCCESS &&
+		multi_write_information(atmegaio, 0, -1, -1, 0xD1, -1, status) == ATMEGAIO_SUCCESS &&
+		multi_write_program(atmegaio, 0, image, 0, IMAGE_WORDS, PAGE_WORDS, status) == ATMEGAIO_SUCCESS &&
+		status[0] == ATMEGAIO_SUCCESS && status[1] == ATMEGAIO_SUCCESS, "erase and write");
+	ok &= check(memcmp(sims[0].flash, image, sizeof(image)) == 0 && memcmp(sims[1].flash, image, sizeof(image)) == 0 &&
+		sims[0].fuse_high_bits == 0xD1 && sims[1].fuse_high_bits == 0xD1, "good targets written");
+	ok &= check(sims[3].flash[0] == 0x1111 && sims[3].fuse_high_bits == 0xD9, "unreachable target untouched");
+	ok &= check(status[2] == ATMEGAIO_MISMATCH && status[3] == ATMEGAIO_PROGRAMMING_ENABLE_ERROR,
+		"dropped targets stay dropped");
+	ok &= check(multi_read_program(atmegaio, readback_ptr, 0, IMAGE_WORDS, status) == ATMEGAIO_SUCCESS &&
+		memcmp(readback[0], image, sizeof(image)) == 0 && memcmp(readback[1], image, sizeof(image)) == 0,
+		"read program");
+
+	/* 1番だけ書き込みに失敗したことにする */
+	sims[1].flash[PAGE_WORDS + 10] &= 0x00ff;
+	ok &= check(multi_verify_program(atmegaio, image, 0, IMAGE_WORDS, status) == ATMEGAIO_SUCCESS &&
+		status[0] == ATMEGAIO_SUCCESS && status[1] == ATMEGAIO_MISMATCH, "verify drops the mismatching target");
+
+	/* EEPROMのページ(4オクテット)の境界をまたぐ */
+	ok &= check(multi_write_eeprom(atmegaio, 0, eeprom_data, 3, EEPROM_BYTES, status) == ATMEGAIO_SUCCESS &&
+		multi_read_eeprom(atmegaio, eeprom_ptr, 3, EEPROM_BYTES, status) == ATMEGAIO_SUCCESS &&
+		status[0] == ATMEGAIO_SUCCESS &&
+		memcmp(eeprom_readback[0], eeprom_data, sizeof(eeprom_data)) == 0, "EEPROM write and read");
+	ok &= check(sims[3].eeprom[3] == 0x5A && status[1] == ATMEGAIO_MISMATCH, "EEPROM of the unreachable target untouched");
+	/* 照合は書き込んだのと同じアドレスから行わないといけない */
+	ok &= check(multi_verify_eeprom(atmegaio, eeprom_data, 3, EEPROM_BYTES, status) == ATMEGAIO_SUCCESS &&
+		status[0] == ATMEGAIO_SUCCESS, "EEPROM verify at a nonzero address");
+	memcpy(shifted_status, status, sizeof(status));
+	ok &= check(multi_verify_eeprom(atmegaio, eeprom_data, 0, EEPROM_BYTES, shifted_status) == ATMEGAIO_SUCCESS &&
+		shifted_status[0] == ATMEGAIO_MISMATCH, "EEPROM verify at the wrong address fails");
+	sims[0].eeprom[3 + EEPROM_BYTES - 1] ^= 0x01;
+	ok &= check(multi_verify_eeprom(atmegaio, eeprom_data, 3, EEPROM_BYTES, status) == ATMEGAIO_SUCCESS &&
+		status[0] == ATMEGAIO_MISMATCH, "EEPROM verify drops the mismatching target");
+
+	ok &= check(multi_disconnect(atmegaio) == ATMEGAIO_SUCCESS, "disconnect");
+	puts(ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
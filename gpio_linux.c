@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include "gpio_linux.h"
+#include "atmega_io.h"
+
+/* ライン要求の中での各ピンの位置 */
+enum {
+	LINE_RESET = 0,
+	LINE_SCK,
+	LINE_MOSI,
+	LINE_MISO,
+	LINE_NUM
+};
+
+/* これより短い待ち時間はビジーウェイトで待つ */
+#define BUSY_WAIT_LIMIT_NS 100000UL
+/* 1ビットごとにioctlを2回発行するので、これより速いSCKは実現できない */
+#define MAX_SCK_FREQUENCY 1000000UL
+
+typedef struct {
+	int fd;
+	unsigned long half_period_ns;
+} gpio_t;
+
+static void sleep_ms(int ms) {
+	struct timespec req, ret;
+	req.tv_sec = ms / 1000;
+	req.tv_nsec = (long)(ms % 1000) * 1000000L;
+	while (nanosleep(&req, &ret) == -1 && errno == EINTR) req = ret;
+}
+
+/* 指定した時間以上待つ */
+static void wait_ns(unsigned long ns) {
+	struct timespec start, now;
+	if (ns == 0) return;
+	if (ns >= BUSY_WAIT_LIMIT_NS) {
+		struct timespec req, ret;
+		req.tv_sec = ns / 1000000000UL;
+		req.tv_nsec = ns % 1000000000UL;
+		while (nanosleep(&req, &ret) == -1 && errno == EINTR) req = ret;
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((unsigned long)((now.tv_sec - start.tv_sec) * 1000000000L +
+		(now.tv_nsec - start.tv_nsec)) < ns);
+}
+
+/* maskで指定したラインにbitsの値を同時に出力する */
+static int set_lines(const gpio_t *gpio, unsigned int mask, unsigned int bits) {
+	struct gpio_v2_line_values values;
+	values.mask = mask;
+	values.bits = bits;
+	return ioctl(gpio->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) == 0;
+}
+
+/* MISOの値を読み込む。失敗したら-1を返す。 */
+static int get_miso(const gpio_t *gpio) {
+	struct gpio_v2_line_values values;
+	values.mask = 1u << LINE_MISO;
+	values.bits = 0;
+	if (ioctl(gpio->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) != 0) return -1;
+	return (values.bits >> LINE_MISO) & 1;
+}
+
+/* GPIOを用いた通信を終了する。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int gpio_disconnect(void *hardware_data) {
+	gpio_t *gpio;
+	int fd;
+	if (hardware_data == NULL) return 0;
+	gpio = (gpio_t*)hardware_data;
+	fd = gpio->fd;
+	free(gpio);
+	return close(fd) == 0;
+}
+
+/* GPIOを用いて8ビット送受信する。
+ * 成功と判定したら受信したデータを、失敗を検出したら-1を返す。
+ */
+static int gpio_io_8bits(void *hardware_data, int out) {
+	const unsigned int sck_mosi = (1u << LINE_SCK) | (1u << LINE_MOSI);
+	gpio_t *gpio;
+	int i;
+	int input = 0;
+	if (hardware_data == NULL) return -1;
+	gpio = (gpio_t*)hardware_data;
+	for (i = 7; i >= 0; i--) {
+		int raw_input;
+		/* クロックをLOWにするのと同時に出力を設定する */
+		if (!set_lines(gpio, sck_mosi, ((out >> i) & 1) << LINE_MOSI)) return -1;
+		wait_ns(gpio->half_period_ns);
+		/* クロックをHIGHにして入力を読み込む */
+		if (!set_lines(gpio, 1u << LINE_SCK, 1u << LINE_SCK)) return -1;
+		if ((raw_input = get_miso(gpio)) < 0) return -1;
+		if (raw_input) input |= (1 << i);
+		wait_ns(gpio->half_period_ns);
+	}
+	if (!set_lines(gpio, sck_mosi, 0)) return -1;
+	return input;
+}
+
+/* GPIOを用いてリセットを行う。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int gpio_reset(void *hardware_data) {
+	const unsigned int all = (1u << LINE_RESET) | (1u << LINE_SCK) | (1u << LINE_MOSI);
+	gpio_t *gpio;
+	if (hardware_data == NULL) return 0;
+	gpio = (gpio_t*)hardware_data;
+	if (!set_lines(gpio, all, 1u << LINE_RESET)) return 0;
+	sleep_ms(1);
+	if (!set_lines(gpio, all, 0)) return 0;
+	sleep_ms(20);
+	return 1;
+}
+
+/* GPIOのRESETをHIGHにしてターゲットのプログラムを動かす。
+ * SCKとMOSIはLOWのままにする。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int gpio_release(void *hardware_data) {
+	const unsigned int all = (1u << LINE_RESET) | (1u << LINE_SCK) | (1u << LINE_MOSI);
+	if (hardware_data == NULL) return 0;
+	return set_lines((gpio_t*)hardware_data, all, 1u << LINE_RESET);
+}
+
+/* SCKの半周期を、指定した周波数以下になるように設定する */
+static unsigned long gpio_set_sck_frequency(void *hardware_data, unsigned long frequency) {
+	gpio_t *gpio;
+	if (hardware_data == NULL || frequency == 0) return 0;
+	gpio = (gpio_t*)hardware_data;
+	if (frequency > MAX_SCK_FREQUENCY) frequency = MAX_SCK_FREQUENCY;
+	gpio->half_period_ns = (500000000UL + frequency - 1) / frequency;
+	return 500000000UL / gpio->half_period_ns;
+}
+
+atmegaio_t *gpio_init(const char *chip_path, int miso_line, int mosi_line,
+int sck_line, int reset_line, unsigned long half_period_ns) {
+	struct gpio_v2_line_request request;
+	atmegaio_t *atmegaio;
+	gpio_t *gpio;
+	int chip_fd;
+	if (chip_path == NULL || miso_line < 0 || mosi_line < 0 || sck_line < 0 || reset_line < 0 ||
+	miso_line == mosi_line || miso_line == sck_line || miso_line == reset_line ||
+	mosi_line == sck_line || mosi_line == reset_line || sck_line == reset_line) {
+		/* 無効なラインまたはラインが被っている */
+		return NULL;
+	}
+	/* 4本のラインをまとめて要求し、MISOだけを入力にする */
+	memset(&request, 0, sizeof(request));
+	request.offsets[LINE_RESET] = reset_line;
+	request.offsets[LINE_SCK] = sck_line;
+	request.offsets[LINE_MOSI] = mosi_line;
+	request.offsets[LINE_MISO] = miso_line;
+	request.num_lines = LINE_NUM;
+	strcpy(request.consumer, "atmega_io");
+	request.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+	request.config.num_attrs = 2;
+	request.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+	request.config.attrs[0].attr.flags = GPIO_V2_LINE_FLAG_INPUT;
+	request.config.attrs[0].mask = 1u << LINE_MISO;
+	request.config.attrs[1].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+	request.config.attrs[1].attr.values = 0;
+	request.config.attrs[1].mask = (1u << LINE_RESET) | (1u << LINE_SCK) | (1u << LINE_MOSI);
+	chip_fd = open(chip_path, O_RDWR | O_CLOEXEC);
+	if (chip_fd < 0) return NULL;
+	if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &request) != 0) {
+		close(chip_fd);
+		return NULL;
+	}
+	/* ラインの操作には要求で得たfdを使うので、チップのfdは閉じて良い */
+	close(chip_fd);
+	/* 情報を格納する */
+	atmegaio = calloc(1, sizeof(atmegaio_t));
+	if (atmegaio == NULL) {
+		close(request.fd);
+		return NULL;
+	}
+	gpio = malloc(sizeof(gpio_t));
+	if (gpio == NULL) {
+		free(atmegaio);
+		close(request.fd);
+		return NULL;
+	}
+	gpio->fd = request.fd;
+	gpio->half_period_ns = half_period_ns;
+	atmegaio->hardware_data = (void*)gpio;
+	atmegaio->disconnect = gpio_disconnect;
+	atmegaio->reset = gpio_reset;
+	atmegaio->io_8bits = gpio_io_8bits;
+	atmegaio->release = gpio_release;
+	atmegaio->set_sck_frequency = gpio_set_sck_frequency;
+	return atmegaio;
+}
@@ -0,0 +1,16 @@
+#ifndef GPIO_LINUX_H_GUARD_B83D0F47_2C96_4A1E_8D5B_39E7A60C1F28
+#define GPIO_LINUX_H_GUARD_B83D0F47_2C96_4A1E_8D5B_39E7A60C1F28
+
+#include "atmega_io.h"
+
+/* GPIOキャラクタデバイス(/dev/gpiochipN)を用いた通信を初期化する。
+ * 各ピンはチップ内のライン番号で指定する。
+ * half_period_nsはSCKのHIGHとLOWそれぞれの最小の長さ(ナノ秒)で、
+ * ターゲットのクロックの4分の1未満の周波数になるように設定する。
+ * 接続後にcalibrate_sckで調整することもできる。
+ * 成功と判定したら通信用データのポインタ、失敗を検出したらNULLを返す。
+ */
+atmegaio_t *gpio_init(const char *chip_path, int miso_line, int mosi_line,
+	int sck_line, int reset_line, unsigned long half_period_ns);
+
+#endif
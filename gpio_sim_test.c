@@ -0,0 +1,149 @@
+/* カーネルのgpio-simで作った仮想GPIOチップとシミュレートしたATmegaを用いて、gpio_linux.cを試験する。
+ * 実行にはgpio-simモジュール、マウントされたconfigfs、root権限が必要。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "gpio_linux.h"
+#include "atmega_io.h"
+#include "atmega_sim.h"
+
+#define CONFIGFS_DIR "/sys/kernel/config/gpio-sim/atmega_io_test"
+/* 仮想チップでのライン番号 */
+#define LINE_MISO 0
+#define LINE_MOSI 1
+#define LINE_SCK 2
+#define LINE_RESET 3
+/* SCKの半周期(シミュレータがsysfsのポーリングでエッジを見逃さないように長めにする) */
+#define HALF_PERIOD_NS 2000000UL
+
+static atmega_sim_t sim;
+static volatile int stop_flag = 0;
+static char sim_dir[512];
+
+static int write_file(const char *path, const char *value) {
+	int fd = open(path, O_WRONLY);
+	int ok;
+	if (fd < 0) return 0;
+	ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+	close(fd);
+	return ok;
+}
+
+static int read_file(const char *path, char *buffer, size_t size) {
+	int fd = open(path, O_RDONLY);
+	ssize_t len;
+	if (fd < 0) return 0;
+	len = read(fd, buffer, size - 1);
+	close(fd);
+	if (len <= 0) return 0;
+	buffer[len] = '\0';
+	while (len > 0 && buffer[len - 1] == '\n') buffer[--len] = '\0';
+	return 1;
+}
+
+/* 仮想チップのラインの出力値を読み込む */
+static int read_line(int line) {
+	char path[600], value[16];
+	sprintf(path, "%s/sim_gpio%d/value", sim_dir, line);
+	if (!read_file(path, value, sizeof(value))) return 0;
+	return value[0] == '1';
+}
+
+/* 仮想チップのラインに入力値を与える */
+static void drive_line(int line, int value) {
+	char path[600];
+	sprintf(path, "%s/sim_gpio%d/pull", sim_dir, line);
+	write_file(path, value ? "pull-up" : "pull-down");
+}
+
+/* ラインの変化をATmegaのシミュレータに伝え続ける */
+static void *target_thread(void *arg) {
+	int last_miso = -1;
+	(void)arg;
+	while (!stop_flag) {
+		int miso;
+		atmega_sim_set_pins(&sim, read_line(LINE_RESET), read_line(LINE_SCK), read_line(LINE_MOSI));
+		miso = atmega_sim_miso(&sim);
+		if (miso != last_miso) {
+			drive_line(LINE_MISO, miso);
+			last_miso = miso;
+		}
+	}
+	return NULL;
+}
+
+/* gpio-simのチップを作り、/dev/gpiochipNのパスを得る */
+static int create_chip(char *chip_path, size_t size) {
+	char dev_name[128], chip_name[128];
+	rmdir(CONFIGFS_DIR "/bank0");
+	rmdir(CONFIGFS_DIR);
+	if (mkdir(CONFIGFS_DIR, 0755) != 0 || mkdir(CONFIGFS_DIR "/bank0", 0755) != 0) return 0;
+	if (!write_file(CONFIGFS_DIR "/bank0/num_lines", "4")) return 0;
+	if (!write_file(CONFIGFS_DIR "/live", "1")) return 0;
+	if (!read_file(CONFIGFS_DIR "/dev_name", dev_name, sizeof(dev_name)) ||
+	!read_file(CONFIGFS_DIR "/bank0/chip_name", chip_name, sizeof(chip_name))) return 0;
+	snprintf(sim_dir, sizeof(sim_dir), "/sys/devices/platform/%s/%s", dev_name, chip_name);
+	snprintf(chip_path, size, "/dev/%s", chip_name);
+	return 1;
+}
+
+static void destroy_chip(void) {
+	write_file(CONFIGFS_DIR "/live", "0");
+	rmdir(CONFIGFS_DIR "/bank0");
+	rmdir(CONFIGFS_DIR);
+}
+
+static int check(int cond, const char *what) {
+	printf("%s: %s\n", cond ? "ok  " : "FAIL", what);
+	return cond;
+}
+
+int main(void) {
+	pthread_t thread;
+	atmegaio_t *atmegaio;
+	char chip_path[256];
+	unsigned int words[8], readback[8];
+	int signature[3];
+	int fuse;
+	int ok = 1;
+	int i;
+	if (access("/sys/kernel/config/gpio-sim", F_OK) != 0) {
+		fputs("gpio-sim is not available\n", stderr);
+		return 77;
+	}
+	if (!create_chip(chip_path, sizeof(chip_path))) {
+		perror("gpio-sim setup");
+		destroy_chip();
+		return 1;
+	}
+	atmega_sim_init(&sim);
+	drive_line(LINE_MISO, 0);
+	pthread_create(&thread, NULL, target_thread, NULL);
+	atmegaio = gpio_init(chip_path, LINE_MISO, LINE_MOSI, LINE_SCK, LINE_RESET, HALF_PERIOD_NS);
+	if (!check(atmegaio != NULL, "gpio_init")) {
+		ok = 0;
+	} else {
+		for (i = 0; i < 8; i++) words[i] = 0xA500 + i;
+		ok &= check(reset(atmegaio) == ATMEGAIO_SUCCESS, "reset");
+		ok &= check(read_signature_byte(atmegaio, signature) == ATMEGAIO_SUCCESS &&
+			signature[0] == 0x1E && signature[1] == 0x95 && signature[2] == 0x0F, "signature");
+		ok &= check(write_information(atmegaio, 0, -1, 0xE2, -1, -1) == ATMEGAIO_SUCCESS &&
+			read_information(atmegaio, NULL, &fuse, NULL, NULL, NULL) == ATMEGAIO_SUCCESS &&
+			fuse == 0xE2, "fuse write/read");
+		ok &= check(write_program(atmegaio, 0, words, 0, 8, 64) == ATMEGAIO_SUCCESS &&
+			read_program(atmegaio, readback, 0, 8) == ATMEGAIO_SUCCESS &&
+			memcmp(words, readback, sizeof(words)) == 0, "program write/read");
+		ok &= check(disconnect(atmegaio) == ATMEGAIO_SUCCESS, "disconnect");
+	}
+	stop_flag = 1;
+	pthread_join(thread, NULL);
+	destroy_chip();
+	puts(ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hex_stream.h"
+#include "load_hex.h"
+
+typedef struct {
+	const hex_stream_config_t *config;
+	const char *out;
+	unsigned char *page_written;
+	hex_stream_result_t *result;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/* 書き込みを待つページのキュー */
+	unsigned int queue_addr[HEX_STREAM_QUEUE_PAGES];
+	unsigned int *queue_words;
+	int queue_head;
+	int queue_count;
+	/* これ以上ページを渡さないなら真 */
+	int finished;
+	/* 読み込み側の状態 */
+	int page_num;
+	int next_page;
+	unsigned char *handed;
+	int stopped;
+	/* 書き込みスレッドが使う1ページ分の領域 */
+	unsigned int *page;
+	unsigned int *verify;
+} stream_t;
+
+/* ページにデータがあるかを調べる */
+static int page_has_data(const stream_t *st, int page) {
+	int page_bytes = st->config->page_size * 2;
+	int i;
+	for (i = 0; i < page_bytes; i++) {
+		if ((unsigned char)st->out[page * page_bytes + i] != 0xff) return 1;
+	}
+	return 0;
+}
+
+/* ページをワード列に変換してキューに入れる。キューが一杯なら空くまで待つ。 */
+static void push_page(stream_t *st, int page) {
+	int page_size = st->config->page_size;
+	unsigned int *words;
+	int slot;
+	pthread_mutex_lock(&st->mutex);
+	while (st->queue_count >= HEX_STREAM_QUEUE_PAGES) pthread_cond_wait(&st->cond, &st->mutex);
+	slot = (st->queue_head + st->queue_count) % HEX_STREAM_QUEUE_PAGES;
+	words = st->queue_words + slot * page_size;
+	chars_to_words(words, st->out + page * page_size * 2, page_size * 2);
+	st->queue_addr[slot] = (unsigned int)(page * page_size);
+	st->queue_count++;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->mutex);
+	st->handed[page] = 1;
+}
+
+/* キューからページを取り出す。もうページが来ないなら偽を返す。 */
+static int pop_page(stream_t *st, unsigned int *addr, unsigned int *words) {
+	int page_size = st->config->page_size;
+	pthread_mutex_lock(&st->mutex);
+	while (st->queue_count == 0 && !st->finished) pthread_cond_wait(&st->cond, &st->mutex);
+	if (st->queue_count == 0) {
+		pthread_mutex_unlock(&st->mutex);
+		return 0;
+	}
+	*addr = st->queue_addr[st->queue_head];
+	memcpy(words, st->queue_words + st->queue_head * page_size, sizeof(unsigned int) * page_size);
+	st->queue_head = (st->queue_head + 1) % HEX_STREAM_QUEUE_PAGES;
+	st->queue_count--;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->mutex);
+	return 1;
+}
+
+/* これ以上ページを渡さないことを書き込みスレッドに伝える */
+static void finish_queue(stream_t *st) {
+	pthread_mutex_lock(&st->mutex);
+	st->finished = 1;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->mutex);
+}
+
+/* 書き込みスレッド */
+static void *writer_thread(void *arg) {
+	stream_t *st = (stream_t*)arg;
+	const hex_stream_config_t *config = st->config;
+	hex_stream_result_t *result = st->result;
+	unsigned int *page = st->page, *verify = st->verify;
+	unsigned int addr;
+	int ok = 1;
+	if ((result->atmegaio = (config->open)(config->user_data)) == NULL) {
+		ok = 0;
+	} else if (!(config->prepare)(result->atmegaio, config->user_data)) {
+		result->prepare_failed = 1;
+		ok = 0;
+	}
+	for (;;) {
+		int ret;
+		if (!pop_page(st, &addr, page)) break;
+		/* 失敗した後は読み込み側を止めないように、取り出して捨てる */
+		if (!ok) continue;
+		ret = write_program(result->atmegaio, config->fixed_wait, page, addr, config->page_size, config->page_size);
+		if (ret == ATMEGAIO_SUCCESS && config->page_verify) {
+			ret = read_program(result->atmegaio, verify, addr, config->page_size);
+			if (ret == ATMEGAIO_SUCCESS &&
+			memcmp(page, verify, sizeof(unsigned int) * config->page_size) != 0) {
+				result->mismatch = 1;
+				ok = 0;
+				continue;
+			}
+		}
+		if (ret != ATMEGAIO_SUCCESS) {
+			result->write_result = ret;
+			ok = 0;
+			continue;
+		}
+		/* 読み込み側はスレッドの終了後に参照する */
+		st->page_written[addr / config->page_size] = 1;
+		result->written_pages++;
+	}
+	return NULL;
+}
+
+/* データレコードごとに呼ばれ、完成したページを書き込みスレッドに渡す */
+static void on_record(int address, int size, void *user_data) {
+	stream_t *st = (stream_t*)user_data;
+	int page_bytes = st->config->page_size * 2;
+	int first = address / page_bytes;
+	int last = (address + size - 1) / page_bytes;
+	int page;
+	if (st->stopped) return;
+	for (page = first; page <= last && page < st->next_page; page++) {
+		if (st->handed[page]) {
+			/* 既に渡したページが変わるので、書き込み直しが必要になる */
+			st->stopped = 1;
+			st->result->out_of_order = 1;
+			return;
+		}
+	}
+	/* レコードは昇順に並んでいると見なし、このレコードより前のページは完成したとする */
+	while (st->next_page < first && st->next_page < st->page_num) {
+		if (page_has_data(st, st->next_page)) push_page(st, st->next_page);
+		st->next_page++;
+	}
+}
+
+static void free_stream(stream_t *st) {
+	free(st->queue_words);
+	free(st->handed);
+	free(st->page);
+	free(st->verify);
+}
+
+int hex_stream_write(char *out, int out_size, FILE *fp, const hex_stream_config_t *config,
+unsigned char *page_written, hex_stream_result_t *result) {
+	stream_t st;
+	pthread_t thread;
+	if (out == NULL || out_size <= 0 || fp == NULL || config == NULL || config->open == NULL ||
+	config->prepare == NULL || config->page_size <= 0 || page_written == NULL || result == NULL) {
+		return 0;
+	}
+	memset(result, 0, sizeof(*result));
+	memset(&st, 0, sizeof(st));
+	st.config = config;
+	st.out = out;
+	st.page_written = page_written;
+	st.result = result;
+	st.page_num = out_size / (config->page_size * 2);
+	st.queue_words = malloc(sizeof(unsigned int) * config->page_size * HEX_STREAM_QUEUE_PAGES);
+	st.handed = calloc(st.page_num > 0 ? st.page_num : 1, 1);
+	st.page = malloc(sizeof(unsigned int) * config->page_size);
+	st.verify = malloc(sizeof(unsigned int) * config->page_size);
+	if (st.queue_words == NULL || st.handed == NULL || st.page == NULL || st.verify == NULL) {
+		free_stream(&st);
+		result->load_result = LOAD_HEX_INVALID_PARAMETER;
+		return 0;
+	}
+	pthread_mutex_init(&st.mutex, NULL);
+	pthread_cond_init(&st.cond, NULL);
+	if (pthread_create(&thread, NULL, writer_thread, &st) != 0) {
+		pthread_mutex_destroy(&st.mutex);
+		pthread_cond_destroy(&st.cond);
+		free_stream(&st);
+		result->load_result = LOAD_HEX_INVALID_PARAMETER;
+		return 0;
+	}
+	result->load_result = load_hex_with_callback(out, out_size, fp, on_record, &st);
+	if (result->load_result == LOAD_HEX_SUCCESS && !st.stopped) {
+		/* 残りのページを渡す */
+		for (; st.next_page < st.page_num; st.next_page++) {
+			if (page_has_data(&st, st.next_page)) push_page(&st, st.next_page);
+		}
+	}
+	finish_queue(&st);
+	pthread_join(thread, NULL);
+	pthread_mutex_destroy(&st.mutex);
+	pthread_cond_destroy(&st.cond);
+	free_stream(&st);
+	return result->load_result == LOAD_HEX_SUCCESS && result->atmegaio != NULL &&
+		!result->prepare_failed && result->write_result == ATMEGAIO_SUCCESS &&
+		!result->mismatch && !result->out_of_order;
+}
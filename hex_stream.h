@@ -0,0 +1,62 @@
+#ifndef HEX_STREAM_H_GUARD_71E0B5D2_48A3_4C6F_9B17_D52C03A8E94F
+#define HEX_STREAM_H_GUARD_71E0B5D2_48A3_4C6F_9B17_D52C03A8E94F
+
+#include <stdio.h>
+#include "atmega_io.h"
+
+/* 解析が終わって書き込みを待つページの最大数 */
+#define HEX_STREAM_QUEUE_PAGES 8
+
+/* 読み込みながら書き込むための設定 */
+typedef struct {
+	/* 書き込み器を開く関数。書き込みスレッドで呼ばれる。失敗したらNULLを返す。 */
+	atmegaio_t *(*open)(void *user_data);
+	/* 最初のページを書き込む前に呼ばれる、リセットや消去などの準備を行う関数。
+	 * 書き込みスレッドで呼ばれる。失敗したら偽を返す。
+	 */
+	int (*prepare)(const atmegaio_t *atmegaio, void *user_data);
+	/* open、prepareに渡すデータ */
+	void *user_data;
+	/* ページサイズ(ワード数) */
+	int page_size;
+	/* 真の場合、Poll RDY/~BSYを実行するのではなく、10ms待つ */
+	int fixed_wait;
+	/* 真の場合、各ページを書き込んだ直後に読み込んで照合する */
+	int page_verify;
+} hex_stream_config_t;
+
+/* 読み込みながら書き込んだ結果 */
+typedef struct {
+	/* 開いた書き込み器(開けなかった場合はNULL)。呼び出し側で切断する */
+	atmegaio_t *atmegaio;
+	/* HEXファイルの読み込みのエラーコード(LOAD_HEX_*) */
+	int load_result;
+	/* 準備に失敗したら真 */
+	int prepare_failed;
+	/* 書き込みのエラーコード(ATMEGAIO_*)。照合の不一致はATMEGAIO_SUCCESSのままmismatchを真にする */
+	int write_result;
+	int mismatch;
+	/* 書き込み済みのページに後からレコードが来たため、書き込み直す必要があるなら真 */
+	int out_of_order;
+	/* 書き込んだページ数 */
+	int written_pages;
+} hex_stream_result_t;
+
+/**
+ * HEXファイルを読み込みながら、完成したページから書き込む。
+ * 書き込みスレッドが書き込み器の接続と準備を読み込みと並行して行い、
+ * レコードのアドレスが次のページに進んだ時点で、前のページまでをキューで書き込みスレッドに渡す。
+ * 既に渡したページに後からレコードが来た場合はそれ以降のページを渡さず、result->out_of_orderを真にする。
+ * その場合もHEXファイルは最後まで読み込むので、呼び出し側は読み込んだデータで書き込み直せば良い。
+ * @param out ファイルのデータを書き込むバッファ(あらかじめ0xffで埋めておく)
+ * @param out_size outのバッファサイズ(オクテット数)
+ * @param fp 読み込みに使用するファイルハンドル
+ * @param config 設定
+ * @param page_written 書き込み(page_verifyなら照合も)が完了したページを真にする配列(ページ番号で添え字を付ける)
+ * @param result 結果を格納する領域へのポインタ
+ * @return 読み込みと書き込みが全て成功したら真
+ */
+int hex_stream_write(char *out, int out_size, FILE *fp, const hex_stream_config_t *config,
+	unsigned char *page_written, hex_stream_result_t *result);
+
+#endif
@@ -0,0 +1,139 @@
+/* 複数のレコードからなるHEXファイルをシミュレートしたATmegaに読み込みながら書き込み、
+ * hex_stream.cを試験する。途中のレコードのチェックサムが壊れている場合も確かめる。
+ */
+#include <stdio.h>
+#include <string.h>
+#include "atmega_io.h"
+#include "atmega_sim.h"
+#include "hex_stream.h"
+#include "load_hex.h"
+
+#define PAGE_WORDS ATMEGA_SIM_PAGE_WORDS
+#define PAGE_BYTES (PAGE_WORDS * 2)
+#define IMAGE_PAGES 12
+#define RECORD_BYTES 16
+/* チェックサムを壊すレコードのあるページ */
+#define BROKEN_PAGE 7
+
+static atmega_sim_t sim;
+static char out[ATMEGA_SIM_FLASH_WORDS * 2];
+static unsigned char page_written[ATMEGA_SIM_FLASH_WORDS / PAGE_WORDS];
+
+/* open、prepareの呼び出しを記録する */
+typedef struct {
+	int opened, prepared;
+} stream_log_t;
+
+static atmegaio_t *open_sim(void *user_data) {
+	((stream_log_t*)user_data)->opened++;
+	return atmega_sim_open(&sim);
+}
+
+static int prepare_sim(const atmegaio_t *atmegaio, void *user_data) {
+	((stream_log_t*)user_data)->prepared++;
+	return reset(atmegaio) == ATMEGAIO_SUCCESS && chip_erase(atmegaio, 0) == ATMEGAIO_SUCCESS;
+}
+
+/* 書き込むデータのaddr番地のオクテット */
+static int image_byte(int addr) {
+	return (addr * 13 + (addr >> 8) * 7 + 0x21) & 0xff;
+}
+
+/* 0番地からIMAGE_PAGESページ分をRECORD_BYTESずつのレコードにしたHEXファイルを作る。
+ * broken_recordが非負なら、その番号のレコードのチェックサムを壊す。
+ */
+static FILE *make_hex(int broken_record) {
+	FILE *fp = tmpfile();
+	int addr, i, record = 0;
+	if (fp == NULL) return NULL;
+	for (addr = 0; addr < IMAGE_PAGES * PAGE_BYTES; addr += RECORD_BYTES, record++) {
+		int sum = RECORD_BYTES + (addr >> 8) + (addr & 0xff);
+		fprintf(fp, ":%02X%04X00", RECORD_BYTES, addr);
+		for (i = 0; i < RECORD_BYTES; i++) {
+			fprintf(fp, "%02X", image_byte(addr + i));
+			sum += image_byte(addr + i);
+		}
+		fprintf(fp, "%02X\n", (-sum + (record == broken_record ? 1 : 0)) & 0xff);
+	}
+	fputs(":00000001FF\n", fp);
+	rewind(fp);
+	return fp;
+}
+
+/* フラッシュのpage番目のページが書き込むデータと一致するかを返す */
+static int page_matches(int page) {
+	int i;
+	for (i = 0; i < PAGE_WORDS; i++) {
+		int addr = (page * PAGE_WORDS + i) * 2;
+		if (sim.flash[page * PAGE_WORDS + i] != (unsigned int)(image_byte(addr) | (image_byte(addr + 1) << 8))) return 0;
+	}
+	return 1;
+}
+
+static int check(int cond, const char *what) {
+	printf("%s: %s\n", cond ? "ok  " : "FAIL", what);
+	return cond;
+}
+
+/* HEXファイルを読み込みながら書き込む */
+static int stream(FILE *fp, stream_log_t *log, hex_stream_result_t *result) {
+	hex_stream_config_t config;
+	int ret;
+	memset(&config, 0, sizeof(config));
+	config.open = open_sim;
+	config.prepare = prepare_sim;
+	config.user_data = log;
+	config.page_size = PAGE_WORDS;
+	config.page_verify = 1;
+	memset(out, 0xff, sizeof(out));
+	memset(page_written, 0, sizeof(page_written));
+	memset(log, 0, sizeof(*log));
+	atmega_sim_init(&sim);
+	ret = hex_stream_write(out, sizeof(out), fp, &config, page_written, result);
+	fclose(fp);
+	if (result->atmegaio != NULL) disconnect(result->atmegaio);
+	return ret;
+}
+
+int main(void) {
+	stream_log_t log;
+	hex_stream_result_t result;
+	FILE *fp;
+	int all_written, written_match, rest_blank;
+	int ok = 1;
+	int i;
+
+	/* 全てのレコードが正しい */
+	if (!check((fp = make_hex(-1)) != NULL, "make_hex")) return 1;
+	ok &= check(stream(fp, &log, &result) && result.load_result == LOAD_HEX_SUCCESS &&
+		result.write_result == ATMEGAIO_SUCCESS && !result.mismatch && !result.out_of_order &&
+		log.opened == 1 && log.prepared == 1, "stream a multi-record file");
+	all_written = result.written_pages == IMAGE_PAGES;
+	for (i = 0; i < IMAGE_PAGES; i++) {
+		if (!page_written[i] || !page_matches(i)) all_written = 0;
+	}
+	ok &= check(all_written && !page_written[IMAGE_PAGES] && sim.flash[IMAGE_PAGES * PAGE_WORDS] == 0xffff,
+		"every page written and verified");
+
+	/* 途中のレコードのチェックサムが壊れている */
+	if (!check((fp = make_hex(BROKEN_PAGE * PAGE_BYTES / RECORD_BYTES + 3)) != NULL, "make_hex (broken)")) return 1;
+	ok &= check(!stream(fp, &log, &result) && result.load_result == LOAD_HEX_CHECKSUM_ERROR &&
+		result.write_result == ATMEGAIO_SUCCESS && !result.mismatch, "checksum error stops the stream");
+	/* 壊れたレコードのページより前のページは完成しているので書き込まれ、その記録は実際の内容と合う */
+	written_match = result.written_pages == BROKEN_PAGE;
+	for (i = 0; i < result.written_pages; i++) {
+		if (!page_written[i] || !page_matches(i)) written_match = 0;
+	}
+	ok &= check(written_match, "pages before the broken record written");
+	rest_blank = 1;
+	for (i = BROKEN_PAGE; i < IMAGE_PAGES; i++) {
+		if (page_written[i]) rest_blank = 0;
+	}
+	for (i = BROKEN_PAGE * PAGE_WORDS; i < IMAGE_PAGES * PAGE_WORDS; i++) {
+		if (sim.flash[i] != 0xffff) rest_blank = 0;
+	}
+	ok &= check(rest_blank, "nothing written from the broken page on");
+
+	puts(ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#define CLOSE_SOCKET closesocket
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define CLOSE_SOCKET close
+#endif
+
+#include "ipc_frame.h"
+
+int ipc_init(void) {
+#ifdef _WIN32
+	WSADATA wsa_data;
+	return WSAStartup(MAKEWORD(2, 2), &wsa_data) == 0;
+#else
+	return 1;
+#endif
+}
+
+/* UNIXドメインソケットのアドレスを設定する */
+static int set_address(struct sockaddr_un *addr, const char *path) {
+	if (path == NULL || strlen(path) >= sizeof(addr->sun_path)) return 0;
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 1;
+}
+
+ipc_socket_t ipc_listen(const char *path) {
+	struct sockaddr_un addr;
+	ipc_socket_t s;
+	if (!set_address(&addr, path)) return IPC_INVALID_SOCKET;
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == IPC_INVALID_SOCKET) return IPC_INVALID_SOCKET;
+	/* 前回のサーバが残したソケットファイルを消す */
+	remove(path);
+	if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, 4) != 0) {
+		CLOSE_SOCKET(s);
+		return IPC_INVALID_SOCKET;
+	}
+	return s;
+}
+
+ipc_socket_t ipc_accept(ipc_socket_t listen_socket) {
+	return accept(listen_socket, NULL, NULL);
+}
+
+ipc_socket_t ipc_connect(const char *path) {
+	struct sockaddr_un addr;
+	ipc_socket_t s;
+	if (!set_address(&addr, path)) return IPC_INVALID_SOCKET;
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == IPC_INVALID_SOCKET) return IPC_INVALID_SOCKET;
+	if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		CLOSE_SOCKET(s);
+		return IPC_INVALID_SOCKET;
+	}
+	return s;
+}
+
+void ipc_close(ipc_socket_t s) {
+	if (s != IPC_INVALID_SOCKET) CLOSE_SOCKET(s);
+}
+
+/* 指定したサイズを全て送信する */
+static int send_all(ipc_socket_t s, const unsigned char *data, unsigned long size) {
+	while (size > 0) {
+		int ret = send(s, (const char*)data, size > 0x10000 ? 0x10000 : (int)size, 0);
+		if (ret <= 0) return 0;
+		data += ret;
+		size -= ret;
+	}
+	return 1;
+}
+
+/* 指定したサイズを全て受信する */
+static int recv_all(ipc_socket_t s, unsigned char *data, unsigned long size) {
+	while (size > 0) {
+		int ret = recv(s, (char*)data, size > 0x10000 ? 0x10000 : (int)size, 0);
+		if (ret <= 0) return 0;
+		data += ret;
+		size -= ret;
+	}
+	return 1;
+}
+
+int ipc_send_frame(ipc_socket_t s, int type, const void *payload, unsigned long size) {
+	unsigned char header[IPC_FRAME_HEADER_SIZE];
+	if (size > IPC_FRAME_MAX_PAYLOAD || (size > 0 && payload == NULL)) return 0;
+	header[0] = type & 0xff;
+	header[1] = (size >> 24) & 0xff;
+	header[2] = (size >> 16) & 0xff;
+	header[3] = (size >> 8) & 0xff;
+	header[4] = size & 0xff;
+	if (!send_all(s, header, IPC_FRAME_HEADER_SIZE)) return 0;
+	return send_all(s, (const unsigned char*)payload, size);
+}
+
+int ipc_recv_frame(ipc_socket_t s, int *type, void *payload,
+unsigned long max_size, unsigned long *size) {
+	unsigned char header[IPC_FRAME_HEADER_SIZE];
+	unsigned long payload_size;
+	if (type == NULL || payload == NULL || size == NULL) return 0;
+	if (!recv_all(s, header, IPC_FRAME_HEADER_SIZE)) return 0;
+	payload_size = ((unsigned long)header[1] << 24) | ((unsigned long)header[2] << 16) |
+		((unsigned long)header[3] << 8) | header[4];
+	if (payload_size > max_size || payload_size > IPC_FRAME_MAX_PAYLOAD) return 0;
+	if (!recv_all(s, (unsigned char*)payload, payload_size)) return 0;
+	((unsigned char*)payload)[payload_size] = '\0';
+	*type = header[0];
+	*size = payload_size;
+	return 1;
+}
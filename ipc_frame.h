@@ -0,0 +1,69 @@
+#ifndef IPC_FRAME_H_GUARD_3D1A7C52_8E0B_4F6A_9B27_5C4E1F0A6D93
+#define IPC_FRAME_H_GUARD_3D1A7C52_8E0B_4F6A_9B27_5C4E1F0A6D93
+
+#ifdef _WIN32
+#include <winsock2.h>
+typedef SOCKET ipc_socket_t;
+#define IPC_INVALID_SOCKET INVALID_SOCKET
+#else
+typedef int ipc_socket_t;
+#define IPC_INVALID_SOCKET (-1)
+#endif
+
+/* フレームのヘッダのサイズ(種類1オクテット + ビッグエンディアンの長さ4オクテット) */
+#define IPC_FRAME_HEADER_SIZE 5
+/* 受け付けるペイロードの最大サイズ */
+#define IPC_FRAME_MAX_PAYLOAD 0x20000
+
+/* フレームの種類 */
+enum {
+	/* クライアント -> サーバ */
+	IPC_FRAME_PROGRAM = 'P', /* 書き込みジョブ */
+	IPC_FRAME_VERIFY = 'V', /* 照合ジョブ */
+	IPC_FRAME_DUMP = 'D', /* 読み出しジョブ */
+	/* サーバ -> クライアント */
+	IPC_FRAME_PROGRESS = 'p', /* 進捗("完了数 全体数") */
+	IPC_FRAME_MESSAGE = 'm', /* 表示用メッセージ */
+	IPC_FRAME_DATA = 'd', /* 読み出したデータ(リトルエンディアンのワード列) */
+	IPC_FRAME_RESULT = 'r' /* ジョブの結果("終了コード メッセージ")、ジョブの最後のフレーム */
+};
+
+/* ソケット通信を初期化する。成功したら真、失敗したら偽を返す。 */
+int ipc_init(void);
+
+/* pathで待ち受けを開始する。失敗したらIPC_INVALID_SOCKETを返す。 */
+ipc_socket_t ipc_listen(const char *path);
+
+/* 接続を受け付ける。失敗したらIPC_INVALID_SOCKETを返す。 */
+ipc_socket_t ipc_accept(ipc_socket_t listen_socket);
+
+/* pathに接続する。失敗したらIPC_INVALID_SOCKETを返す。 */
+ipc_socket_t ipc_connect(const char *path);
+
+/* ソケットを閉じる。 */
+void ipc_close(ipc_socket_t s);
+
+/**
+ * フレームを1個送信する。
+ * @param s 送信に使用するソケット
+ * @param type フレームの種類
+ * @param payload ペイロード(sizeが0ならNULLで良い)
+ * @param size ペイロードのサイズ
+ * @return 成功したら真、失敗したら偽
+ */
+int ipc_send_frame(ipc_socket_t s, int type, const void *payload, unsigned long size);
+
+/**
+ * フレームを1個受信する。
+ * ペイロードの後ろには'\0'を付加するので、payloadはmax_size + 1オクテット以上確保しておくこと。
+ * @param s 受信に使用するソケット
+ * @param type 受信したフレームの種類を格納する領域へのポインタ
+ * @param payload 受信したペイロードを格納する領域
+ * @param max_size payloadに格納できるペイロードの最大サイズ
+ * @param size 受信したペイロードのサイズを格納する領域へのポインタ
+ * @return 成功したら真、失敗または接続の終了なら偽
+ */
+int ipc_recv_frame(ipc_socket_t s, int *type, void *payload,
+	unsigned long max_size, unsigned long *size);
+
+#endif
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <string.h>
+#include "journal.h"
+
+/* ジャーナルのファイルの1行目 */
+#define JOURNAL_MAGIC "write_atmega journal 2"
+
+unsigned long journal_image_hash(const unsigned int *words, int size, int page_size) {
+	unsigned long hash = 2166136261UL;
+	int i;
+	for (i = 0; i < size; i++) {
+		hash = ((hash ^ (words[i] & 0xff)) * 16777619UL) & 0xffffffffUL;
+		hash = ((hash ^ ((words[i] >> 8) & 0xff)) * 16777619UL) & 0xffffffffUL;
+	}
+	return ((hash ^ (unsigned long)page_size) * 16777619UL) & 0xffffffffUL;
+}
+
+int journal_board_id(const atmegaio_t *atmegaio, unsigned long serial, char *id) {
+	int signature[4];
+	int calibration_byte;
+	if (read_signature_byte(atmegaio, signature) != ATMEGAIO_SUCCESS ||
+	read_information(atmegaio, NULL, NULL, NULL, NULL, &calibration_byte) != ATMEGAIO_SUCCESS) {
+		return 0;
+	}
+	snprintf(id, JOURNAL_BOARD_ID_SIZE, "signature %02X%02X%02X calibration %02X serial %lu",
+		signature[0], signature[1], signature[2], calibration_byte, serial);
+	return 1;
+}
+
+int journal_load(const char *path, unsigned long hash, int page_size, const char *board,
+unsigned char *page_done, int data_size) {
+	char line[128];
+	unsigned long file_hash;
+	int file_page_size;
+	unsigned int addr;
+	int count = 0;
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) return JOURNAL_NONE;
+	if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) != 0 ||
+	fgets(line, sizeof(line), fp) == NULL ||
+	sscanf(line, "image %lx page-size %d", &file_hash, &file_page_size) != 2 ||
+	file_hash != hash || file_page_size != page_size) {
+		fclose(fp);
+		return JOURNAL_NONE;
+	}
+	/* 途中で別のボードにつなぎ替えていたら、書き込み済みのページは信用できない */
+	if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, "board ", 6) != 0 ||
+	strcspn(line + 6, "\n") != strlen(board) || strncmp(line + 6, board, strlen(board)) != 0) {
+		fclose(fp);
+		return JOURNAL_OTHER_BOARD;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		/* 書きかけの行は無視する */
+		if (strchr(line, '\n') == NULL || sscanf(line, "%x", &addr) != 1) continue;
+		if (addr % page_size != 0 || addr + page_size > (unsigned int)data_size) continue;
+		if (!page_done[addr / page_size]) count++;
+		page_done[addr / page_size] = 1;
+	}
+	fclose(fp);
+	return count;
+}
+
+FILE *journal_open(const char *path, int resume, unsigned long hash, int page_size, const char *board) {
+	FILE *fp = fopen(path, resume ? "a" : "w");
+	if (fp == NULL) return NULL;
+	if (!resume) {
+		fprintf(fp, "%s\nimage %08lx page-size %d\nboard %s\n", JOURNAL_MAGIC, hash, page_size, board);
+		fflush(fp);
+	}
+	return fp;
+}
+
+void journal_record(FILE *journal, unsigned int addr) {
+	fprintf(journal, "%04x\n", addr);
+	fflush(journal);
+}
@@ -0,0 +1,69 @@
+#ifndef JOURNAL_H_GUARD_3E9A6C14_B7F2_4D05_9A8E_61C0D4F27B93
+#define JOURNAL_H_GUARD_3E9A6C14_B7F2_4D05_9A8E_61C0D4F27B93
+
+#include <stdio.h>
+#include "atmega_io.h"
+
+/* ボードの識別情報の最大の長さ(終端を含む) */
+#define JOURNAL_BOARD_ID_SIZE 64
+
+/* journal_loadの戻り値 */
+enum {
+	JOURNAL_NONE = -1, /* ジャーナルが無いか、別のデータのもの */
+	JOURNAL_OTHER_BOARD = -2 /* 同じデータを別のボードに書き込んでいたもの */
+};
+
+/**
+ * 書き込むデータとページサイズからジャーナルの照合に使う値を計算する(FNV-1a)。
+ * @param words 書き込むデータ
+ * @param size wordsの要素数
+ * @param page_size ページサイズ(ワード)
+ * @return 照合に使う値
+ */
+unsigned long journal_image_hash(const unsigned int *words, int size, int page_size);
+
+/**
+ * ジャーナルの照合に使うボードの識別情報を作る。
+ * Signature Byteで部品の種類を、Calibration Byteでチップの個体差を、通し番号でボードの順番を区別する。
+ * Calibration Byteは同じ値のチップもあるので、同じ部品どうしのつなぎ替えを必ず検出できるわけではない。
+ * @param atmegaio 接続しているボード
+ * @param serial このボードの通し番号
+ * @param id 識別情報を書き込むバッファ(JOURNAL_BOARD_ID_SIZE文字)
+ * @return 読み込めたら真
+ */
+int journal_board_id(const atmegaio_t *atmegaio, unsigned long serial, char *id);
+
+/**
+ * ジャーナルを読み込み、書き込みと照合が完了したページに印を付ける。
+ * @param path ジャーナルのファイル
+ * @param hash 今回書き込むデータのjournal_image_hash
+ * @param page_size ページサイズ(ワード)
+ * @param board 接続しているボードのjournal_board_idの結果
+ * @param page_done ページごとの印(ページの先頭のアドレス / page_size で指定する)
+ * @param data_size 書き込むデータのワード数。これを超えるページは無視する
+ * @return 完了したページの数、JOURNAL_NONEまたはJOURNAL_OTHER_BOARD
+ */
+int journal_load(const char *path, unsigned long hash, int page_size, const char *board,
+	unsigned char *page_done, int data_size);
+
+/**
+ * ページを記録するためにジャーナルを開く。
+ * 再開しない場合は新しく作り直し、データとボードの情報を書き込む。
+ * @param path ジャーナルのファイル
+ * @param resume 真ならjournal_loadで読み込んだジャーナルに追記する
+ * @param hash 書き込むデータのjournal_image_hash
+ * @param page_size ページサイズ(ワード)
+ * @param board 接続しているボードのjournal_board_idの結果
+ * @return ファイルハンドル。開けなかったらNULL
+ */
+FILE *journal_open(const char *path, int resume, unsigned long hash, int page_size, const char *board);
+
+/**
+ * 書き込みと照合が完了したページを記録する。
+ * 途中で止まっても記録が残るよう、すぐにファイルに書き出す。
+ * @param journal journal_openで開いたファイルハンドル
+ * @param addr ページの先頭のワードアドレス
+ */
+void journal_record(FILE *journal, unsigned int addr);
+
+#endif
@@ -0,0 +1,128 @@
+/* シミュレートしたATmegaの通信に故障を注入し、コマンドのエコーの確認、再同期と再試行、
+ * ジャーナルからの再開を試験する。
+ */
+#include <stdio.h>
+#include <string.h>
+#include "atmega_io.h"
+#include "atmega_sim.h"
+#include "journal.h"
+
+#define PAGE_WORDS ATMEGA_SIM_PAGE_WORDS
+#define IMAGE_WORDS (8 * PAGE_WORDS)
+/* 書き込みが止まるページ */
+#define FAIL_PAGE 5
+#define JOURNAL_FILE "journal_test.tmp"
+
+static atmega_sim_t sim, other_sim;
+
+static int check(int cond, const char *what) {
+	printf("%s: %s\n", cond ? "ok  " : "FAIL", what);
+	return cond;
+}
+
+/* フラッシュの範囲が消去されたままかを返す */
+static int is_blank(const atmega_sim_t *target, unsigned int start, unsigned int size) {
+	unsigned int i;
+	for (i = 0; i < size; i++) {
+		if (target->flash[start + i] != 0xffff) return 0;
+	}
+	return 1;
+}
+
+/* 1ページを書き込んで照合し、成功したらジャーナルに記録する */
+static int write_page(const atmegaio_t *atmegaio, const unsigned int *image, unsigned int addr, FILE *journal) {
+	unsigned int readback[PAGE_WORDS];
+	if (write_program(atmegaio, 0, image + addr, addr, PAGE_WORDS, PAGE_WORDS) != ATMEGAIO_SUCCESS ||
+	read_program(atmegaio, readback, addr, PAGE_WORDS) != ATMEGAIO_SUCCESS ||
+	memcmp(readback, image + addr, sizeof(readback)) != 0) {
+		return 0;
+	}
+	journal_record(journal, addr);
+	return 1;
+}
+
+int main(void) {
+	static unsigned int image[IMAGE_WORDS];
+	unsigned char page_done[IMAGE_WORDS / PAGE_WORDS];
+	char board_id[JOURNAL_BOARD_ID_SIZE], other_id[JOURNAL_BOARD_ID_SIZE];
+	unsigned long hash;
+	atmegaio_t *atmegaio, *other;
+	FILE *journal;
+	int signature[4];
+	int written, resumed;
+	int ok = 1;
+	int i;
+	atmega_sim_init(&sim);
+	atmega_sim_init(&other_sim);
+	other_sim.calibration_byte = 0x9B;
+	atmegaio = atmega_sim_open(&sim);
+	other = atmega_sim_open(&other_sim);
+	if (!check(atmegaio != NULL && other != NULL, "atmega_sim_open")) return 1;
+	for (i = 0; i < IMAGE_WORDS; i++) image[i] = (i * 0x2F1D + 0x0B07) & 0xffff;
+	ok &= check(reset(atmegaio) == ATMEGAIO_SUCCESS && reset(other) == ATMEGAIO_SUCCESS &&
+		chip_erase(atmegaio, 0) == ATMEGAIO_SUCCESS, "reset and erase");
+
+	/* 読み込みの2オクテット目が化けると、エコーが合わずに再同期して読み直す */
+	sim.fault_command = 0x30;
+	sim.fault_index = 1;
+	ok &= check(read_signature_byte(atmegaio, signature) == ATMEGAIO_SUCCESS && sim.fault_command == 0 &&
+		signature[0] == 0x1E && signature[1] == 0x95 && signature[2] == 0x0F, "echo mismatch on a read is retried");
+
+	/* Write Program Memory Pageのアドレスが化けても、4オクテット目を送る前に止めるので
+	 * 別のページ(0x100ワード先)には書き込まれず、再試行で正しいページに書き込まれる
+	 */
+	sim.fault_command = 0x4C;
+	sim.fault_index = 1;
+	ok &= check(write_program(atmegaio, 0, image, 0, PAGE_WORDS, PAGE_WORDS) == ATMEGAIO_SUCCESS &&
+		sim.fault_command == 0 && memcmp(sim.flash, image, PAGE_WORDS * sizeof(*image)) == 0,
+		"echo mismatch on Write Page is retried");
+	ok &= check(is_blank(&sim, 0x100, PAGE_WORDS), "desynchronised Write Page not executed");
+	ok &= check(chip_erase(atmegaio, 0) == ATMEGAIO_SUCCESS, "erase again");
+
+	/* ページごとに記録しながら書き込み、途中で通信できなくなったことにする */
+	hash = journal_image_hash(image, IMAGE_WORDS, PAGE_WORDS);
+	ok &= check(journal_board_id(atmegaio, 7, board_id) && journal_board_id(other, 7, other_id) &&
+		strcmp(board_id, other_id) != 0, "board id");
+	remove(JOURNAL_FILE);
+	journal = journal_open(JOURNAL_FILE, 0, hash, PAGE_WORDS, board_id);
+	if (!check(journal != NULL, "journal_open")) return 1;
+	for (written = 0; written < IMAGE_WORDS / PAGE_WORDS; written++) {
+		/* SCKが速すぎる状態は再試行しても直らない */
+		if (written == FAIL_PAGE) sim.sck_frequency = sim.clock_frequency;
+		if (!write_page(atmegaio, image, written * PAGE_WORDS, journal)) break;
+	}
+	fclose(journal);
+	ok &= check(written == FAIL_PAGE && is_blank(&sim, FAIL_PAGE * PAGE_WORDS, IMAGE_WORDS - FAIL_PAGE * PAGE_WORDS),
+		"persistent fault stops the write after retrying");
+
+	/* 別のボードや別のデータでは再開しない */
+	memset(page_done, 0, sizeof(page_done));
+	ok &= check(journal_load(JOURNAL_FILE, hash, PAGE_WORDS, other_id, page_done, IMAGE_WORDS) == JOURNAL_OTHER_BOARD,
+		"journal refused for another board");
+	ok &= check(journal_load(JOURNAL_FILE, hash ^ 1, PAGE_WORDS, board_id, page_done, IMAGE_WORDS) == JOURNAL_NONE &&
+		journal_load(JOURNAL_FILE, hash, PAGE_WORDS * 2, board_id, page_done, IMAGE_WORDS) == JOURNAL_NONE,
+		"journal ignored for other data");
+
+	/* 通信が直ったら、消去せずに残りのページだけを書き込む */
+	sim.sck_frequency = 0;
+	memset(page_done, 0, sizeof(page_done));
+	resumed = journal_load(JOURNAL_FILE, hash, PAGE_WORDS, board_id, page_done, IMAGE_WORDS);
+	ok &= check(resumed == FAIL_PAGE && page_done[FAIL_PAGE - 1] && !page_done[FAIL_PAGE], "journal resume");
+	journal = journal_open(JOURNAL_FILE, 1, hash, PAGE_WORDS, board_id);
+	if (!check(journal != NULL, "journal_open (resume)")) return 1;
+	for (i = 0; i < IMAGE_WORDS / PAGE_WORDS; i++) {
+		if (page_done[i]) continue;
+		if (!write_page(atmegaio, image, i * PAGE_WORDS, journal)) break;
+	}
+	fclose(journal);
+	ok &= check(memcmp(sim.flash, image, sizeof(image)) == 0, "resumed write completes the image");
+	memset(page_done, 0, sizeof(page_done));
+	ok &= check(journal_load(JOURNAL_FILE, hash, PAGE_WORDS, board_id, page_done, IMAGE_WORDS) ==
+		IMAGE_WORDS / PAGE_WORDS, "all pages recorded");
+	remove(JOURNAL_FILE);
+
+	disconnect(atmegaio);
+	disconnect(other);
+	puts(ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
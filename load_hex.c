@@ -1,5 +1,6 @@
 #include <ctype.h>
 #include <limits.h>
+#include <stdlib.h>
 #include "load_hex.h"
 
 /* スタートコードを読み込む */
@@ -46,6 +47,11 @@ static int load_hex_byte(int *out, FILE *fp) {
 }
 
 int load_hex(char *out, int out_size, FILE *fp) {
+	return load_hex_with_callback(out, out_size, fp, NULL, NULL);
+}
+
+int load_hex_with_callback(char *out, int out_size, FILE *fp,
+load_hex_callback_t callback, void *user_data) {
 	int address_offset = 0;
 	int size_over_flag = 0;
 	if (out == NULL || out_size < 0) {
@@ -57,6 +63,7 @@ int load_hex(char *out, int out_size, FILE *fp) {
 		int data_size;
 		int address_high, address_low, address = 0;
 		int data_type;
+		int record_address;
 		int i;
 		/* 行のヘッダの読み込み */
 		if ((ret = load_hex_start(fp)) != LOAD_HEX_SUCCESS) return ret;
@@ -75,6 +82,7 @@ int load_hex(char *out, int out_size, FILE *fp) {
 			/* アドレスを調整する */
 			address += address_offset;
 		}
+		record_address = address;
 		/* 行の内容の読み込み */
 		for (i = 0; i < data_size; i++) {
 			int data;
@@ -115,12 +123,101 @@ int load_hex(char *out, int out_size, FILE *fp) {
 		if ((ret = load_hex_byte(&i, fp)) != LOAD_HEX_SUCCESS) return ret;
 		checksum = (checksum + i) & 0xff;
 		if (checksum != 0x00) return LOAD_HEX_CHECKSUM_ERROR;
+		if (callback != NULL && data_type == 0x00 && data_size > 0) {
+			callback(record_address, data_size, user_data);
+		}
 		/* End Of Fileなら終了する */
 		if (data_type == 0x01) break;
 	}
 	return size_over_flag ? LOAD_HEX_SIZE_OVER : LOAD_HEX_SUCCESS;
 }
 
+/* load_hex_mergeで読み込んだ範囲を記録するための情報 */
+typedef struct {
+	const char *image;
+	unsigned char *defined;
+	/* 各オクテットに最初に来た値(ファイル内のレコードどうしの重なりを調べる) */
+	char *first;
+	int size;
+	int overlap;
+	int conflict_address;
+} merge_range_t;
+
+static void mark_defined(int address, int size, void *user_data) {
+	merge_range_t *range = (merge_range_t*)user_data;
+	int i;
+	for (i = 0; i < size; i++) {
+		int a = address + i;
+		if (a < 0 || range->size <= a) continue;
+		if (!range->defined[a]) {
+			range->first[a] = range->image[a];
+			range->defined[a] = 1;
+		} else if (range->first[a] == range->image[a]) {
+			range->overlap++;
+		} else if (range->conflict_address < 0) {
+			range->conflict_address = a;
+		}
+	}
+}
+
+int load_hex_merge(char *out, unsigned char *defined, int out_size, int offset, FILE *fp,
+int *overlap, int *conflict_address) {
+	char *image;
+	merge_range_t range;
+	int overlap_count;
+	int ret;
+	int i;
+	if (out == NULL || defined == NULL || out_size < 0 || offset < 0 || fp == NULL) {
+		return LOAD_HEX_INVALID_PARAMETER;
+	}
+	image = malloc(out_size > 0 ? out_size : 1);
+	range.image = image;
+	range.defined = calloc(out_size > 0 ? out_size : 1, 1);
+	range.first = malloc(out_size > 0 ? out_size : 1);
+	range.size = out_size;
+	range.overlap = 0;
+	range.conflict_address = -1;
+	if (image == NULL || range.defined == NULL || range.first == NULL) {
+		free(image);
+		free(range.defined);
+		free(range.first);
+		return LOAD_HEX_INVALID_PARAMETER;
+	}
+	ret = load_hex_with_callback(image, out_size, fp, mark_defined, &range);
+	/* ファイルの中で重なったレコードの値が異なる */
+	if (ret == LOAD_HEX_SUCCESS && range.conflict_address >= 0) {
+		if (conflict_address != NULL) *conflict_address = range.conflict_address + offset;
+		ret = LOAD_HEX_CONFLICT;
+	}
+	overlap_count = range.overlap;
+	/* ずらした位置に収まるか、既にあるデータと衝突しないかを確認する */
+	for (i = 0; ret == LOAD_HEX_SUCCESS && i < out_size; i++) {
+		if (!range.defined[i]) continue;
+		if (i >= out_size - offset) {
+			ret = LOAD_HEX_SIZE_OVER;
+		} else if (defined[i + offset]) {
+			if (out[i + offset] != image[i]) {
+				if (conflict_address != NULL) *conflict_address = i + offset;
+				ret = LOAD_HEX_CONFLICT;
+			} else {
+				overlap_count++;
+			}
+		}
+	}
+	if (ret == LOAD_HEX_SUCCESS) {
+		for (i = 0; i < out_size - offset; i++) {
+			if (!range.defined[i]) continue;
+			out[i + offset] = image[i];
+			defined[i + offset] = 1;
+		}
+		if (overlap != NULL) *overlap = overlap_count;
+	}
+	free(image);
+	free(range.defined);
+	free(range.first);
+	return ret;
+}
+
 int chars_to_words(unsigned int *out, const char *in, int in_bytes) {
 	int i;
 	if (out == NULL || in == NULL || in_bytes < 0 || in_bytes % 2 != 0) {
@@ -134,8 +231,91 @@ int chars_to_words(unsigned int *out, const char *in, int in_bytes) {
 }
 
 #ifdef LOAD_HEX_TEST
-/* 標準入力からHEXファイルを読み込み、標準出力に内容を出力する */
-int main(void) {
+#include <string.h>
+
+#define MERGE_TEST_SIZE 0x100
+
+/* データレコードを1個書き込む */
+static void put_record(FILE *fp, int address, const char *data, int size) {
+	int checksum = size + (address >> 8) + (address & 0xff);
+	int i;
+	fprintf(fp, ":%02X%04X00", size, address);
+	for (i = 0; i < size; i++) {
+		fprintf(fp, "%02X", (unsigned char)data[i]);
+		checksum += (unsigned char)data[i];
+	}
+	fprintf(fp, "%02X\n", -checksum & 0xff);
+}
+
+/* レコードを並べたHEXファイルを作り、load_hex_mergeで重ねる */
+static int merge_records(char *out, unsigned char *defined, int offset, int record_num,
+const int *addresses, const char *const *data, int *overlap, int *conflict_address) {
+	FILE *fp = tmpfile();
+	int ret;
+	int i;
+	if (fp == NULL) return LOAD_HEX_IO_ERROR;
+	for (i = 0; i < record_num; i++) put_record(fp, addresses[i], data[i], (int)strlen(data[i]));
+	fputs(":00000001FF\n", fp);
+	rewind(fp);
+	*overlap = 0;
+	*conflict_address = -1;
+	ret = load_hex_merge(out, defined, MERGE_TEST_SIZE, offset, fp, overlap, conflict_address);
+	fclose(fp);
+	return ret;
+}
+
+static int check(int cond, const char *what) {
+	printf("%s: %s\n", cond ? "ok  " : "FAIL", what);
+	return cond;
+}
+
+/* 重なったレコードの扱いを試験する */
+static int merge_test(void) {
+	static const int same_addr[2] = {0x10, 0x12};
+	static const char *const same_data[2] = {"\xAA\xBB\xCC\xDD", "\xCC\xDD\xEE"};
+	static const int diff_addr[2] = {0x20, 0x21};
+	static const char *const diff_data[2] = {"\x11\x22\x33", "\x22\x99"};
+	static const int next_addr[1] = {0x13};
+	static const char *const next_data[1] = {"\xDD\xEE\xFF"};
+	static const int shifted_addr[1] = {0x00};
+	static const char *const shifted_data[1] = {"\x55"};
+	char out[MERGE_TEST_SIZE], saved[MERGE_TEST_SIZE];
+	unsigned char defined[MERGE_TEST_SIZE], saved_defined[MERGE_TEST_SIZE];
+	int overlap, conflict_address;
+	int ok = 1;
+	memset(out, 0xff, sizeof(out));
+	memset(defined, 0, sizeof(defined));
+
+	/* ファイルの中で同じ値のレコードが重なる */
+	ok &= check(merge_records(out, defined, 0, 2, same_addr, same_data, &overlap, &conflict_address) ==
+		LOAD_HEX_SUCCESS && overlap == 2 && defined[0x10] && defined[0x14] && !defined[0x15] &&
+		memcmp(out + 0x10, "\xAA\xBB\xCC\xDD\xEE", 5) == 0, "identical overlap in a file");
+	/* ファイルの中で異なる値のレコードが重なる */
+	memcpy(saved, out, sizeof(out));
+	memcpy(saved_defined, defined, sizeof(defined));
+	ok &= check(merge_records(out, defined, 0, 2, diff_addr, diff_data, &overlap, &conflict_address) ==
+		LOAD_HEX_CONFLICT && conflict_address == 0x22 &&
+		memcmp(out, saved, sizeof(out)) == 0 && memcmp(defined, saved_defined, sizeof(defined)) == 0,
+		"conflicting overlap in a file");
+	/* 既に読み込んだデータに同じ値が重なる */
+	ok &= check(merge_records(out, defined, 0, 1, next_addr, next_data, &overlap, &conflict_address) ==
+		LOAD_HEX_SUCCESS && overlap == 2 && (unsigned char)out[0x15] == 0xFF && defined[0x15],
+		"identical overlap with a loaded file");
+	/* ずらした位置で既に読み込んだデータと異なる値が重なる */
+	memcpy(saved, out, sizeof(out));
+	memcpy(saved_defined, defined, sizeof(defined));
+	ok &= check(merge_records(out, defined, 0x11, 1, shifted_addr, shifted_data, &overlap, &conflict_address) ==
+		LOAD_HEX_CONFLICT && conflict_address == 0x11 &&
+		memcmp(out, saved, sizeof(out)) == 0 && memcmp(defined, saved_defined, sizeof(defined)) == 0,
+		"conflicting overlap with a loaded file");
+	puts(ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+/* 標準入力からHEXファイルを読み込み、標準出力に内容を出力する。
+ * --merge-testを指定した場合は、load_hex_mergeの試験を行う。
+ */
+int main(int argc, char *argv[]) {
 	static char buffer[1024 * 1024];
 	static unsigned int buffer_int[1024 * 1024 / 2];
 	unsigned int i;
@@ -143,6 +323,7 @@ int main(void) {
 	int print_exists = 0;
 	int words_per_line = 8;
 	int ret;
+	if (argc > 1 && strcmp(argv[1], "--merge-test") == 0) return merge_test();
 	for (i = 0; i < sizeof(buffer) / sizeof(buffer[0]); i++) buffer[i] = 0xff;
 	ret = load_hex(buffer, sizeof(buffer), stdin);
 	if (ret != LOAD_HEX_SUCCESS) {
@@ -10,7 +10,8 @@ enum {
 	LOAD_HEX_IO_ERROR, /* ファイル操作エラー */
 	LOAD_HEX_INVALID_CHAR, /* ファイルに不正な文字が含まれる */
 	LOAD_HEX_CHECKSUM_ERROR, /* チェックサムが一致しない */
-	LOAD_HEX_UNEXPECTED_EOF /* 予期せぬファイル終端 */
+	LOAD_HEX_UNEXPECTED_EOF, /* 予期せぬファイル終端 */
+	LOAD_HEX_CONFLICT /* 既に読み込んだデータと異なる値が同じアドレスにある */
 };
 
 /**
@@ -25,6 +26,43 @@ enum {
  */
 int load_hex(char *out, int out_size, FILE *fp);
 
+/* データレコードを1個読み込むたびに呼ばれる関数。
+ * addressはレコードの先頭のアドレス、sizeはデータのオクテット数で、データはoutに格納済み。
+ */
+typedef void (*load_hex_callback_t)(int address, int size, void *user_data);
+
+/**
+ * load_hexと同様にHEXファイルを読み込み、データレコードごとにcallbackを呼ぶ。
+ * callbackはチェックサムを確認した後に呼ばれる。
+ * @param out ファイルのデータを書き込むバッファ
+ * @param out_size outのバッファサイズ
+ * @param fp 読み込みに使用するファイルハンドル
+ * @param callback データレコードごとに呼ぶ関数(NULLならload_hexと同じ)
+ * @param user_data callbackに渡すデータ
+ * @return エラーコード
+ */
+int load_hex_with_callback(char *out, int out_size, FILE *fp,
+	load_hex_callback_t callback, void *user_data);
+
+/**
+ * HEXファイルを読み込み、既に読み込んだデータに重ねる。
+ * definedはoutの各オクテットにデータがあるかを表す配列で、読み込んだ範囲を真にする。
+ * ファイルのアドレスにoffsetを足した位置に格納する。
+ * 既にデータがあるアドレスに同じ値が来た場合は重複として数え、
+ * 異なる値が来た場合はoutを変更せずにLOAD_HEX_CONFLICTを返す。
+ * ファイルの中でレコードどうしが重なった場合も同様に扱う。
+ * @param out データを重ねるバッファ
+ * @param defined outの各オクテットにデータがあるかを表す配列
+ * @param out_size outとdefinedの要素数
+ * @param offset ファイルのアドレスに足す値(非負)
+ * @param fp 読み込みに使用するファイルハンドル
+ * @param overlap 同じ値で重複したオクテット数を格納する変数へのポインタ(不要ならNULL)
+ * @param conflict_address 最初に衝突したアドレスを格納する変数へのポインタ(不要ならNULL)
+ * @return エラーコード
+ */
+int load_hex_merge(char *out, unsigned char *defined, int out_size, int offset, FILE *fp,
+	int *overlap, int *conflict_address);
+
 /**
  * char型のデータ配列をワード配列に変換する。
  * in_bytesは非負の偶数でないといけない。
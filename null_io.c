@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include "null_io.h"
+#include "atmega_sim.h"
+
+/* USB-IO2.0で1オクテットを送受信するのに使うレポートの数(各ビットのLOWとHIGH、最後に全部LOW) */
+#define REPORTS_PER_BYTE 17
+/* USB-IO2.0のリセットで使うレポートの数と待ち時間(ミリ秒) */
+#define REPORTS_PER_RESET 2
+#define RESET_WAIT_MS 21
+
+/* データシートの書き込み・消去の最大時間(マイクロ秒) */
+#define FLASH_WRITE_US 4500UL
+#define EEPROM_WRITE_US 3600UL
+#define CHIP_ERASE_US 9000UL
+#define INFORMATION_WRITE_US 4500UL
+
+typedef struct {
+	atmega_sim_t sim;
+	unsigned long report_us;
+	null_io_stats_t stats;
+	/* 送信中のコマンド */
+	int command[4];
+	int byte_index;
+} null_io_t;
+
+static int null_disconnect(void *hardware_data) {
+	if (hardware_data == NULL) return 0;
+	free(hardware_data);
+	return 1;
+}
+
+static int null_reset(void *hardware_data) {
+	null_io_t *nio = (null_io_t*)hardware_data;
+	if (nio == NULL) return 0;
+	atmega_sim_set_pins(&nio->sim, 1, 0, 0);
+	atmega_sim_set_pins(&nio->sim, 0, 0, 0);
+	nio->byte_index = 0;
+	nio->stats.resets++;
+	nio->stats.reports += REPORTS_PER_RESET;
+	return 1;
+}
+
+/* 送信し終わったコマンドを分類して数える */
+static void count_command(null_io_t *nio) {
+	const int *c = nio->command;
+	nio->stats.commands++;
+	if (c[0] == 0xF0) {
+		nio->stats.polls++;
+	} else if (c[0] == 0x4C) {
+		nio->stats.flash_page_writes++;
+	} else if (c[0] == 0xC0 || c[0] == 0xC2) {
+		nio->stats.eeprom_writes++;
+	} else if (c[0] == 0xAC && c[1] == 0x80) {
+		nio->stats.chip_erases++;
+	} else if (c[0] == 0xAC && (c[1] == 0xE0 || c[1] == 0xA0 || c[1] == 0xA8 || c[1] == 0xA4)) {
+		nio->stats.information_writes++;
+	}
+}
+
+static int null_io_8bits(void *hardware_data, int out) {
+	null_io_t *nio = (null_io_t*)hardware_data;
+	if (nio == NULL) return -1;
+	nio->stats.transfers++;
+	nio->stats.reports += REPORTS_PER_BYTE;
+	nio->command[nio->byte_index++] = out & 0xff;
+	if (nio->byte_index >= 4) {
+		count_command(nio);
+		nio->byte_index = 0;
+	}
+	return atmega_sim_transfer(&nio->sim, out);
+}
+
+static void null_wait_ms(void *hardware_data, int ms) {
+	null_io_t *nio = (null_io_t*)hardware_data;
+	if (nio == NULL || ms < 0) return;
+	nio->stats.fixed_waits++;
+	nio->stats.fixed_wait_ms += ms;
+}
+
+atmegaio_t *null_io_init(unsigned long report_us) {
+	atmegaio_t *atmegaio;
+	null_io_t *nio;
+	nio = calloc(1, sizeof(null_io_t));
+	if (nio == NULL) return NULL;
+	atmega_sim_init(&nio->sim);
+	nio->report_us = report_us;
+	atmegaio = calloc(1, sizeof(atmegaio_t));
+	if (atmegaio == NULL) {
+		free(nio);
+		return NULL;
+	}
+	atmegaio->hardware_data = (void*)nio;
+	atmegaio->disconnect = null_disconnect;
+	atmegaio->reset = null_reset;
+	atmegaio->io_8bits = null_io_8bits;
+	atmegaio->wait_ms = null_wait_ms;
+	return atmegaio;
+}
+
+int null_io_get_stats(const atmegaio_t *atmegaio, null_io_stats_t *stats) {
+	if (atmegaio == NULL || atmegaio->hardware_data == NULL || stats == NULL) return 0;
+	*stats = ((const null_io_t*)atmegaio->hardware_data)->stats;
+	return 1;
+}
+
+void null_io_report(const atmegaio_t *atmegaio, FILE *fp) {
+	null_io_stats_t s;
+	double transfer_ms, reset_ms, wait_ms;
+	if (fp == NULL || !null_io_get_stats(atmegaio, &s)) return;
+	transfer_ms = (double)s.reports * ((const null_io_t*)atmegaio->hardware_data)->report_us / 1000.0;
+	reset_ms = (double)s.resets * RESET_WAIT_MS;
+	if (s.fixed_waits > 0) {
+		wait_ms = (double)s.fixed_wait_ms;
+	} else {
+		/* Poll RDY/~BSYの場合は、ターゲットの書き込み時間だけ待つことになる */
+		wait_ms = (s.flash_page_writes * FLASH_WRITE_US + s.eeprom_writes * EEPROM_WRITE_US +
+			s.chip_erases * CHIP_ERASE_US + s.information_writes * INFORMATION_WRITE_US) / 1000.0;
+	}
+	fputs("--- dry run ---\n", fp);
+	fprintf(fp, "ISP commands       : %lu (%lu Poll RDY/~BSY)\n", s.commands, s.polls);
+	fprintf(fp, "backend transfers  : %lu\n", s.transfers);
+	fprintf(fp, "USB reports        : %lu\n", s.reports);
+	fprintf(fp, "resets             : %lu\n", s.resets);
+	fprintf(fp, "page writes        : flash %lu, EEPROM %lu\n", s.flash_page_writes, s.eeprom_writes);
+	fprintf(fp, "erases / fuse bits : %lu / %lu\n", s.chip_erases, s.information_writes);
+	if (s.fixed_waits > 0) {
+		fprintf(fp, "fixed waits        : %lu (%lu ms)\n", s.fixed_waits, s.fixed_wait_ms);
+	}
+	fprintf(fp, "predicted time     : %.1f s (transfers %.1f s, resets %.1f s, waits %.1f s)\n",
+		(transfer_ms + reset_ms + wait_ms) / 1000.0,
+		transfer_ms / 1000.0, reset_ms / 1000.0, wait_ms / 1000.0);
+}
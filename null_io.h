@@ -0,0 +1,57 @@
+#ifndef NULL_IO_H_GUARD_9E3B71C4_0A56_4D28_B1F7_6C84D2E5A039
+#define NULL_IO_H_GUARD_9E3B71C4_0A56_4D28_B1F7_6C84D2E5A039
+
+#include <stdio.h>
+#include "atmega_io.h"
+
+/* USB-IO2.0のレポート1個の送受信にかかる時間(マイクロ秒)の既定値。
+ * 出力と入力の割り込み転送がそれぞれ1フレーム(1ms)かかるものとする。
+ */
+#define NULL_IO_DEFAULT_REPORT_US 2000UL
+
+/* 通信を数えた結果 */
+typedef struct {
+	/* 4オクテットのISPコマンドの数 */
+	unsigned long commands;
+	/* 書き込み器とのやり取り(io_8bitsの呼び出し)の数 */
+	unsigned long transfers;
+	/* USB-IO2.0で送受信するレポートの数 */
+	unsigned long reports;
+	/* リセットの回数 */
+	unsigned long resets;
+	/* Poll RDY/~BSYの回数 */
+	unsigned long polls;
+	/* 固定の待ち時間の回数と合計(ミリ秒) */
+	unsigned long fixed_waits;
+	unsigned long fixed_wait_ms;
+	/* 完了を待つ必要がある操作の数 */
+	unsigned long flash_page_writes;
+	unsigned long eeprom_writes;
+	unsigned long chip_erases;
+	unsigned long information_writes;
+} null_io_stats_t;
+
+/* 実際には通信せず、USB-IO2.0で書き込んだ場合の通信を数える書き込み器を初期化する。
+ * ターゲットはシミュレータで置き換えるので、書き込んだデータは読み込みや照合で返ってくる。
+ * 固定の待ち時間は実際には待たずに数えるだけにする。
+ * report_usはレポート1個の送受信にかかる時間(マイクロ秒)で、見積もりに使う。
+ * 成功と判定したら通信用データのポインタ、失敗を検出したらNULLを返す。
+ */
+atmegaio_t *null_io_init(unsigned long report_us);
+
+/**
+ * 数えた結果を取得する。
+ * @param atmegaio null_io_initで初期化した通信用データ
+ * @param stats 結果を格納する領域へのポインタ
+ * @return 成功と判定したら真、失敗を検出したら偽
+ */
+int null_io_get_stats(const atmegaio_t *atmegaio, null_io_stats_t *stats);
+
+/**
+ * 数えた結果と、それから見積もった実行時間を表示する。
+ * @param atmegaio null_io_initで初期化した通信用データ
+ * @param fp 出力先
+ */
+void null_io_report(const atmegaio_t *atmegaio, FILE *fp);
+
+#endif
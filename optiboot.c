@@ -0,0 +1,286 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "optiboot.h"
+#include "serial_posix.h"
+#include "atmega_io.h"
+
+/* 応答を待つ時間(ミリ秒) */
+#define READ_TIMEOUT_MS 1000
+/* 同期を取るときに応答を待つ時間(ミリ秒)と試行回数 */
+#define SYNC_TIMEOUT_MS 200
+#define SYNC_RETRY 10
+
+typedef struct {
+	int fd;
+	/* 読み込んだ識別子(読み込む前は-1) */
+	int signature[3];
+} optiboot_t;
+
+static void wait_ms(long ms) {
+	struct timespec req;
+	req.tv_sec = ms / 1000;
+	req.tv_nsec = (ms % 1000) * 1000000L;
+	nanosleep(&req, NULL);
+}
+
+/* STK_INSYNC、answer_sizeオクテットのデータ、STK_OKを受信する */
+static int receive_answer(optiboot_t *boot, unsigned char *answer, int answer_size, int timeout_ms) {
+	int c;
+	int i;
+	if (serial_read_byte(boot->fd, timeout_ms) != STK_INSYNC) return 0;
+	for (i = 0; i < answer_size; i++) {
+		if ((c = serial_read_byte(boot->fd, timeout_ms)) < 0) return 0;
+		answer[i] = c;
+	}
+	return serial_read_byte(boot->fd, timeout_ms) == STK_OK;
+}
+
+/* コマンドを送信し、応答を受信する */
+static int transaction(optiboot_t *boot, const unsigned char *command, int size,
+unsigned char *answer, int answer_size) {
+	if (!serial_write_all(boot->fd, command, size)) return 0;
+	return receive_answer(boot, answer, answer_size, READ_TIMEOUT_MS);
+}
+
+/* STK_LOAD_ADDRESSのコマンドをbufferに格納する */
+static int put_load_address(unsigned char *buffer, unsigned int word_addr) {
+	buffer[0] = STK_LOAD_ADDRESS;
+	buffer[1] = word_addr & 0xff;
+	buffer[2] = (word_addr >> 8) & 0xff;
+	buffer[3] = STK_CRC_EOP;
+	return 4;
+}
+
+/* ブートローダと同期を取る */
+static int get_sync(optiboot_t *boot) {
+	static const unsigned char command[2] = {STK_GET_SYNC, STK_CRC_EOP};
+	int i;
+	for (i = 0; i < SYNC_RETRY; i++) {
+		serial_flush_input(boot->fd);
+		if (!serial_write_all(boot->fd, command, 2)) return 0;
+		if (receive_answer(boot, NULL, 0, SYNC_TIMEOUT_MS)) return 1;
+	}
+	return 0;
+}
+
+/* Optibootを用いた通信を終了する。
+ * ブートローダにアプリケーションを起動させる。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int optiboot_disconnect(void *hardware_data) {
+	static const unsigned char command[2] = {STK_LEAVE_PROGMODE, STK_CRC_EOP};
+	optiboot_t *boot;
+	int fd;
+	if (hardware_data == NULL) return 0;
+	boot = (optiboot_t*)hardware_data;
+	transaction(boot, command, 2, NULL, 0);
+	fd = boot->fd;
+	free(boot);
+	return close(fd) == 0;
+}
+
+/* ブートローダにアプリケーションを起動させる。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int optiboot_release(void *hardware_data) {
+	static const unsigned char command[2] = {STK_LEAVE_PROGMODE, STK_CRC_EOP};
+	if (hardware_data == NULL) return 0;
+	return transaction((optiboot_t*)hardware_data, command, 2, NULL, 0);
+}
+
+/* DTR/RTSでターゲットをリセットし、ブートローダと同期を取る。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int optiboot_reset(void *hardware_data) {
+	optiboot_t *boot;
+	if (hardware_data == NULL) return 0;
+	boot = (optiboot_t*)hardware_data;
+	serial_set_dtr_rts(boot->fd, 0);
+	wait_ms(50);
+	serial_set_dtr_rts(boot->fd, 1);
+	wait_ms(50);
+	return get_sync(boot);
+}
+
+/* ブートローダは1オクテット単位のシリアルプログラミングには対応しない */
+static int optiboot_io_8bits(void *hardware_data, int out) {
+	(void)hardware_data;
+	(void)out;
+	return -1;
+}
+
+/* シリアルプログラミングのコマンドをブートローダのコマンドに置き換えて実行する。
+ * Programming EnableとRead Signature Byteはブートローダ側で処理し、
+ * それ以外はSTK_UNIVERSALで送る(Optibootは0を返す)。
+ */
+static int optiboot_command(void *hardware_data, const int *out, int *in) {
+	optiboot_t *boot;
+	unsigned char command[6];
+	unsigned char answer[3];
+	int i;
+	if (hardware_data == NULL) return 0;
+	boot = (optiboot_t*)hardware_data;
+	in[0] = 0;
+	in[1] = out[0];
+	in[2] = out[1];
+	in[3] = out[2];
+	if (out[0] == 0xAC && out[1] == 0x53) return 1;
+	if (out[0] == 0x30) {
+		if (boot->signature[0] < 0) {
+			command[0] = STK_READ_SIGN;
+			command[1] = STK_CRC_EOP;
+			if (!transaction(boot, command, 2, answer, 3)) return 0;
+			for (i = 0; i < 3; i++) boot->signature[i] = answer[i];
+		}
+		in[3] = (out[2] & 3) < 3 ? boot->signature[out[2] & 3] : 0xff;
+		return 1;
+	}
+	command[0] = STK_UNIVERSAL;
+	for (i = 0; i < 4; i++) command[1 + i] = out[i] & 0xff;
+	command[5] = STK_CRC_EOP;
+	if (!transaction(boot, command, 6, answer, 1)) return 0;
+	in[3] = answer[0];
+	return 1;
+}
+
+/* 1ページ以内を読み込む。アドレスの設定と読み込みは続けて送信する。 */
+static int read_chunk(optiboot_t *boot, unsigned int word_addr, unsigned char *bytes, int size) {
+	unsigned char command[9];
+	unsigned char dummy[1];
+	int len = put_load_address(command, word_addr);
+	command[len++] = STK_READ_PAGE;
+	command[len++] = (size >> 8) & 0xff;
+	command[len++] = size & 0xff;
+	command[len++] = 'F';
+	command[len++] = STK_CRC_EOP;
+	if (!serial_write_all(boot->fd, command, len)) return 0;
+	return receive_answer(boot, dummy, 0, READ_TIMEOUT_MS) &&
+		receive_answer(boot, bytes, size, READ_TIMEOUT_MS);
+}
+
+static int optiboot_read_program(void *hardware_data, unsigned int *data_out,
+unsigned int start_addr, unsigned int data_size) {
+	unsigned char bytes[OPTIBOOT_MAX_PAGE_BYTES];
+	unsigned int done = 0;
+	unsigned int i;
+	if (hardware_data == NULL) return 0;
+	while (done < data_size) {
+		unsigned int words = data_size - done;
+		if (words > OPTIBOOT_MAX_PAGE_BYTES / 2) words = OPTIBOOT_MAX_PAGE_BYTES / 2;
+		if (!read_chunk((optiboot_t*)hardware_data, start_addr + done, bytes, words * 2)) return 0;
+		for (i = 0; i < words; i++) {
+			data_out[done + i] = bytes[i * 2] | ((unsigned int)bytes[i * 2 + 1] << 8);
+		}
+		done += words;
+	}
+	return 1;
+}
+
+/* Optibootはページを消去してから書き込むので、ページ全体を送る必要がある。
+ * データがページの途中で始まるか終わる場合は、残りを読み込んで補う。
+ * アドレスの設定とページのデータは1回で送信し、応答をまとめて受信する。
+ */
+static int optiboot_write_program(void *hardware_data, int fixed_wait, const unsigned int *data,
+unsigned int start_addr, unsigned int data_size, unsigned int page_size) {
+	unsigned char command[4 + 5 + OPTIBOOT_MAX_PAGE_BYTES];
+	unsigned int page_words[OPTIBOOT_MAX_PAGE_BYTES / 2];
+	optiboot_t *boot;
+	unsigned int done = 0;
+	unsigned int i;
+	(void)fixed_wait;
+	if (hardware_data == NULL || page_size == 0 || page_size * 2 > OPTIBOOT_MAX_PAGE_BYTES) return 0;
+	boot = (optiboot_t*)hardware_data;
+	while (done < data_size) {
+		unsigned int page_addr = (start_addr + done) - (start_addr + done) % page_size;
+		unsigned int offset = (start_addr + done) - page_addr;
+		unsigned int words = page_size - offset;
+		int size = page_size * 2;
+		int len;
+		if (words > data_size - done) words = data_size - done;
+		if (words != page_size) {
+			if (!optiboot_read_program(hardware_data, page_words, page_addr, page_size)) return 0;
+		}
+		for (i = 0; i < words; i++) page_words[offset + i] = data[done + i];
+		len = put_load_address(command, page_addr);
+		command[len++] = STK_PROG_PAGE;
+		command[len++] = (size >> 8) & 0xff;
+		command[len++] = size & 0xff;
+		command[len++] = 'F';
+		for (i = 0; i < page_size; i++) {
+			command[len++] = page_words[i] & 0xff;
+			command[len++] = (page_words[i] >> 8) & 0xff;
+		}
+		command[len++] = STK_CRC_EOP;
+		if (!serial_write_all(boot->fd, command, len)) return 0;
+		if (!receive_answer(boot, NULL, 0, READ_TIMEOUT_MS) ||
+		!receive_answer(boot, NULL, 0, READ_TIMEOUT_MS)) return 0;
+		done += words;
+	}
+	return 1;
+}
+
+/* Chip EraseとEEPROMの操作はブートローダではできないので、失敗として扱う */
+static int optiboot_chip_erase(void *hardware_data, int fixed_wait) {
+	(void)hardware_data;
+	(void)fixed_wait;
+	return 0;
+}
+
+static int optiboot_read_eeprom(void *hardware_data, int *data_out,
+unsigned int start_addr, unsigned int data_size) {
+	(void)hardware_data;
+	(void)data_out;
+	(void)start_addr;
+	(void)data_size;
+	return 0;
+}
+
+static int optiboot_write_eeprom(void *hardware_data, int fixed_wait, const int *data,
+unsigned int start_addr, unsigned int data_size) {
+	(void)hardware_data;
+	(void)fixed_wait;
+	(void)data;
+	(void)start_addr;
+	(void)data_size;
+	return 0;
+}
+
+atmegaio_t *optiboot_init(const char *port, long baud) {
+	atmegaio_t *atmegaio;
+	optiboot_t *boot;
+	int fd;
+	fd = serial_open(port, baud > 0 ? baud : 115200);
+	if (fd < 0) return NULL;
+	/* 情報を格納する */
+	atmegaio = calloc(1, sizeof(atmegaio_t));
+	boot = malloc(sizeof(optiboot_t));
+	if (atmegaio == NULL || boot == NULL) {
+		free(atmegaio);
+		free(boot);
+		close(fd);
+		return NULL;
+	}
+	boot->fd = fd;
+	boot->signature[0] = boot->signature[1] = boot->signature[2] = -1;
+	/* ブートローダが応答するかを確認する */
+	if (!optiboot_reset(boot)) {
+		free(atmegaio);
+		free(boot);
+		close(fd);
+		return NULL;
+	}
+	atmegaio->hardware_data = (void*)boot;
+	atmegaio->disconnect = optiboot_disconnect;
+	atmegaio->reset = optiboot_reset;
+	atmegaio->io_8bits = optiboot_io_8bits;
+	atmegaio->command = optiboot_command;
+	atmegaio->read_program = optiboot_read_program;
+	atmegaio->write_program = optiboot_write_program;
+	atmegaio->read_eeprom = optiboot_read_eeprom;
+	atmegaio->write_eeprom = optiboot_write_eeprom;
+	atmegaio->chip_erase = optiboot_chip_erase;
+	atmegaio->release = optiboot_release;
+	return atmegaio;
+}
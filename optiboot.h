@@ -0,0 +1,34 @@
+#ifndef OPTIBOOT_H_GUARD_2D9F4A63_7C1E_4B58_9E07_C5A3816BD2F4
+#define OPTIBOOT_H_GUARD_2D9F4A63_7C1E_4B58_9E07_C5A3816BD2F4
+
+#include "atmega_io.h"
+
+/* STK500v1プロトコルのうちOptibootが実装している部分の定数 */
+#define STK_OK 0x10
+#define STK_INSYNC 0x14
+#define STK_CRC_EOP 0x20
+#define STK_GET_SYNC 0x30
+#define STK_GET_PARAMETER 0x41
+#define STK_SET_DEVICE 0x42
+#define STK_SET_DEVICE_EXT 0x45
+#define STK_ENTER_PROGMODE 0x50
+#define STK_LEAVE_PROGMODE 0x51
+#define STK_LOAD_ADDRESS 0x55
+#define STK_UNIVERSAL 0x56
+#define STK_PROG_PAGE 0x64
+#define STK_READ_PAGE 0x74
+#define STK_READ_SIGN 0x75
+
+/* Optibootが1回に読み書きできる最大オクテット数 */
+#define OPTIBOOT_MAX_PAGE_BYTES 256
+
+/* シリアルポートに接続した、Optibootが書き込まれたATmegaとの通信を初期化する。
+ * ISPの配線は不要で、DTR/RTSでリセットしてブートローダを起動する。
+ * プログラムデータの読み書きと識別子の読み込みのみ行え、
+ * Chip Erase、EEPROM、Fuse bits、Lock bitsの操作はできない。
+ * baudが0以下の場合は115200bpsを使う。
+ * 成功と判定したら通信用データのポインタ、失敗を検出したらNULLを返す。
+ */
+atmegaio_t *optiboot_init(const char *port, long baud);
+
+#endif
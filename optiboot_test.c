@@ -0,0 +1,165 @@
+/* 擬似端末の向こう側でOptibootをエミュレートし、optiboot.cを試験する。
+ * ブートローダが書き換えるメモリにはATmegaのシミュレータのものを使う。
+ */
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include "optiboot.h"
+#include "atmega_io.h"
+#include "atmega_sim.h"
+
+static atmega_sim_t sim;
+static volatile int stop_flag = 0;
+static int master_fd;
+/* 統計とプロトコル違反の検出 */
+static unsigned long command_count = 0, page_write_count = 0, received_bytes = 0;
+static int protocol_error = 0;
+static int left_bootloader = 0;
+
+static int getch(void) {
+	unsigned char c;
+	while (!stop_flag) {
+		struct pollfd pfd;
+		pfd.fd = master_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 50) <= 0) continue;
+		if (read(master_fd, &c, 1) == 1) {
+			received_bytes++;
+			return c;
+		}
+	}
+	return -1;
+}
+
+static void putch(int c) {
+	unsigned char b = c;
+	if (write(master_fd, &b, 1) != 1) perror("emulator write");
+}
+
+/* Optibootと同様に、CRC_EOPを確認してSTK_INSYNCを返す */
+static void verify_space(void) {
+	if (getch() != STK_CRC_EOP) protocol_error = 1;
+	putch(STK_INSYNC);
+}
+
+static void skip(int n) {
+	while (n-- > 0) getch();
+	verify_space();
+}
+
+/* Optibootのメインループ */
+static void *bootloader_thread(void *arg) {
+	unsigned int address = 0;
+	(void)arg;
+	while (!stop_flag) {
+		int c = getch();
+		int i;
+		if (c < 0) break;
+		command_count++;
+		if (c == STK_GET_PARAMETER) {
+			getch();
+			verify_space();
+			putch(0x03);
+		} else if (c == STK_SET_DEVICE) {
+			skip(20);
+		} else if (c == STK_SET_DEVICE_EXT) {
+			skip(5);
+		} else if (c == STK_LOAD_ADDRESS) {
+			address = getch();
+			address |= getch() << 8;
+			verify_space();
+		} else if (c == STK_UNIVERSAL) {
+			skip(4);
+			putch(0x00);
+		} else if (c == STK_PROG_PAGE) {
+			unsigned char buffer[OPTIBOOT_MAX_PAGE_BYTES];
+			int size = getch() << 8;
+			size |= getch();
+			if (getch() != 'F' || size != ATMEGA_SIM_PAGE_WORDS * 2 ||
+			(address & (ATMEGA_SIM_PAGE_WORDS - 1)) != 0) protocol_error = 1;
+			for (i = 0; i < size; i++) buffer[i] = getch();
+			verify_space();
+			/* ページを消去してから書き込む */
+			for (i = 0; i < ATMEGA_SIM_PAGE_WORDS && i * 2 + 1 < size; i++) {
+				sim.flash[(address + i) & (ATMEGA_SIM_FLASH_WORDS - 1)] =
+					buffer[i * 2] | (buffer[i * 2 + 1] << 8);
+			}
+			page_write_count++;
+		} else if (c == STK_READ_PAGE) {
+			int size = getch() << 8;
+			size |= getch();
+			if (getch() != 'F') protocol_error = 1;
+			verify_space();
+			for (i = 0; i < size; i++) {
+				unsigned int word = sim.flash[(address + i / 2) & (ATMEGA_SIM_FLASH_WORDS - 1)];
+				putch(i & 1 ? word >> 8 : word & 0xff);
+			}
+		} else if (c == STK_READ_SIGN) {
+			verify_space();
+			for (i = 0; i < 3; i++) putch(sim.signature[i]);
+		} else if (c == STK_LEAVE_PROGMODE) {
+			verify_space();
+			left_bootloader = 1;
+		} else {
+			/* STK_GET_SYNCなど */
+			verify_space();
+		}
+		putch(STK_OK);
+	}
+	return NULL;
+}
+
+static int check(int cond, const char *what) {
+	printf("%s: %s\n", cond ? "ok  " : "FAIL", what);
+	return cond;
+}
+
+int main(void) {
+	static unsigned int words[200], readback[200];
+	pthread_t thread;
+	atmegaio_t *atmegaio;
+	int signature[3];
+	int eeprom[4];
+	int ok = 1;
+	int i;
+	master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master_fd < 0 || grantpt(master_fd) != 0 || unlockpt(master_fd) != 0) {
+		perror("pty");
+		return 77;
+	}
+	atmega_sim_init(&sim);
+	/* 書き込むページの外側にある既存のデータ */
+	sim.flash[0x40 + 210] = 0x1234;
+	sim.flash[0x3F] = 0x5678;
+	pthread_create(&thread, NULL, bootloader_thread, NULL);
+	atmegaio = optiboot_init(ptsname(master_fd), 115200);
+	if (!check(atmegaio != NULL, "optiboot_init")) {
+		ok = 0;
+	} else {
+		for (i = 0; i < 200; i++) words[i] = (i * 0x0301 + 0x1C0E) & 0xffff;
+		ok &= check(reset(atmegaio) == ATMEGAIO_SUCCESS, "reset");
+		ok &= check(read_signature_byte(atmegaio, signature) == ATMEGAIO_SUCCESS &&
+			signature[0] == 0x1E && signature[1] == 0x95 && signature[2] == 0x0F, "signature");
+		/* 3ページと途中まで(最後のページは残りを読み込んで補う) */
+		ok &= check(write_program(atmegaio, 0, words, 0x40, 200, 64) == ATMEGAIO_SUCCESS, "program write");
+		ok &= check(read_program(atmegaio, readback, 0x40, 200) == ATMEGAIO_SUCCESS &&
+			memcmp(words, readback, sizeof(words)) == 0, "program read");
+		ok &= check(sim.flash[0x3F] == 0x5678 && sim.flash[0x40 + 200] == 0xffff &&
+			sim.flash[0x40 + 210] == 0x1234 && page_write_count == 4, "page merge");
+		ok &= check(chip_erase(atmegaio, 0) == ATMEGAIO_CONTROLLER_ERROR &&
+			read_eeprom(atmegaio, eeprom, 0, 4) == ATMEGAIO_CONTROLLER_ERROR, "unsupported operations");
+		printf("commands: %lu, bytes to bootloader: %lu\n", command_count, received_bytes);
+		ok &= check(disconnect(atmegaio) == ATMEGAIO_SUCCESS && left_bootloader, "disconnect");
+	}
+	stop_flag = 1;
+	pthread_join(thread, NULL);
+	close(master_fd);
+	ok &= check(!protocol_error, "protocol");
+	puts(ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
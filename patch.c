@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "patch.h"
+
+/* 値のファイルを読み込む */
+static int load_values(patch_t *patch, const char *path) {
+	char line[128];
+	int capacity = 0;
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) return PATCH_IO_ERROR;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		unsigned long value;
+		if (sscanf(line, "%lx", &value) != 1) continue;
+		if (patch->value_num >= capacity) {
+			unsigned long *next;
+			capacity = capacity > 0 ? capacity * 2 : 64;
+			next = realloc(patch->values, sizeof(*next) * capacity);
+			if (next == NULL) {
+				fclose(fp);
+				return PATCH_IO_ERROR;
+			}
+			patch->values = next;
+		}
+		patch->values[patch->value_num++] = value;
+	}
+	fclose(fp);
+	return PATCH_SUCCESS;
+}
+
+int patch_parse(patch_t *patch, const char *spec) {
+	char space[16], format[16];
+	const char *source;
+	int consumed = 0;
+	if (patch == NULL || spec == NULL) return PATCH_INVALID_PARAMETER;
+	memset(patch, 0, sizeof(*patch));
+	if (sscanf(spec, "%15[^:]:%x:%d:%15[^:]:%n", space, &patch->address, &patch->width,
+	format, &consumed) != 4 || consumed == 0) {
+		return PATCH_SYNTAX_ERROR;
+	}
+	source = spec + consumed;
+	if (strcmp(space, "flash") == 0) {
+		patch->space = PATCH_FLASH;
+	} else if (strcmp(space, "eeprom") == 0) {
+		patch->space = PATCH_EEPROM;
+	} else {
+		return PATCH_SYNTAX_ERROR;
+	}
+	if (strcmp(format, "le") == 0) {
+		patch->format = PATCH_FORMAT_LE;
+	} else if (strcmp(format, "be") == 0) {
+		patch->format = PATCH_FORMAT_BE;
+	} else if (strcmp(format, "ascii") == 0) {
+		patch->format = PATCH_FORMAT_ASCII;
+	} else {
+		return PATCH_SYNTAX_ERROR;
+	}
+	/* 2進数は unsigned long に収まる4オクテットまで */
+	if (patch->width <= 0 || patch->width > PATCH_MAX_WIDTH ||
+	(patch->format != PATCH_FORMAT_ASCII && patch->width > 4)) {
+		return PATCH_SYNTAX_ERROR;
+	}
+	if (strcmp(source, "serial") == 0) {
+		patch->source = PATCH_SOURCE_SERIAL;
+	} else if (strncmp(source, "value=", 6) == 0) {
+		char *end;
+		patch->source = PATCH_SOURCE_VALUE;
+		patch->value = strtoul(source + 6, &end, 16);
+		if (end == source + 6 || *end != '\0') return PATCH_SYNTAX_ERROR;
+	} else if (strncmp(source, "file=", 5) == 0) {
+		int ret;
+		patch->source = PATCH_SOURCE_FILE;
+		if ((ret = load_values(patch, source + 5)) != PATCH_SUCCESS) {
+			patch_free(patch);
+			return ret;
+		}
+	} else {
+		return PATCH_SYNTAX_ERROR;
+	}
+	return PATCH_SUCCESS;
+}
+
+void patch_free(patch_t *patch) {
+	if (patch == NULL) return;
+	free(patch->values);
+	patch->values = NULL;
+	patch->value_num = 0;
+}
+
+int patch_bytes(const patch_t *patch, int board, unsigned long serial, unsigned char *bytes) {
+	unsigned long value;
+	int i;
+	if (patch == NULL || bytes == NULL || board < 0) return PATCH_INVALID_PARAMETER;
+	switch (patch->source) {
+	case PATCH_SOURCE_SERIAL:
+		value = serial;
+		break;
+	case PATCH_SOURCE_VALUE:
+		value = patch->value;
+		break;
+	default:
+		if (board >= patch->value_num) return PATCH_NO_VALUE;
+		value = patch->values[board];
+		break;
+	}
+	if (patch->format == PATCH_FORMAT_ASCII) {
+		/* 下の桁から埋める */
+		for (i = patch->width - 1; i >= 0; i--) {
+			bytes[i] = '0' + (int)(value % 10);
+			value /= 10;
+		}
+	} else {
+		for (i = 0; i < patch->width; i++) {
+			int pos = patch->format == PATCH_FORMAT_LE ? i : patch->width - 1 - i;
+			bytes[pos] = value & 0xff;
+			value >>= 8;
+		}
+	}
+	return value == 0 ? PATCH_SUCCESS : PATCH_VALUE_OVERFLOW;
+}
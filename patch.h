@@ -0,0 +1,71 @@
+#ifndef PATCH_H_GUARD_71C5E8A2_3B0D_4F96_A4E7_D29B6083C15F
+#define PATCH_H_GUARD_71C5E8A2_3B0D_4F96_A4E7_D29B6083C15F
+
+enum {
+	PATCH_SUCCESS = 0, /* 成功 */
+	PATCH_INVALID_PARAMETER, /* 引数が不正 */
+	PATCH_SYNTAX_ERROR, /* 指定の書式が不正 */
+	PATCH_IO_ERROR, /* 値のファイルの読み込みエラー */
+	PATCH_NO_VALUE, /* 値のファイルに対応する行が無い */
+	PATCH_VALUE_OVERFLOW /* 値が幅に収まらない */
+};
+
+/* 書き込む先 */
+enum {
+	PATCH_FLASH = 0,
+	PATCH_EEPROM
+};
+
+/* 値の書式 */
+enum {
+	PATCH_FORMAT_LE = 0, /* リトルエンディアンの2進数 */
+	PATCH_FORMAT_BE, /* ビッグエンディアンの2進数 */
+	PATCH_FORMAT_ASCII /* 0で埋めた10進数の文字列 */
+};
+
+/* 値の取得元 */
+enum {
+	PATCH_SOURCE_SERIAL = 0, /* ボードごとの通し番号 */
+	PATCH_SOURCE_VALUE, /* 固定値 */
+	PATCH_SOURCE_FILE /* ファイルのボードごとの行 */
+};
+
+/* 1個のボードに書き込めるパッチの最大幅(オクテット) */
+#define PATCH_MAX_WIDTH 10
+
+/* ボードごとに書き換える領域 */
+typedef struct {
+	int space;
+	unsigned int address; /* バイトアドレス */
+	int width; /* オクテット数 */
+	int format;
+	int source;
+	unsigned long value; /* PATCH_SOURCE_VALUEの値 */
+	unsigned long *values; /* PATCH_SOURCE_FILEの値 */
+	int value_num;
+} patch_t;
+
+/**
+ * パッチの指定を読み込む。
+ * 書式は <flash|eeprom>:<address>:<width>:<le|be|ascii>:<serial|value=<hex>|file=<path>>
+ * (addressは16進数)で、file=の場合はファイルの各行の16進数を1行目から順にボードに割り当てる。
+ * @param patch 読み込んだ指定を格納する構造体
+ * @param spec 指定の文字列
+ * @return エラーコード
+ */
+int patch_parse(patch_t *patch, const char *spec);
+
+/* patch_parseで確保した領域を解放する */
+void patch_free(patch_t *patch);
+
+/**
+ * ボードに書き込むパッチのデータを求める。
+ * @param patch パッチ
+ * @param board 何番目のボードか(0から数える)
+ * @param serial ボードの通し番号
+ * @param bytes データを格納する配列(patch->widthオクテット)
+ * @return エラーコード
+ */
+int patch_bytes(const patch_t *patch, int board, unsigned long serial, unsigned char *bytes);
+
+#endif
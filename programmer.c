@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "programmer.h"
+#ifdef __linux__
+#include "usbio_linux.h"
+#include "gpio_linux.h"
+#include "stk500v2.h"
+#include "optiboot.h"
+#else
+#include "usbio_windows.h"
+#endif
+
+/* USB-IO2.0のポート(MISO, MOSI, SCK, RESET) */
+#define USBIO_PORTS 8, 7, 6, 5
+
+#ifdef __linux__
+/* gpio:<chip>:<miso>,<mosi>,<sck>,<reset>[,<half_period_ns>] を開く */
+static atmegaio_t *open_gpio(const char *arg) {
+	char chip[256];
+	const char *lines = strrchr(arg, ':');
+	int miso, mosi, sck, reset_line;
+	unsigned long half_period_ns = 5000;
+	int num;
+	if (lines == NULL || (size_t)(lines - arg) >= sizeof(chip)) return NULL;
+	memcpy(chip, arg, lines - arg);
+	chip[lines - arg] = '\0';
+	num = sscanf(lines + 1, "%d,%d,%d,%d,%lu", &miso, &mosi, &sck, &reset_line, &half_period_ns);
+	if (num < 4) return NULL;
+	return gpio_init(chip, miso, mosi, sck, reset_line, half_period_ns);
+}
+
+/* <port>[:<baud>] をポートと通信速度に分ける */
+static int parse_serial(const char *arg, char *port, size_t port_size, long *baud) {
+	const char *colon = strrchr(arg, ':');
+	size_t len = colon != NULL ? (size_t)(colon - arg) : strlen(arg);
+	if (len >= port_size) return 0;
+	memcpy(port, arg, len);
+	port[len] = '\0';
+	*baud = colon != NULL ? strtol(colon + 1, NULL, 10) : 0;
+	return 1;
+}
+
+/* stk500v2:<port>[:<baud>] を開く */
+static atmegaio_t *open_stk500v2(const char *arg) {
+	char port[256];
+	long baud;
+	if (!parse_serial(arg, port, sizeof(port), &baud)) return NULL;
+	return stk500v2_init(port, baud);
+}
+
+/* optiboot:<port>[:<baud>] を開く */
+static atmegaio_t *open_optiboot(const char *arg) {
+	char port[256];
+	long baud;
+	if (!parse_serial(arg, port, sizeof(port), &baud)) return NULL;
+	return optiboot_init(port, baud);
+}
+#endif
+
+atmegaio_t *programmer_open(const char *spec) {
+	if (spec == NULL || strcmp(spec, "usbio") == 0) {
+		return usbio_init(USBIO_PORTS);
+	} else if (strncmp(spec, "usbio:", 6) == 0) {
+		return usbio_init_path(spec + 6, USBIO_PORTS);
+#ifdef __linux__
+	} else if (strncmp(spec, "gpio:", 5) == 0) {
+		return open_gpio(spec + 5);
+	} else if (strncmp(spec, "stk500v2:", 9) == 0) {
+		return open_stk500v2(spec + 9);
+	} else if (strncmp(spec, "optiboot:", 9) == 0) {
+		return open_optiboot(spec + 9);
+#endif
+	}
+	return NULL;
+}
+
+void programmer_usage(FILE *fp) {
+	fputs("programmers:\n", fp);
+	fputs("usbio : USB-IO2.0 (default)\n", fp);
+	fputs("usbio:<device path> : USB-IO2.0 at the given path (skips device search)\n", fp);
+#ifdef __linux__
+	fputs("gpio:<chip>:<miso>,<mosi>,<sck>,<reset>[,<half period ns>] :\n", fp);
+	fputs("    GPIO character device lines (default half period: 5000ns)\n", fp);
+	fputs("stk500v2:<serial port>[:<baud>] : STK500v2 compatible ISP programmer (default: 115200bps)\n", fp);
+	fputs("optiboot:<serial port>[:<baud>] : Optiboot bootloader on the target (default: 115200bps)\n", fp);
+#endif
+}
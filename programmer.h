@@ -0,0 +1,18 @@
+#ifndef PROGRAMMER_H_GUARD_6A0E3B95_D147_4C82_B6F9_08C5E2D7A13B
+#define PROGRAMMER_H_GUARD_6A0E3B95_D147_4C82_B6F9_08C5E2D7A13B
+
+#include <stdio.h>
+#include "atmega_io.h"
+
+/**
+ * 指定した書き込み器を開く。
+ * specの書式はprogrammer_usageで表示される。NULLの場合はUSB-IO2.0を使う。
+ * @param spec 書き込み器の指定
+ * @return 成功と判定したら通信用データのポインタ、失敗を検出したらNULL
+ */
+atmegaio_t *programmer_open(const char *spec);
+
+/* 書き込み器の指定の書式を表示する */
+void programmer_usage(FILE *fp);
+
+#endif
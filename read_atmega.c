@@ -1,11 +1,169 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include "usbio_windows.h"
+#include <string.h>
+#include <signal.h>
 #include "atmega_io.h"
+#include "programmer.h"
 #include "progress_bar.h"
+#include "null_io.h"
+#include "session.h"
+#include "load_hex.h"
+
+/* 1回の読み込みで扱うワード数 */
+#define READ_PAGE_SIZE 64
+/* 比較で1回に読み込む量(プログラムはワード、EEPROMはオクテット単位) */
+#define COMPARE_CHUNK 256
+/* 比較用のHEXファイルを読み込むバッファのオクテット数 */
+#define COMPARE_PROGRAM_BYTES 0x10000
+#define COMPARE_EEPROM_BYTES 0x400
+/* 不一致の要約で表示する範囲の最大数 */
+#define COMPARE_MAX_RANGES 16
+/* 比較で不一致が見つかった場合の終了コード */
+#define EXIT_MISMATCH 2
+
+/* Ctrl+Cで中止を要求されたら真 */
+static volatile sig_atomic_t cancel_requested = 0;
+
+static void handle_interrupt(int sig) {
+	(void)sig;
+	cancel_requested = 1;
+}
+
+/* セッションの進捗をプログレスバーに表示する */
+static void show_progress(const session_progress_t *progress, void *user_data) {
+	update_progress((progress_t*)user_data, (int)progress->done);
+}
+
+/* 不一致の要約 */
+typedef struct {
+	unsigned long count;
+	/* 不一致が続く範囲(オクテット単位のアドレス)。COMPARE_MAX_RANGES個まで記録する */
+	int range_num;
+	unsigned int range_start[COMPARE_MAX_RANGES], range_end[COMPARE_MAX_RANGES];
+	unsigned int last_addr;
+} mismatch_summary_t;
+
+/* 不一致のオクテットを要約に加える */
+static void add_mismatch(mismatch_summary_t *summary, unsigned int addr) {
+	if (summary->count == 0 || addr != summary->last_addr + 1) {
+		if (summary->range_num < COMPARE_MAX_RANGES) summary->range_start[summary->range_num] = addr;
+		summary->range_num++;
+	}
+	if (summary->range_num <= COMPARE_MAX_RANGES) summary->range_end[summary->range_num - 1] = addr;
+	summary->last_addr = addr;
+	summary->count++;
+}
+
+/**
+ * 参照用のHEXファイルを読み込み、データのある範囲だけをターゲットから読み込んで比較する。
+ * @param atmegaio 書き込み器
+ * @param path 参照用のHEXファイル("-"なら標準入力)
+ * @param eeprom 真ならEEPROM、偽ならプログラムデータと比較する
+ * @param stop_at_first 真なら最初の不一致で止める
+ * @return 一致すれば0、不一致があればEXIT_MISMATCH、ファイルや通信のエラーなら1
+ */
+static int compare_image(const atmegaio_t *atmegaio, const char *path, int eeprom, int stop_at_first) {
+	static char image[COMPARE_PROGRAM_BYTES];
+	static unsigned char defined[COMPARE_PROGRAM_BYTES];
+	const char *name = eeprom ? "EEPROM" : "program";
+	/* 比較の単位(プログラムはワード、EEPROMはオクテット) */
+	const int unit_bytes = eeprom ? 1 : 2;
+	const int units = (eeprom ? COMPARE_EEPROM_BYTES : COMPARE_PROGRAM_BYTES) / unit_bytes;
+	mismatch_summary_t summary;
+	unsigned long checked = 0;
+	int total = 0, done = 0;
+	int first_expected = 0, first_read = 0;
+	int error_code = ATMEGAIO_SUCCESS;
+	progress_t prog;
+	FILE *fp;
+	int ret;
+	int i, j, k;
+	memset(image, 0xff, sizeof(image));
+	memset(defined, 0, sizeof(defined));
+	memset(&summary, 0, sizeof(summary));
+	fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "file \"%s\" open error\n", path);
+		return 1;
+	}
+	ret = load_hex_merge(image, defined, units * unit_bytes, 0, fp, NULL, NULL);
+	if (fp != stdin) fclose(fp);
+	if (ret != LOAD_HEX_SUCCESS) {
+		fprintf(stderr, "error %d on load_hex for \"%s\"\n", ret, path);
+		return 1;
+	}
+	/* データのある単位を数える */
+	for (i = 0; i < units; i++) {
+		if (defined[i * unit_bytes] || defined[i * unit_bytes + unit_bytes - 1]) total++;
+	}
+	fprintf(stderr, "comparing %s with \"%s\"...\n", name, path);
+	init_progress(&prog, total);
+	for (i = 0; i < units && !cancel_requested; i = j) {
+		unsigned int words[COMPARE_CHUNK];
+		int bytes[COMPARE_CHUNK];
+		if (!defined[i * unit_bytes] && !defined[i * unit_bytes + unit_bytes - 1]) {
+			j = i + 1;
+			continue;
+		}
+		/* データのある範囲をCOMPARE_CHUNKずつ読み込む */
+		for (j = i; j < units && j - i < COMPARE_CHUNK &&
+		(defined[j * unit_bytes] || defined[j * unit_bytes + unit_bytes - 1]); j++);
+		if (eeprom) {
+			error_code = read_eeprom(atmegaio, bytes, i, j - i);
+		} else {
+			error_code = read_program(atmegaio, words, i, j - i);
+		}
+		if (error_code != ATMEGAIO_SUCCESS) break;
+		for (k = i * unit_bytes; k < j * unit_bytes; k++) {
+			int value;
+			if (!defined[k]) continue;
+			if (eeprom) {
+				value = bytes[k - i];
+			} else {
+				value = (words[k / 2 - i] >> ((k & 1) ? 8 : 0)) & 0xff;
+			}
+			checked++;
+			if (value != (unsigned char)image[k]) {
+				if (summary.count == 0) {
+					first_expected = (unsigned char)image[k];
+					first_read = value;
+				}
+				add_mismatch(&summary, k);
+				if (stop_at_first) break;
+			}
+		}
+		done += j - i;
+		update_progress(&prog, done);
+		if (stop_at_first && summary.count > 0) break;
+	}
+	fputc('\n', stderr);
+	if (error_code != ATMEGAIO_SUCCESS) {
+		fprintf(stderr, "error %d on reading %s\n", error_code, name);
+		return 1;
+	}
+	if (stop_at_first && summary.count > 0) {
+		printf("%s: mismatch at byte address %04X (expected %02X, read %02X)\n",
+			name, summary.range_start[0], first_expected, first_read);
+		return EXIT_MISMATCH;
+	}
+	if (cancel_requested) {
+		fprintf(stderr, "cancelled after %lu byte(s)\n", checked);
+		return 1;
+	}
+	printf("%s: %lu byte(s) checked, %lu mismatch(es)", name, checked, summary.count);
+	if (summary.count == 0) {
+		putchar('\n');
+		return 0;
+	}
+	printf(" in %d range(s)\n", summary.range_num);
+	for (i = 0; i < summary.range_num && i < COMPARE_MAX_RANGES; i++) {
+		printf("  %04X-%04X\n", summary.range_start[i], summary.range_end[i]);
+	}
+	if (summary.range_num > COMPARE_MAX_RANGES) puts("  ...");
+	return EXIT_MISMATCH;
+}
 
 int main(int argc, char *argv[]) {
-	int buffer_size = 4;
 	unsigned int *data;
 	int start_addr;
 	int read_size;
@@ -13,23 +171,83 @@ int main(int argc, char *argv[]) {
 	int signature[4];
 	int lock, fuse, fuse_high, extended_fuse, calibration;
 	int error_code;
-	if (argc != 4 || sscanf(argv[1], "%d", &start_addr) != 1 ||
-	sscanf(argv[2], "%d", &read_size) != 1) {
-		fprintf(stderr, "Usage: %s start_addr read_size out_file\n\n",
-			argc > 0 ? argv[0] : "read_atmega");
+	unsigned long sck_frequency;
+	const char *programmer = NULL;
+	int arg_start = 1;
+	int dry_run = 0;
+	unsigned long report_us = NULL_IO_DEFAULT_REPORT_US;
+	const char *compare_file = NULL;
+	const char *compare_eeprom_file = NULL;
+	int all_mismatches = 0;
+	int compare_mode;
+	int exit_code = 0;
+	while (arg_start < argc) {
+		if (argc - arg_start >= 2 &&
+		(strcmp(argv[arg_start], "--programmer") == 0 || strcmp(argv[arg_start], "-P") == 0)) {
+			programmer = argv[arg_start + 1];
+			arg_start += 2;
+		} else if (argc - arg_start >= 2 && strcmp(argv[arg_start], "--report-latency") == 0) {
+			report_us = strtoul(argv[arg_start + 1], NULL, 10);
+			arg_start += 2;
+		} else if (argc - arg_start >= 2 && strcmp(argv[arg_start], "--compare") == 0) {
+			compare_file = argv[arg_start + 1];
+			arg_start += 2;
+		} else if (argc - arg_start >= 2 && strcmp(argv[arg_start], "--compare-eeprom") == 0) {
+			compare_eeprom_file = argv[arg_start + 1];
+			arg_start += 2;
+		} else if (strcmp(argv[arg_start], "--all-mismatches") == 0) {
+			all_mismatches = 1;
+			arg_start++;
+		} else if (strcmp(argv[arg_start], "--dry-run") == 0 || strcmp(argv[arg_start], "-n") == 0) {
+			dry_run = 1;
+			arg_start++;
+		} else {
+			break;
+		}
+	}
+	compare_mode = compare_file != NULL || compare_eeprom_file != NULL;
+	if (compare_mode ? argc != arg_start :
+	(argc - arg_start != 3 || sscanf(argv[arg_start], "%d", &start_addr) != 1 ||
+	sscanf(argv[arg_start + 1], "%d", &read_size) != 1 || start_addr < 0 || read_size < 0)) {
+		fprintf(stderr, "Usage: %s [--programmer <spec> / -P <spec>] [--dry-run / -n] [--report-latency <us>]\n"
+			"       start_addr read_size out_file\n"
+			"   or: %s [--programmer <spec> / -P <spec>] [--dry-run / -n] [--report-latency <us>]\n"
+			"       [--compare <hex>] [--compare-eeprom <hex>] [--all-mismatches]\n\n",
+			argc > 0 ? argv[0] : "read_atmega", argc > 0 ? argv[0] : "read_atmega");
+		fputs("--compare <hex> : read only the addresses the HEX file has data for and compare them\n", stderr);
+		fputs("    with the program memory; stops at the first mismatch and writes no file\n", stderr);
+		fputs("--compare-eeprom <hex> : the same for EEPROM\n", stderr);
+		fputs("--all-mismatches : compare everything and summarize the mismatches\n", stderr);
+		fprintf(stderr, "    exit status of the compare mode: 0 if equal, %d if not, 1 on errors\n", EXIT_MISMATCH);
+		fputs("--dry-run / -n : don't touch the hardware nor create out_file;\n", stderr);
+		fputs("    count the USB-IO2.0 traffic and estimate the time\n", stderr);
+		fprintf(stderr, "--report-latency <us> : time per USB report for --dry-run (default: %lu)\n\n",
+			NULL_IO_DEFAULT_REPORT_US);
 		fputs("serial out   (MOSI) : J1-7\n", stderr);
 		fputs("serial in    (MISO) : J2-0\n", stderr);
 		fputs("serial clock (SCK)  : J1-6\n", stderr);
 		fputs("reset               : J1-5\n", stderr);
+		fputc('\n', stderr);
+		programmer_usage(stderr);
 		return 1;
 	}
-	if ((atmegaio = usbio_init(8, 7, 6, 5)) == NULL) {
-		fputs("usbio_init error\n", stderr);
+	if (dry_run) {
+		atmegaio = null_io_init(report_us);
+	} else {
+		atmegaio = programmer_open(programmer);
+	}
+	if (atmegaio == NULL) {
+		fputs("programmer_open error\n", stderr);
 		return 1;
 	}
 	if ((error_code = reset(atmegaio)) != ATMEGAIO_SUCCESS) {
 		fprintf(stderr, "reset error %d\n", error_code);
 	}
+	if ((error_code = calibrate_sck(atmegaio, &sck_frequency)) != ATMEGAIO_SUCCESS) {
+		fprintf(stderr, "calibrate_sck error %d\n", error_code);
+	} else if (sck_frequency > 0) {
+		printf("SCK = %lu Hz\n", sck_frequency);
+	}
 	if ((error_code = read_signature_byte(atmegaio, signature)) == ATMEGAIO_SUCCESS) {
 		printf("signature = %02X %02X %02X\n",
 			signature[0], signature[1], signature[2]);
@@ -46,44 +264,68 @@ int main(int argc, char *argv[]) {
 	} else {
 		fprintf(stderr, "read_information error %d\n", error_code);
 	}
-	data = malloc(sizeof(unsigned int) * read_size);
-	if (data != NULL) {
-		FILE* fp;
+	if (compare_mode) {
+		/* 参照用のデータがある所だけを読み込んで比較する */
+		signal(SIGINT, handle_interrupt);
+		if (compare_file != NULL) exit_code = compare_image(atmegaio, compare_file, 0, !all_mismatches);
+		if (compare_eeprom_file != NULL && (exit_code == 0 || (exit_code == EXIT_MISMATCH && all_mismatches))) {
+			int ret = compare_image(atmegaio, compare_eeprom_file, 1, !all_mismatches);
+			if (ret == 1 || exit_code == 0) exit_code = ret;
+		}
+		signal(SIGINT, SIG_DFL);
+		if (exit_code != 1) puts(exit_code == 0 ? "compare: PASS" : "compare: FAIL");
+	} else if ((data = malloc(sizeof(unsigned int) * (read_size > 0 ? read_size : 1))) != NULL) {
+		session_job_t job;
+		session_progress_t result;
+		session_t *session;
 		progress_t prog;
-		int i;
-		fp = fopen(argv[3], "wb");
-		if (fp == NULL) {
-			fputs("fopen error\n", stderr);
+		memset(&job, 0, sizeof(job));
+		job.operation = SESSION_READ_PROGRAM;
+		job.start_addr = start_addr;
+		job.data_size = read_size;
+		job.page_size = READ_PAGE_SIZE;
+		job.program = data;
+		init_progress(&prog, read_size);
+		if ((session = session_start(atmegaio, &job, show_progress, &prog)) == NULL) {
+			fputs("session_start error\n", stderr);
 		} else {
-			int initial_read_size = read_size;
-			init_progress(&prog, initial_read_size);
-			while (read_size > 0) {
-				int current_read_size = read_size;
-				if (current_read_size > buffer_size) current_read_size = buffer_size;
-				if ((error_code = read_program(atmegaio, data, start_addr, current_read_size)) == ATMEGAIO_SUCCESS) {
-					for (i = 0; i < current_read_size; i++) {
+			signal(SIGINT, handle_interrupt);
+			while (session_step(session) == SESSION_RUNNING) {
+				if (cancel_requested) session_cancel(session);
+			}
+			signal(SIGINT, SIG_DFL);
+			fputc('\n', stderr);
+			session_get_progress(session, &result);
+			session_free(session);
+			if (result.state == SESSION_FAILED) {
+				fprintf(stderr, "read_program error %d\n", result.error);
+			} else if (result.state == SESSION_CANCELLED) {
+				fprintf(stderr, "cancelled after %u word(s)\n", result.done);
+			}
+			/* 読み込めた所までを保存する */
+			if (!dry_run) {
+				FILE *fp = fopen(argv[arg_start + 2], "wb");
+				if (fp == NULL) {
+					fputs("fopen error\n", stderr);
+				} else {
+					unsigned int i;
+					for (i = 0; i < result.done; i++) {
 						unsigned char write_data[2];
 						write_data[0] = data[i] & 0xff;
 						write_data[1] = (data[i] >> 8) & 0xff;
 						fwrite(write_data, sizeof(write_data[0]), 2, fp);
 					}
-				} else {
-					fprintf(stderr, "read_program error %d\n", error_code);
-					break;
+					fclose(fp);
 				}
-				read_size -= current_read_size;
-				start_addr += current_read_size;
-				update_progress(&prog, initial_read_size - read_size);
 			}
-			fputc('\n', stderr);
 		}
-		fclose(fp);
 		free(data);
 	} else {
 		fputs("malloc error\n", stderr);
 	}
+	if (dry_run) null_io_report(atmegaio, stdout);
 	if ((error_code = disconnect(atmegaio)) != ATMEGAIO_SUCCESS) {
 		fprintf(stderr, "disconnect error %d\n", error_code);
 	}
-	return 0;
+	return exit_code;
 }
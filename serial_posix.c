@@ -0,0 +1,85 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include "serial_posix.h"
+
+int serial_open(const char *port, long baud) {
+	static const struct {
+		long baud;
+		speed_t speed;
+	} speeds[] = {
+		{9600, B9600}, {19200, B19200}, {38400, B38400}, {57600, B57600},
+		{115200, B115200}, {230400, B230400}
+	};
+	struct termios tio;
+	speed_t speed = B115200;
+	size_t i;
+	int fd;
+	if (port == NULL) return -1;
+	fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0) return -1;
+	for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+		if (speeds[i].baud == baud) speed = speeds[i].speed;
+	}
+	if (tcgetattr(fd, &tio) != 0) {
+		close(fd);
+		return -1;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+		close(fd);
+		return -1;
+	}
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+int serial_write_all(int fd, const unsigned char *data, size_t size) {
+	while (size > 0) {
+		ssize_t ret = write(fd, data, size);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret < 0 && errno == EAGAIN) {
+			struct pollfd pfd;
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, 100);
+			continue;
+		}
+		if (ret <= 0) return 0;
+		data += ret;
+		size -= ret;
+	}
+	return 1;
+}
+
+int serial_read_byte(int fd, int timeout_ms) {
+	struct pollfd pfd;
+	unsigned char c;
+	for (;;) {
+		ssize_t ret;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout_ms) <= 0) return -1;
+		ret = read(fd, &c, 1);
+		if (ret == 1) return c;
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+		return -1;
+	}
+}
+
+void serial_flush_input(int fd) {
+	tcflush(fd, TCIFLUSH);
+}
+
+void serial_set_dtr_rts(int fd, int level) {
+	int bits = TIOCM_DTR | TIOCM_RTS;
+	ioctl(fd, level ? TIOCMBIS : TIOCMBIC, &bits);
+}
@@ -0,0 +1,27 @@
+#ifndef SERIAL_POSIX_H_GUARD_8E3B6D21_A94F_47C0_B5D8_16F2C7E03A94
+#define SERIAL_POSIX_H_GUARD_8E3B6D21_A94F_47C0_B5D8_16F2C7E03A94
+
+#include <stddef.h>
+
+/**
+ * シリアルポートを生の8N1モードで開く。
+ * 対応していない通信速度が指定された場合は115200bpsを使う。
+ * @param port デバイスのパス
+ * @param baud 通信速度(bps)
+ * @return 成功と判定したらファイルディスクリプタ、失敗を検出したら-1
+ */
+int serial_open(const char *port, long baud);
+
+/* 指定したサイズを全て送信する。成功と判定したら真、失敗を検出したら偽を返す。 */
+int serial_write_all(int fd, const unsigned char *data, size_t size);
+
+/* 1オクテット受信する。失敗またはtimeout_msミリ秒のタイムアウトなら-1を返す。 */
+int serial_read_byte(int fd, int timeout_ms);
+
+/* 受信済みで読んでいないデータを捨てる */
+void serial_flush_input(int fd);
+
+/* DTRとRTSを設定する。擬似端末のように制御線が無い場合は何もしない。 */
+void serial_set_dtr_rts(int fd, int level);
+
+#endif
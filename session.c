@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include "session.h"
+
+struct session {
+	const atmegaio_t *func;
+	session_job_t job;
+	session_callback_t callback;
+	void *user_data;
+	session_progress_t progress;
+	/* 現在の処理で次に扱う位置(start_addrからの距離) */
+	unsigned int offset;
+	int cancel_requested;
+	/* 照合で読み込む1ページ分の領域 */
+	unsigned int *program_buffer;
+	int *eeprom_buffer;
+};
+
+static int is_write(const session_job_t *job) {
+	return job->operation == SESSION_WRITE_PROGRAM || job->operation == SESSION_WRITE_EEPROM;
+}
+
+static int is_program(const session_job_t *job) {
+	return job->operation == SESSION_READ_PROGRAM || job->operation == SESSION_WRITE_PROGRAM;
+}
+
+static void notify(session_t *session) {
+	if (session->callback != NULL) (session->callback)(&session->progress, session->user_data);
+}
+
+/* セッションを終了状態にして通知する */
+static int finish(session_t *session, int state, int error) {
+	session->progress.state = state;
+	session->progress.error = error;
+	notify(session);
+	return state;
+}
+
+session_t *session_start(const atmegaio_t *func, const session_job_t *job,
+session_callback_t callback, void *user_data) {
+	session_t *session;
+	if (func == NULL || job == NULL || job->page_size == 0) return NULL;
+	if (job->operation < SESSION_READ_PROGRAM || job->operation > SESSION_WRITE_EEPROM) return NULL;
+	if (is_program(job) ? job->program == NULL : job->eeprom == NULL) return NULL;
+	if (job->operation == SESSION_WRITE_PROGRAM && job->start_addr % job->page_size != 0) return NULL;
+	session = calloc(1, sizeof(session_t));
+	if (session == NULL) return NULL;
+	session->func = func;
+	session->job = *job;
+	if (!is_write(job)) session->job.verify = SESSION_VERIFY_NONE;
+	session->callback = callback;
+	session->user_data = user_data;
+	session->progress.state = SESSION_RUNNING;
+	session->progress.phase = SESSION_PHASE_TRANSFER;
+	session->progress.total = job->data_size;
+	if (session->job.verify == SESSION_VERIFY_END) session->progress.total += job->data_size;
+	if (session->job.verify != SESSION_VERIFY_NONE) {
+		if (is_program(job)) {
+			session->program_buffer = malloc(sizeof(unsigned int) * job->page_size);
+		} else {
+			session->eeprom_buffer = malloc(sizeof(int) * job->page_size);
+		}
+		if (session->program_buffer == NULL && session->eeprom_buffer == NULL) {
+			free(session);
+			return NULL;
+		}
+	}
+	return session;
+}
+
+/* 書き込みを飛ばすページかを調べる */
+static int is_skipped(const session_t *session, unsigned int size) {
+	unsigned int i;
+	if (!session->job.skip_blank || session->job.operation != SESSION_WRITE_PROGRAM) return 0;
+	for (i = 0; i < size; i++) {
+		if (session->job.program[session->offset + i] != 0xffff) return 0;
+	}
+	return 1;
+}
+
+/* 現在の位置からsize個を読み込んで照合する */
+static int verify_chunk(session_t *session, unsigned int size) {
+	unsigned int addr = session->job.start_addr + session->offset;
+	unsigned int i;
+	int ret;
+	if (is_program(&session->job)) {
+		ret = read_program(session->func, session->program_buffer, addr, size);
+	} else {
+		ret = read_eeprom(session->func, session->eeprom_buffer, addr, size);
+	}
+	if (ret != ATMEGAIO_SUCCESS) return ret;
+	for (i = 0; i < size; i++) {
+		int match = is_program(&session->job) ?
+			session->program_buffer[i] == session->job.program[session->offset + i] :
+			session->eeprom_buffer[i] == session->job.eeprom[session->offset + i];
+		if (!match) {
+			session->progress.mismatch = 1;
+			session->progress.mismatch_addr = addr + i;
+			break;
+		}
+	}
+	return ATMEGAIO_SUCCESS;
+}
+
+/* 現在の位置からsize個を読み書きする */
+static int transfer_chunk(session_t *session, unsigned int size) {
+	const session_job_t *job = &session->job;
+	unsigned int addr = job->start_addr + session->offset;
+	int ret;
+	switch (job->operation) {
+	case SESSION_READ_PROGRAM:
+		return read_program(session->func, job->program + session->offset, addr, size);
+	case SESSION_READ_EEPROM:
+		return read_eeprom(session->func, job->eeprom + session->offset, addr, size);
+	case SESSION_WRITE_PROGRAM:
+		ret = write_program(session->func, job->fixed_wait, job->program + session->offset,
+			addr, size, job->page_size);
+		break;
+	default:
+		ret = write_eeprom(session->func, job->fixed_wait, job->eeprom + session->offset, addr, size);
+		break;
+	}
+	if (ret != ATMEGAIO_SUCCESS || job->verify != SESSION_VERIFY_PAGE) return ret;
+	return verify_chunk(session, size);
+}
+
+int session_step(session_t *session) {
+	unsigned int addr, size;
+	int ret;
+	if (session == NULL) return SESSION_FAILED;
+	if (session->progress.state != SESSION_RUNNING) return session->progress.state;
+	if (session->cancel_requested) return finish(session, SESSION_CANCELLED, ATMEGAIO_SUCCESS);
+	if (session->offset >= session->job.data_size) return finish(session, SESSION_DONE, ATMEGAIO_SUCCESS);
+	/* ページの境界で区切る */
+	addr = session->job.start_addr + session->offset;
+	size = session->job.page_size - addr % session->job.page_size;
+	if (size > session->job.data_size - session->offset) size = session->job.data_size - session->offset;
+	if (is_skipped(session, size)) {
+		ret = ATMEGAIO_SUCCESS;
+	} else if (session->progress.phase == SESSION_PHASE_VERIFY) {
+		ret = verify_chunk(session, size);
+	} else {
+		ret = transfer_chunk(session, size);
+	}
+	if (ret != ATMEGAIO_SUCCESS) return finish(session, SESSION_FAILED, ret);
+	if (session->progress.mismatch) return finish(session, SESSION_FAILED, ATMEGAIO_SUCCESS);
+	session->offset += size;
+	session->progress.done += size;
+	if (session->offset >= session->job.data_size) {
+		if (session->progress.phase == SESSION_PHASE_TRANSFER && session->job.verify == SESSION_VERIFY_END) {
+			session->progress.phase = SESSION_PHASE_VERIFY;
+			session->offset = 0;
+		} else {
+			return finish(session, SESSION_DONE, ATMEGAIO_SUCCESS);
+		}
+	}
+	notify(session);
+	return SESSION_RUNNING;
+}
+
+void session_cancel(session_t *session) {
+	if (session != NULL) session->cancel_requested = 1;
+}
+
+int session_get_progress(const session_t *session, session_progress_t *progress) {
+	if (session == NULL) return SESSION_FAILED;
+	if (progress != NULL) *progress = session->progress;
+	return session->progress.state;
+}
+
+void session_free(session_t *session) {
+	if (session == NULL) return;
+	free(session->program_buffer);
+	free(session->eeprom_buffer);
+	free(session);
+}
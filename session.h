@@ -0,0 +1,129 @@
+#ifndef SESSION_H_GUARD_3D8F2A61_C94E_4B07_A5D3_E17B60F49C82
+#define SESSION_H_GUARD_3D8F2A61_C94E_4B07_A5D3_E17B60F49C82
+
+#include "atmega_io.h"
+
+/*
+ * ページ単位で少しずつ進めるジョブ(セッション)。
+ * session_startでジョブを登録し、session_stepを呼ぶたびに1ページ分だけ通信する。
+ * 1回のsession_stepはすぐに戻るので、GUIやデーモンのイベントループから
+ * 複数のセッションを交互に進めることができる。
+ * 進捗はsession_stepのたびにコールバックで通知され、session_get_progressでも取得できる。
+ * session_cancelで中止すると、処理中のページを終えた所で止まる。
+ */
+
+/* ジョブの種類 */
+enum {
+	SESSION_READ_PROGRAM = 0,
+	SESSION_WRITE_PROGRAM,
+	SESSION_READ_EEPROM,
+	SESSION_WRITE_EEPROM
+};
+
+/* 書き込みの照合方法 */
+enum {
+	/* 照合しない */
+	SESSION_VERIFY_NONE = 0,
+	/* 各ページを書き込んだ直後に読み込んで照合する */
+	SESSION_VERIFY_PAGE,
+	/* 全て書き込んでから、改めて全体を照合する */
+	SESSION_VERIFY_END
+};
+
+/* セッションの状態 */
+enum {
+	SESSION_RUNNING = 0,
+	SESSION_DONE,
+	SESSION_FAILED,
+	SESSION_CANCELLED
+};
+
+/* 進行中の処理 */
+enum {
+	SESSION_PHASE_TRANSFER = 0,
+	SESSION_PHASE_VERIFY
+};
+
+/* ジョブの内容 */
+typedef struct {
+	/* ジョブの種類 */
+	int operation;
+	/* 対象の領域(プログラムはワード、EEPROMはオクテット単位) */
+	unsigned int start_addr;
+	unsigned int data_size;
+	/* 1回のsession_stepで扱う量。プログラムの書き込みではページサイズにし、start_addrはその倍数にする */
+	unsigned int page_size;
+	/* 読み込むデータを格納する配列、または書き込むデータ(data_size要素)。
+	 * プログラムはprogram、EEPROMはeepromを使う。セッションが終わるまで有効でなければならない。
+	 */
+	unsigned int *program;
+	int *eeprom;
+	/* 書き込みの照合方法 */
+	int verify;
+	/* 真の場合、Poll RDY/~BSYを実行するのではなく、10ms待つ */
+	int fixed_wait;
+	/* 真の場合、プログラムの書き込みで全て0xffffのページを飛ばす(消去済みのターゲット用) */
+	int skip_blank;
+} session_job_t;
+
+/* 進捗 */
+typedef struct {
+	/* セッションの状態 */
+	int state;
+	/* 進行中の処理 */
+	int phase;
+	/* 処理した量と全体の量(照合も含めた、プログラムはワード、EEPROMはオクテット単位) */
+	unsigned int done;
+	unsigned int total;
+	/* 失敗した場合のエラーコード(ATMEGAIO_*) */
+	int error;
+	/* 照合で不一致を見つけた場合は真と、最初の不一致のアドレス */
+	int mismatch;
+	unsigned int mismatch_addr;
+} session_progress_t;
+
+/* 進捗を通知するコールバック */
+typedef void (*session_callback_t)(const session_progress_t *progress, void *user_data);
+
+typedef struct session session_t;
+
+/**
+ * セッションを開始する。まだ通信は行わない。
+ * @param func 利用する関数が格納された構造体へのポインタ(セッションが終わるまで有効でなければならない)
+ * @param job ジョブの内容(コピーされる)
+ * @param callback 進捗を通知するコールバック(不要ならNULL)
+ * @param user_data コールバックに渡すデータ
+ * @return 成功したらセッション、パラメータの不正やメモリ不足ならNULL
+ */
+session_t *session_start(const atmegaio_t *func, const session_job_t *job,
+	session_callback_t callback, void *user_data);
+
+/**
+ * セッションを1ページ分進める。
+ * @param session セッション
+ * @return セッションの状態(SESSION_RUNNINGなら、まだ続きがある)
+ */
+int session_step(session_t *session);
+
+/**
+ * セッションを中止する。次のsession_stepで通信せずにSESSION_CANCELLEDになる。
+ * コールバックの中から呼んでも良い。
+ * @param session セッション
+ */
+void session_cancel(session_t *session);
+
+/**
+ * 進捗を取得する。
+ * @param session セッション
+ * @param progress 進捗を格納する領域へのポインタ
+ * @return セッションの状態
+ */
+int session_get_progress(const session_t *session, session_progress_t *progress);
+
+/**
+ * セッションを解放する。中止していない途中のセッションを解放しても良い。
+ * @param session セッション
+ */
+void session_free(session_t *session);
+
+#endif
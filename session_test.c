@@ -0,0 +1,151 @@
+/* シミュレートしたATmegaに対してセッションを進め、session.cを試験する。
+ */
+#include <stdio.h>
+#include <string.h>
+#include "atmega_io.h"
+#include "atmega_sim.h"
+#include "session.h"
+
+#define IMAGE_WORDS 1000
+#define PAGE_WORDS ATMEGA_SIM_PAGE_WORDS
+/* 読み込みを中止する位置(ワード) */
+#define CANCEL_AT 256
+
+static atmega_sim_t sim;
+
+/* コールバックの呼び出しを記録する */
+typedef struct {
+	session_t *session;
+	int calls;
+	unsigned int last_done;
+	int went_backwards;
+} callback_log_t;
+
+static void record_progress(const session_progress_t *progress, void *user_data) {
+	callback_log_t *log = (callback_log_t*)user_data;
+	log->calls++;
+	if (progress->done < log->last_done) log->went_backwards = 1;
+	log->last_done = progress->done;
+}
+
+/* 一定量を読み込んだら、コールバックの中から中止する */
+static void cancel_after(const session_progress_t *progress, void *user_data) {
+	callback_log_t *log = (callback_log_t*)user_data;
+	record_progress(progress, user_data);
+	if (progress->done >= CANCEL_AT) session_cancel(log->session);
+}
+
+/* セッションを最後まで進め、状態と進捗を返す */
+static int run(session_t *session, session_progress_t *progress) {
+	int state;
+	while ((state = session_step(session)) == SESSION_RUNNING);
+	session_get_progress(session, progress);
+	return state;
+}
+
+static int check(int cond, const char *what) {
+	printf("%s: %s\n", cond ? "ok  " : "FAIL", what);
+	return cond;
+}
+
+int main(void) {
+	static unsigned int image[IMAGE_WORDS], readback[IMAGE_WORDS];
+	int eeprom_data[10], eeprom_readback[10];
+	atmegaio_t *atmegaio;
+	session_job_t job;
+	session_progress_t progress;
+	session_t *session;
+	callback_log_t log;
+	int state;
+	int ok = 1;
+	int i;
+	atmega_sim_init(&sim);
+	atmegaio = atmega_sim_open(&sim);
+	if (!check(atmegaio != NULL, "atmega_sim_open")) return 1;
+	ok &= check(reset(atmegaio) == ATMEGAIO_SUCCESS && chip_erase(atmegaio, 0) == ATMEGAIO_SUCCESS, "reset and erase");
+	for (i = 0; i < IMAGE_WORDS; i++) image[i] = (i * 7919u + 0x0123) & 0xffff;
+	/* 3ページ目は空にして、書き込みを飛ばす */
+	for (i = 2 * PAGE_WORDS; i < 3 * PAGE_WORDS; i++) image[i] = 0xffff;
+	/* 飛ばしたページは照合もしないので、消去されていない値が残っていても成功する */
+	sim.flash[2 * PAGE_WORDS + 5] = 0x1234;
+
+	/* skip_blankと全体の照合 */
+	memset(&job, 0, sizeof(job));
+	job.operation = SESSION_WRITE_PROGRAM;
+	job.data_size = IMAGE_WORDS;
+	job.page_size = PAGE_WORDS;
+	job.program = image;
+	job.verify = SESSION_VERIFY_END;
+	job.skip_blank = 1;
+	memset(&log, 0, sizeof(log));
+	session = session_start(atmegaio, &job, record_progress, &log);
+	if (!check(session != NULL, "session_start (write)")) return 1;
+	state = run(session, &progress);
+	ok &= check(state == SESSION_DONE && progress.done == 2 * IMAGE_WORDS && progress.total == 2 * IMAGE_WORDS &&
+		progress.phase == SESSION_PHASE_VERIFY && !progress.mismatch, "write with end verification");
+	ok &= check(sim.flash[2 * PAGE_WORDS + 5] == 0x1234 &&
+		memcmp(sim.flash, image, 2 * PAGE_WORDS * sizeof(*image)) == 0 &&
+		memcmp(sim.flash + 3 * PAGE_WORDS, image + 3 * PAGE_WORDS,
+			(IMAGE_WORDS - 3 * PAGE_WORDS) * sizeof(*image)) == 0, "skip_blank");
+	ok &= check(log.calls > 0 && !log.went_backwards && log.last_done == progress.done, "progress callback");
+	session_free(session);
+
+	/* コールバックの中から中止する */
+	job.operation = SESSION_READ_PROGRAM;
+	job.program = readback;
+	job.verify = SESSION_VERIFY_NONE;
+	memset(&log, 0, sizeof(log));
+	session = session_start(atmegaio, &job, cancel_after, &log);
+	if (!check(session != NULL, "session_start (read)")) return 1;
+	log.session = session;
+	state = run(session, &progress);
+	ok &= check(state == SESSION_CANCELLED && progress.done == CANCEL_AT &&
+		memcmp(readback, sim.flash, CANCEL_AT * sizeof(*readback)) == 0, "cancel from the callback");
+	ok &= check(session_step(session) == SESSION_CANCELLED, "step after cancel");
+	session_free(session);
+
+	/* 消去せずに書き込むと、0から1に戻すビットは書き込めずに不一致になる */
+	sim.flash[7 * PAGE_WORDS + 3] = 0;
+	job.operation = SESSION_WRITE_PROGRAM;
+	job.start_addr = 7 * PAGE_WORDS;
+	job.data_size = 2 * PAGE_WORDS;
+	job.program = image + 7 * PAGE_WORDS;
+	job.verify = SESSION_VERIFY_PAGE;
+	job.skip_blank = 0;
+	session = session_start(atmegaio, &job, NULL, NULL);
+	if (!check(session != NULL, "session_start (page verify)")) return 1;
+	state = run(session, &progress);
+	ok &= check(state == SESSION_FAILED && progress.error == ATMEGAIO_SUCCESS && progress.mismatch &&
+		progress.mismatch_addr == 7 * PAGE_WORDS + 3 && progress.done == 0, "mismatch with page verification");
+	session_free(session);
+
+	/* EEPROMの書き込みと読み込み(ページの境界をまたぐ) */
+	for (i = 0; i < 10; i++) eeprom_data[i] = (i * 37 + 5) & 0xff;
+	memset(&job, 0, sizeof(job));
+	job.operation = SESSION_WRITE_EEPROM;
+	job.start_addr = 2;
+	job.data_size = 10;
+	job.page_size = ATMEGA_SIM_EEPROM_PAGE_BYTES;
+	job.eeprom = eeprom_data;
+	job.verify = SESSION_VERIFY_PAGE;
+	session = session_start(atmegaio, &job, NULL, NULL);
+	ok &= check(session != NULL && run(session, &progress) == SESSION_DONE, "EEPROM write");
+	session_free(session);
+	job.operation = SESSION_READ_EEPROM;
+	job.eeprom = eeprom_readback;
+	session = session_start(atmegaio, &job, NULL, NULL);
+	ok &= check(session != NULL && run(session, &progress) == SESSION_DONE &&
+		memcmp(eeprom_data, eeprom_readback, sizeof(eeprom_data)) == 0, "EEPROM read");
+	session_free(session);
+
+	/* 不正なジョブ */
+	job.operation = SESSION_WRITE_PROGRAM;
+	job.program = image;
+	job.start_addr = 1;
+	job.page_size = PAGE_WORDS;
+	ok &= check(session_start(atmegaio, &job, NULL, NULL) == NULL, "unaligned program write rejected");
+
+	disconnect(atmegaio);
+	puts(ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
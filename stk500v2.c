@@ -0,0 +1,365 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "stk500v2.h"
+#include "serial_posix.h"
+#include "atmega_io.h"
+
+/* 応答を待つ時間(ミリ秒) */
+#define READ_TIMEOUT_MS 2000
+/* 1個のメッセージで読み書きするデータの最大オクテット数 */
+#define CHUNK_BYTES 256
+/* Chip EraseとPage Writeに待つ時間(ミリ秒) */
+#define ERASE_DELAY_MS 10
+#define WRITE_DELAY_MS 10
+
+typedef struct {
+	int fd;
+	int sequence;
+} stk_t;
+
+/**
+ * メッセージを送信し、応答を受信する。
+ * @return 応答の本体のサイズ、通信に失敗したら-1、書き込み器がコマンドの失敗を返したら-2
+ */
+static int transaction(stk_t *stk, const unsigned char *body, int size,
+unsigned char *answer, int answer_max) {
+	unsigned char header[5];
+	unsigned char checksum = 0;
+	int answer_size;
+	int i;
+	int c;
+	if (size <= 0 || size > STK500V2_MAX_BODY) return -1;
+	stk->sequence = (stk->sequence + 1) & 0xff;
+	header[0] = STK500V2_MESSAGE_START;
+	header[1] = stk->sequence;
+	header[2] = (size >> 8) & 0xff;
+	header[3] = size & 0xff;
+	header[4] = STK500V2_TOKEN;
+	for (i = 0; i < 5; i++) checksum ^= header[i];
+	for (i = 0; i < size; i++) checksum ^= body[i];
+	if (!serial_write_all(stk->fd, header, 5) || !serial_write_all(stk->fd, body, size) ||
+	!serial_write_all(stk->fd, &checksum, 1)) return -1;
+	/* 応答のヘッダを探す */
+	do {
+		if ((c = serial_read_byte(stk->fd, READ_TIMEOUT_MS)) < 0) return -1;
+	} while (c != STK500V2_MESSAGE_START);
+	checksum = c;
+	for (i = 1; i < 5; i++) {
+		if ((c = serial_read_byte(stk->fd, READ_TIMEOUT_MS)) < 0) return -1;
+		header[i] = c;
+		checksum ^= c;
+	}
+	answer_size = (header[2] << 8) | header[3];
+	if (header[1] != stk->sequence || header[4] != STK500V2_TOKEN ||
+	answer_size > answer_max) return -1;
+	for (i = 0; i < answer_size; i++) {
+		if ((c = serial_read_byte(stk->fd, READ_TIMEOUT_MS)) < 0) return -1;
+		answer[i] = c;
+		checksum ^= c;
+	}
+	if ((c = serial_read_byte(stk->fd, READ_TIMEOUT_MS)) < 0 || (checksum ^ c) != 0) return -1;
+	/* 応答は同じコマンド番号とSTATUS_CMD_OKで始まる */
+	if (answer_size < 2 || answer[0] != body[0]) return -1;
+	if (answer[1] != STK500V2_STATUS_CMD_OK) return -2;
+	return answer_size;
+}
+
+/* アドレスを設定する */
+static int load_address(stk_t *stk, unsigned long address) {
+	unsigned char body[5], answer[8];
+	body[0] = STK500V2_CMD_LOAD_ADDRESS;
+	body[1] = (address >> 24) & 0xff;
+	body[2] = (address >> 16) & 0xff;
+	body[3] = (address >> 8) & 0xff;
+	body[4] = address & 0xff;
+	return transaction(stk, body, 5, answer, sizeof(answer)) >= 0;
+}
+
+/* プログラミングモードに入る(ターゲットのリセットとProgramming Enableを含む)
+ * transactionの結果を返す。
+ */
+static int enter_progmode(stk_t *stk) {
+	static const unsigned char body[] = {
+		STK500V2_CMD_ENTER_PROGMODE_ISP,
+		200, /* timeout */
+		100, /* stabDelay */
+		25, /* cmdexeDelay */
+		32, /* synchLoops */
+		0, /* byteDelay */
+		0x53, /* pollValue */
+		3, /* pollIndex */
+		0xAC, 0x53, 0x00, 0x00
+	};
+	unsigned char answer[8];
+	return transaction(stk, body, sizeof(body), answer, sizeof(answer));
+}
+
+static int leave_progmode(stk_t *stk) {
+	static const unsigned char body[] = {STK500V2_CMD_LEAVE_PROGMODE_ISP, 1, 1};
+	unsigned char answer[8];
+	return transaction(stk, body, sizeof(body), answer, sizeof(answer)) >= 0;
+}
+
+/* STK500v2書き込み器を用いた通信を終了する。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int stk_disconnect(void *hardware_data) {
+	stk_t *stk;
+	int fd;
+	if (hardware_data == NULL) return 0;
+	stk = (stk_t*)hardware_data;
+	leave_progmode(stk);
+	fd = stk->fd;
+	free(stk);
+	return close(fd) == 0;
+}
+
+/* STK500v2書き込み器のプログラミングモードを抜けて、ターゲットを動かす。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int stk_release(void *hardware_data) {
+	if (hardware_data == NULL) return 0;
+	return leave_progmode((stk_t*)hardware_data);
+}
+
+/* STK500v2書き込み器を用いてリセットを行い、プログラミングモードに入る。
+ * ターゲットが応答しなかった場合も、以降のProgramming Enableで検出するので成功とする。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int stk_reset(void *hardware_data) {
+	stk_t *stk;
+	if (hardware_data == NULL) return 0;
+	stk = (stk_t*)hardware_data;
+	leave_progmode(stk);
+	return enter_progmode(stk) != -1;
+}
+
+/* SPI_MULTIでoutを送信し、受信したデータをinに格納する */
+static int spi_multi(stk_t *stk, const int *out, int *in, int num) {
+	unsigned char body[4 + 4], answer[3 + 4];
+	int i;
+	if (num > 4) return 0;
+	body[0] = STK500V2_CMD_SPI_MULTI;
+	body[1] = num; /* numTx */
+	body[2] = num; /* numRx */
+	body[3] = 0; /* rxStartAddr */
+	for (i = 0; i < num; i++) body[4 + i] = out[i] & 0xff;
+	if (transaction(stk, body, 4 + num, answer, sizeof(answer)) != 3 + num) return 0;
+	for (i = 0; i < num; i++) in[i] = answer[2 + i];
+	return 1;
+}
+
+/* STK500v2書き込み器を用いて8ビット送受信する。
+ * 成功と判定したら受信したデータを、失敗を検出したら-1を返す。
+ */
+static int stk_io_8bits(void *hardware_data, int out) {
+	int in;
+	if (hardware_data == NULL) return -1;
+	if (!spi_multi((stk_t*)hardware_data, &out, &in, 1)) return -1;
+	return in;
+}
+
+static int stk_command(void *hardware_data, const int *out, int *in) {
+	if (hardware_data == NULL) return 0;
+	return spi_multi((stk_t*)hardware_data, out, in, 4);
+}
+
+unsigned long stk500v2_sck_frequency(int duration) {
+	/* 0から2はSTK500のファームウェアの表の値で、3以降はおおよそ86400/duration Hzになる */
+	static const unsigned long table[3] = {921600UL, 230400UL, 57600UL};
+	if (duration < 0) duration = 0;
+	if (duration < 3) return table[duration];
+	return 86400UL / duration;
+}
+
+/* SCKの周波数を、指定した周波数以下で最も速いSCK_DURATIONに設定する */
+static unsigned long stk_set_sck_frequency(void *hardware_data, unsigned long frequency) {
+	unsigned char body[3], answer[8];
+	int duration = 0;
+	if (hardware_data == NULL || frequency == 0) return 0;
+	while (duration < STK500V2_SCK_DURATION_MAX && stk500v2_sck_frequency(duration) > frequency) {
+		duration++;
+	}
+	body[0] = STK500V2_CMD_SET_PARAMETER;
+	body[1] = STK500V2_PARAM_SCK_DURATION;
+	body[2] = duration;
+	if (transaction((stk_t*)hardware_data, body, 3, answer, sizeof(answer)) < 0) return 0;
+	return stk500v2_sck_frequency(duration);
+}
+
+/* READ_FLASH_ISPまたはREAD_EEPROM_ISPでsizeオクテット読み込む */
+static int read_memory(stk_t *stk, int command, int isp_command, unsigned long address,
+unsigned char *data, int size) {
+	unsigned char body[4], answer[3 + CHUNK_BYTES];
+	if (size > CHUNK_BYTES || !load_address(stk, address)) return 0;
+	body[0] = command;
+	body[1] = (size >> 8) & 0xff;
+	body[2] = size & 0xff;
+	body[3] = isp_command;
+	if (transaction(stk, body, 4, answer, sizeof(answer)) != 3 + size) return 0;
+	memcpy(data, answer + 2, size);
+	return 1;
+}
+
+/* PROGRAM_FLASH_ISPまたはPROGRAM_EEPROM_ISPでsizeオクテットをページにloadし、
+ * write_pageが真ならページを書き込む
+ */
+static int program_memory(stk_t *stk, int command, const int *isp_commands, int fixed_wait,
+unsigned long address, const unsigned char *data, int size, int write_page) {
+	unsigned char body[10 + CHUNK_BYTES], answer[8];
+	if (size > CHUNK_BYTES || !load_address(stk, address)) return 0;
+	body[0] = command;
+	body[1] = (size >> 8) & 0xff;
+	body[2] = size & 0xff;
+	/* ページモードで、完了はRDY/~BSYのポーリングまたは時間待ちで確認する */
+	body[3] = 0x01 | (fixed_wait ? 0x10 : 0x40) | (write_page ? 0x80 : 0x00);
+	body[4] = WRITE_DELAY_MS;
+	body[5] = isp_commands[0];
+	body[6] = isp_commands[1];
+	body[7] = isp_commands[2];
+	body[8] = 0xFF; /* poll1 */
+	body[9] = 0xFF; /* poll2 */
+	memcpy(body + 10, data, size);
+	return transaction(stk, body, 10 + size, answer, sizeof(answer)) >= 0;
+}
+
+static int stk_read_program(void *hardware_data, unsigned int *data_out,
+unsigned int start_addr, unsigned int data_size) {
+	unsigned char bytes[CHUNK_BYTES];
+	unsigned int done = 0;
+	unsigned int i;
+	if (hardware_data == NULL) return 0;
+	while (done < data_size) {
+		unsigned int words = data_size - done;
+		if (words > CHUNK_BYTES / 2) words = CHUNK_BYTES / 2;
+		if (!read_memory((stk_t*)hardware_data, STK500V2_CMD_READ_FLASH_ISP, 0x20,
+		start_addr + done, bytes, words * 2)) return 0;
+		for (i = 0; i < words; i++) {
+			data_out[done + i] = bytes[i * 2] | ((unsigned int)bytes[i * 2 + 1] << 8);
+		}
+		done += words;
+	}
+	return 1;
+}
+
+static int stk_write_program(void *hardware_data, int fixed_wait, const unsigned int *data,
+unsigned int start_addr, unsigned int data_size, unsigned int page_size) {
+	static const int isp_commands[3] = {0x40, 0x4C, 0x20};
+	unsigned char bytes[CHUNK_BYTES];
+	unsigned int done = 0;
+	unsigned int i;
+	if (hardware_data == NULL) return 0;
+	while (done < data_size) {
+		/* ページの終わりかデータの終わりまで、1メッセージに収まる分を送る */
+		unsigned int page_left = page_size - (start_addr + done) % page_size;
+		unsigned int words = data_size - done;
+		int write_page;
+		if (words > page_left) words = page_left;
+		if (words > CHUNK_BYTES / 2) words = CHUNK_BYTES / 2;
+		write_page = words == page_left || done + words >= data_size;
+		for (i = 0; i < words; i++) {
+			bytes[i * 2] = data[done + i] & 0xff;
+			bytes[i * 2 + 1] = (data[done + i] >> 8) & 0xff;
+		}
+		if (!program_memory((stk_t*)hardware_data, STK500V2_CMD_PROGRAM_FLASH_ISP, isp_commands,
+		fixed_wait, start_addr + done, bytes, words * 2, write_page)) return 0;
+		done += words;
+	}
+	return 1;
+}
+
+static int stk_read_eeprom(void *hardware_data, int *data_out,
+unsigned int start_addr, unsigned int data_size) {
+	unsigned char bytes[CHUNK_BYTES];
+	unsigned int done = 0;
+	unsigned int i;
+	if (hardware_data == NULL) return 0;
+	while (done < data_size) {
+		unsigned int size = data_size - done;
+		if (size > CHUNK_BYTES) size = CHUNK_BYTES;
+		if (!read_memory((stk_t*)hardware_data, STK500V2_CMD_READ_EEPROM_ISP, 0xA0,
+		start_addr + done, bytes, size)) return 0;
+		for (i = 0; i < size; i++) data_out[done + i] = bytes[i];
+		done += size;
+	}
+	return 1;
+}
+
+static int stk_write_eeprom(void *hardware_data, int fixed_wait, const int *data,
+unsigned int start_addr, unsigned int data_size) {
+	static const int isp_commands[3] = {0xC1, 0xC2, 0xA0};
+	unsigned char bytes[4];
+	unsigned int done = 0;
+	unsigned int i;
+	if (hardware_data == NULL) return 0;
+	while (done < data_size) {
+		/* EEPROMのページ(4オクテット)ごとに書き込む */
+		unsigned int size = 4 - (start_addr + done) % 4;
+		if (size > data_size - done) size = data_size - done;
+		for (i = 0; i < size; i++) bytes[i] = data[done + i] & 0xff;
+		if (!program_memory((stk_t*)hardware_data, STK500V2_CMD_PROGRAM_EEPROM_ISP, isp_commands,
+		fixed_wait, start_addr + done, bytes, size, 1)) return 0;
+		done += size;
+	}
+	return 1;
+}
+
+static int stk_chip_erase(void *hardware_data, int fixed_wait) {
+	unsigned char body[7], answer[8];
+	if (hardware_data == NULL) return 0;
+	body[0] = STK500V2_CMD_CHIP_ERASE_ISP;
+	body[1] = ERASE_DELAY_MS;
+	body[2] = fixed_wait ? 0 : 1; /* pollMethod (0 : 時間待ち, 1 : RDY/~BSY) */
+	body[3] = 0xAC;
+	body[4] = 0x80;
+	body[5] = 0x00;
+	body[6] = 0x00;
+	return transaction((stk_t*)hardware_data, body, 7, answer, sizeof(answer)) >= 0;
+}
+
+atmegaio_t *stk500v2_init(const char *port, long baud) {
+	static const unsigned char sign_on[] = {STK500V2_CMD_SIGN_ON};
+	unsigned char answer[32];
+	atmegaio_t *atmegaio;
+	stk_t *stk;
+	int fd;
+	int i;
+	fd = serial_open(port, baud > 0 ? baud : 115200);
+	if (fd < 0) return NULL;
+	/* 情報を格納する */
+	atmegaio = calloc(1, sizeof(atmegaio_t));
+	stk = malloc(sizeof(stk_t));
+	if (atmegaio == NULL || stk == NULL) {
+		free(atmegaio);
+		free(stk);
+		close(fd);
+		return NULL;
+	}
+	stk->fd = fd;
+	stk->sequence = 0;
+	/* 書き込み器が応答するかを確認する */
+	for (i = 0; i < 3; i++) {
+		if (transaction(stk, sign_on, sizeof(sign_on), answer, sizeof(answer)) >= 0) break;
+		serial_flush_input(fd);
+	}
+	if (i >= 3) {
+		free(atmegaio);
+		free(stk);
+		close(fd);
+		return NULL;
+	}
+	atmegaio->hardware_data = (void*)stk;
+	atmegaio->disconnect = stk_disconnect;
+	atmegaio->reset = stk_reset;
+	atmegaio->release = stk_release;
+	atmegaio->io_8bits = stk_io_8bits;
+	atmegaio->command = stk_command;
+	atmegaio->read_program = stk_read_program;
+	atmegaio->write_program = stk_write_program;
+	atmegaio->read_eeprom = stk_read_eeprom;
+	atmegaio->write_eeprom = stk_write_eeprom;
+	atmegaio->chip_erase = stk_chip_erase;
+	atmegaio->set_sck_frequency = stk_set_sck_frequency;
+	return atmegaio;
+}
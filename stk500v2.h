@@ -0,0 +1,50 @@
+#ifndef STK500V2_H_GUARD_C4A7E019_58B2_4F3D_A6E1_9D0B27F8C365
+#define STK500V2_H_GUARD_C4A7E019_58B2_4F3D_A6E1_9D0B27F8C365
+
+#include "atmega_io.h"
+
+/* STK500v2プロトコルの定数 */
+#define STK500V2_MESSAGE_START 0x1B
+#define STK500V2_TOKEN 0x0E
+/* メッセージ本体の最大サイズ */
+#define STK500V2_MAX_BODY 275
+
+enum {
+	STK500V2_CMD_SIGN_ON = 0x01,
+	STK500V2_CMD_SET_PARAMETER = 0x02,
+	STK500V2_CMD_GET_PARAMETER = 0x03,
+	STK500V2_CMD_LOAD_ADDRESS = 0x06,
+	STK500V2_CMD_ENTER_PROGMODE_ISP = 0x10,
+	STK500V2_CMD_LEAVE_PROGMODE_ISP = 0x11,
+	STK500V2_CMD_CHIP_ERASE_ISP = 0x12,
+	STK500V2_CMD_PROGRAM_FLASH_ISP = 0x13,
+	STK500V2_CMD_READ_FLASH_ISP = 0x14,
+	STK500V2_CMD_PROGRAM_EEPROM_ISP = 0x15,
+	STK500V2_CMD_READ_EEPROM_ISP = 0x16,
+	STK500V2_CMD_SPI_MULTI = 0x1D
+};
+
+enum {
+	STK500V2_STATUS_CMD_OK = 0x00,
+	STK500V2_STATUS_CMD_FAILED = 0xC0,
+	STK500V2_STATUS_CKSUM_ERROR = 0xC1,
+	STK500V2_STATUS_CMD_UNKNOWN = 0xC9
+};
+
+/* パラメータ */
+#define STK500V2_PARAM_SCK_DURATION 0x98
+
+/* SCK_DURATIONの最大値 */
+#define STK500V2_SCK_DURATION_MAX 254
+
+/* STK500のSCK_DURATIONの値に対応するSCKの周波数(Hz)を返す */
+unsigned long stk500v2_sck_frequency(int duration);
+
+/* シリアルポートに接続したSTK500v2互換のISP書き込み器を用いた通信を初期化する。
+ * プログラムデータやEEPROMの読み書きはページ単位のコマンドでまとめて行う。
+ * baudが0以下の場合は115200bpsを使う。
+ * 成功と判定したら通信用データのポインタ、失敗を検出したらNULLを返す。
+ */
+atmegaio_t *stk500v2_init(const char *port, long baud);
+
+#endif
@@ -0,0 +1,231 @@
+/* 擬似端末の向こう側でSTK500v2互換の書き込み器をエミュレートし、stk500v2.cを試験する。
+ * 書き込み器はシミュレートしたATmegaに対してISPのコマンドを実行する。
+ */
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include "stk500v2.h"
+#include "atmega_io.h"
+#include "atmega_sim.h"
+
+static atmega_sim_t sim;
+static volatile int stop_flag = 0;
+static int master_fd;
+static unsigned long message_count = 0;
+
+/* エミュレータ側で1オクテット受信する。停止したら-1を返す。 */
+static int emu_read_byte(void) {
+	unsigned char c;
+	while (!stop_flag) {
+		struct pollfd pfd;
+		pfd.fd = master_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 50) <= 0) continue;
+		if (read(master_fd, &c, 1) == 1) return c;
+	}
+	return -1;
+}
+
+static void emu_send(int sequence, const unsigned char *body, int size) {
+	unsigned char frame[5 + STK500V2_MAX_BODY + 1];
+	unsigned char checksum = 0;
+	int i;
+	frame[0] = STK500V2_MESSAGE_START;
+	frame[1] = sequence;
+	frame[2] = (size >> 8) & 0xff;
+	frame[3] = size & 0xff;
+	frame[4] = STK500V2_TOKEN;
+	memcpy(frame + 5, body, size);
+	for (i = 0; i < 5 + size; i++) checksum ^= frame[i];
+	frame[5 + size] = checksum;
+	if (write(master_fd, frame, 6 + size) != 6 + size) perror("emulator write");
+}
+
+/* 4オクテットのISPコマンドをターゲットに送り、4オクテット目の応答を返す */
+static int isp(int c0, int c1, int c2, int c3) {
+	atmega_sim_transfer(&sim, c0);
+	atmega_sim_transfer(&sim, c1);
+	atmega_sim_transfer(&sim, c2);
+	return atmega_sim_transfer(&sim, c3);
+}
+
+/* 受信したメッセージを処理し、応答をanswerに格納してそのサイズを返す */
+static int emulate(const unsigned char *body, int size, unsigned char *answer) {
+	static unsigned long address = 0;
+	int num = size >= 3 ? (body[1] << 8) | body[2] : 0;
+	int i;
+	answer[0] = body[0];
+	answer[1] = STK500V2_STATUS_CMD_OK;
+	switch (body[0]) {
+	case STK500V2_CMD_SIGN_ON:
+		answer[2] = 8;
+		memcpy(answer + 3, "STK500_2", 8);
+		return 11;
+	case STK500V2_CMD_SET_PARAMETER:
+		if (body[1] == STK500V2_PARAM_SCK_DURATION) sim.sck_frequency = stk500v2_sck_frequency(body[2]);
+		return 2;
+	case STK500V2_CMD_GET_PARAMETER:
+		answer[2] = 0;
+		return 3;
+	case STK500V2_CMD_LOAD_ADDRESS:
+		address = ((unsigned long)body[1] << 24) | ((unsigned long)body[2] << 16) |
+			((unsigned long)body[3] << 8) | body[4];
+		return 2;
+	case STK500V2_CMD_ENTER_PROGMODE_ISP:
+		{
+			int in[4];
+			atmega_sim_set_pins(&sim, 1, 0, 0);
+			atmega_sim_set_pins(&sim, 0, 0, 0);
+			for (i = 0; i < 4; i++) in[i] = atmega_sim_transfer(&sim, body[8 + i]);
+			if (body[7] >= 1 && body[7] <= 4 && in[body[7] - 1] != body[6]) {
+				answer[1] = STK500V2_STATUS_CMD_FAILED;
+			}
+		}
+		return 2;
+	case STK500V2_CMD_LEAVE_PROGMODE_ISP:
+		atmega_sim_set_pins(&sim, 1, 0, 0);
+		return 2;
+	case STK500V2_CMD_CHIP_ERASE_ISP:
+		isp(body[3], body[4], body[5], body[6]);
+		return 2;
+	case STK500V2_CMD_PROGRAM_FLASH_ISP:
+		for (i = 0; i < num; i++) {
+			unsigned long word = address + i / 2;
+			isp(body[5] | (i & 1 ? 0x08 : 0x00), (word >> 8) & 0xff, word & 0xff, body[10 + i]);
+		}
+		if (body[3] & 0x80) isp(body[6], (address >> 8) & 0xff, address & 0xff, 0);
+		address += num / 2;
+		return 2;
+	case STK500V2_CMD_READ_FLASH_ISP:
+		for (i = 0; i < num; i++) {
+			unsigned long word = address + i / 2;
+			answer[2 + i] = isp(body[3] | (i & 1 ? 0x08 : 0x00), (word >> 8) & 0xff, word & 0xff, 0);
+		}
+		answer[2 + num] = STK500V2_STATUS_CMD_OK;
+		address += num / 2;
+		return 3 + num;
+	case STK500V2_CMD_PROGRAM_EEPROM_ISP:
+		for (i = 0; i < num; i++) {
+			isp(body[5], ((address + i) >> 8) & 0xff, (address + i) & 0xff, body[10 + i]);
+		}
+		if (body[3] & 0x80) isp(body[6], (address >> 8) & 0xff, address & 0xff, 0);
+		address += num;
+		return 2;
+	case STK500V2_CMD_READ_EEPROM_ISP:
+		for (i = 0; i < num; i++) {
+			answer[2 + i] = isp(body[3], ((address + i) >> 8) & 0xff, (address + i) & 0xff, 0);
+		}
+		answer[2 + num] = STK500V2_STATUS_CMD_OK;
+		address += num;
+		return 3 + num;
+	case STK500V2_CMD_SPI_MULTI:
+		{
+			int in[STK500V2_MAX_BODY];
+			for (i = 0; i < body[1]; i++) in[i] = atmega_sim_transfer(&sim, body[4 + i]);
+			for (i = 0; i < body[2]; i++) {
+				int index = body[3] + i;
+				answer[2 + i] = index < body[1] ? in[index] : 0;
+			}
+			answer[2 + body[2]] = STK500V2_STATUS_CMD_OK;
+			return 3 + body[2];
+		}
+	}
+	answer[1] = STK500V2_STATUS_CMD_UNKNOWN;
+	return 2;
+}
+
+/* STK500v2互換の書き込み器として振る舞う */
+static void *programmer_thread(void *arg) {
+	unsigned char body[STK500V2_MAX_BODY], answer[STK500V2_MAX_BODY + 8];
+	(void)arg;
+	while (!stop_flag) {
+		int header[5];
+		unsigned char checksum = 0;
+		int size;
+		int c;
+		int i;
+		if ((c = emu_read_byte()) < 0) break;
+		if (c != STK500V2_MESSAGE_START) continue;
+		header[0] = c;
+		for (i = 1; i < 5; i++) header[i] = emu_read_byte();
+		size = (header[2] << 8) | header[3];
+		if (header[4] != STK500V2_TOKEN || size <= 0 || size > STK500V2_MAX_BODY) continue;
+		for (i = 0; i < 5; i++) checksum ^= header[i];
+		for (i = 0; i < size; i++) checksum ^= (body[i] = emu_read_byte());
+		if ((checksum ^ emu_read_byte()) != 0) {
+			answer[0] = 0x00;
+			answer[1] = STK500V2_STATUS_CKSUM_ERROR;
+			emu_send(header[1], answer, 2);
+			continue;
+		}
+		message_count++;
+		emu_send(header[1], answer, emulate(body, size, answer));
+	}
+	return NULL;
+}
+
+static int check(int cond, const char *what) {
+	printf("%s: %s\n", cond ? "ok  " : "FAIL", what);
+	return cond;
+}
+
+int main(void) {
+	static unsigned int words[200], readback[200];
+	pthread_t thread;
+	atmegaio_t *atmegaio;
+	int eeprom[6] = {0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC}, eeprom_readback[6];
+	int signature[3];
+	int fuse;
+	unsigned long sck;
+	int ok = 1;
+	int i;
+	master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master_fd < 0 || grantpt(master_fd) != 0 || unlockpt(master_fd) != 0) {
+		perror("pty");
+		return 77;
+	}
+	atmega_sim_init(&sim);
+	pthread_create(&thread, NULL, programmer_thread, NULL);
+	atmegaio = stk500v2_init(ptsname(master_fd), 115200);
+	if (!check(atmegaio != NULL, "stk500v2_init")) {
+		ok = 0;
+	} else {
+		for (i = 0; i < 200; i++) words[i] = (i * 0x0101 + 0x2030) & 0xffff;
+		/* 初期状態は1MHzなので、SCKは250kHz未満でないといけない */
+		ok &= check(calibrate_sck(atmegaio, &sck) == ATMEGAIO_SUCCESS && sck == 230400, "sck calibration");
+		printf("SCK = %lu Hz\n", sck);
+		ok &= check(read_signature_byte(atmegaio, signature) == ATMEGAIO_SUCCESS &&
+			signature[0] == 0x1E && signature[1] == 0x95 && signature[2] == 0x0F, "signature");
+		ok &= check(chip_erase(atmegaio, 0) == ATMEGAIO_SUCCESS, "chip erase");
+		/* 3ページ強(最後のページは途中まで) */
+		ok &= check(write_program(atmegaio, 0, words, 0x40, 200, 64) == ATMEGAIO_SUCCESS, "program write");
+		ok &= check(read_program(atmegaio, readback, 0x40, 200) == ATMEGAIO_SUCCESS &&
+			memcmp(words, readback, sizeof(words)) == 0, "program read");
+		ok &= check(sim.flash[0x3F] == 0xffff && sim.flash[0x40] == words[0] &&
+			sim.flash[0x40 + 199] == words[199] && sim.flash[0x40 + 200] == 0xffff, "program placement");
+		/* ページの境界をまたぐ */
+		ok &= check(write_eeprom(atmegaio, 0, eeprom, 0x102, 6) == ATMEGAIO_SUCCESS &&
+			read_eeprom(atmegaio, eeprom_readback, 0x102, 6) == ATMEGAIO_SUCCESS &&
+			memcmp(eeprom, eeprom_readback, sizeof(eeprom)) == 0 &&
+			sim.eeprom[0x101] == 0xff && sim.eeprom[0x108] == 0xff, "eeprom write/read");
+		ok &= check(write_information(atmegaio, 0, -1, 0xE2, -1, -1) == ATMEGAIO_SUCCESS &&
+			read_information(atmegaio, NULL, &fuse, NULL, NULL, NULL) == ATMEGAIO_SUCCESS &&
+			fuse == 0xE2, "fuse write/read");
+		/* CKDIV8を解除したので8MHzになる */
+		ok &= check(calibrate_sck(atmegaio, &sck) == ATMEGAIO_SUCCESS && sck == 921600, "sck recalibration");
+		printf("SCK = %lu Hz\n", sck);
+		printf("messages: %lu, target bytes: %lu\n", message_count, sim.byte_count);
+		ok &= check(disconnect(atmegaio) == ATMEGAIO_SUCCESS, "disconnect");
+	}
+	stop_flag = 1;
+	pthread_join(thread, NULL);
+	close(master_fd);
+	puts(ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include "usbio_linux.h"
+#include "device_cache.h"
+#include "atmega_io.h"
+
+#define IO_SIZE 65
+#define PORT_NUM 12
+/* 1オクテットの送受信に使うレポートの数 */
+#define REPORTS_PER_BYTE 17
+/* 応答を待つ時間(ミリ秒) */
+#define READ_TIMEOUT_MS 1000
+
+typedef struct {
+	int fd;
+	/* MISOを接続したポート(ターゲットごと) */
+	int sin_port[PORT_NUM];
+	int target_num;
+	int sout_port, clock_port, reset_port;
+	int pipelined;
+} hid_t;
+
+/* 目的のデバイスの条件 */
+typedef struct {
+	int vendor_id;
+	const int *product_ids;
+	int product_id_num;
+} hid_condition_t;
+
+/* /sys/class/hidrawによるデバイスの列挙の状態 */
+typedef struct {
+	const hid_condition_t *condition;
+	DIR *dir;
+	char path[DEVICE_PATH_MAX];
+} hid_enum_t;
+
+static void sleep_ms(int ms) {
+	struct timespec req, ret;
+	req.tv_sec = ms / 1000;
+	req.tv_nsec = (long)(ms % 1000) * 1000000L;
+	while (nanosleep(&req, &ret) == -1 && errno == EINTR) req = ret;
+}
+
+/* パスで指定したデバイスを開き、条件に合うかを確認する */
+static int openHIDPath(const hid_condition_t *condition, const char *path, int *fd_out) {
+	struct hidraw_devinfo info;
+	int fd;
+	int i;
+	fd = open(path, O_RDWR | O_NONBLOCK);
+	if (fd < 0) return 0;
+	/* IDがマッチするかを調べる */
+	if (ioctl(fd, HIDIOCGRAWINFO, &info) == 0 &&
+	(info.vendor & 0xffff) == condition->vendor_id) {
+		for (i = 0; i < condition->product_id_num; i++) {
+			if ((info.product & 0xffff) == condition->product_ids[i]) {
+				*fd_out = fd;
+				return 1;
+			}
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+static int hid_enum_begin(void *context) {
+	hid_enum_t *e = (hid_enum_t*)context;
+	e->dir = opendir("/sys/class/hidraw");
+	return e->dir != NULL;
+}
+
+static const char *hid_enum_next(void *context) {
+	hid_enum_t *e = (hid_enum_t*)context;
+	struct dirent *ent;
+	while ((ent = readdir(e->dir)) != NULL) {
+		if (strncmp(ent->d_name, "hidraw", 6) != 0) continue;
+		if (strlen(ent->d_name) + 6 > sizeof(e->path)) continue;
+		sprintf(e->path, "/dev/%s", ent->d_name);
+		return e->path;
+	}
+	return NULL;
+}
+
+static void hid_enum_end(void *context) {
+	closedir(((hid_enum_t*)context)->dir);
+}
+
+static int hid_enum_open(void *context, const char *path, void *device) {
+	return openHIDPath(((hid_enum_t*)context)->condition, path, (int*)device);
+}
+
+/* デバイスのパスのキャッシュファイルの場所を決める */
+static const char *cacheFilePath(void) {
+	static char path[DEVICE_PATH_MAX];
+	const char *env = getenv("USBIO_DEVICE_CACHE");
+	const char *dir;
+	if (env != NULL) return env[0] != '\0' ? env : NULL;
+	dir = getenv("TMPDIR");
+	if (dir == NULL || dir[0] == '\0') dir = "/tmp";
+	if (strlen(dir) + 32 > sizeof(path)) return NULL;
+	sprintf(path, "%s/usbio_device_path.txt", dir);
+	return path;
+}
+
+static int openHID(int *fd, int vendor_id, const int product_ids[], int product_id_num) {
+	hid_condition_t condition;
+	hid_enum_t e;
+	device_source_t source;
+	if (product_ids == NULL || product_id_num <= 0) return 0;
+	condition.vendor_id = vendor_id;
+	condition.product_ids = product_ids;
+	condition.product_id_num = product_id_num;
+	e.condition = &condition;
+	source.context = &e;
+	source.begin = hid_enum_begin;
+	source.next = hid_enum_next;
+	source.end = hid_enum_end;
+	source.open = hid_enum_open;
+	/* 前回見つけたパスを先に試し、駄目ならデバイスを列挙して探す */
+	return device_open_cached(&source, cacheFilePath(), fd);
+}
+
+/* レポートを1個送信する */
+static int writeReport(int fd, const unsigned char *writeData) {
+	ssize_t size;
+	do {
+		size = write(fd, writeData, IO_SIZE);
+	} while (size < 0 && errno == EINTR);
+	return size == IO_SIZE;
+}
+
+/* レポートを1個受信する。hidrawはレポートIDを付けないので、readData[1]から格納する。 */
+static int readReport(int fd, unsigned char *readData) {
+	struct pollfd pfd;
+	ssize_t size;
+	for (;;) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, READ_TIMEOUT_MS) <= 0) return 0;
+		size = read(fd, readData + 1, IO_SIZE - 1);
+		if (size < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+		readData[0] = 0;
+		return size == IO_SIZE - 1;
+	}
+}
+
+static int writeAndRead(int fd, const unsigned char* writeData, unsigned char* readData) {
+	if (!writeReport(fd, writeData)) return 0;
+	return readReport(fd, readData);
+}
+
+/* ポートに出力するレポートを作る */
+static void makeReport(unsigned char *write_buffer, int writeData) {
+	memset(write_buffer, 0, IO_SIZE);
+	write_buffer[1] = 0x20;
+	write_buffer[2] = 0x1;
+	write_buffer[3] = writeData & 0xff;
+	write_buffer[4] = 0x2;
+	write_buffer[5] = (writeData >> 8) & 0x0f;
+}
+
+static int inputAndOutput(int fd, int writeData, int *readData) {
+	unsigned char write_buffer[IO_SIZE];
+	unsigned char read_buffer[IO_SIZE];
+	makeReport(write_buffer, writeData);
+	if (!writeAndRead(fd, write_buffer, read_buffer)) return 0;
+	if (readData != NULL) *readData = read_buffer[2] | (read_buffer[3] << 8);
+	return 1;
+}
+
+/* USB-IO2.0を用いた通信を終了する。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int usbio_disconnect(void *hardware_data) {
+	hid_t *hid;
+	int fd;
+	if (hardware_data == NULL) return 0;
+	hid = (hid_t*)hardware_data;
+	fd = hid->fd;
+	free(hid);
+	return close(fd) == 0;
+}
+
+/* 1オクテット分のレポートを全て送信してから、応答をまとめて読み込む。
+ * 各ビットのクロックをHIGHにした時の入力をraw_inputに格納する。
+ */
+static int transferPipelined(const hid_t *hid, int out, int *raw_input) {
+	unsigned char write_buffer[REPORTS_PER_BYTE][IO_SIZE];
+	unsigned char read_buffer[IO_SIZE];
+	int i;
+	for (i = 7; i >= 0; i--) {
+		int bit = ((out >> i) & 1) << hid->sout_port;
+		makeReport(write_buffer[(7 - i) * 2], bit);
+		makeReport(write_buffer[(7 - i) * 2 + 1], bit | (1 << hid->clock_port));
+	}
+	makeReport(write_buffer[REPORTS_PER_BYTE - 1], 0);
+	for (i = 0; i < REPORTS_PER_BYTE; i++) {
+		if (!writeReport(hid->fd, write_buffer[i])) return 0;
+	}
+	for (i = 0; i < REPORTS_PER_BYTE; i++) {
+		if (!readReport(hid->fd, read_buffer)) return 0;
+		if (i % 2 == 1 && i / 2 < 8) {
+			raw_input[i / 2] = read_buffer[2] | (read_buffer[3] << 8);
+		}
+	}
+	return 1;
+}
+
+/* USB-IO2.0を用いて全ターゲットと8ビット送受信する。
+ * 受信したデータはinにターゲットの順に格納する。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int usbio_io_8bits_multi(void *hardware_data, int out, int *in) {
+	hid_t *hid;
+	int raw_input[8];
+	int i, j;
+	if (hardware_data == NULL || in == NULL) return 0;
+	hid = (hid_t*)hardware_data;
+	if (hid->pipelined) {
+		if (!transferPipelined(hid, out, raw_input)) return 0;
+	} else {
+		for (i = 7; i >= 0; i--) {
+			/* クロックをLOWにして出力を設定する */
+			if (!inputAndOutput(hid->fd, ((out >> i) & 1) << hid->sout_port, NULL)) return 0;
+			/* クロックをHIGHにして入力を読み込む */
+			if (!inputAndOutput(hid->fd,
+				(((out >> i) & 1) << hid->sout_port) | (1 << hid->clock_port), &raw_input[7 - i])) return 0;
+		}
+		if (!inputAndOutput(hid->fd, 0, NULL)) return 0;
+	}
+	/* 1回の入力で全ターゲットのMISOが読める */
+	for (j = 0; j < hid->target_num; j++) {
+		in[j] = 0;
+		for (i = 7; i >= 0; i--) {
+			if ((raw_input[7 - i] >> hid->sin_port[j]) & 1) in[j] |= (1 << i);
+		}
+	}
+	return 1;
+}
+
+/* USB-IO2.0を用いて8ビット送受信する。
+ * 成功と判定したら受信したデータを、失敗を検出したら-1を返す。
+ */
+static int usbio_io_8bits(void *hardware_data, int out) {
+	int input;
+	if (!usbio_io_8bits_multi(hardware_data, out, &input)) return -1;
+	return input;
+}
+
+/* USB-IO2.0を用いてリセットを行う。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int usbio_reset(void *hardware_data) {
+	hid_t *hid;
+	if (hardware_data == NULL) return 0;
+	hid = (hid_t*)hardware_data;
+	if (!inputAndOutput(hid->fd, 1 << hid->reset_port, NULL)) return 0;
+	sleep_ms(1);
+	if (!inputAndOutput(hid->fd, 0, NULL)) return 0;
+	sleep_ms(20);
+	return 1;
+}
+
+/* USB-IO2.0のRESETをHIGHにしてターゲットのプログラムを動かす。
+ * SCKとMOSIはLOWのままにする。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int usbio_release(void *hardware_data) {
+	hid_t *hid;
+	if (hardware_data == NULL) return 0;
+	hid = (hid_t*)hardware_data;
+	return inputAndOutput(hid->fd, 1 << hid->reset_port, NULL);
+}
+
+int usbio_round_trip(void *hardware_data) {
+	if (hardware_data == NULL) return 0;
+	return inputAndOutput(((hid_t*)hardware_data)->fd, 0, NULL);
+}
+
+int usbio_set_pipelined(void *hardware_data, int pipelined) {
+	if (hardware_data == NULL) return 0;
+	((hid_t*)hardware_data)->pipelined = pipelined != 0;
+	return 1;
+}
+
+/* ポートの設定を確認してUSB-IO2.0を開く。
+ * pathがNULLの場合はデバイスを探す。
+ * 成功と判定したら通信用データのポインタ、失敗を検出したらNULLを返す。
+ */
+static hid_t *usbio_open(const char *path, const int *sin_ports, int target_num,
+int sout_port, int clock_port, int reset_port) {
+	static const int vendor_id = 0x1352;
+	static const int product_id[2] = {0x120, 0x121};
+	static const int product_id_num = 2;
+	int fd;
+	hid_t *hid;
+	int used[PORT_NUM] = {0};
+	int i;
+	if (sin_ports == NULL || target_num <= 0 || PORT_NUM < target_num ||
+	ATMEGAIO_MAX_TARGETS < target_num ||
+	sout_port < 0 || PORT_NUM <= sout_port ||
+	reset_port < 0 || PORT_NUM <= reset_port || clock_port < 0 || PORT_NUM <= clock_port) {
+		/* 無効なポートまたはターゲット数 */
+		return NULL;
+	}
+	used[sout_port]++;
+	used[clock_port]++;
+	used[reset_port]++;
+	for (i = 0; i < target_num; i++) {
+		if (sin_ports[i] < 0 || PORT_NUM <= sin_ports[i]) return NULL;
+		used[sin_ports[i]]++;
+	}
+	for (i = 0; i < PORT_NUM; i++) {
+		/* ポートが被っている */
+		if (used[i] > 1) return NULL;
+	}
+	/* USB-IO2.0を開く */
+	if (path != NULL) {
+		hid_condition_t condition;
+		condition.vendor_id = vendor_id;
+		condition.product_ids = product_id;
+		condition.product_id_num = product_id_num;
+		if (!openHIDPath(&condition, path, &fd)) return NULL;
+	} else if (!openHID(&fd, vendor_id, product_id, product_id_num)) {
+		return NULL;
+	}
+	/* 情報を格納する */
+	hid = malloc(sizeof(hid_t));
+	if (hid == NULL) {
+		close(fd);
+		return NULL;
+	}
+	hid->fd = fd;
+	for (i = 0; i < target_num; i++) hid->sin_port[i] = sin_ports[i];
+	hid->target_num = target_num;
+	hid->sout_port = sout_port;
+	hid->clock_port = clock_port;
+	hid->reset_port = reset_port;
+	hid->pipelined = 0;
+	return hid;
+}
+
+atmegaio_t *usbio_init_path(const char *path,
+int sin_port, int sout_port, int clock_port, int reset_port) {
+	atmegaio_t *atmegaio;
+	hid_t *hid;
+	atmegaio = calloc(1, sizeof(atmegaio_t));
+	if (atmegaio == NULL) return NULL;
+	hid = usbio_open(path, &sin_port, 1, sout_port, clock_port, reset_port);
+	if (hid == NULL) {
+		free(atmegaio);
+		return NULL;
+	}
+	atmegaio->hardware_data = (void*)hid;
+	atmegaio->disconnect = usbio_disconnect;
+	atmegaio->reset = usbio_reset;
+	atmegaio->io_8bits = usbio_io_8bits;
+	atmegaio->release = usbio_release;
+	return atmegaio;
+}
+
+atmegaio_t *usbio_init(int sin_port, int sout_port, int clock_port, int reset_port) {
+	return usbio_init_path(NULL, sin_port, sout_port, clock_port, reset_port);
+}
+
+atmegaio_multi_t *usbio_init_multi(const int *sin_ports, int target_num,
+int sout_port, int clock_port, int reset_port) {
+	atmegaio_multi_t *atmegaio;
+	hid_t *hid;
+	atmegaio = malloc(sizeof(atmegaio_multi_t));
+	if (atmegaio == NULL) return NULL;
+	hid = usbio_open(NULL, sin_ports, target_num, sout_port, clock_port, reset_port);
+	if (hid == NULL) {
+		free(atmegaio);
+		return NULL;
+	}
+	atmegaio->hardware_data = (void*)hid;
+	atmegaio->target_num = target_num;
+	atmegaio->disconnect = usbio_disconnect;
+	atmegaio->reset = usbio_reset;
+	atmegaio->io_8bits = usbio_io_8bits_multi;
+	return atmegaio;
+}
@@ -0,0 +1,173 @@
+/* /dev/uhidで作った仮想USB-IO2.0とシミュレートしたATmegaを用いて、usbio_linux.cを試験する。
+ * 実行にはuhidモジュールと/dev/uhidへの書き込み権限が必要。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/uhid.h>
+#include "usbio_linux.h"
+#include "atmega_io.h"
+#include "atmega_sim.h"
+
+/* 64オクテットの入力レポートと出力レポートを持つベンダ定義のデバイス */
+static const unsigned char report_descriptor[] = {
+	0x06, 0x00, 0xFF, /* Usage Page (Vendor Defined 0xFF00) */
+	0x09, 0x01, /* Usage (0x01) */
+	0xA1, 0x01, /* Collection (Application) */
+	0x15, 0x00, /* Logical Minimum (0) */
+	0x26, 0xFF, 0x00, /* Logical Maximum (255) */
+	0x75, 0x08, /* Report Size (8) */
+	0x95, 0x40, /* Report Count (64) */
+	0x09, 0x01, /* Usage (0x01) */
+	0x81, 0x02, /* Input (Data, Var, Abs) */
+	0x95, 0x40, /* Report Count (64) */
+	0x09, 0x01, /* Usage (0x01) */
+	0x91, 0x02, /* Output (Data, Var, Abs) */
+	0xC0 /* End Collection */
+};
+
+static atmega_sim_t sim;
+static int uhid_fd;
+static volatile int stop_flag = 0;
+static unsigned long report_count = 0;
+
+/* USB-IO2.0の1個のレポートを処理する */
+static void handle_report(const unsigned char *data, int size) {
+	struct uhid_event ev;
+	int port1, port2;
+	if (size == 65 && data[0] == 0) {
+		/* レポートIDを飛ばす */
+		data++;
+		size--;
+	}
+	if (size < 5 || data[0] != 0x20) return;
+	port1 = data[2];
+	port2 = data[4] & 0x0f;
+	report_count++;
+	/* J1-5 : RESET, J1-6 : SCK, J1-7 : MOSI, J2-0 : MISO */
+	atmega_sim_set_pins(&sim, (port1 >> 5) & 1, (port1 >> 6) & 1, (port1 >> 7) & 1);
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = 64;
+	ev.u.input2.data[0] = 0x20;
+	ev.u.input2.data[1] = port1;
+	ev.u.input2.data[2] = (port2 & ~1) | atmega_sim_miso(&sim);
+	if (write(uhid_fd, &ev, sizeof(ev)) < 0) perror("write UHID_INPUT2");
+}
+
+/* 仮想デバイスのイベントを処理し続ける */
+static void *device_thread(void *arg) {
+	(void)arg;
+	while (!stop_flag) {
+		struct pollfd pfd;
+		struct uhid_event ev;
+		pfd.fd = uhid_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) <= 0) continue;
+		if (read(uhid_fd, &ev, sizeof(ev)) <= 0) continue;
+		if (ev.type == UHID_OUTPUT) {
+			handle_report(ev.u.output.data, ev.u.output.size);
+		}
+	}
+	return NULL;
+}
+
+static int create_device(void) {
+	struct uhid_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	strcpy((char*)ev.u.create2.name, "USB-IO2.0 stand-in");
+	memcpy(ev.u.create2.rd_data, report_descriptor, sizeof(report_descriptor));
+	ev.u.create2.rd_size = sizeof(report_descriptor);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = 0x1352;
+	ev.u.create2.product = 0x121;
+	return write(uhid_fd, &ev, sizeof(ev)) == sizeof(ev);
+}
+
+static void destroy_device(void) {
+	struct uhid_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	if (write(uhid_fd, &ev, sizeof(ev)) < 0) perror("write UHID_DESTROY");
+}
+
+static int check(int cond, const char *what) {
+	printf("%s: %s\n", cond ? "ok  " : "FAIL", what);
+	return cond;
+}
+
+/* 書き込みと読み込みを一通り行う */
+static int run_scenario(atmegaio_t *atmegaio) {
+	unsigned int page[64], readback[64];
+	int eeprom_data[8], eeprom_readback[8];
+	int signature[3];
+	int fuse;
+	int ok = 1;
+	int i;
+	for (i = 0; i < 64; i++) page[i] = (i * 0x0101 + 0x1234) & 0xffff;
+	for (i = 0; i < 8; i++) eeprom_data[i] = 0x40 + i;
+	ok &= check(reset(atmegaio) == ATMEGAIO_SUCCESS, "reset");
+	ok &= check(read_signature_byte(atmegaio, signature) == ATMEGAIO_SUCCESS &&
+		signature[0] == 0x1E && signature[1] == 0x95 && signature[2] == 0x0F, "signature");
+	ok &= check(chip_erase(atmegaio, 0) == ATMEGAIO_SUCCESS, "chip_erase");
+	ok &= check(write_program(atmegaio, 0, page, 0x40, 64, 64) == ATMEGAIO_SUCCESS, "write_program");
+	ok &= check(read_program(atmegaio, readback, 0x40, 64) == ATMEGAIO_SUCCESS &&
+		memcmp(page, readback, sizeof(page)) == 0, "read_program");
+	ok &= check(write_information(atmegaio, 0, -1, 0xE2, -1, -1) == ATMEGAIO_SUCCESS &&
+		read_information(atmegaio, NULL, &fuse, NULL, NULL, NULL) == ATMEGAIO_SUCCESS &&
+		fuse == 0xE2, "fuse write/read");
+	ok &= check(write_eeprom(atmegaio, 0, eeprom_data, 0x10, 8) == ATMEGAIO_SUCCESS &&
+		read_eeprom(atmegaio, eeprom_readback, 0x10, 8) == ATMEGAIO_SUCCESS &&
+		memcmp(eeprom_data, eeprom_readback, sizeof(eeprom_data)) == 0, "eeprom write/read");
+	return ok;
+}
+
+int main(void) {
+	pthread_t thread;
+	atmegaio_t *atmegaio = NULL;
+	struct timespec wait = {0, 50 * 1000000L};
+	int ok = 1;
+	int i;
+	atmega_sim_init(&sim);
+	uhid_fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (uhid_fd < 0) {
+		perror("open /dev/uhid");
+		return 77;
+	}
+	if (!create_device()) {
+		perror("UHID_CREATE2");
+		return 1;
+	}
+	pthread_create(&thread, NULL, device_thread, NULL);
+	/* hidrawノードが作られるのを待つ(キャッシュは使わない) */
+	setenv("USBIO_DEVICE_CACHE", "", 1);
+	for (i = 0; i < 40 && atmegaio == NULL; i++) {
+		nanosleep(&wait, NULL);
+		atmegaio = usbio_init(8, 7, 6, 5);
+	}
+	if (!check(atmegaio != NULL, "usbio_init")) {
+		ok = 0;
+	} else {
+		ok &= run_scenario(atmegaio);
+		printf("%lu report(s) in blocking mode\n", report_count);
+		usbio_set_pipelined(atmegaio->hardware_data, 1);
+		atmega_sim_init(&sim);
+		report_count = 0;
+		ok &= run_scenario(atmegaio);
+		printf("%lu report(s) in pipelined mode\n", report_count);
+		ok &= check(disconnect(atmegaio) == ATMEGAIO_SUCCESS, "disconnect");
+	}
+	stop_flag = 1;
+	pthread_join(thread, NULL);
+	destroy_device();
+	close(uhid_fd);
+	puts(ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
@@ -3,7 +3,9 @@
 #include <ddk/hidsdi.h>
 #include <ddk/hidpi.h>
 #include <stdlib.h>
+#include <string.h>
 #include "usbio_windows.h"
+#include "device_cache.h"
 #include "atmega_io.h"
 
 #define IO_SIZE 65
@@ -11,79 +13,142 @@
 
 typedef struct {
 	HANDLE hDevice;
-	int sin_port, sout_port, clock_port, reset_port;
+	/* MISOを接続したポート(ターゲットごと) */
+	int sin_port[PORT_NUM];
+	int target_num;
+	int sout_port, clock_port, reset_port;
 } hid_t;
 
-static int openHID(HANDLE *hHid, int vendor_id, const int product_ids[], int product_id_num) {
+/* 目的のデバイスの条件 */
+typedef struct {
+	int vendor_id;
+	const int *product_ids;
+	int product_id_num;
+} hid_condition_t;
+
+/* SetupDiによるHIDデバイスの列挙の状態 */
+typedef struct {
+	const hid_condition_t *condition;
 	GUID hid_guid;
 	HDEVINFO hDeviceInfo;
 	int index;
-	HidD_GetHidGuid(&hid_guid);
-	if (product_ids == NULL || product_id_num <= 0) return 0;
+	SP_DEVICE_INTERFACE_DETAIL_DATA *detail;
+} hid_enum_t;
 
-	/* デバイスを列挙して探す */
-	hDeviceInfo = SetupDiGetClassDevs(
-		&hid_guid, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
-	for (index = 0; ; index++) {
-		SP_DEVICE_INTERFACE_DATA did;
-		SP_DEVICE_INTERFACE_DETAIL_DATA *detail;
-		DWORD needed_size;
-		did.cbSize = sizeof(did);
-		/* 次のデバイスの情報を得る準備をする */
-		if (SetupDiEnumDeviceInterfaces(hDeviceInfo, NULL, &hid_guid, index, &did)) {
-			SP_DEVINFO_DATA devinfo;
-			HANDLE hDevice;
-			/* このデバイスの情報を得る */
-			devinfo.cbSize = sizeof(devinfo);
-			if (!SetupDiGetDeviceInterfaceDetail(hDeviceInfo, &did, NULL, 0, &needed_size, &devinfo)
-				&& GetLastError() != ERROR_INSUFFICIENT_BUFFER) break;
-			detail = HeapAlloc(GetProcessHeap(), 0, needed_size);
-			if (detail == NULL) break;
-			detail->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA);
-			if (!SetupDiGetDeviceInterfaceDetail(hDeviceInfo, &did, detail, needed_size, &needed_size, &devinfo)) {
-				HeapFree(GetProcessHeap(), 0, detail);
+/* パスで指定したデバイスを開き、条件に合うかを確認する */
+static int openHIDPath(const hid_condition_t *condition, const char *path, HANDLE *hHid) {
+	HANDLE hDevice;
+	HIDD_ATTRIBUTES attr;
+	hDevice = CreateFile(path, GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
+	if (hDevice == INVALID_HANDLE_VALUE) return 0;
+	/* IDがマッチするかを調べる */
+	if (HidD_GetAttributes(hDevice, &attr) && attr.VendorID == condition->vendor_id) {
+		int i, matched = 0;
+		for (i = 0; i < condition->product_id_num; i++) {
+			if (attr.ProductID == condition->product_ids[i]) {
+				matched = 1;
 				break;
 			}
-			/* このデバイスを開く */
-			hDevice = CreateFile(detail->DevicePath, GENERIC_READ | GENERIC_WRITE,
-				FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-			HeapFree(GetProcessHeap(), 0, detail);
-			if (hDevice != INVALID_HANDLE_VALUE) {
-				HIDD_ATTRIBUTES attr;
-				/* IDがマッチするかを調べる */
-				if (HidD_GetAttributes(hDevice, &attr) && attr.VendorID == vendor_id) {
-					int i, matched = 0;
-					for (i = 0; i < product_id_num; i++) {
-						if (attr.ProductID == product_ids[i]) {
-							matched = 1;
-							break;
-						}
-					}
-					if (matched) {
-						/* 最終的な情報を記録する */
-						PHIDP_PREPARSED_DATA ppd;
-						HIDP_CAPS caps;
-						if (HidD_GetPreparsedData(hDevice, &ppd) &&
-						HidP_GetCaps(ppd, &caps) == HIDP_STATUS_SUCCESS &&
-						caps.OutputReportByteLength == IO_SIZE &&
-						caps.InputReportByteLength == IO_SIZE) {
-							/* 結果を返す */
-							*hHid = hDevice;
-							SetupDiDestroyDeviceInfoList(hDeviceInfo);
-							return 1;
-						}
-					}
-				}
-				CloseHandle(hDevice);
+		}
+		if (matched) {
+			/* 最終的な情報を記録する */
+			PHIDP_PREPARSED_DATA ppd;
+			HIDP_CAPS caps;
+			if (HidD_GetPreparsedData(hDevice, &ppd) &&
+			HidP_GetCaps(ppd, &caps) == HIDP_STATUS_SUCCESS &&
+			caps.OutputReportByteLength == IO_SIZE &&
+			caps.InputReportByteLength == IO_SIZE) {
+				/* 結果を返す */
+				*hHid = hDevice;
+				return 1;
 			}
-		} else {
-			break;
 		}
 	}
-	SetupDiDestroyDeviceInfoList(hDeviceInfo);
+	CloseHandle(hDevice);
 	return 0;
 }
 
+static int hid_enum_begin(void *context) {
+	hid_enum_t *e = (hid_enum_t*)context;
+	HidD_GetHidGuid(&e->hid_guid);
+	e->hDeviceInfo = SetupDiGetClassDevs(
+		&e->hid_guid, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+	e->index = 0;
+	e->detail = NULL;
+	return e->hDeviceInfo != INVALID_HANDLE_VALUE;
+}
+
+static const char *hid_enum_next(void *context) {
+	hid_enum_t *e = (hid_enum_t*)context;
+	SP_DEVICE_INTERFACE_DATA did;
+	SP_DEVINFO_DATA devinfo;
+	DWORD needed_size;
+	if (e->detail != NULL) {
+		HeapFree(GetProcessHeap(), 0, e->detail);
+		e->detail = NULL;
+	}
+	did.cbSize = sizeof(did);
+	/* 次のデバイスの情報を得る準備をする */
+	if (!SetupDiEnumDeviceInterfaces(e->hDeviceInfo, NULL, &e->hid_guid, e->index++, &did)) {
+		return NULL;
+	}
+	/* このデバイスの情報を得る */
+	devinfo.cbSize = sizeof(devinfo);
+	if (!SetupDiGetDeviceInterfaceDetail(e->hDeviceInfo, &did, NULL, 0, &needed_size, &devinfo)
+		&& GetLastError() != ERROR_INSUFFICIENT_BUFFER) return NULL;
+	e->detail = HeapAlloc(GetProcessHeap(), 0, needed_size);
+	if (e->detail == NULL) return NULL;
+	e->detail->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA);
+	if (!SetupDiGetDeviceInterfaceDetail(e->hDeviceInfo, &did, e->detail, needed_size, &needed_size, &devinfo)) {
+		return NULL;
+	}
+	return e->detail->DevicePath;
+}
+
+static void hid_enum_end(void *context) {
+	hid_enum_t *e = (hid_enum_t*)context;
+	if (e->detail != NULL) {
+		HeapFree(GetProcessHeap(), 0, e->detail);
+		e->detail = NULL;
+	}
+	SetupDiDestroyDeviceInfoList(e->hDeviceInfo);
+}
+
+static int hid_enum_open(void *context, const char *path, void *device) {
+	return openHIDPath(((hid_enum_t*)context)->condition, path, (HANDLE*)device);
+}
+
+/* デバイスのパスのキャッシュファイルの場所を決める */
+static const char *cacheFilePath(void) {
+	static char path[MAX_PATH + 32];
+	const char *env = getenv("USBIO_DEVICE_CACHE");
+	DWORD len;
+	if (env != NULL) return env[0] != '\0' ? env : NULL;
+	len = GetTempPathA(MAX_PATH, path);
+	if (len == 0 || len > MAX_PATH) return NULL;
+	strcat(path, "usbio_device_path.txt");
+	return path;
+}
+
+static int openHID(HANDLE *hHid, int vendor_id, const int product_ids[], int product_id_num) {
+	hid_condition_t condition;
+	hid_enum_t e;
+	device_source_t source;
+	if (product_ids == NULL || product_id_num <= 0) return 0;
+	condition.vendor_id = vendor_id;
+	condition.product_ids = product_ids;
+	condition.product_id_num = product_id_num;
+	e.condition = &condition;
+	source.context = &e;
+	source.begin = hid_enum_begin;
+	source.next = hid_enum_next;
+	source.end = hid_enum_end;
+	source.open = hid_enum_open;
+	/* 前回見つけたパスを先に試し、駄目ならデバイスを列挙して探す */
+	return device_open_cached(&source, cacheFilePath(), hHid);
+}
+
 static int writeAndRead(HANDLE hHid,const unsigned char* writeData,unsigned char* readData) {
 	DWORD size;
 	if(!WriteFile(hHid,writeData,IO_SIZE,&size,NULL) || size!=IO_SIZE)return 0;
@@ -119,25 +184,38 @@ static int usbio_disconnect(void *hardware_data) {
 	return 1;
 }
 
-/* USB-IO2.0を用いて8ビット送受信する。
- * 成功と判定したら受信したデータを、失敗ｗ検出したら-1を返す。
+/* USB-IO2.0を用いて全ターゲットと8ビット送受信する。
+ * 受信したデータはinにターゲットの順に格納する。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
  */
-static int usbio_io_8bits(void *hardware_data, int out) {
+static int usbio_io_8bits_multi(void *hardware_data, int out, int *in) {
 	hid_t *hid;
-	int i;
-	int input = 0;
-	if (hardware_data == NULL) return -1;
+	int i, j;
+	if (hardware_data == NULL || in == NULL) return 0;
 	hid = (hid_t*)hardware_data;
+	for (j = 0; j < hid->target_num; j++) in[j] = 0;
 	for (i = 7; i >= 0; i--) {
 		int raw_input;
 		/* クロックをLOWにして出力を設定する */
-		if (!inputAndOutput(hid->hDevice, ((out >> i) & 1) << hid->sout_port, NULL)) return -1;
+		if (!inputAndOutput(hid->hDevice, ((out >> i) & 1) << hid->sout_port, NULL)) return 0;
 		/* クロックをHIGHにして入力を読み込む */
 		if (!inputAndOutput(hid->hDevice,
-			(((out >> i) & 1) << hid->sout_port) | (1 << hid->clock_port), &raw_input)) return -1;
-		if ((raw_input >> hid->sin_port) & 1) input |= (1 << i);
+			(((out >> i) & 1) << hid->sout_port) | (1 << hid->clock_port), &raw_input)) return 0;
+		/* 1回の入力で全ターゲットのMISOが読める */
+		for (j = 0; j < hid->target_num; j++) {
+			if ((raw_input >> hid->sin_port[j]) & 1) in[j] |= (1 << i);
+		}
 	}
-	if (!inputAndOutput(hid->hDevice, 0, NULL)) return -1;
+	if (!inputAndOutput(hid->hDevice, 0, NULL)) return 0;
+	return 1;
+}
+
+/* USB-IO2.0を用いて8ビット送受信する。
+ * 成功と判定したら受信したデータを、失敗ｗ検出したら-1を返す。
+ */
+static int usbio_io_8bits(void *hardware_data, int out) {
+	int input;
+	if (!usbio_io_8bits_multi(hardware_data, out, &input)) return -1;
 	return input;
 }
 
@@ -157,40 +235,118 @@ static int usbio_reset(void *hardware_data) {
 	return 1;
 }
 
-atmegaio_t *usbio_init(int sin_port, int sout_port, int clock_port, int reset_port) {
+/* USB-IO2.0のRESETをHIGHにしてターゲットのプログラムを動かす。
+ * SCKとMOSIはLOWのままにする。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+static int usbio_release(void *hardware_data) {
+	HANDLE hDevice;
+	int reset_port;
+	if (hardware_data == NULL) return 0;
+	hDevice = ((hid_t*)hardware_data)->hDevice;
+	reset_port = ((hid_t*)hardware_data)->reset_port;
+	return inputAndOutput(hDevice, 1 << reset_port, NULL);
+}
+
+int usbio_round_trip(void *hardware_data) {
+	if (hardware_data == NULL) return 0;
+	return inputAndOutput(((hid_t*)hardware_data)->hDevice, 0, NULL);
+}
+
+/* ポートの設定を確認してUSB-IO2.0を開く。
+ * pathがNULLの場合はデバイスを探す。
+ * 成功と判定したら通信用データのポインタ、失敗を検出したらNULLを返す。
+ */
+static hid_t *usbio_open(const char *path, const int *sin_ports, int target_num,
+int sout_port, int clock_port, int reset_port) {
 	static const int vendor_id = 0x1352;
 	static const int product_id[2] = {0x120, 0x121};
 	static const int product_id_num = 2;
 	HANDLE hUsbIO;
-	atmegaio_t *atmegaio;
 	hid_t *hid;
-	if (sin_port < 0 || PORT_NUM <= sin_port || sout_port < 0 || PORT_NUM <= sout_port ||
-	reset_port < 0 || PORT_NUM <= reset_port || clock_port < 0 || PORT_NUM <= clock_port ||
-	sin_port == sout_port || sin_port == clock_port || sin_port == reset_port ||
-	sout_port == clock_port || sout_port == reset_port || clock_port == reset_port) {
-		/* 無効なポートまたはポートが被っている */
+	int used[PORT_NUM] = {};
+	int i;
+	if (sin_ports == NULL || target_num <= 0 || PORT_NUM < target_num ||
+	ATMEGAIO_MAX_TARGETS < target_num ||
+	sout_port < 0 || PORT_NUM <= sout_port ||
+	reset_port < 0 || PORT_NUM <= reset_port || clock_port < 0 || PORT_NUM <= clock_port) {
+		/* 無効なポートまたはターゲット数 */
 		return NULL;
 	}
+	used[sout_port]++;
+	used[clock_port]++;
+	used[reset_port]++;
+	for (i = 0; i < target_num; i++) {
+		if (sin_ports[i] < 0 || PORT_NUM <= sin_ports[i]) return NULL;
+		used[sin_ports[i]]++;
+	}
+	for (i = 0; i < PORT_NUM; i++) {
+		/* ポートが被っている */
+		if (used[i] > 1) return NULL;
+	}
 	/* USB-IO2.0を開く */
-	if(!openHID(&hUsbIO, vendor_id, product_id, product_id_num)) {
+	if (path != NULL) {
+		hid_condition_t condition;
+		condition.vendor_id = vendor_id;
+		condition.product_ids = product_id;
+		condition.product_id_num = product_id_num;
+		if (!openHIDPath(&condition, path, &hUsbIO)) return NULL;
+	} else if(!openHID(&hUsbIO, vendor_id, product_id, product_id_num)) {
 		return NULL;
 	}
 	/* 情報を格納する */
-	atmegaio = malloc(sizeof(atmegaio_t));
-	if (atmegaio == NULL) return NULL;
 	hid = malloc(sizeof(hid_t));
 	if (hid == NULL) {
-		free(atmegaio);
+		CloseHandle(hUsbIO);
 		return NULL;
 	}
 	hid->hDevice = hUsbIO;
-	hid->sin_port = sin_port;
+	for (i = 0; i < target_num; i++) hid->sin_port[i] = sin_ports[i];
+	hid->target_num = target_num;
 	hid->sout_port = sout_port;
 	hid->clock_port = clock_port;
 	hid->reset_port = reset_port;
+	return hid;
+}
+
+atmegaio_t *usbio_init_path(const char *path,
+int sin_port, int sout_port, int clock_port, int reset_port) {
+	atmegaio_t *atmegaio;
+	hid_t *hid;
+	atmegaio = calloc(1, sizeof(atmegaio_t));
+	if (atmegaio == NULL) return NULL;
+	hid = usbio_open(path, &sin_port, 1, sout_port, clock_port, reset_port);
+	if (hid == NULL) {
+		free(atmegaio);
+		return NULL;
+	}
 	atmegaio->hardware_data = (void*)hid;
 	atmegaio->disconnect = usbio_disconnect;
 	atmegaio->reset = usbio_reset;
 	atmegaio->io_8bits = usbio_io_8bits;
+	atmegaio->release = usbio_release;
+	return atmegaio;
+}
+
+atmegaio_t *usbio_init(int sin_port, int sout_port, int clock_port, int reset_port) {
+	return usbio_init_path(NULL, sin_port, sout_port, clock_port, reset_port);
+}
+
+atmegaio_multi_t *usbio_init_multi(const int *sin_ports, int target_num,
+int sout_port, int clock_port, int reset_port) {
+	atmegaio_multi_t *atmegaio;
+	hid_t *hid;
+	atmegaio = malloc(sizeof(atmegaio_multi_t));
+	if (atmegaio == NULL) return NULL;
+	hid = usbio_open(NULL, sin_ports, target_num, sout_port, clock_port, reset_port);
+	if (hid == NULL) {
+		free(atmegaio);
+		return NULL;
+	}
+	atmegaio->hardware_data = (void*)hid;
+	atmegaio->target_num = target_num;
+	atmegaio->disconnect = usbio_disconnect;
+	atmegaio->reset = usbio_reset;
+	atmegaio->io_8bits = usbio_io_8bits_multi;
 	return atmegaio;
 }
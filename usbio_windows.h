@@ -4,8 +4,31 @@
 #include "atmega_io.h"
 
 /* USB-IO2.0を用いた通信を初期化する。
+ * 前回見つけたデバイスのパスを記録しておき、次回はそれを先に試す。
+ * 記録するファイルは環境変数USBIO_DEVICE_CACHEで指定でき(空なら記録しない)、
+ * 指定しない場合は一時ディレクトリのusbio_device_path.txtを用いる。
  * 成功と判定したら通信用データのポインタ、失敗を検出したらNULLを返す。
  */
 atmegaio_t *usbio_init(int sin_port, int sout_port, int clock_port, int reset_port);
 
+/* デバイスのパスを指定して、USB-IO2.0を用いた通信を初期化する。
+ * デバイスの列挙を行わないので、usbio_initより速く開ける。
+ * 成功と判定したら通信用データのポインタ、失敗を検出したらNULLを返す。
+ */
+atmegaio_t *usbio_init_path(const char *path,
+	int sin_port, int sout_port, int clock_port, int reset_port);
+
+/* USB-IO2.0を用いた複数ターゲットとの通信を初期化する。
+ * SCK、MOSI、RESETは全ターゲットで共有し、MISOはターゲットごとにsin_portsのポートに接続する。
+ * 成功と判定したら通信用データのポインタ、失敗を検出したらNULLを返す。
+ */
+atmegaio_multi_t *usbio_init_multi(const int *sin_ports, int target_num,
+	int sout_port, int clock_port, int reset_port);
+
+/* 全ての出力をLOWにするレポートを1個送信し、応答を受信する(通信の診断用)。
+ * hardware_dataはusbio_init系の関数が返した構造体のhardware_dataを渡す。
+ * 成功と判定したら真、失敗を検出したら偽を返す。
+ */
+int usbio_round_trip(void *hardware_data);
+
 #endif
@@ -1,11 +1,509 @@
 #include <stdio.h>
 #include <string.h>
-#include "usbio_windows.h"
 #include "atmega_io.h"
+#include "programmer.h"
 #include "progress_bar.h"
 #include "load_hex.h"
+#include "patch.h"
+#include "null_io.h"
+#include "journal.h"
+#ifdef __linux__
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "hex_stream.h"
+#endif
 
 #define DATA_BUFFER_SIZE 0x10000
+/* włpb`̍ő吔 */
+#define MAX_PATCHES 16
+/* wł̓t@C̍ő吔 */
+#define MAX_INPUT_FILES 8
+/* EEPROM̃obt@̃TCY */
+#define EEPROM_BUFFER_SIZE 0x400
+
+/* EEPROMɏގw̃oCgƁA擪2oCg("FP") */
+#define STAMP_SIZE 6
+#define STAMP_MAGIC0 0x46
+#define STAMP_MAGIC1 0x50
+
+/* ̒ʂԍt@CǂݍށBǂݍ߂^ԂB */
+static int load_serial(const char *path, unsigned long *serial) {
+	FILE *fp = fopen(path, "r");
+	int ok;
+	if (fp == NULL) return 0;
+	ok = fscanf(fp, "%lu", serial) == 1;
+	fclose(fp);
+	return ok;
+}
+
+/* ̒ʂԍt@Cɕۑ */
+static void save_serial(const char *path, unsigned long serial) {
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "serial file \"%s\" open error\n", path);
+		return;
+	}
+	fprintf(fp, "%lu\n", serial);
+	fclose(fp);
+}
+
+/* y[Wɏނׂf[^邩𒲂ׂ */
+static int page_has_data(const unsigned int *words, int page, int page_size) {
+	int i;
+	for (i = 0; i < page_size; i++) {
+		if (words[page + i] != 0xffff) return 1;
+	}
+	return 0;
+}
+
+/* ̓t@CJB"-"ȂW͂ԂB */
+static FILE *open_input(const char *path) {
+	FILE *fp;
+	if (strcmp(path, "-") == 0) return stdin;
+	fp = fopen(path, "r");
+	if (fp == NULL) fprintf(stderr, "file \"%s\" open error\n", path);
+	return fp;
+}
+
+/* SCK̎g𒲐Aʂ\ */
+static void calibrate_and_report(const atmegaio_t *atmegaio) {
+	unsigned long frequency;
+	int ret;
+	if ((ret = calibrate_sck(atmegaio, &frequency)) != ATMEGAIO_SUCCESS) {
+		fprintf(stderr, "error %d on calibrate_sck\n", ret);
+	} else if (frequency > 0) {
+		printf("SCK = %lu Hz\n", frequency);
+	}
+}
+
+/* ^[Qbg̏Ɏgݒ */
+typedef struct {
+	const char *programmer;
+	int bootloader;
+	int fixed_wait;
+	/* 0Ȃ玩ŒBݒ肵͎ۂ̎gɂȂ */
+	unsigned long sck_frequency;
+	int lock_bits, fuse_bits, fuse_high_bits, extended_fuse_bits;
+	/* ^̏ꍇAChip Erases */
+	int erase;
+} target_setup_t;
+
+/* ZbgSCK킹ASignature Byte\ */
+static void connect_target(const atmegaio_t *atmegaio, target_setup_t *setup) {
+	int signature[4];
+	int ret;
+	if ((ret = reset(atmegaio)) != ATMEGAIO_SUCCESS) {
+		fprintf(stderr, "error %d on reset\n", ret);
+	}
+	if (setup->sck_frequency > 0) {
+		if ((ret = set_sck_frequency(atmegaio, setup->sck_frequency, &setup->sck_frequency)) != ATMEGAIO_SUCCESS) {
+			fprintf(stderr, "error %d on set_sck_frequency\n", ret);
+		}
+	} else if (!setup->bootloader) {
+		calibrate_and_report(atmegaio);
+	}
+	if ((ret = read_signature_byte(atmegaio, signature)) == ATMEGAIO_SUCCESS) {
+		printf("signature = %02X %02X %02X\n",
+			signature[0], signature[1], signature[2]);
+	} else {
+		fprintf(stderr, "read_signature_byte error %d\n", ret);
+	}
+}
+
+/* Ɗȅ݂sBsUԂB */
+static int program_target(const atmegaio_t *atmegaio, target_setup_t *setup) {
+	int ret;
+	if (setup->erase && !setup->bootloader) {
+		if ((ret = chip_erase(atmegaio, setup->fixed_wait)) != ATMEGAIO_SUCCESS) {
+			fprintf(stderr, "error %d on chip_erase\n", ret);
+			return 0;
+		}
+	}
+	if (!setup->bootloader && (ret = write_information(atmegaio, setup->fixed_wait,
+	setup->lock_bits, setup->fuse_bits, setup->fuse_high_bits, setup->extended_fuse_bits)) != ATMEGAIO_SUCCESS) {
+		fprintf(stderr, "error %d on write_information\n", ret);
+		return 0;
+	} else if (!setup->bootloader && setup->sck_frequency == 0 && setup->fuse_bits >= 0) {
+		/* NbN̐ݒ肪ςȂ̂ŁASCK̎g킹 */
+		calibrate_and_report(atmegaio);
+	}
+	return 1;
+}
+
+/* ZbgSCK킹ASignature Byte\ĂAƊȅ݂sB
+ * sUԂB
+ */
+static int prepare_target(const atmegaio_t *atmegaio, target_setup_t *setup) {
+	connect_target(atmegaio, setup);
+	return program_target(atmegaio, setup);
+}
+
+/**
+ * ^[QbgFuse bitsLock bitsǂݍ݁AސݒƔrB
+ * ސݒ肪Γǂݍ܂ȂB
+ * @param atmegaio ݑ
+ * @param setup Fuse bitsLock bits̐ݒ
+ * @return SĈvΐ^
+ */
+static int information_matches(const atmegaio_t *atmegaio, const target_setup_t *setup) {
+	int information[5];
+	if (setup->lock_bits < 0 && setup->fuse_bits < 0 &&
+	setup->fuse_high_bits < 0 && setup->extended_fuse_bits < 0) {
+		return 1;
+	}
+	return read_information(atmegaio, &information[0], &information[1], &information[2],
+		&information[3], &information[4]) == ATMEGAIO_SUCCESS &&
+		(setup->lock_bits < 0 || setup->lock_bits == information[0]) &&
+		(setup->fuse_bits < 0 || setup->fuse_bits == information[1]) &&
+		(setup->fuse_high_bits < 0 || setup->fuse_high_bits == information[2]) &&
+		(setup->extended_fuse_bits < 0 || setup->extended_fuse_bits == information[3]);
+}
+
+/* FNV-1ǎvZ1oCg */
+static unsigned long hash_byte(unsigned long hash, unsigned int byte) {
+	return ((hash ^ (byte & 0xff)) * 16777619UL) & 0xffffffffUL;
+}
+
+/**
+ * ޓeŜ̎wvZB
+ * @param words ރf[^(pb`𓖂Ă̂)
+ * @param page_size y[WTCY
+ * @param setup Fuse bitsLock bits̐ݒ
+ * @param eeprom EEPROMɏރf[^(pb`𓖂Ă̂)
+ * @param eeprom_defined EEPROMɏރoCg̈
+ * @return w
+ */
+static unsigned long image_fingerprint(const unsigned int *words, int page_size, const target_setup_t *setup,
+const int *eeprom, const unsigned char *eeprom_defined) {
+	unsigned long hash = journal_image_hash(words, DATA_BUFFER_SIZE, page_size);
+	const int information[4] = {
+		setup->lock_bits, setup->fuse_bits, setup->fuse_high_bits, setup->extended_fuse_bits
+	};
+	int i;
+	/* ܂Ȃ(-1)ꍇƋʂ邽߁A9rbgڂ */
+	for (i = 0; i < 4; i++) {
+		hash = hash_byte(hash, (unsigned int)information[i]);
+		hash = hash_byte(hash, ((unsigned int)information[i] >> 8) & 1);
+	}
+	for (i = 0; i < EEPROM_BUFFER_SIZE; i++) {
+		if (!eeprom_defined[i]) continue;
+		hash = hash_byte(hash, (unsigned int)i);
+		hash = hash_byte(hash, (unsigned int)i >> 8);
+		hash = hash_byte(hash, (unsigned int)eeprom[i]);
+	}
+	return hash;
+}
+
+/**
+ * EEPROMɏ܂ꂽwǂݍށB
+ * @param atmegaio ݑ
+ * @param address wuEEPROM̃AhX
+ * @param fingerprint ǂݍ񂾎wi[ϐւ̃|C^
+ * @return w䂪܂Ă1AꂽԂȂ0AȊO(ʂ̓eǂݍ݂̎s)Ȃ-1
+ */
+static int read_stamp(const atmegaio_t *atmegaio, int address, unsigned long *fingerprint) {
+	int stamp[STAMP_SIZE];
+	int i, blank = 1;
+	int ret;
+	if ((ret = read_eeprom(atmegaio, stamp, address, STAMP_SIZE)) != ATMEGAIO_SUCCESS) {
+		fprintf(stderr, "error %d on reading the fingerprint\n", ret);
+		return -1;
+	}
+	for (i = 0; i < STAMP_SIZE; i++) {
+		if (stamp[i] != 0xff) blank = 0;
+	}
+	if (blank) return 0;
+	if (stamp[0] != STAMP_MAGIC0 || stamp[1] != STAMP_MAGIC1) return -1;
+	*fingerprint = 0;
+	for (i = 0; i < 4; i++) *fingerprint |= (unsigned long)stamp[2 + i] << (8 * i);
+	return 1;
+}
+
+/**
+ * EEPROMɎwŏƍB
+ * @param atmegaio ݑ
+ * @param fixed_wait ^̏ꍇAPoll RDY/~BSYŝł͂ȂA10ms҂
+ * @param address wuEEPROM̃AhX
+ * @param fingerprint ގwBNULLȂꂽԂɖ߂
+ * @return ߂^
+ */
+static int write_stamp(const atmegaio_t *atmegaio, int fixed_wait, int address, const unsigned long *fingerprint) {
+	int stamp[STAMP_SIZE], stamp_read[STAMP_SIZE];
+	int i;
+	int ret;
+	for (i = 0; i < STAMP_SIZE; i++) stamp[i] = 0xff;
+	if (fingerprint != NULL) {
+		stamp[0] = STAMP_MAGIC0;
+		stamp[1] = STAMP_MAGIC1;
+		for (i = 0; i < 4; i++) stamp[2 + i] = (int)((*fingerprint >> (8 * i)) & 0xff);
+	}
+	if ((ret = write_eeprom(atmegaio, fixed_wait, stamp, address, STAMP_SIZE)) != ATMEGAIO_SUCCESS ||
+	(ret = read_eeprom(atmegaio, stamp_read, address, STAMP_SIZE)) != ATMEGAIO_SUCCESS) {
+		fprintf(stderr, "error %d on writing the fingerprint\n", ret);
+		return 0;
+	}
+	return memcmp(stamp, stamp_read, sizeof(stamp)) == 0;
+}
+
+/**
+ * ^[Qbg̓eǂݍ݁Aރf[^ƔrB
+ * @param atmegaio ݑ
+ * @param words ރf[^
+ * @param page_used ރy[Ẅ(܂Ȃy[W͔rȂ)
+ * @param page_size y[WTCY
+ * @param setup Fuse bitsLock bits̐ݒ
+ * @param eeprom EEPROMɏރf[^
+ * @param eeprom_defined EEPROMɏރoCg̈
+ * @return SĈvΐ^
+ */
+static int target_matches(const atmegaio_t *atmegaio, const unsigned int *words, const unsigned char *page_used,
+int page_size, const target_setup_t *setup, const int *eeprom, const unsigned char *eeprom_defined) {
+	static unsigned int words_read[DATA_BUFFER_SIZE];
+	int eeprom_read[EEPROM_BUFFER_SIZE];
+	int i, j;
+	if (!information_matches(atmegaio, setup)) return 0;
+	for (i = 0; i + page_size <= DATA_BUFFER_SIZE; i += page_size) {
+		if (!page_used[i / page_size]) continue;
+		if (read_program(atmegaio, words_read + i, i, page_size) != ATMEGAIO_SUCCESS ||
+		memcmp(words + i, words_read + i, page_size * sizeof(*words)) != 0) {
+			return 0;
+		}
+	}
+	for (i = 0; i < EEPROM_BUFFER_SIZE; i = j) {
+		if (!eeprom_defined[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i; j < EEPROM_BUFFER_SIZE && eeprom_defined[j]; j++);
+		if (read_eeprom(atmegaio, eeprom_read + i, i, j - i) != ATMEGAIO_SUCCESS ||
+		memcmp(eeprom + i, eeprom_read + i, sizeof(int) * (j - i)) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+#ifdef __linux__
+/* ǂݍ݂Ȃ珑ޏꍇɁA݃Xbhŏ݊J */
+static atmegaio_t *open_stream_target(void *user_data) {
+	atmegaio_t *atmegaio = programmer_open(((const target_setup_t*)user_data)->programmer);
+	if (atmegaio != NULL) enable_cache(atmegaio);
+	return atmegaio;
+}
+
+/* ǂݍ݂Ȃ珑ޏꍇɁA݃XbhŃ^[Qbg */
+static int prepare_stream_target(const atmegaio_t *atmegaio, void *user_data) {
+	return prepare_target(atmegaio, (target_setup_t*)user_data);
+}
+
+/* Ď߂悤ɗvꂽ^ */
+static volatile sig_atomic_t watch_stop = 0;
+
+static void handle_watch_interrupt(int sig) {
+	(void)sig;
+	watch_stop = 1;
+}
+
+/* ĎĂ̓t@C̍XV̂҂(~b) */
+#define WATCH_SETTLE_MS 200
+
+/* ĎĂ̓t@CǂݍݒāA[hPʂ̃f[^ɂ */
+static int reload_input(const char *path, int offset, unsigned int *words) {
+	static char data[DATA_BUFFER_SIZE];
+	static unsigned char defined[DATA_BUFFER_SIZE];
+	FILE *fp;
+	int ret;
+	int i;
+	memset(data, 0xff, sizeof(data));
+	memset(defined, 0, sizeof(defined));
+	/* chars_to_words߂Ȃ㔼A߂ɓǂݍ񂾎ƓꂽԂɂ */
+	for (i = 0; i < DATA_BUFFER_SIZE; i++) words[i] = 0xffff;
+	if ((fp = fopen(path, "r")) == NULL) return LOAD_HEX_IO_ERROR;
+	ret = load_hex_merge(data, defined, sizeof(data), offset, fp, NULL, NULL);
+	fclose(fp);
+	if (ret != LOAD_HEX_SUCCESS) return ret;
+	return chars_to_words(words, data, sizeof(data));
+}
+
+/* ̓t@ĈfBNg̃Cxgǂ݁A̓t@CɊւ̂ΐ^Ԃ */
+static int read_watch_events(int fd, const char *name) {
+	/* Cxg̍\̂̋Eɍ킹 */
+	union {
+		struct inotify_event event;
+		char bytes[4096];
+	} buffer;
+	const struct inotify_event *event;
+	ssize_t size;
+	char *p;
+	int found = 0;
+	if ((size = read(fd, buffer.bytes, sizeof(buffer.bytes))) <= 0) return 0;
+	for (p = buffer.bytes; p < buffer.bytes + size; p += sizeof(struct inotify_event) + event->len) {
+		event = (const struct inotify_event*)p;
+		if (event->len > 0 && strcmp(event->name, name) == 0) found = 1;
+	}
+	return found;
+}
+
+/* EEPROMƍ(Chip Erasěɏ) */
+static int rewrite_eeprom(const atmegaio_t *atmegaio, int fixed_wait,
+const int *eeprom, const unsigned char *eeprom_defined) {
+	int eeprom_read[EEPROM_BUFFER_SIZE];
+	int i, j;
+	for (i = 0; i < EEPROM_BUFFER_SIZE; i = j) {
+		if (!eeprom_defined[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i; j < EEPROM_BUFFER_SIZE && eeprom_defined[j]; j++);
+		if (write_eeprom(atmegaio, fixed_wait, eeprom + i, i, j - i) != ATMEGAIO_SUCCESS ||
+		read_eeprom(atmegaio, eeprom_read + i, i, j - i) != ATMEGAIO_SUCCESS ||
+		memcmp(eeprom + i, eeprom_read + i, sizeof(int) * (j - i)) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* vO~O[h𔲂āA񂾃vO𓮂 */
+static void run_target(const atmegaio_t *atmegaio) {
+	int ret = release_target(atmegaio);
+	if (ret == ATMEGAIO_NOT_SUPPORTED) {
+		fputs("this programmer can't release RESET; the target stays in reset\n", stderr);
+	} else if (ret != ATMEGAIO_SUCCESS) {
+		fprintf(stderr, "error %d on release_target\n", ret);
+	}
+}
+
+/**
+ * ̓t@CĎAXV邽тɑO񏑂񂾃f[^ƈႤy[WށB
+ * ISP̃y[W݂̓rbg10ɂςȂ̂ŁAႤy[W̒
+ * 01ɖ߂rbg΁AChip EraseđSẴy[WB
+ * u[g[_̓y[WƂɏ̂ŁAɈႤy[WށB
+ * 񂾌̓^[Qbg̃vO𓮂BCtrl+CŏIB
+ * @param atmegaio ݑ(ڑ܂܎g)
+ * @param setup ^[Qbg̏Ɏgݒ
+ * @param path ̓t@C
+ * @param offset ̓t@C̃AhXɑl
+ * @param page_size y[WTCY
+ * @param flashed ^[Qbgɏłf[^(ނтɍXV)
+ * @param eeprom Chip ErasěɏEEPROM̃f[^
+ * @param eeprom_defined EEPROMɏރoCg̈
+ * @return Ō݂̏ԂŏI^
+ */
+static int watch_input(const atmegaio_t *atmegaio, target_setup_t *setup, const char *path, int offset,
+int page_size, unsigned int *flashed, const int *eeprom, const unsigned char *eeprom_defined) {
+	static unsigned int words[DATA_BUFFER_SIZE];
+	static unsigned int read_back[DATA_BUFFER_SIZE];
+	static char directory[4096];
+	const char *name = strrchr(path, '/');
+	/* ݂Ɏs^[Qbg̓eȂ̂ŁA͑Ŝ */
+	int unknown = 0;
+	int fd;
+	int ret;
+	int i, j;
+	if (name == path) {
+		strcpy(directory, "/");
+		name++;
+	} else if (name != NULL && (size_t)(name - path) < sizeof(directory)) {
+		memcpy(directory, path, name - path);
+		directory[name - path] = '\0';
+		name++;
+	} else {
+		strcpy(directory, ".");
+		name = path;
+	}
+	/* rhc[̓t@Cu邱Ƃ̂ŁAfBNgĎ */
+	if ((fd = inotify_init()) < 0 ||
+	inotify_add_watch(fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+		perror("inotify");
+		if (fd >= 0) close(fd);
+		return 0;
+	}
+	watch_stop = 0;
+	signal(SIGINT, handle_watch_interrupt);
+	run_target(atmegaio);
+	fprintf(stderr, "watching \"%s\" (Ctrl+C to quit)\n", path);
+	while (!watch_stop) {
+		struct pollfd pfd;
+		int changed_pages = 0, pages_to_write = 0, written_pages = 0;
+		int erase, setup_failed = 0;
+		progress_t progress;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) <= 0 || !read_watch_events(fd, name)) continue;
+		/* ݂ĂԂ͑҂ */
+		while (!watch_stop && poll(&pfd, 1, WATCH_SETTLE_MS) > 0) read_watch_events(fd, name);
+		if (watch_stop) break;
+		if ((ret = reload_input(path, offset, words)) != LOAD_HEX_SUCCESS) {
+			fprintf(stderr, "error %d on load_hex (waiting for the next change)\n", ret);
+			continue;
+		}
+		/* Ⴄy[WƁAKv𒲂ׂ */
+		erase = unknown;
+		for (i = 0; i + page_size <= DATA_BUFFER_SIZE; i += page_size) {
+			if (memcmp(words + i, flashed + i, page_size * sizeof(*words)) == 0) continue;
+			changed_pages++;
+			for (j = 0; j < page_size && !setup->bootloader; j++) {
+				if (words[i + j] & ~flashed[i + j] & 0xffff) erase = 1;
+			}
+		}
+		if (changed_pages == 0 && !unknown) {
+			fputs("no page changed\n", stderr);
+			continue;
+		}
+		connect_target(atmegaio, setup);
+		if (erase) {
+			setup->erase = 1;
+			if (!program_target(atmegaio, setup)) {
+				setup_failed = 1;
+			} else if (!rewrite_eeprom(atmegaio, setup->fixed_wait, eeprom, eeprom_defined)) {
+				fputs("EEPROM rewrite failed\n", stderr);
+				setup_failed = 1;
+			}
+		}
+		for (i = 0; i + page_size <= DATA_BUFFER_SIZE; i += page_size) {
+			if (erase ? page_has_data(words, i, page_size) :
+			memcmp(words + i, flashed + i, page_size * sizeof(*words)) != 0) {
+				pages_to_write++;
+			}
+		}
+		fprintf(stderr, "%d page(s) changed; %s %d page(s)\n", changed_pages,
+			erase ? "erasing and writing" : "writing", pages_to_write);
+		init_progress(&progress, pages_to_write);
+		unknown = 1;
+		for (i = 0; i + page_size <= DATA_BUFFER_SIZE && !setup_failed; i += page_size) {
+			if (erase ? !page_has_data(words, i, page_size) :
+			memcmp(words + i, flashed + i, page_size * sizeof(*words)) == 0) {
+				continue;
+			}
+			if ((ret = write_program(atmegaio, setup->fixed_wait, words + i, i, page_size, page_size)) != ATMEGAIO_SUCCESS ||
+			(ret = read_program(atmegaio, read_back + i, i, page_size)) != ATMEGAIO_SUCCESS) {
+				fprintf(stderr, "\nerror %d on writing the page at word address %04X\n", ret, i);
+				break;
+			}
+			if (memcmp(words + i, read_back + i, page_size * sizeof(*words)) != 0) {
+				fprintf(stderr, "\npage at word address %04X mismatch\n", i);
+				break;
+			}
+			update_progress(&progress, ++written_pages);
+		}
+		fputc('\n', stderr);
+		if (written_pages == pages_to_write && !setup_failed) {
+			unknown = 0;
+			memcpy(flashed, words, sizeof(words));
+		} else {
+			fputs("will erase and rewrite everything on the next change\n", stderr);
+		}
+		run_target(atmegaio);
+		fprintf(stderr, "watching \"%s\" (Ctrl+C to quit)\n", path);
+	}
+	signal(SIGINT, SIG_DFL);
+	close(fd);
+	return !unknown;
+}
+#endif
 
 int main(int argc, char *argv[]) {
 	int lock_bits = -1;
@@ -18,14 +516,62 @@ int main(int argc, char *argv[]) {
 	static char data[DATA_BUFFER_SIZE];
 	static unsigned int data_words[DATA_BUFFER_SIZE];
 	static unsigned int validation_words[DATA_BUFFER_SIZE];
-	const char *input_file = NULL;
+	const char *input_files[MAX_INPUT_FILES];
+	int input_offsets[MAX_INPUT_FILES];
+	int input_num = 0;
+	int input_offset = 0;
+	/* W͂ǂݍޓ̓t@C̐ */
+	int stdin_used = 0;
+	static unsigned char data_defined[DATA_BUFFER_SIZE];
+	const char *eeprom_file = NULL;
+	static char eeprom_bytes[EEPROM_BUFFER_SIZE];
+	static unsigned char eeprom_defined[EEPROM_BUFFER_SIZE];
+	static int eeprom_image[EEPROM_BUFFER_SIZE], eeprom_read_back[EEPROM_BUFFER_SIZE];
+	/* pb`𓖂ẮA{[hƂEEPROM̃f[^ */
+	static int board_eeprom[EEPROM_BUFFER_SIZE];
+	static unsigned char board_eeprom_defined[EEPROM_BUFFER_SIZE];
+	/* wuEEPROM̃AhX(ȂwgȂ) */
+	int stamp_address = -1;
+	int force = 0;
+	int differential = 0;
+	unsigned long fingerprint = 0, stamp_fingerprint;
+	int board_verified = 0;
+	const char *programmer = NULL;
+#ifdef __linux__
+	static char bootloader_spec[512];
+#endif
+	int bootloader = 0;
+	int page_verify = 0;
+	const char *journal_file = NULL;
+	FILE *journal = NULL;
+	static unsigned char page_done[DATA_BUFFER_SIZE];
+	int resumed_pages = -1;
+	char board_id[JOURNAL_BOARD_ID_SIZE];
+	int write_failed = 0;
+	static patch_t patches[MAX_PATCHES];
+	int patch_num = 0;
+	static unsigned char page_used[DATA_BUFFER_SIZE];
+	static unsigned char page_patched[DATA_BUFFER_SIZE];
+	int boards = 1;
+	int board;
+	unsigned long serial = 1, serial_step = 1;
+	const char *serial_file = NULL;
+	int exit_code = 0;
+	int dry_run = 0;
+	atmegaio_cache_stats_t cache_stats;
+	unsigned long report_us = NULL_IO_DEFAULT_REPORT_US;
+	unsigned long sck_frequency = 0;
 	int command_line_error = 0;
 	int show_help = 0;
 	int i, j;
 	FILE* fp;
 	int ret;
-	atmegaio_t *atmegaio;
-	int signature[4];
+	atmegaio_t *atmegaio = NULL;
+	target_setup_t setup;
+	int stream = 0;
+	int watch = 0;
+	int input_index;
+	int streamed = 0;
 	int pages_to_write = 0;
 	int written_pages = 0;
 	int fixed_wait = 0;
@@ -84,11 +630,156 @@ int main(int argc, char *argv[]) {
 			}
 		} else if (strcmp(argv[i], "--input-file") == 0 || strcmp(argv[i], "-i") == 0) {
 			if ((++i) < argc) {
-				input_file = argv[i];
+				if (input_num >= MAX_INPUT_FILES) {
+					fprintf(stderr, "too many --input-file\n");
+					command_line_error = 1;
+				} else {
+					if (strcmp(argv[i], "-") == 0) stdin_used++;
+					input_files[input_num] = argv[i];
+					input_offsets[input_num] = input_offset;
+					input_num++;
+				}
+				input_offset = 0;
 			} else {
 				fprintf(stderr, "missing argument for --input-file\n");
 				command_line_error = 1;
 			}
+		} else if (strcmp(argv[i], "--input-offset") == 0) {
+			if ((++i) < argc) {
+				if (sscanf(argv[i], "%x", (unsigned int*)&input_offset) != 1 ||
+				input_offset < 0 || input_offset >= DATA_BUFFER_SIZE) {
+					fprintf(stderr, "invalid argument for --input-offset\n");
+					command_line_error = 1;
+				}
+			} else {
+				fprintf(stderr, "missing argument for --input-offset\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--eeprom-file") == 0) {
+			if ((++i) < argc) {
+				if (strcmp(argv[i], "-") == 0) stdin_used++;
+				eeprom_file = argv[i];
+			} else {
+				fprintf(stderr, "missing argument for --eeprom-file\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--programmer") == 0 || strcmp(argv[i], "-P") == 0) {
+			if ((++i) < argc) {
+				programmer = argv[i];
+			} else {
+				fprintf(stderr, "missing argument for --programmer\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--bootloader") == 0 || strcmp(argv[i], "-b") == 0) {
+#ifdef __linux__
+			if ((++i) < argc) {
+				snprintf(bootloader_spec, sizeof(bootloader_spec), "optiboot:%s", argv[i]);
+				programmer = bootloader_spec;
+				bootloader = 1;
+			} else {
+				fprintf(stderr, "missing argument for --bootloader\n");
+				command_line_error = 1;
+			}
+#else
+			/* optiboot:̓VA|[gĝLinuxłɂ */
+			fputs("--bootloader is only available on Linux\n", stderr);
+			command_line_error = 1;
+			i++;
+#endif
+		} else if (strcmp(argv[i], "--sck-frequency") == 0) {
+			if ((++i) < argc) {
+				if (sscanf(argv[i], "%lu", &sck_frequency) != 1 || sck_frequency == 0) {
+					fprintf(stderr, "invalid argument for --sck-frequency\n");
+					command_line_error = 1;
+				}
+			} else {
+				fprintf(stderr, "missing argument for --sck-frequency\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--journal") == 0 || strcmp(argv[i], "-j") == 0) {
+			if ((++i) < argc) {
+				journal_file = argv[i];
+			} else {
+				fprintf(stderr, "missing argument for --journal\n");
+				command_line_error = 1;
+			}
+#ifdef __linux__
+		} else if (strcmp(argv[i], "--stream") == 0) {
+			stream = 1;
+		} else if (strcmp(argv[i], "--watch") == 0) {
+			watch = 1;
+#endif
+		} else if (strcmp(argv[i], "--stamp") == 0) {
+			if ((++i) < argc) {
+				if (sscanf(argv[i], "%x", (unsigned int*)&stamp_address) != 1 ||
+				stamp_address < 0 || stamp_address > EEPROM_BUFFER_SIZE - STAMP_SIZE) {
+					fprintf(stderr, "invalid argument for --stamp\n");
+					command_line_error = 1;
+				}
+			} else {
+				fprintf(stderr, "missing argument for --stamp\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--force") == 0 || strcmp(argv[i], "-f") == 0) {
+			force = 1;
+		} else if (strcmp(argv[i], "--differential") == 0) {
+			differential = 1;
+		} else if (strcmp(argv[i], "--dry-run") == 0 || strcmp(argv[i], "-n") == 0) {
+			dry_run = 1;
+		} else if (strcmp(argv[i], "--report-latency") == 0) {
+			if ((++i) < argc) {
+				if (sscanf(argv[i], "%lu", &report_us) != 1) {
+					fprintf(stderr, "invalid argument for --report-latency\n");
+					command_line_error = 1;
+				}
+			} else {
+				fprintf(stderr, "missing argument for --report-latency\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--patch") == 0) {
+			if ((++i) < argc) {
+				if (patch_num >= MAX_PATCHES) {
+					fprintf(stderr, "too many --patch\n");
+					command_line_error = 1;
+				} else if ((ret = patch_parse(&patches[patch_num], argv[i])) != PATCH_SUCCESS) {
+					fprintf(stderr, "invalid argument for --patch (error %d)\n", ret);
+					command_line_error = 1;
+				} else {
+					patch_num++;
+				}
+			} else {
+				fprintf(stderr, "missing argument for --patch\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--boards") == 0) {
+			if ((++i) < argc) {
+				if (sscanf(argv[i], "%d", &boards) != 1 || boards <= 0) {
+					fprintf(stderr, "invalid argument for --boards\n");
+					command_line_error = 1;
+				}
+			} else {
+				fprintf(stderr, "missing argument for --boards\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--serial") == 0) {
+			if ((++i) < argc) {
+				if (sscanf(argv[i], "%lu:%lu", &serial, &serial_step) < 1) {
+					fprintf(stderr, "invalid argument for --serial\n");
+					command_line_error = 1;
+				}
+			} else {
+				fprintf(stderr, "missing argument for --serial\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--serial-file") == 0) {
+			if ((++i) < argc) {
+				serial_file = argv[i];
+			} else {
+				fprintf(stderr, "missing argument for --serial-file\n");
+				command_line_error = 1;
+			}
+		} else if (strcmp(argv[i], "--page-verify") == 0) {
+			page_verify = 1;
 		} else if (strcmp(argv[i], "--chip-erase") == 0) {
 			do_chip_erase = 1;
 		} else if (strcmp(argv[i], "--no-chip-erase") == 0) {
@@ -108,6 +799,42 @@ int main(int argc, char *argv[]) {
 			command_line_error = 1;
 		}
 	}
+	if (bootloader && (lock_bits >= 0 || fuse_bits >= 0 || fuse_high_bits >= 0 || extended_fuse_bits >= 0)) {
+		fputs("Lock bits and Fuse bits can't be written through the bootloader\n", stderr);
+		command_line_error = 1;
+	}
+	if (bootloader && eeprom_file != NULL) {
+		fputs("EEPROM can't be written through the bootloader\n", stderr);
+		command_line_error = 1;
+	}
+	if (bootloader && (stamp_address >= 0 || differential)) {
+		fputs("--stamp and --differential can't be used through the bootloader\n", stderr);
+		command_line_error = 1;
+	}
+	if (input_offset != 0) {
+		fputs("--input-offset must come before the --input-file it applies to\n", stderr);
+		command_line_error = 1;
+	}
+	if (stdin_used > 1) {
+		fputs("only one input can be read from stdin\n", stderr);
+		command_line_error = 1;
+	}
+	if (stream && (input_num != 1 || input_offsets[0] != 0 || boards > 1 || patch_num > 0 ||
+	journal_file != NULL || dry_run || stamp_address >= 0 || differential)) {
+		fputs("--stream needs one --input-file without --input-offset and can't be used with\n", stderr);
+		fputs("--boards, --patch, --journal, --dry-run, --stamp or --differential\n", stderr);
+		command_line_error = 1;
+	}
+	if (watch && (input_num != 1 || stdin_used || boards > 1 || patch_num > 0 || journal_file != NULL ||
+	stream || dry_run || stamp_address >= 0 || (!do_chip_erase && !bootloader))) {
+		fputs("--watch needs one --input-file other than stdin and can't be used with --boards, --patch,\n", stderr);
+		fputs("--journal, --stream, --dry-run, --stamp or --no-chip-erase\n", stderr);
+		command_line_error = 1;
+	}
+	if (boards > 1 && stdin_used) {
+		fputs("--boards needs stdin to wait for the next board\n", stderr);
+		command_line_error = 1;
+	}
 	/* KvȂwv\ */
 	if (show_help || command_line_error) {
 		fprintf(stderr, "Usage: %s [options...]\n", argc > 0 ? argv[0] : "write_atmega");
@@ -118,6 +845,45 @@ int main(int argc, char *argv[]) {
 		fputs("--extended-fuse-byte <byte> / -ef <byte> : write Extended Fuse Byte\n", stderr);
 		fputs("--page-size <size> / -p <size> : set page size (default: 64)\n", stderr);
 		fputs("--input-file <file> / -i <file> : set hex file to write (default: none)\n", stderr);
+		fputs("    repeat to merge several files (e.g. bootloader and application) into one image;\n", stderr);
+		fputs("    overlapping bytes must have the same value\n", stderr);
+		fputs("--input-offset <hex> : byte address offset for the next --input-file (default: 0)\n", stderr);
+		fputs("--eeprom-file <file> : set hex file to write to EEPROM after the program\n", stderr);
+		fputs("--programmer <spec> / -P <spec> : select programmer (default: usbio)\n", stderr);
+#ifdef __linux__
+		fputs("--bootloader <port>[:<baud>] / -b <port>[:<baud>] :\n", stderr);
+		fputs("    write through the Optiboot bootloader on the serial port instead of ISP\n", stderr);
+		fputs("    (no chip erase, Lock bits or Fuse bits; blank pages between the first and last\n", stderr);
+		fputs("    pages with data are written with 0xFF, pages outside them keep their old contents)\n", stderr);
+#endif
+		fputs("--sck-frequency <Hz> : use the given SCK frequency\n", stderr);
+		fputs("    (default: find the fastest stable one, again after writing Fuse Low Byte)\n", stderr);
+		fputs("--journal <file> / -j <file> : record verified pages in the file and\n", stderr);
+		fputs("    resume from it if the same data was interrupted on the same board\n", stderr);
+		fputs("    (removed on success; refused if the board's signature, calibration or serial differs)\n", stderr);
+		fputs("--patch <space>:<address>:<width>:<format>:<source> :\n", stderr);
+		fputs("    patch each board's data (space: flash or eeprom, address: hex byte address,\n", stderr);
+		fputs("    format: le, be or ascii, source: serial, value=<hex> or file=<one hex per board>)\n", stderr);
+		fputs("--boards <n> : program n boards in a row, waiting for Enter between them (default: 1)\n", stderr);
+		fputs("--serial <start>[:<step>] : serial number of the first board and the step (default: 1:1)\n", stderr);
+		fputs("--serial-file <file> : read the next serial number from the file and update it\n", stderr);
+		fputs("--page-verify : read back and compare each page right after writing it\n", stderr);
+		fputs("--stamp <hex> : keep a fingerprint of the data, Fuse bits and Lock bits in EEPROM at the address\n", stderr);
+		fprintf(stderr, "    (%d bytes) and skip the board if it matches; written only after --validation or\n", STAMP_SIZE);
+		fputs("    --page-verify succeeded\n", stderr);
+		fputs("--differential : if the fingerprint doesn't match, read the board and skip it when\n", stderr);
+		fputs("    the pages to write, Fuse bits, Lock bits and EEPROM data already match\n", stderr);
+		fputs("--force / -f : always write, even if the board looks up to date\n", stderr);
+#ifdef __linux__
+		fputs("--stream : connect, erase and write completed pages while the HEX file is still being read\n", stderr);
+		fputs("    (rewrites everything after reading if the records are not in address order)\n", stderr);
+		fputs("--watch : after writing, keep the programmer open and watch the input file; on each change\n", stderr);
+		fputs("    write only the pages that differ and run the target (chip erase and a full rewrite\n", stderr);
+		fputs("    if a changed page needs a bit set back to 1, which a page write can't do)\n", stderr);
+#endif
+		fputs("--dry-run / -n : don't touch the hardware; count the USB-IO2.0 traffic and estimate the time\n", stderr);
+		fprintf(stderr, "--report-latency <us> : time per USB report for --dry-run (default: %lu)\n",
+			NULL_IO_DEFAULT_REPORT_US);
 		fputs("--chip-erase : do chip erase before writing (default)\n", stderr);
 		fputs("--no-chip-erase : don't do chip erase before writing\n", stderr);
 		fputs("--validation / -v : do validation after writing\n", stderr);
@@ -125,6 +891,8 @@ int main(int argc, char *argv[]) {
 		fputs("--fixed-wait : wait 10ms for writing/erasing\n", stderr);
 		fputs("--no-fixed-wait : use Poll RDY/~BSY for writing/erasing (default)\n", stderr);
 		fputs("--help / -h : show this help\n", stderr);
+		fputc('\n', stderr);
+		programmer_usage(stderr);
 
 		fputs("\nconnection between USB-IO2.0 and ATmega:\n", stderr);
 		fputs("serial out   (MOSI) : J1-7\n", stderr);
@@ -134,140 +902,433 @@ int main(int argc, char *argv[]) {
 		return command_line_error ? 1 : 0;
 	}
 
+	if (page_size <= 0 || page_size > DATA_BUFFER_SIZE) {
+		fputs("invalid page size\n", stderr);
+		return 1;
+	}
+	/* Ďꍇ͏񂾃f[^̍̊ɂ̂ŁAݒɏƍĂ */
+	if (watch) page_verify = 1;
+	setup.programmer = programmer;
+	setup.bootloader = bootloader;
+	setup.fixed_wait = fixed_wait;
+	setup.sck_frequency = sck_frequency;
+	setup.lock_bits = lock_bits;
+	setup.fuse_bits = fuse_bits;
+	setup.fuse_high_bits = fuse_high_bits;
+	setup.extended_fuse_bits = extended_fuse_bits;
+	setup.erase = do_chip_erase;
+
 	/* t@Cǂݍ */
 	for (i = 0; i < DATA_BUFFER_SIZE; i++) {
 		data[i] = 0xff;
 		data_words[i] = validation_words[i] = 0xffff;
 	}
-	if (input_file != NULL) {
-		if (strcmp(input_file, "-") == 0) {
-			fp = stdin;
+	for (input_index = 0; input_index < input_num; input_index++) {
+		if ((fp = open_input(input_files[input_index])) == NULL) return 1;
+		if (stream) {
+#ifdef __linux__
+			hex_stream_config_t stream_config;
+			hex_stream_result_t stream_result;
+			stream_config.open = open_stream_target;
+			stream_config.prepare = prepare_stream_target;
+			stream_config.user_data = &setup;
+			stream_config.page_size = page_size;
+			stream_config.fixed_wait = fixed_wait;
+			stream_config.page_verify = page_verify;
+			streamed = hex_stream_write(data, sizeof(data), fp, &stream_config, page_done, &stream_result);
+			ret = stream_result.load_result;
+			atmegaio = stream_result.atmegaio;
+			if (stream_result.prepare_failed) {
+				fputs("failed to prepare the target while streaming\n", stderr);
+				write_failed = 1;
+			} else if (stream_result.out_of_order) {
+				fputs("HEX records are not in address order; rewriting in the buffered mode\n", stderr);
+			} else if (stream_result.write_result != ATMEGAIO_SUCCESS) {
+				fprintf(stderr, "error %d on write_program\n", stream_result.write_result);
+				write_failed = 1;
+			} else if (stream_result.mismatch) {
+				fputs("page mismatch while streaming\n", stderr);
+				write_failed = 1;
+			} else if (ret == LOAD_HEX_SUCCESS) {
+				fprintf(stderr, "%d page(s) written while reading the HEX file\n", stream_result.written_pages);
+			}
+#endif
 		} else {
-			fp = fopen(input_file, "r");
-			if (fp == NULL) {
-				fprintf(stderr, "file \"%s\" open error\n", input_file);
-				return 1;
+			/* O̓̓t@CƏd˂ */
+			int overlap = 0, conflict_address = 0;
+			ret = load_hex_merge(data, data_defined, sizeof(data), input_offsets[input_index], fp,
+				&overlap, &conflict_address);
+			if (ret == LOAD_HEX_CONFLICT) {
+				fprintf(stderr, "\"%s\" conflicts with the previous input at byte address %04X\n",
+					input_files[input_index], conflict_address);
+			} else if (ret == LOAD_HEX_SUCCESS && overlap > 0) {
+				fprintf(stderr, "\"%s\": %d byte(s) overlap the previous input with the same value\n",
+					input_files[input_index], overlap);
 			}
 		}
-		ret = load_hex(data, sizeof(data), fp);
+		if (fp != stdin) fclose(fp);
+		if (ret != LOAD_HEX_SUCCESS || write_failed) {
+			if (ret != LOAD_HEX_SUCCESS && ret != LOAD_HEX_CONFLICT) fprintf(stderr, "error %d on load_hex\n", ret);
+			if (atmegaio != NULL) disconnect(atmegaio);
+			return 1;
+		}
+	}
+	if (eeprom_file != NULL) {
+		for (i = 0; i < EEPROM_BUFFER_SIZE; i++) eeprom_bytes[i] = 0xff;
+		if ((fp = open_input(eeprom_file)) == NULL) {
+			if (atmegaio != NULL) disconnect(atmegaio);
+			return 1;
+		}
+		ret = load_hex_merge(eeprom_bytes, eeprom_defined, EEPROM_BUFFER_SIZE, 0, fp, NULL, NULL);
 		if (fp != stdin) fclose(fp);
 		if (ret != LOAD_HEX_SUCCESS) {
-			fprintf(stderr, "error %d on load_hex\n", ret);
+			fprintf(stderr, "error %d on load_hex for EEPROM\n", ret);
+			if (atmegaio != NULL) disconnect(atmegaio);
 			return 1;
 		}
+		for (i = 0; i < EEPROM_BUFFER_SIZE; i++) eeprom_image[i] = (unsigned char)eeprom_bytes[i];
 	}
 	if ((ret = chars_to_words(data_words, data, sizeof(data))) != LOAD_HEX_SUCCESS) {
 		fprintf(stderr, "error %d on chars_to_words\n", ret);
 		return 1;
 	}
 
-	/* ݑ */
-	if ((atmegaio = usbio_init(8, 7, 6, 5)) == NULL) {
-		fputs("error on usbio_init\n", stderr);
-		return 1;
+	/* ނׂy[W𒲂ׂ(pb`𓖂Ăy[W͌Œǉ) */
+	for (i = 0; i + page_size <= DATA_BUFFER_SIZE; i += page_size) {
+		page_used[i / page_size] = page_has_data(data_words, i, page_size);
 	}
-	if ((ret = reset(atmegaio)) != ATMEGAIO_SUCCESS) {
-		fprintf(stderr, "error %d on reset\n", ret);
+	if (bootloader) {
+		/* u[g[_ł͏Ȃ̂ŁAf[^͈̔͂ɂ̃y[W0xFFŏ݁A
+		 * ÕvOcȂ悤ɂ
+		 */
+		int first_page = -1, last_page = -1;
+		for (i = 0; i + page_size <= DATA_BUFFER_SIZE; i += page_size) {
+			if (!page_used[i / page_size]) continue;
+			if (first_page < 0) first_page = i / page_size;
+			last_page = i / page_size;
+		}
+		for (i = first_page; 0 <= i && i <= last_page; i++) page_used[i] = 1;
 	}
-	if ((ret = read_signature_byte(atmegaio, signature)) == ATMEGAIO_SUCCESS) {
-		printf("signature = %02X %02X %02X\n",
-			signature[0], signature[1], signature[2]);
+	if (serial_file != NULL && load_serial(serial_file, &serial)) {
+		fprintf(stderr, "next serial number from \"%s\": %lu\n", serial_file, serial);
+	}
+
+	if (dry_run) {
+		/* ςł̓W[ig킸Aʂԍ̃t@CXVȂ */
+		journal_file = NULL;
+		serial_file = NULL;
+	}
+
+	/* ݑ */
+	if (atmegaio != NULL) {
+		/* ǂݍ݂Ȃ珑񂾎ɊJĂ */
+	} else if (dry_run) {
+		atmegaio = null_io_init(report_us);
 	} else {
-		fprintf(stderr, "read_signature_byte error %d\n", ret);
+		atmegaio = programmer_open(programmer);
 	}
-	if (do_chip_erase) {
-		if ((ret = chip_erase(atmegaio, fixed_wait)) != ATMEGAIO_SUCCESS) {
-			fprintf(stderr, "error %d on chip_erase\n", ret);
-		}
+	if (atmegaio == NULL) {
+		fputs("error on programmer_open\n", stderr);
+		return 1;
 	}
-	if ((ret = write_information(atmegaio, fixed_wait,
-	lock_bits, fuse_bits, fuse_high_bits, extended_fuse_bits)) != ATMEGAIO_SUCCESS) {
-		fprintf(stderr, "error %d on write_information\n", ret);
+	/* ݒɏƍy[ẂAŌ̏ƍœǂݍݒɍς */
+	if ((ret = enable_cache(atmegaio)) != ATMEGAIO_SUCCESS) {
+		fprintf(stderr, "error %d on enable_cache (continuing without it)\n", ret);
 	}
-
-	/* ނׂy[V𐔂 */
-	for (i = 0; i + page_size <= DATA_BUFFER_SIZE; i += page_size) {
-		for (j = 0; j < page_size; j++) {
-			if (data_words[i + j] != 0xffff) {
-				pages_to_write++;
+	for (board = 0; board < boards; board++) {
+		int eeprom_failed = 0;
+		if (board > 0) {
+			char line[16];
+			fprintf(stderr, "connect board %d/%d and press Enter (q to quit): ", board + 1, boards);
+			if (fgets(line, sizeof(line), stdin) == NULL || line[0] == 'q') break;
+		}
+		/* pb`𓖂ĂBey[WݑΏۂɉA݌ɏƍ */
+		memset(page_patched, 0, sizeof(page_patched));
+		for (i = 0; i < patch_num; i++) {
+			unsigned char bytes[PATCH_MAX_WIDTH];
+			if (patches[i].space != PATCH_FLASH) continue;
+			if ((ret = patch_bytes(&patches[i], board, serial, bytes)) != PATCH_SUCCESS ||
+			patches[i].address + patches[i].width > DATA_BUFFER_SIZE * 2) {
+				fprintf(stderr, "error %d on patch %d\n", ret, i + 1);
+				write_failed = 1;
 				break;
 			}
+			for (j = 0; j < patches[i].width; j++) {
+				unsigned int addr = patches[i].address + j;
+				unsigned int shift = (addr & 1) ? 8 : 0;
+				unsigned int word = addr / 2;
+				data_words[word] = (data_words[word] & ~(0xffu << shift)) | ((unsigned int)bytes[j] << shift);
+				page_used[word / page_size] = page_patched[word / page_size] = 1;
+			}
 		}
-	}
-	/* ۂɏ݂s */
-	fputs("writing the data...\n", stderr);
-	init_progress(&progress, pages_to_write);
-	for (i = 0; i + page_size <= DATA_BUFFER_SIZE; i += page_size) {
-		int to_write = 0;
-		for (j = 0; j < page_size; j++) {
-			if (data_words[i + j] != 0xffff) {
-				to_write = 1;
+		/* EEPROM̃f[^Ƀpb`𓖂Ă */
+		memcpy(board_eeprom, eeprom_image, sizeof(board_eeprom));
+		memcpy(board_eeprom_defined, eeprom_defined, sizeof(board_eeprom_defined));
+		for (i = 0; !write_failed && i < patch_num; i++) {
+			unsigned char bytes[PATCH_MAX_WIDTH];
+			if (patches[i].space != PATCH_EEPROM) continue;
+			if ((ret = patch_bytes(&patches[i], board, serial, bytes)) != PATCH_SUCCESS ||
+			patches[i].address + patches[i].width > EEPROM_BUFFER_SIZE) {
+				fprintf(stderr, "error %d on patch %d\n", ret, i + 1);
+				write_failed = 1;
 				break;
 			}
+			for (j = 0; j < patches[i].width; j++) {
+				board_eeprom[patches[i].address + j] = bytes[j];
+				board_eeprom_defined[patches[i].address + j] = 1;
+			}
 		}
-		if (to_write) {
-			if ((ret = write_program(atmegaio, fixed_wait, data_words + i, i, page_size, page_size)) != ATMEGAIO_SUCCESS) {
-				fprintf(stderr, "error %d on write_program\n", ret);
-				break;
+		for (i = 0; !write_failed && stamp_address >= 0 && i < STAMP_SIZE; i++) {
+			if (board_eeprom_defined[stamp_address + i]) {
+				fputs("the EEPROM data overlaps the fingerprint\n", stderr);
+				write_failed = 1;
 			}
-			written_pages++;
-			update_progress(&progress, written_pages);
 		}
-	}
-	fputc('\n', stderr);
+		if (write_failed) {
+			exit_code = 1;
+			break;
+		}
+		if (patch_num > 0) printf("board %d: serial = %lu\n", board + 1, serial);
 
-	if (do_validation) {
-		int checked = 0;
-		int mismatch = 0;
-		int lock_bits_read, fuse_bits_read, fuse_high_bits_read;
-		int extended_fuse_bits_read, calibration_byte_read;
-		fputs("validating the data...\n", stderr);
-		init_progress(&progress, pages_to_write);
-		written_pages = 0;
-		for (i = 0; i + page_size <= DATA_BUFFER_SIZE; i += page_size) {
-			int to_write = 0;
-			for (j = 0; j < page_size; j++) {
-				if (data_words[i + j] != 0xffff) {
-					to_write = 1;
+		if (!streamed) {
+			int up_to_date = 0;
+			connect_target(atmegaio, &setup);
+			if (journal_file != NULL) {
+				if (!journal_board_id(atmegaio, serial, board_id)) {
+					fputs("can't identify the board for the journal\n", stderr);
+					exit_code = 1;
 					break;
 				}
+				memset(page_done, 0, sizeof(page_done));
+				resumed_pages = journal_load(journal_file, journal_image_hash(data_words, DATA_BUFFER_SIZE, page_size),
+					page_size, board_id, page_done, DATA_BUFFER_SIZE);
+				if (resumed_pages == JOURNAL_OTHER_BOARD) {
+					fprintf(stderr, "journal \"%s\" was written for another board (now %s);\n",
+						journal_file, board_id);
+					fputs("reconnect that board, or remove the journal to start over\n", stderr);
+					exit_code = 1;
+					break;
+				} else if (resumed_pages >= 0) {
+					fprintf(stderr, "resuming from \"%s\": %d page(s) already written\n", journal_file, resumed_pages);
+				}
+			}
+			/* ĊJꍇ́AƏݍς݂̃y[WĂ܂ */
+			setup.erase = do_chip_erase && resumed_pages < 0;
+			if (stamp_address >= 0) {
+				fingerprint = image_fingerprint(data_words, page_size, &setup, board_eeprom, board_eeprom_defined);
+				ret = read_stamp(atmegaio, stamp_address, &stamp_fingerprint);
+				if (ret > 0 && stamp_fingerprint == fingerprint && !force) {
+					printf("board %d is up to date (fingerprint %08lX)\n", board + 1, fingerprint);
+					up_to_date = 1;
+				}
 			}
-			if (to_write) {
-				if ((ret = read_program(atmegaio, validation_words + i, i, page_size)) != ATMEGAIO_SUCCESS) {
-					fprintf(stderr, "error %d on read_program\n", ret);
+			if (!up_to_date && differential && !force &&
+			target_matches(atmegaio, data_words, page_used, page_size, &setup, board_eeprom, board_eeprom_defined)) {
+				printf("board %d already has the data (differential check)\n", board + 1);
+				up_to_date = 1;
+				if (stamp_address >= 0 && !write_stamp(atmegaio, fixed_wait, stamp_address, &fingerprint)) {
+					fputs("fingerprint write failed\n", stderr);
+					exit_code = 1;
+				}
+			} else if (!up_to_date) {
+				/* ݂rŎ~܂ĂŐVɌȂ悤AÂwɏ */
+				if (stamp_address >= 0 && ret != 0 && !write_stamp(atmegaio, fixed_wait, stamp_address, NULL)) {
+					fputs("fingerprint erase failed\n", stderr);
+					exit_code = 1;
 					break;
 				}
-				for (j = 0; j < page_size; j++) {
-					checked++;
-					if (data_words[i + j] != validation_words[i + j]) mismatch++;
+				if (!program_target(atmegaio, &setup)) {
+					exit_code = 1;
+					break;
 				}
+			}
+			if (up_to_date) {
+				serial += serial_step;
+				if (serial_file != NULL) save_serial(serial_file, serial);
+				continue;
+			}
+		}
+		if (journal_file != NULL) {
+			/* Ə݂̏IォL^ */
+			journal = journal_open(journal_file, resumed_pages >= 0,
+				journal_image_hash(data_words, DATA_BUFFER_SIZE, page_size), page_size, board_id);
+			if (journal == NULL) {
+				fprintf(stderr, "journal \"%s\" open error\n", journal_file);
+			}
+		}
+		/* ݒɏƍĂ΁Aw߂B
+		 * W[iJȂꍇ́A--page-verifyΏƍȂ
+		 */
+		board_verified = page_verify || journal != NULL;
+
+		/* ނׂy[V𐔂 */
+		pages_to_write = 0;
+		written_pages = 0;
+		for (i = 0; i + page_size <= DATA_BUFFER_SIZE; i += page_size) {
+			if (page_used[i / page_size]) pages_to_write++;
+		}
+		/* ۂɏ݂s */
+		fputs("writing the data...\n", stderr);
+		init_progress(&progress, pages_to_write);
+		for (i = 0; i + page_size <= DATA_BUFFER_SIZE; i += page_size) {
+			int to_write = page_used[i / page_size];
+			if (to_write && (journal_file != NULL || streamed) && page_done[i / page_size]) {
+				/* Ȍ݂ƏƍA܂͓ǂݍݒ݂̏Ă */
+				written_pages++;
+				update_progress(&progress, written_pages);
+			} else if (to_write) {
+				if ((ret = write_program(atmegaio, fixed_wait, data_words + i, i, page_size, page_size)) != ATMEGAIO_SUCCESS) {
+					fprintf(stderr, "\nerror %d on write_program\n", ret);
+					write_failed = 1;
+					break;
+				}
+				if (page_verify || journal != NULL || page_patched[i / page_size]) {
+					/* 񂾃y[WɓǂݍŔr */
+					if ((ret = read_program(atmegaio, validation_words + i, i, page_size)) != ATMEGAIO_SUCCESS) {
+						fprintf(stderr, "\nerror %d on read_program\n", ret);
+						write_failed = 1;
+						break;
+					}
+					if (memcmp(data_words + i, validation_words + i, page_size * sizeof(*data_words)) != 0) {
+						fprintf(stderr, "\npage at word address %04X mismatch\n", i);
+						write_failed = 1;
+						break;
+					}
+				}
+				if (journal != NULL) journal_record(journal, i);
 				written_pages++;
 				update_progress(&progress, written_pages);
 			}
 		}
 		fputc('\n', stderr);
-		puts("--- validation results ---");
-		printf("program: %d word(s) checked, %d mismatch(es) found.\n", checked, mismatch);
-		if ((ret = read_information(atmegaio,
-		&lock_bits_read, &fuse_bits_read, &fuse_high_bits_read,
-		&extended_fuse_bits_read, &calibration_byte_read)) == ATMEGAIO_SUCCESS) {
-			puts("Fuse bits and Lock bits:");
-			printf("Lock bits = %02X%s\n", lock_bits_read,
-				(lock_bits >= 0 && lock_bits != lock_bits_read) ? " (mismatch)" : "");
-			printf("Fuse bits = %02X%s\n", fuse_bits_read,
-				(fuse_bits >= 0 && fuse_bits != fuse_bits_read) ? " (mismatch)" : "");
-			printf("Fuse High bits = %02X%s\n", fuse_high_bits_read,
-				(fuse_high_bits >= 0 && fuse_high_bits != fuse_high_bits_read) ? " (mismatch)" : "");
-			printf("Extended Fuse bits = %02X%s\n", extended_fuse_bits_read,
-				(extended_fuse_bits >= 0 && extended_fuse_bits != extended_fuse_bits_read) ? " (mismatch)" : "");
-			printf("Calibration Byte = %02X\n", calibration_byte_read);
-		} else {
-			fprintf(stderr, "read_information error %d\n", ret);
+		if (journal != NULL) {
+			fclose(journal);
+			if (!write_failed) {
+				remove(journal_file);
+			} else {
+				fprintf(stderr, "run again with --journal \"%s\" to resume\n", journal_file);
+			}
+		}
+		if (write_failed) {
+			exit_code = 1;
+			break;
+		}
+
+		/* EEPROM̃f[^ƃpb`ŏƍ(f[^͈̂͂Ƃɏ) */
+		for (i = 0; i < EEPROM_BUFFER_SIZE; i = j) {
+			if (!board_eeprom_defined[i]) {
+				j = i + 1;
+				continue;
+			}
+			for (j = i; j < EEPROM_BUFFER_SIZE && board_eeprom_defined[j]; j++);
+			if ((ret = write_eeprom(atmegaio, fixed_wait, board_eeprom + i, i, j - i)) != ATMEGAIO_SUCCESS ||
+			(ret = read_eeprom(atmegaio, eeprom_read_back + i, i, j - i)) != ATMEGAIO_SUCCESS) {
+				fprintf(stderr, "error %d on writing EEPROM at %03X\n", ret, i);
+				eeprom_failed = 1;
+				break;
+			}
+			if (memcmp(board_eeprom + i, eeprom_read_back + i, sizeof(int) * (j - i)) != 0) {
+				fprintf(stderr, "EEPROM mismatch in %03X-%03X\n", i, j - 1);
+				eeprom_failed = 1;
+				break;
+			}
+		}
+
+		if (eeprom_failed) {
+			exit_code = 1;
+			break;
+		}
+
+		if (do_validation) {
+			int checked = 0;
+			int mismatch = 0;
+			int lock_bits_read, fuse_bits_read, fuse_high_bits_read;
+			int extended_fuse_bits_read, calibration_byte_read;
+			int read_failed = 0;
+			fputs("validating the data...\n", stderr);
+			init_progress(&progress, pages_to_write);
+			written_pages = 0;
+			for (i = 0; i + page_size <= DATA_BUFFER_SIZE; i += page_size) {
+				int to_write = page_used[i / page_size];
+				if (to_write) {
+					if ((ret = read_program(atmegaio, validation_words + i, i, page_size)) != ATMEGAIO_SUCCESS) {
+						fprintf(stderr, "error %d on read_program\n", ret);
+						read_failed = 1;
+						break;
+					}
+					for (j = 0; j < page_size; j++) {
+						checked++;
+						if (data_words[i + j] != validation_words[i + j]) mismatch++;
+					}
+					written_pages++;
+					update_progress(&progress, written_pages);
+				}
+			}
+			fputc('\n', stderr);
+			puts("--- validation results ---");
+			printf("program: %d word(s) checked, %d mismatch(es) found.\n", checked, mismatch);
+			board_verified = !read_failed && mismatch == 0;
+			if (bootloader) {
+				/* u[g[_łFuse bitsLock bitsǂݍ߂Ȃ */
+			} else if ((ret = read_information(atmegaio,
+			&lock_bits_read, &fuse_bits_read, &fuse_high_bits_read,
+			&extended_fuse_bits_read, &calibration_byte_read)) == ATMEGAIO_SUCCESS) {
+				puts("Fuse bits and Lock bits:");
+				printf("Lock bits = %02X%s\n", lock_bits_read,
+					(lock_bits >= 0 && lock_bits != lock_bits_read) ? " (mismatch)" : "");
+				printf("Fuse bits = %02X%s\n", fuse_bits_read,
+					(fuse_bits >= 0 && fuse_bits != fuse_bits_read) ? " (mismatch)" : "");
+				printf("Fuse High bits = %02X%s\n", fuse_high_bits_read,
+					(fuse_high_bits >= 0 && fuse_high_bits != fuse_high_bits_read) ? " (mismatch)" : "");
+				printf("Extended Fuse bits = %02X%s\n", extended_fuse_bits_read,
+					(extended_fuse_bits >= 0 && extended_fuse_bits != extended_fuse_bits_read) ? " (mismatch)" : "");
+				printf("Calibration Byte = %02X\n", calibration_byte_read);
+				if ((lock_bits >= 0 && lock_bits != lock_bits_read) || (fuse_bits >= 0 && fuse_bits != fuse_bits_read) ||
+				(fuse_high_bits >= 0 && fuse_high_bits != fuse_high_bits_read) ||
+				(extended_fuse_bits >= 0 && extended_fuse_bits != extended_fuse_bits_read)) {
+					board_verified = 0;
+				}
+			} else {
+				fprintf(stderr, "read_information error %d\n", ret);
+				board_verified = 0;
+			}
+		}
+
+		/* ƍς񂾃{[hɂw */
+		if (stamp_address >= 0) {
+			if (!board_verified) {
+				fputs("fingerprint not written: use --validation or --page-verify\n", stderr);
+			} else if (!information_matches(atmegaio, &setup)) {
+				/* wFuse bitsLock bits܂ނ̂ŁAǂݍŊm߂ */
+				fputs("fingerprint not written: Fuse bits or Lock bits don't match\n", stderr);
+				exit_code = 1;
+			} else if (write_stamp(atmegaio, fixed_wait, stamp_address, &fingerprint)) {
+				printf("fingerprint %08lX written to EEPROM at %03X\n", fingerprint, stamp_address);
+			} else {
+				fputs("fingerprint write failed\n", stderr);
+				exit_code = 1;
+			}
 		}
+
+		serial += serial_step;
+		if (serial_file != NULL) save_serial(serial_file, serial);
+	}
+	for (i = 0; i < patch_num; i++) patch_free(&patches[i]);
+#ifdef __linux__
+	if (watch && exit_code == 0 &&
+	!watch_input(atmegaio, &setup, input_files[0], input_offsets[0], page_size, data_words,
+	eeprom_image, eeprom_defined)) {
+		exit_code = 1;
 	}
+#endif
 
+	if (get_cache_stats(atmegaio, &cache_stats) == ATMEGAIO_SUCCESS &&
+	cache_stats.hits + cache_stats.misses > 0) {
+		printf("read cache: %lu hit(s), %lu miss(es)\n", cache_stats.hits, cache_stats.misses);
+	}
+	if (dry_run) null_io_report(atmegaio, stdout);
 	if ((ret = disconnect(atmegaio)) != ATMEGAIO_SUCCESS) {
 		fprintf(stderr, "disconnect error %d\n", ret);
 	}
-	return 0;
+	return exit_code;
 }